@@ -0,0 +1,160 @@
+#include "gtest/gtest.h"
+#include <string.h>
+#include <unistd.h>
+#include <deque>
+#include <vector>
+
+#include "stream.h"
+
+namespace fpgajtag_stream {
+
+// a sink whose transfers each take latency_us, one after the other, like a
+// USB bulk endpoint, and which keeps what it was sent
+struct fake_sink {
+  stream_sink sink;
+  std::deque<int> pending;
+  std::vector<uint8_t> received;
+  int latency_us;
+  int fail_after; // transfers, -1 for never
+  int fail_wait;
+};
+
+int fake_submit(stream_sink *sink, int slot, uint8_t *buf, int len)
+{
+  fake_sink *fake = (fake_sink *)sink->ctx;
+
+  if (fake->fail_after == 0)
+    return -1;
+  if (fake->fail_after > 0)
+    fake->fail_after--;
+  fake->received.insert(fake->received.end(), buf, buf + len);
+  fake->pending.push_back(slot);
+  return 0;
+}
+
+int fake_wait(stream_sink *sink)
+{
+  fake_sink *fake = (fake_sink *)sink->ctx;
+
+  if (fake->fail_wait)
+    return -1;
+  usleep(fake->latency_us);
+  int slot = fake->pending.front();
+  fake->pending.pop_front();
+  stream_transfer_done(slot, 0);
+  return 0;
+}
+
+void init_fake(fake_sink *fake, int latency_us)
+{
+  fake->sink.submit = fake_submit;
+  fake->sink.wait = fake_wait;
+  fake->sink.ctx = fake;
+  fake->latency_us = latency_us;
+  fake->fail_after = -1;
+  fake->fail_wait = 0;
+}
+
+struct pattern_job {
+  int buffers;
+  int encode_us; // per buffer
+};
+
+uint8_t pattern(int i)
+{
+  return (i * 7 + (i >> 8)) & 0xff;
+}
+
+void produce_pattern(void *arg)
+{
+  pattern_job *job = (pattern_job *)arg;
+  int n = 0;
+
+  for (int b = 0; b < job->buffers; b++) {
+    uint8_t *buf = stream_get();
+    // not all full, as flush_write would leave them
+    int len = STREAM_BUFSIZE - (b % 3) * 100;
+    for (int i = 0; i < len; i++)
+      buf[i] = pattern(n++);
+    if (job->encode_us)
+      usleep(job->encode_us);
+    stream_put(buf, len);
+  }
+}
+
+TEST(FpgajtagStream, SendsEverythingInOrder)
+{
+  fake_sink fake;
+  init_fake(&fake, 100);
+  pattern_job job = { 50, 0 };
+  stream_stats stats;
+
+  ASSERT_EQ(0, stream_run(&fake.sink, produce_pattern, &job, &stats));
+
+  ASSERT_EQ(stats.bytes, fake.received.size());
+  EXPECT_EQ(50, stats.transfers);
+  for (size_t i = 0; i < fake.received.size(); i++)
+    ASSERT_EQ(pattern(i), fake.received[i]) << "at byte " << i;
+}
+
+TEST(FpgajtagStream, KeepsSeveralTransfersInFlight)
+{
+  fake_sink fake;
+  init_fake(&fake, 2000);
+  pattern_job job = { 40, 1000 };
+  stream_stats stats;
+
+  ASSERT_EQ(0, stream_run(&fake.sink, produce_pattern, &job, &stats));
+
+  EXPECT_EQ(STREAM_IN_FLIGHT, stats.max_in_flight);
+  // encoding overlaps the transfers, rather than adding to them
+  EXPECT_LT(stats.elapsed_ms, 40 * (2 + 1));
+  EXPECT_LE(stats.busy_ms, stats.elapsed_ms);
+  EXPECT_GT(stats.busy_ms, stats.elapsed_ms / 2);
+}
+
+TEST(FpgajtagStream, GivenBackBuffersAreNotSent)
+{
+  fake_sink fake;
+  init_fake(&fake, 0);
+  stream_stats stats;
+
+  ASSERT_EQ(0, stream_run(
+                   &fake.sink,
+                   [](void *) {
+                     for (int i = 0; i < STREAM_BUFFERS * 2; i++)
+                       stream_put(stream_get(), 0);
+                   },
+                   NULL, &stats));
+
+  EXPECT_EQ(0, stats.transfers);
+  EXPECT_EQ(0u, fake.received.size());
+}
+
+TEST(FpgajtagStream, FailedSubmitEndsTheStream)
+{
+  fake_sink fake;
+  init_fake(&fake, 100);
+  fake.fail_after = 5;
+  pattern_job job = { 50, 0 };
+
+  EXPECT_EQ(-1, stream_run(&fake.sink, produce_pattern, &job, NULL));
+  // nothing after the failed one goes
+  EXPECT_LE(fake.received.size(), 5u * STREAM_BUFSIZE);
+}
+
+TEST(FpgajtagStream, FailedWaitEndsTheStream)
+{
+  fake_sink fake;
+  init_fake(&fake, 100);
+  fake.fail_wait = 1;
+  pattern_job job = { 50, 0 };
+
+  EXPECT_EQ(-1, stream_run(&fake.sink, produce_pattern, &job, NULL));
+  // and the next one starts afresh
+  fake_sink again;
+  init_fake(&again, 0);
+  EXPECT_EQ(0, stream_run(&again.sink, produce_pattern, &job, NULL));
+}
+
+} // namespace fpgajtag_stream
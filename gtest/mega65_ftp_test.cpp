@@ -18,6 +18,9 @@ void put_tilde_number_in_shortname(char *short_name, int i);
 char *get_current_short_name(void);
 void show_cluster(int cluster_num);
 char *find_long_name_in_curdir(char *filename);
+int create_d81_for_files(char *d81name, char **files, int file_count, int interleave);
+unsigned char *d81_used_sectors(void);
+int sync_tree(char *local_root, char *remote_path, int dry_run);
 
 extern int quietFlag;
 
@@ -919,6 +922,118 @@ TEST_F(Mega65FtpTestFixture, BashTestAutoShortNames)
   */
 }
 
+TEST_F(Mega65FtpTestFixture, D81BuilderChainsDirectoryAndTracksUsedSectors)
+{
+  // 200 files of 2 blocks each need 25 directory sectors
+  char *files[200];
+  for (int k = 0; k < 200; k++) {
+    files[k] = (char *)malloc(16);
+    sprintf(files[k], "F%03d.%s", k, (k % 2) ? "seq" : "prg");
+    generate_dummy_file(files[k], 300);
+  }
+  ASSERT_EQ(0, create_d81_for_files("MULTI.D81", files, 200, 1));
+
+  unsigned char *img = (unsigned char *)malloc(819200);
+  FILE *f = fopen("MULTI.D81", "rb");
+  ASSERT_EQ(819200, fread(img, 1, 819200, f));
+  fclose(f);
+#define TS(t, s) (img + ((t)-1) * 40 * 256 + (s) * 256)
+
+  int entries = 0, dir_sectors = 0;
+  for (int t = 40, s = 3; t; dir_sectors++) {
+    unsigned char *sec = TS(t, s);
+    for (int k = 0; k < 8; k++) {
+      unsigned char *de = sec + k * 32;
+      if (!de[2])
+        continue;
+      char name[17];
+      sprintf(name, "F%03d", entries);
+      ASSERT_EQ(0, memcmp(de + 5, name, 4));
+      ASSERT_EQ((entries % 2) ? 0x81 : 0x82, de[2]);
+      ASSERT_EQ(2, de[0x1e]);
+
+      // follow the file's block chain
+      unsigned char *blk = TS(de[3], de[4]);
+      ASSERT_EQ(0, memcmp(blk + 2, "\x00\x01\x02\x03", 4));
+      blk = TS(blk[0], blk[1]);
+      ASSERT_EQ(0, blk[0]);
+      ASSERT_EQ(300 - 254 + 1, blk[1]);
+      entries++;
+    }
+    t = sec[0];
+    s = sec[1];
+  }
+  ASSERT_EQ(200, entries);
+  ASSERT_EQ(25, dir_sectors);
+
+  // 400 file blocks from 3160, plus header, bam and directory sectors on track 40
+  int free_blocks = 0;
+  for (int t = 1; t <= 80; t++) {
+    unsigned char *bam = (t <= 40) ? TS(40, 1) + 0x10 + (t - 1) * 6 : TS(40, 2) + 0x10 + (t - 41) * 6;
+    if (t != 40)
+      free_blocks += bam[0];
+    else
+      ASSERT_EQ(40 - 3 - 25, bam[0]);
+  }
+  ASSERT_EQ(3160 - 400, free_blocks);
+
+  // only the touched 512 byte sectors need uploading
+  unsigned char *map = d81_used_sectors();
+  int used = 0;
+  for (int k = 0; k < 1600; k++) {
+    int has_data = 0;
+    for (int b = 0; b < 512; b++)
+      has_data |= img[k * 512 + b];
+    if (has_data)
+      ASSERT_TRUE(map[k]);
+    used += map[k];
+  }
+  ASSERT_LT(used, 250);
+#undef TS
+
+  free(img);
+  delete_local_file("MULTI.D81");
+  for (int k = 0; k < 200; k++) {
+    delete_local_file(files[k]);
+    free(files[k]);
+  }
+}
+
+TEST_F(Mega65FtpTestFixture, SyncUploadsOnlyNewOrChangedFiles)
+{
+  init_sdcard_data();
+
+  mkdir("synctree", 0755);
+  mkdir("synctree/sub", 0755);
+  generate_dummy_file("synctree/one.prg", 1000);
+  generate_dummy_file("synctree/sub/two.prg", 5000);
+
+  ASSERT_EQ(0, sync_tree("synctree", "/", 0));
+  change_dir("/sub");
+  ASSERT_EQ(1, contains_file_or_dir("two.prg"));
+  change_dir("/");
+
+  // nothing left to do after a sync
+  ReleaseStdOut();
+  CaptureStdOut();
+  ASSERT_EQ(0, sync_tree("synctree", "/", 1));
+  std::string output = RetrieveStdOut();
+  EXPECT_THAT(output, testing::ContainsRegex("0 new, 0 changed, 2 unchanged files, 0 new directories, 0 bytes"));
+
+  // a file of different size gets sent again
+  CaptureStdOut();
+  generate_dummy_file("synctree/sub/two.prg", 6000);
+  ASSERT_EQ(0, sync_tree("synctree", "/", 1));
+  output = RetrieveStdOut();
+  EXPECT_THAT(output, testing::ContainsRegex("0 new, 1 changed, 1 unchanged files, 0 new directories, 6000 bytes"));
+  CaptureStdOut();
+
+  delete_local_file("synctree/sub/two.prg");
+  delete_local_file("synctree/one.prg");
+  rmdir("synctree/sub");
+  rmdir("synctree");
+}
+
 // Further test ideas:
 // re-upload the same file with a smaller size and assure orphaned clusters get freed.
 
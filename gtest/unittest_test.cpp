@@ -0,0 +1,146 @@
+#include "gtest/gtest.h"
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <unittest.h>
+
+namespace unittest {
+
+struct line {
+  unsigned short issue;
+  unsigned char sub;
+  unsigned char state;
+  std::string msg;
+};
+
+std::vector<line> lines;
+
+void record(ut_parser *p, unsigned short issue, unsigned char sub, unsigned char state, const char *msg)
+{
+  lines.push_back({ issue, sub, state, msg ? msg : "(none)" });
+}
+
+std::string token(int issue, int sub, int state)
+{
+  return std::string({ (char)(issue & 0xff), (char)(issue >> 8), (char)sub, (char)(0xf0 + state) });
+}
+
+std::string text(int issue, int sub, int kind, const char *s)
+{
+  return token(issue, sub, kind) + s + "\\";
+}
+
+class UnitTestParser : public ::testing::Test {
+protected:
+  ut_parser parser;
+
+  void SetUp() override
+  {
+    lines.clear();
+    ut_init(&parser, record, NULL);
+  }
+
+  int feed(const std::string &bytes)
+  {
+    return ut_feed(&parser, (const unsigned char *)bytes.data(), bytes.size());
+  }
+};
+
+TEST_F(UnitTestParser, ReportsTestsByName)
+{
+  EXPECT_EQ(UT_FEED_ACTIVE, feed("READY.\r" + text(332, 1, UT_NAME, "colour ram") + token(332, 1, UT_START)
+                                 + token(332, 1, UT_PASS)));
+
+  ASSERT_EQ(2u, lines.size());
+  EXPECT_EQ(332, lines[0].issue);
+  EXPECT_EQ(1, lines[0].sub);
+  EXPECT_EQ(UT_START, lines[0].state);
+  EXPECT_EQ("colour ram", lines[0].msg);
+  EXPECT_EQ(UT_PASS, lines[1].state);
+  EXPECT_EQ(0u, parser.failcount);
+}
+
+TEST_F(UnitTestParser, LogMessagesGoWithTheirResult)
+{
+  feed(text(1, 1, UT_NAME, "name") + token(1, 1, UT_START) + text(1, 1, UT_LOG, "got $12") + token(1, 1, UT_FAIL));
+  // one that no result follows gets a line of its own
+  feed(text(1, 2, UT_LOG, "first") + text(1, 2, UT_LOG, "second") + token(1, 2, UT_START));
+
+  ASSERT_EQ(5u, lines.size());
+  EXPECT_EQ(UT_FAIL, lines[1].state);
+  EXPECT_EQ("got $12", lines[1].msg);
+  EXPECT_EQ(UT_LOG, lines[2].state);
+  EXPECT_EQ("first", lines[2].msg);
+  EXPECT_EQ(UT_LOG, lines[3].state);
+  EXPECT_EQ("second", lines[3].msg);
+  EXPECT_EQ(UT_START, lines[4].state);
+  EXPECT_EQ("name", lines[4].msg);
+  EXPECT_EQ(1u, parser.failcount);
+}
+
+TEST_F(UnitTestParser, TokensMaySplitAcrossReads)
+{
+  std::string bytes = text(7, 3, UT_NAME, "split") + token(7, 3, UT_START) + token(7, 3, UT_ERROR);
+
+  for (size_t i = 0; i < bytes.size(); i++)
+    feed(bytes.substr(i, 1));
+
+  ASSERT_EQ(2u, lines.size());
+  EXPECT_EQ("split", lines[0].msg);
+  EXPECT_EQ(UT_ERROR, lines[1].state);
+  EXPECT_EQ(1u, parser.failcount);
+}
+
+TEST_F(UnitTestParser, StopsAfterTheLastTest)
+{
+  EXPECT_EQ(UT_FEED_ACTIVE | UT_FEED_DONE, feed(token(1, 1, UT_START) + token(1, 1, UT_DONE) + token(2, 1, UT_FAIL)));
+
+  ASSERT_EQ(2u, lines.size());
+  EXPECT_EQ(UT_DONE, lines[1].state);
+  EXPECT_EQ(0u, parser.failcount);
+  EXPECT_EQ(UT_FEED_DONE, feed(token(2, 1, UT_FAIL)));
+}
+
+TEST_F(UnitTestParser, OverlongMessagesAreCut)
+{
+  feed(text(1, 1, UT_NAME, std::string(UT_MSG_LEN * 2, 'x').c_str()) + token(1, 1, UT_START));
+
+  ASSERT_EQ(1u, lines.size());
+  EXPECT_EQ(std::string(UT_MSG_LEN - 1, 'x'), lines[0].msg);
+}
+
+int filtered;
+
+int take_5c(ut_parser *p, unsigned char recent[4])
+{
+  if (recent[3] != 0x5c)
+    return 0;
+  filtered++;
+  return 1;
+}
+
+TEST_F(UnitTestParser, FilterSeesTheBytesFirst)
+{
+  filtered = 0;
+  parser.filter = take_5c;
+
+  // (a $5C that ends a string is not the filter's)
+  feed(text(1, 1, UT_NAME, "n") + std::string("\x01\x02\x03\x5c") + token(1, 1, UT_START));
+
+  EXPECT_EQ(1, filtered);
+  ASSERT_EQ(1u, lines.size());
+  EXPECT_EQ("n", lines[0].msg);
+}
+
+TEST(UnitTestLog, FormatsLikeM65)
+{
+  char out[255];
+
+  ut_format_line(out, sizeof(out), 332, 1, UT_PASS, "colour ram");
+  EXPECT_STREQ("  PASS (Issue#0332, Test #001 - colour ram)", strchr(out, 'Z') + 1);
+  ut_format_line(out, sizeof(out), 5, 12, UT_DONE, NULL);
+  EXPECT_STREQ("  DONE (Issue#0005, Test #012)", strchr(out, 'Z') + 1);
+}
+
+} // namespace unittest
@@ -11,6 +11,16 @@ extern int fpgajtag_libusb_open_failed;
 // enable USBDK interface
 extern int fpgajtag_usbdk_enable;
 
+// stream the bitstream with several USB transfers in flight (default), rather
+// than one blocking transfer at a time
+extern int fpgajtag_stream_enable;
+
+// keep the MPSSE commands made from a bitstream on disk, to send them as they
+// are the next time the same bitstream goes to the same JTAG chain
+extern int fpgajtag_cache_enable;
+// make them afresh anyway, compare them with the cached ones and cache them
+extern int fpgajtag_cache_verify;
+
 /*
  * init_fpgajtag(serialno, serialport, fpga_id)
  *   returns usb device string
@@ -60,4 +60,74 @@ void log_note(const char *measage, ...);
 void log_info(const char *message, ...);
 void log_debug(const char *message, ...);
 
-#endif
\ No newline at end of file
+/*
+ * Tracing
+ *
+ * Spans time a piece of code against a monotonic clock. Every span keeps a
+ * latency histogram, and each occurrence is also recorded into a per-thread
+ * ring of events, so hot paths never take a lock or format a string.
+ *
+ * Tracing is off unless the M65_TRACE environment variable names an output
+ * file when log_setup() is called (or trace_setup() is called directly).
+ * At exit the histograms are logged, and the events are written to that file:
+ * as Chrome trace JSON (chrome://tracing, Perfetto) if it ends in .json,
+ * otherwise as a compact binary dump (see trace_dump() in logging.c).
+ * Building with -DNO_TRACE compiles all spans away.
+ *
+ *   TRACE_SPAN(span_serial_read, "serial_read");
+ *   unsigned long long t = trace_begin();
+ *   ...
+ *   trace_end(&span_serial_read, t);
+ */
+#define TRACE_BUCKETS 24 // bucket n counts spans of [2^n, 2^(n+1)) usec, bucket 0 everything under 2usec
+
+struct trace_span {
+  const char *name;
+  int id; // 0 until first recorded
+  unsigned long long count, total_ns, max_ns;
+  unsigned long long buckets[TRACE_BUCKETS];
+  struct trace_span *next;
+};
+
+#ifndef NO_TRACE
+extern int trace_enabled;
+
+#define TRACE_SPAN(var, span_name) static struct trace_span var = { .name = span_name }
+#define trace_begin() (trace_enabled ? trace_now() : 0)
+#define trace_end(span, start)                                                                                              \
+  do {                                                                                                                      \
+    if (start)                                                                                                              \
+      trace_record(span, start);                                                                                            \
+  } while (0)
+#else
+#define TRACE_SPAN(var, span_name)
+#define trace_begin() 0ULL
+#define trace_end(span, start)                                                                                              \
+  do {                                                                                                                      \
+    (void)(start);                                                                                                          \
+  } while (0)
+#endif
+
+/*
+ * trace_setup(path)
+ *
+ * enables tracing, with the events written to path at exit.
+ * With path NULL, uses the M65_TRACE environment variable, if set.
+ */
+void trace_setup(const char *path);
+
+/*
+ * trace_now()
+ *
+ * monotonic timestamp in nanoseconds (never 0)
+ */
+unsigned long long trace_now(void);
+
+/*
+ * trace_record(span, start)
+ *
+ * records one occurrence of span, from start (a trace_now() value) until now
+ */
+void trace_record(struct trace_span *span, unsigned long long start);
+
+#endif
@@ -44,6 +44,13 @@ int fetch_ram(unsigned long address, unsigned int count, unsigned char *buffer);
 int push_ram(unsigned long address, unsigned int count, unsigned char *buffer);
 int mega65_poke(unsigned int addr, unsigned char value);
 unsigned char mega65_peek(unsigned int addr);
+// queued register operations, sent as one pipelined burst by regop_execute()
+void regop_poke(unsigned int addr, unsigned char value);
+void regop_peek(unsigned int addr, unsigned char *result);
+// wait until (peek(addr) & mask) == value, result gets the last value read (may be NULL)
+void regop_wait(unsigned int addr, unsigned char mask, unsigned char value, unsigned char *result);
+int regop_execute(void);
+extern unsigned long regop_round_trips;
 int dump_bytes(int col, char *msg, unsigned char *bytes, int length);
 void print_spaces(FILE *f, int col);
 int restart_hyppo(void);
@@ -59,6 +66,7 @@ int do_slow_write_safe(PORT_TYPE fd, char *d, int l, const char *func, const cha
 int do_slow_write(PORT_TYPE fd, char *d, int l, const char *func, const char *file, const int line);
 void timestamp_msg(char *msg);
 int stuff_keybuffer(char *s);
+int type_keybuffer(const unsigned char *s, int len, int timeout_ms, int *typed);
 int read_and_print(PORT_TYPE fd);
 int monitor_sync(void);
 int rxbuff_detect(void);
@@ -0,0 +1,79 @@
+#ifndef UNITTEST_H
+#define UNITTEST_H
+
+#include <stdio.h>
+
+/*
+ * Decoding of what MEGA65 unit test programmes report over the serial
+ * monitor link (see mega65-libc's tests.h, src/tests/unittestlog.s): tokens of
+ * four bytes, the issue number (low, high), the sub test number and the state
+ * as $F0 + UT_xxx. A $FD (log message) or $FE (test name) token is followed by
+ * its text, ended by a pound sign (\).
+ *
+ * Used by m65 -u and m65regress, which both write the results in the same log
+ * format (the one src/tests/regression-test.sh parses).
+ */
+
+#define UT_MSG_LEN 160
+
+#define UT_START 0x0
+#define UT_SKIP 0x1
+#define UT_PASS 0x2
+#define UT_FAIL 0x3
+#define UT_ERROR 0x4
+#define UT_LOG 0xd
+#define UT_NAME 0xe
+#define UT_DONE 0xf
+
+// ut_feed() results, or'ed together
+#define UT_FEED_ACTIVE 0x1 // a token arrived
+#define UT_FEED_DONE 0x2   // the last test is complete
+
+typedef struct ut_parser {
+  // gets each result line, msg is NULL if there is neither a name nor a log message
+  void (*event)(struct ut_parser *p, unsigned short issue, unsigned char sub, unsigned char state, const char *msg);
+  // if set, gets to look at each new four byte window outside of strings first,
+  // and returns 1 if it took it (m65 picks out its virtual F011 requests here)
+  int (*filter)(struct ut_parser *p, unsigned char recent[4]);
+  void *ctx;
+
+  unsigned char recent[4];
+  int fill;
+  int in_string, msg_pos;
+  char msg[UT_MSG_LEN];
+  char name[UT_MSG_LEN];
+  char log[UT_MSG_LEN]; // not yet reported
+  unsigned short last_issue;
+  unsigned char last_sub;
+  unsigned int failcount;
+  int done;
+} ut_parser;
+
+/*
+ * ut_init(p, event, ctx)
+ *
+ * gets p ready for a new test programme
+ */
+void ut_init(ut_parser *p, void (*event)(ut_parser *, unsigned short, unsigned char, unsigned char, const char *), void *ctx);
+
+/*
+ * ut_feed(p, buf, len)
+ *
+ * decodes len bytes from the serial link, stopping after the token that says
+ * the last test is complete (the bytes after it are left alone)
+ */
+int ut_feed(ut_parser *p, const unsigned char *buf, int len);
+
+/*
+ * ut_format_line(out, size, issue, sub, state, msg)
+ *
+ * formats a result line, time stamped with the current time
+ */
+void ut_format_line(char *out, int size, unsigned short issue, unsigned char sub, unsigned char state, const char *msg);
+
+// the log file header and footer
+void ut_log_header(FILE *f, const char *test, const char *bitstream, unsigned char model, const char *model_name,
+    const char *rom);
+void ut_log_footer(FILE *f, unsigned int failcount, int timed_out);
+
+#endif /* UNITTEST_H */
@@ -0,0 +1,104 @@
+# What the benchmarks and tests in this directory have in common, sourced by
+# them: the -o, -c and -t options, a work directory and background processes
+# that are cleaned up on exit, timed steps, and the comparison of the results
+# with those of an earlier run.
+#
+# Each result line is "<step> <value> ...", and it is the value that is compared.
+
+results=
+baseline=
+tolerance=25
+bench_keep=0
+
+# bench_option <option> <argument>: takes -o <results file>, -c <baseline
+# file> and -t <tolerance %>, returns 1 for any other option
+bench_option() {
+  case $1 in
+    o) results=$2 ;;
+    c) baseline=$2 ;;
+    t) tolerance=$2 ;;
+    *) return 1 ;;
+  esac
+}
+
+# bench_require <programs...>
+bench_require() {
+  for bin in "$@"; do
+    if [[ ! -x $bin ]]; then
+      echo "ERROR: $bin not found (make $bin)"
+      exit 1
+    fi
+  done
+}
+
+# bench_setup: makes $workdir, which goes on exit (unless bench_keep=1) along
+# with whatever bench_start started, and empties the results file, if any
+bench_setup() {
+  workdir=$(mktemp -d)
+  bench_pids=()
+  trap bench_cleanup EXIT
+  if [[ -n $results ]]; then
+    : > "$results"
+  fi
+}
+
+bench_cleanup() {
+  for pid in "${bench_pids[@]}"; do
+    bench_stop $pid
+  done
+  if [[ $bench_keep -eq 1 ]]; then
+    echo "results in $workdir"
+  else
+    rm -rf "$workdir"
+  fi
+}
+
+# bench_start <file> <command...>: runs the command in the background, and
+# waits up to 5 seconds for the file (e.g. its pty) to appear. Its pid is in
+# $bench_pid.
+bench_start() {
+  "${@:2}" &
+  bench_pid=$!
+  bench_pids+=($bench_pid)
+  for i in $(seq 50); do
+    [[ -e $1 ]] && break
+    sleep 0.1
+  done
+}
+
+# bench_stop <pid>
+bench_stop() {
+  # (killed by the signal, it doesn't exit with 0, which mustn't trip set -e)
+  kill $1 2>/dev/null && wait $1 2>/dev/null || true
+}
+
+# bench_run <step> <command...>: runs the command in $workdir, with its output
+# in $workdir/<step>.log, and stops everything if it fails. How many
+# milliseconds it took is in $bench_ms.
+bench_run() {
+  local start end
+  start=$(date +%s%N)
+  if ! (cd "$workdir" && "${@:2}" > "$workdir/$1.log" 2>&1 < /dev/null); then
+    echo "ERROR: step $1 failed:"
+    cat "$workdir/$1.log"
+    exit 1
+  fi
+  end=$(date +%s%N)
+  bench_ms=$(((end - start) / 1000000))
+}
+
+# bench_compare <unit>: with -c, fails if the value of any step is more than
+# the tolerance over that of the same step in the baseline
+bench_compare() {
+  [[ -z $baseline ]] && return 0
+  awk -v tolerance="$tolerance" -v unit="$1" '
+    NR == FNR { base[$1] = $2; next }
+    $1 in base {
+      limit = int(base[$1] * (100 + tolerance) / 100)
+      if ($2 > limit) {
+        printf "REGRESSION: %s: %d %s, baseline %d (limit %d)\n", $1, $2, unit, base[$1], limit
+        failed = 1
+      }
+    }
+    END { exit failed }' "$baseline" "$results"
+}
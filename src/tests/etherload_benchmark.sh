@@ -0,0 +1,93 @@
+#!/bin/bash
+
+# Bytes sent and time taken by etherload uploads against remotesd_sim, with
+# and without --delta (which only sends the packets that changed since the
+# last upload to the same MEGA65), and checks that --delta sends everything
+# again after an upload that reset the MEGA65 or jumped into the programme.
+#
+# usage: etherload_benchmark.sh [-s <size in KB>] [-o <results file>] [-c <baseline file>] [-t <tolerance %>]
+#          [-- <extra remotesd_sim options, e.g. -B 1000000 -p 1>]
+#
+#   -s  size of the programme uploaded, next to a 128KB ROM (default 40)
+#   -c  compare against the results file of an earlier run and fail if any
+#       step sent more bytes than that, plus the tolerance (default 0%)
+#
+# Each result line is "<step> <bytes sent> <milliseconds>".
+
+set -e
+
+BINDIR=$(cd "${BINDIR:-$(dirname "$0")/../../bin}" && pwd)
+ETHERLOAD=$BINDIR/etherload
+SIM=$BINDIR/remotesd_sim
+. "$(dirname "$0")/bench_common.sh"
+
+size_kb=40
+results=etherload_benchmark.txt
+tolerance=0
+
+while getopts "s:o:c:t:" opt; do
+  case $opt in
+    s) size_kb=$OPTARG ;;
+    *) bench_option $opt "$OPTARG" || { sed -n '3,15p' "$0"; exit 1; } ;;
+  esac
+done
+shift $((OPTIND - 1))
+sim_opts="$*"
+
+bench_require "$ETHERLOAD" "$SIM"
+bench_setup
+
+bench_start "$workdir/tty" "$SIM" -0 1 -C 64 -i "$workdir/sd.img" -l "$workdir/tty" -e -o "$workdir/ram.bin" $sim_opts
+sim_pid=$bench_pid
+
+export M65_ETHERLOAD_CACHE=$workdir/cache
+# a MEGA65 programme at $2001, and a ROM
+(printf '\x01\x20'; head -c $((size_kb * 1024)) /dev/urandom) > "$workdir/prog.prg"
+head -c 131072 /dev/urandom > "$workdir/rom.bin"
+
+# run_step <name> <etherload options, --halt unless they reset or jump>
+run_step() {
+  bench_run "$1" "$ETHERLOAD" -i "::1%lo" $2 -R rom.bin prog.prg
+  bytes=$(awk '$3 == "Sent" && $5 == "of" { n += $4 } END { print n + 0 }' "$workdir/$1.log")
+  echo "$1 $bytes $bench_ms" | tee -a "$results"
+}
+
+# flips a byte of the programme at each of the given offsets
+edit() {
+  for offset in "$@"; do
+    python3 -c "import sys
+f = open(sys.argv[1], 'r+b'); f.seek(int(sys.argv[2])); b = f.read(1); f.seek(int(sys.argv[2])); f.write(bytes([b[0] ^ 1]))" \
+      "$workdir/prog.prg" "$offset"
+  done
+}
+
+run_step full "--halt --delta --forget"
+run_step unchanged "--halt --delta"
+edit 100 $((size_kb * 512)) $((size_kb * 512 + 300))
+run_step edited "--halt --delta"
+edit 200
+run_step plain "--halt"
+edit 300
+run_step after_plain "--halt --delta"
+run_step reset "--delta"
+run_step after_reset "--halt --delta"
+run_step jump "--delta -j 2010"
+run_step after_jump "--halt --delta"
+
+# (the simulated memory is written out when it stops)
+bench_stop $sim_pid
+if ! cmp -s <(tail -c +3 "$workdir/prog.prg") <(tail -c +$((0x2001 + 1)) "$workdir/ram.bin" | head -c $((size_kb * 1024))) \
+  || ! cmp -s "$workdir/rom.bin" <(tail -c +$((0x20000 + 1)) "$workdir/ram.bin" | head -c 131072); then
+  echo "ERROR: the simulated memory differs from the uploaded files"
+  exit 1
+fi
+
+full=$(awk '$1 == "full" { print $2 }' "$results")
+for step in after_reset after_jump; do
+  if [[ $(awk -v s=$step '$1 == s { print $2 }' "$results") -ne $full ]]; then
+    echo "ERROR: step $step relied on the shadow of an upload that let the MEGA65 run"
+    exit 1
+  fi
+done
+
+bench_compare bytes
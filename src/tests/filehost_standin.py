@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""Local stand-in for the files.mega65.org filehost, for trying out the
+mega65_ftp 'fh' and 'fhget' commands offline.
+
+usage: filehost_standin.py [-p <port>] [-n <entries>] [-d <delay ms>] [-s <id>]
+
+Then, in another shell:
+
+  M65_FILEHOST=localhost:<port> M65_FILEHOST_CACHE=/tmp/fhcache mega65_ftp ...
+
+It serves a generated catalogue of <entries> MEGA65 files (plus a few for other
+platforms, which mega65_ftp must skip) and the files themselves. The
+catalogue carries an ETag and Last-Modified, and a conditional request for an
+unchanged catalogue gets a 304. Every request is logged to stderr, so a cache
+hit shows up as a 304 or as no download request at all. A POST to /php/login.php
+always succeeds. The download of the file with the -s id breaks off halfway.
+"""
+
+import argparse
+import hashlib
+import json
+import sys
+import time
+from email.utils import formatdate
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+def make_catalogue(entries):
+    rows = []
+    for i in range(entries):
+        rows.append({
+            "title": "Fixture Program %d" % i,
+            "os": "MEGA65",
+            "filename": "fix%04d.d81" % i,
+            "location": "download.php?id=%d" % i,
+            "author": ["deft", "gurce", "lgb", "adtbm"][i % 4],
+            "published": "2023-%02d-%02d 12:00:00" % (1 + i % 12, 1 + i % 28),
+        })
+        if i % 10 == 0:
+            rows.append({
+                "title": "Other Platform %d" % i,
+                "os": "C64",
+                "filename": "other%d.prg" % i,
+                "location": "download.php?id=c%d" % i,
+                "author": "someone",
+                "published": "2022-01-01 00:00:00",
+            })
+    return json.dumps(rows, separators=(",", ":")).encode()
+
+
+def file_content(ident):
+    # deterministic, so that a download can be checked
+    return hashlib.sha256(ident.encode()).digest() * 64
+
+
+class Handler(BaseHTTPRequestHandler):
+    def send_body(self, body, extra=None, short=False):
+        if args.delay:
+            time.sleep(args.delay / 1000.0)
+        self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(len(body)))
+        for key, value in (extra or {}).items():
+            self.send_header(key, value)
+        self.end_headers()
+        self.wfile.write(body[:len(body) // 2] if short else body)
+
+    def do_GET(self):
+        if self.path == "/php/readfilespublic.php":
+            if self.headers.get("If-None-Match") == etag or self.headers.get("If-Modified-Since") == last_modified:
+                self.send_response(304)
+                self.end_headers()
+                return
+            self.send_body(catalogue, {"ETag": etag, "Last-Modified": last_modified})
+        elif self.path.startswith("/php/download.php?id="):
+            ident = self.path.split("=", 1)[1]
+            self.send_body(file_content(ident), short=ident == args.short)
+        else:
+            self.send_error(404)
+
+    def do_POST(self):
+        self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        self.send_response(200)
+        self.send_header("Set-Cookie", "PHPSESSID=standin; path=/")
+        self.send_header("Content-Length", "2")
+        self.end_headers()
+        self.wfile.write(b"ok")
+
+    def log_message(self, fmt, *a):
+        sys.stderr.write("%s\n" % (fmt % a))
+
+
+parser = argparse.ArgumentParser()
+parser.add_argument("-p", "--port", type=int, default=8065)
+parser.add_argument("-n", "--entries", type=int, default=500)
+parser.add_argument("-d", "--delay", type=int, default=0, help="added to every response, in ms")
+parser.add_argument("-s", "--short", help="id of a file whose download is cut short")
+args = parser.parse_args()
+
+catalogue = make_catalogue(args.entries)
+etag = '"%s"' % hashlib.sha1(catalogue).hexdigest()
+last_modified = formatdate(usegmt=True)
+
+ThreadingHTTPServer(("localhost", args.port), Handler).serve_forever()
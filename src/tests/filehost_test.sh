@@ -0,0 +1,109 @@
+#!/bin/bash
+
+# Runs the mega65_ftp filehost commands against filehost_standin.py (and
+# remotesd_sim for the SD card), and checks the trigram search against a
+# plain search of the whole listing, the catalogue and download caches, and
+# that a download cut short leaves nothing behind.
+#
+# usage: filehost_test.sh [-k]
+#
+#   -k  keep the work directory (logs, cache) and say where it is
+
+set -e
+
+BINDIR=$(cd "${BINDIR:-$(dirname "$0")/../../bin}" && pwd)
+FTP=$BINDIR/mega65_ftp
+SIM=$BINDIR/remotesd_sim
+STANDIN=$(cd "$(dirname "$0")" && pwd)/filehost_standin.py
+. "$(dirname "$0")/bench_common.sh"
+
+while getopts "k" opt; do
+  case $opt in
+    k) bench_keep=1 ;;
+    *) sed -n '3,10p' "$0"; exit 1 ;;
+  esac
+done
+
+bench_require "$FTP" "$SIM"
+bench_setup
+
+entries=300
+short_id=7
+port=$((20000 + $$ % 10000))
+python3 "$STANDIN" -p $port -n $entries -s $short_id 2> "$workdir/standin.log" &
+bench_pids+=($!)
+bench_start "$workdir/tty" "$SIM" -0 1 -C 64 -i "$workdir/sd.img" -l "$workdir/tty"
+for i in $(seq 50); do
+  (echo > /dev/tcp/localhost/$port) 2> /dev/null && break
+  sleep 0.1
+done
+
+export M65_FILEHOST=localhost:$port M65_FILEHOST_CACHE=$workdir/cache
+
+# ftp <log name> <mega65_ftp command>, run in $workdir
+ftp() {
+  (cd "$workdir" && "$FTP" -0 1 -l "$workdir/tty" -c "$2" > "$workdir/$1.log" 2>&1) || true
+}
+
+# requests <pattern>: how many requests the stand-in has logged that match
+requests() {
+  grep -c "$1" "$workdir/standin.log" || true
+}
+
+failed=0
+check() {
+  if eval "$2"; then
+    echo "ok: $1"
+  else
+    echo "FAILED: $1"
+    failed=1
+  fi
+}
+
+ftp full "fh"
+grep '^[0-9]*: ' "$workdir/full.log" > "$workdir/full.txt" || true
+check "whole catalogue listed" "[[ \$(wc -l < $workdir/full.txt) -eq $entries ]]"
+check "other platforms left out" "! grep -q 'Other Platform' $workdir/full.txt"
+
+ftp again "fh"
+grep '^[0-9]*: ' "$workdir/again.log" > "$workdir/again.txt" || true
+check "unchanged catalogue not fetched again" "[[ \$(requests 'readfilespublic.php.* 304') -eq 1 ]]"
+check "cached catalogue listed the same" "cmp -s $workdir/full.txt $workdir/again.txt"
+
+# the matches the trigram index finds must be the ones a plain search of every entry finds
+plain_search='
+import fnmatch
+import re
+import sys
+
+pattern = sys.argv[1].lower()
+for line in sys.stdin:
+    title, filename, author = re.match(r"\d+: (.*) - \"(.*)\" - author: (.*) - published: ", line).groups()
+    if any(fnmatch.fnmatchcase(field.lower(), pattern) for field in (title, filename, author)):
+        sys.stdout.write(line)
+'
+for pattern in '*fix012*' '*URC?' '*deft' 'fix01?5.d81' 'fix*9.d81' '*?81' '*zzz*'; do
+  ftp search "fh $pattern"
+  grep '^[0-9]*: ' "$workdir/search.log" > "$workdir/search.txt" || true
+  python3 -c "$plain_search" "$pattern" < "$workdir/full.txt" > "$workdir/expected.txt"
+  check "search for '$pattern' ($(wc -l < "$workdir/expected.txt") matches)" \
+    "cmp -s $workdir/expected.txt $workdir/search.txt"
+done
+
+expected_content() {
+  python3 -c 'import hashlib, sys; sys.stdout.buffer.write(hashlib.sha256(sys.argv[1].encode()).digest() * 64)' "$1"
+}
+expected_content 2 > "$workdir/expected.bin"
+ftp get "fhget 3"
+check "file downloaded" "cmp -s $workdir/expected.bin $workdir/FIX0002.D81"
+rm -f "$workdir/FIX0002.D81"
+ftp get_again "fhget 3"
+check "file downloaded once" "[[ \$(requests 'download.php?id=2 ') -eq 1 ]]"
+check "file copied out of the cache" "cmp -s $workdir/expected.bin $workdir/FIX0002.D81"
+
+ftp get_short "fhget $((short_id + 1))"
+check "download cut short fails" "grep -q 'ERROR: Download of \"FIX000$short_id.D81\"' $workdir/get_short.log"
+check "download cut short leaves no file" "[[ ! -e $workdir/FIX000$short_id.D81 ]]"
+check "download cut short not cached" "! ls $workdir/cache/files | grep -q -i 'fix000$short_id'"
+
+exit $failed
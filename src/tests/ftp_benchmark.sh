@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# End-to-end timing of mega65_ftp against remotesd_sim, so that transfer
+# speed regressions can be spotted without a MEGA65 on the desk.
+#
+# usage: ftp_benchmark.sh [-e] [-s <size in KB>] [-o <results file>] [-c <baseline file>] [-t <tolerance %>]
+#          [-- <extra remotesd_sim options, e.g. -L 300 -b 200000 -p 1>]
+#
+#   -e  run over the simulated ethernet link instead of the serial pty
+#   -c  compare against the results file of an earlier run and fail if any
+#       step got slower by more than the tolerance (default 25%)
+#
+# Each result line is "<step> <milliseconds>".
+
+set -e
+
+BINDIR=$(cd "${BINDIR:-$(dirname "$0")/../../bin}" && pwd)
+FTP=$BINDIR/mega65_ftp
+SIM=$BINDIR/remotesd_sim
+. "$(dirname "$0")/bench_common.sh"
+
+mode=serial
+size_kb=1024
+results=ftp_benchmark.txt
+
+while getopts "es:o:c:t:" opt; do
+  case $opt in
+    e) mode=ethernet ;;
+    s) size_kb=$OPTARG ;;
+    *) bench_option $opt "$OPTARG" || { sed -n '3,14p' "$0"; exit 1; } ;;
+  esac
+done
+shift $((OPTIND - 1))
+sim_opts="$*"
+
+bench_require "$FTP" "$SIM"
+bench_setup
+
+if [[ $mode == ethernet ]]; then
+  bench_start "$workdir/tty" "$SIM" -0 1 -C 64 -i "$workdir/sd.img" -l "$workdir/tty" -e $sim_opts
+  link=(-i "::1%lo")
+else
+  bench_start "$workdir/tty" "$SIM" -0 1 -C 64 -i "$workdir/sd.img" -l "$workdir/tty" $sim_opts
+  link=(-l "$workdir/tty")
+fi
+
+head -c $((size_kb * 1024)) /dev/urandom > "$workdir/bench.bin"
+
+# run_step <name> <mega65_ftp command>
+run_step() {
+  bench_run "$1" "$FTP" -0 1 "${link[@]}" -c "$2"
+  echo "$1 $bench_ms" | tee -a "$results"
+}
+
+run_step put "put bench.bin"
+mv "$workdir/bench.bin" "$workdir/bench.orig"
+run_step get "get bench.bin"
+if ! cmp -s "$workdir/bench.bin" "$workdir/bench.orig"; then
+  echo "ERROR: downloaded file differs from uploaded file"
+  exit 1
+fi
+run_step dir "dir"
+run_step getslot "getslot 0 slot.bin"
+
+bench_compare ms
@@ -0,0 +1,117 @@
+#!/bin/bash
+
+# Lines/sec and VCD size of ghdl-vcd, on made up GHDL output of the hyperram
+# simulation's reports (src/tools/ghdl-vcd-hyperram.spec), and checks that the
+# value changes in the VCD are the ones in the reports, and that the built-in
+# spec converts up to 10000 samples before the first register write and stops
+# 1000 samples after the last one.
+#
+# usage: ghdl_vcd_benchmark.sh [-n <lines>] [-o <results file>]
+#
+#   -n  lines of GHDL output (default 1000000)
+#
+# Each result line is "<what> <value>".
+
+set -e
+
+BINDIR=$(cd "${BINDIR:-$(dirname "$0")/../../bin}" && pwd)
+CONVERTER=$BINDIR/ghdl-vcd
+SPEC=$(cd "$(dirname "$0")/../tools" && pwd)/ghdl-vcd-hyperram.spec
+. "$(dirname "$0")/bench_common.sh"
+
+lines=1000000
+results=ghdl_vcd_benchmark.txt
+
+while getopts "n:o:" opt; do
+  case $opt in
+    n) lines=$OPTARG ;;
+    o) results=$OPTARG ;;
+    *) sed -n '3,13p' "$0"; exit 1 ;;
+  esac
+done
+
+bench_require "$CONVERTER"
+bench_setup
+
+# make_log <lines> <register write every n lines>: the rest are hyperram
+# samples 5ns apart, with the times in ps and ns by turns. Of the sample's
+# values, the clock changes every time, hr_d every 4th and hr_cs0 every 1000th.
+# The number of samples goes to stderr.
+make_log() {
+  awk -v lines="$1" -v every="$2" 'BEGIN {
+    prefix = "../../src/vhdl/hyperram.vhdl:1234:9:@"
+    for (i = 0; i < lines; i++) {
+      t = i * 5
+      stamp = (i % 2) ? sprintf("%.0fns", t) : sprintf("%.0fps", t * 1000)
+      if (i % every == 0) {
+        printf "../../src/vhdl/sim.vhdl:99:5:@%s:(report note): Writing to register $%02X\n", stamp, i % 256
+        continue
+      }
+      d = int(h / 4) % 256
+      bits = ""
+      for (b = 0; b < 8; b++)
+        bits = bits "'\''" int(d / 2 ^ b) % 2 "'\''"
+      printf "%s%s:(report note): hr_cs0 = '\''%d'\'', hr_clk_p = '\''%d'\'', hr_reset = '\''1'\'', hr_rwds = '\''Z'\'', hr_d = %s, \n",
+        prefix, stamp, int(h / 1000) % 2, h % 2, bits
+      h++
+    }
+    print h > "/dev/stderr"
+  }'
+}
+make_log "$lines" 10 > "$workdir/ghdl.log" 2> "$workdir/samples"
+samples=$(cat "$workdir/samples")
+
+bench_run convert "$CONVERTER" -s "$SPEC" -o "$workdir/out.vcd" "$workdir/ghdl.log"
+ms=$bench_ms
+
+{
+  echo "lines $lines"
+  echo "milliseconds $ms"
+  echo "lines_per_sec $((lines * 1000 / (ms > 0 ? ms : 1)))"
+  echo "log_bytes $(wc -c < "$workdir/ghdl.log" | tr -d " ")"
+  echo "vcd_bytes $(wc -c < "$workdir/out.vcd" | tr -d " ")"
+} | tee "$results"
+
+failed=0
+check() {
+  if eval "$2"; then
+    echo "ok: $1"
+  else
+    echo "FAILED: $1"
+    failed=1
+  fi
+}
+# (identifiers from the spec: ! hr_cs0, " hr_clk_p, % hr_d)
+count() {
+  sed -n '/^\$end$/,$p' "$workdir/out.vcd" | grep -c "$1" || true
+}
+clock=$(count "^[01]\"\$")
+hr_d=$(count '^b[01]* %$')
+hr_cs0=$(count '^[01]!$')
+hr_reset=$(count '^[01]#$')
+last=$((lines - 1))
+[[ $((last % 10)) -eq 0 ]] && last=$((last - 1))
+last_time=$(grep '^#' "$workdir/out.vcd" | tail -1)
+backwards=$(awk '/^#/ { t = substr($0, 2) + 0; if (t <= last) n++; last = t } END { print n + 0 }' "$workdir/out.vcd")
+check "every clock change" "[[ $clock -eq $samples ]]"
+check "hr_d changes" "[[ $hr_d -eq $(((samples + 3) / 4)) ]]"
+check "hr_cs0 changes" "[[ $hr_cs0 -eq $(((samples + 999) / 1000)) ]]"
+check "unchanged values left out" "[[ $hr_reset -eq 1 ]]"
+check "times in ns" "[[ '$last_time' == '#$((last * 5))' ]]"
+check "times only go forwards" "[[ $backwards -eq 0 ]]"
+
+# writes at lines 0 and 1500: the built-in spec stops 1000 samples after the first
+make_log 2000 1500 2> /dev/null > "$workdir/ghdl.log"
+"$CONVERTER" < "$workdir/ghdl.log" > "$workdir/out.vcd"
+clock=$(count "^[01]\"\$")
+check "built-in spec stops 1000 samples after a register write" "[[ $clock -eq 1000 ]]"
+"$CONVERTER" -s "$SPEC" -o "$workdir/spec.vcd" "$workdir/ghdl.log"
+check "built-in spec the same as $(basename "$SPEC")" \
+  "cmp -s <(sed 1,3d $workdir/out.vcd) <(sed 1,3d $workdir/spec.vcd)"
+
+# the first write at line 12000: only the first 10000 samples, as then it stops
+make_log 13000 12000 2> /dev/null | sed 1d > "$workdir/ghdl.log"
+"$CONVERTER" < "$workdir/ghdl.log" > "$workdir/out.vcd"
+clock=$(count "^[01]\"\$")
+check "built-in spec converts 10000 samples before the first register write" "[[ $clock -eq 10000 ]]"
+exit $failed
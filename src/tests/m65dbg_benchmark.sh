@@ -0,0 +1,104 @@
+#!/bin/bash
+
+# Monitor round trips taken by m65dbg commands, against m65dbg_monitor_standin.py
+# (which counts the commands it receives), and how long they took.
+#
+# usage: m65dbg_benchmark.sh [-n <loops>] [-o <results file>] [-c <baseline file>] [-t <tolerance %>]
+#
+#   -n  size of the stand-in's test routine (256 * <loops> * 2 instructions, default 16)
+#   -c  compare against the results file of an earlier run and fail if any
+#       step took more round trips than that by more than the tolerance (default 10%)
+#
+# Each result line is "<step> <round trips> <milliseconds>". The load and save
+# steps move a 64KB file through memory, and also show their bytes/sec.
+
+set -e
+
+BINDIR=$(cd "${BINDIR:-$(dirname "$0")/../../bin}" && pwd)
+DBG=$BINDIR/m65dbg
+STANDIN=$(cd "$(dirname "$0")" && pwd)/m65dbg_monitor_standin.py
+. "$(dirname "$0")/bench_common.sh"
+
+loops=16
+results=m65dbg_benchmark.txt
+tolerance=10
+
+while getopts "n:o:c:t:" opt; do
+  case $opt in
+    n) loops=$OPTARG ;;
+    *) bench_option $opt "$OPTARG" || { sed -n '3,12p' "$0"; exit 1; } ;;
+  esac
+done
+
+bench_require "$DBG"
+bench_setup
+
+# dbg <commands, one per line>
+dbg() {
+  printf '%s\nx\n' "$1" | (cd "$workdir" && "$DBG" -l "$workdir/tty") >> "$workdir/dbg.log" 2>&1
+}
+
+round_trips() {
+  awk '$1 == "total" { print $2 }' "$workdir/stats" 2>/dev/null || echo 0
+}
+
+# run_step <name> <setup commands> <measured commands>
+run_step() {
+  local before start end
+  rm -f "$workdir/tty" "$workdir/stats"
+  bench_start "$workdir/tty" python3 "$STANDIN" -l "$workdir/tty" -n "$loops" -s "$workdir/stats" -p "${STANDIN_PC:-2000}"
+
+  [[ -n $2 ]] && dbg "$2"
+  before=$(round_trips)
+  start=$(date +%s%N)
+  dbg "$3"
+  end=$(date +%s%N)
+  echo "$1 $(($(round_trips) - ${before:-0})) $(((end - start) / 1000000))" | tee -a "$results"
+  bench_stop $bench_pid
+}
+
+run_step next "" "n"
+run_step finish "step
+step
+step" "finish"
+run_step until "" "until 300A"
+STANDIN_PC=E000 run_step next_rom "" "n"
+# (only the one at $3100 is ever reached)
+run_step watches "" "wb 2000
+ww 2001
+wd 01FC
+ws 3100
+wdump 3000 20
+wmdump 3100
+autowatch 1
+step
+step
+step
+step"
+head -c 65536 /dev/urandom > "$workdir/in.bin"
+run_step load "" "load in.bin 40000"
+run_step save "load in.bin 40000" "save out.bin 40000 10000"
+for step in load save; do
+  awk -v s=$step '$1 == s && $3 > 0 { printf "%s: %d bytes/sec\n", s, 65536 * 1000 / $3 }' "$results"
+done
+if ! cmp -s "$workdir/in.bin" "$workdir/out.bin"; then
+  echo "ERROR: saved memory differs from the loaded file"
+  exit 1
+fi
+run_step breakpoints "" "$(for a in $(seq 0x4000 0x80 0x4980); do printf 'sbreak %X\n' "$a"; done)
+sbreak 3100
+c
+c"
+
+if ! grep -q "^\$2003 " "$workdir/dbg.log" || ! grep -q "^\$E003 " "$workdir/dbg.log"; then
+  echo "ERROR: n did not stop after the JSR:"
+  cat "$workdir/dbg.log"
+  exit 1
+fi
+if [[ $(grep -c "^\$3100 " "$workdir/dbg.log") -lt 2 ]]; then
+  echo "ERROR: c did not stop at the software breakpoint:"
+  cat "$workdir/dbg.log"
+  exit 1
+fi
+
+bench_compare "round trips"
@@ -0,0 +1,269 @@
+#!/usr/bin/env python3
+"""Scripted stand-in for the MEGA65 serial monitor, for trying out m65dbg and
+counting the monitor round trips its commands cost, without hardware.
+
+usage: m65dbg_monitor_standin.py -l <link> [-n <loops>] [-p <start pc>] [-s <stats file>]
+
+It creates a pty, symlinked at <link>, to give to m65dbg with -l. Behind it is
+a CPU that knows only the few 6502 instructions of its built-in test program,
+stopped in trace mode at the start pc ($2000 unless -p):
+
+  2000 JSR $3000     E000 JSR $3000   (E000 is ROM)
+  2003 NOP           E003 NOP
+  2004 JMP $2000     E004 JMP $E000
+
+  3000 LDY #<loops>  ; 256 * <loops> * 2 instructions before it returns
+  3002 LDX #$00
+  3004 DEX
+  3005 BNE $3004
+  3007 JSR $3100
+  300A DEY
+  300B BNE $3002
+  300D RTS
+  3100 NOP
+  3101 RTS
+
+The monitor commands understood are r, m, M, s, l, t0, t1, b and an empty
+line (step one instruction). A hardware breakpoint stops the CPU and presents
+the registers unasked, as the real monitor does. Writes through the CPU's view
+($777xxxx) of $E000-$FFFF go to the RAM underneath the ROM.
+
+After every command, the stats file gets the number of commands of each kind
+received so far, as "<kind> <count>" lines plus "total <count>".
+"""
+
+import argparse
+import os
+import select
+import signal
+import sys
+import tty
+
+RAM = bytearray(0x100000)
+ROM = bytearray(0x2000)  # at $E000 in the CPU's view
+
+cpu = {"pc": 0x2000, "a": 0, "x": 0, "y": 0, "z": 0, "b": 0, "sp": 0x01FF, "p": 0x24, "lastop": 0xEA}
+tracing = True
+breakpoint = None
+stats = {}
+
+LINE = "PC   A  X  Y  Z  B  SP   MAPH MAPL LAST-OP     P  P-FLAGS   RGP uS IO\r\n"
+
+
+def cpu_read(addr):
+    addr &= 0xFFFF
+    return ROM[addr - 0xE000] if addr >= 0xE000 else RAM[addr]
+
+
+def cpu_write(addr, val):
+    RAM[addr & 0xFFFF] = val & 0xFF
+
+
+def mem_read(addr):
+    if (addr >> 16) == 0x777:
+        return cpu_read(addr)
+    return RAM[addr] if addr < len(RAM) else 0
+
+
+def mem_write(addr, val):
+    if (addr >> 16) == 0x777:
+        cpu_write(addr, val)
+    elif addr < len(RAM):
+        RAM[addr] = val & 0xFF
+
+
+def assemble(mem, base, code):
+    mem[base:base + len(code)] = bytes(code)
+
+
+def load_program(loops):
+    assemble(RAM, 0x2000, [0x20, 0x00, 0x30, 0xEA, 0x4C, 0x00, 0x20])
+    assemble(ROM, 0x0000, [0x20, 0x00, 0x30, 0xEA, 0x4C, 0x00, 0xE0])
+    assemble(RAM, 0x3000, [0xA0, loops, 0xA2, 0x00, 0xCA, 0xD0, 0xFD, 0x20, 0x00, 0x31, 0x88, 0xD0, 0xF5, 0x60])
+    assemble(RAM, 0x3100, [0xEA, 0x60])
+
+
+def push(v):
+    cpu_write(cpu["sp"], v)
+    cpu["sp"] = 0x0100 | ((cpu["sp"] - 1) & 0xFF)
+
+
+def pull():
+    cpu["sp"] = 0x0100 | ((cpu["sp"] + 1) & 0xFF)
+    return cpu_read(cpu["sp"])
+
+
+def set_nz(v):
+    cpu["p"] = (cpu["p"] & 0x7D) | (v & 0x80) | (0x02 if v == 0 else 0)
+    return v
+
+
+def execute():
+    """Runs one instruction. Returns False on one it does not know."""
+    pc = cpu["pc"]
+    op = cpu_read(pc)
+    lo, hi = cpu_read(pc + 1), cpu_read(pc + 2)
+    nxt = (pc + 1) & 0xFFFF
+    if op == 0x20:  # JSR
+        ret = (pc + 2) & 0xFFFF
+        push(ret >> 8)
+        push(ret & 0xFF)
+        nxt = lo | (hi << 8)
+    elif op == 0x60:  # RTS
+        low = pull()
+        nxt = ((pull() << 8) | low) + 1
+    elif op == 0x4C:  # JMP
+        nxt = lo | (hi << 8)
+    elif op == 0xEA:  # NOP
+        pass
+    elif op in (0xA0, 0xA2, 0xA9):  # LDY/LDX/LDA #
+        cpu[{0xA0: "y", 0xA2: "x", 0xA9: "a"}[op]] = set_nz(lo)
+        nxt = pc + 2
+    elif op in (0xCA, 0x88):  # DEX/DEY
+        reg = "x" if op == 0xCA else "y"
+        cpu[reg] = set_nz((cpu[reg] - 1) & 0xFF)
+    elif op in (0xD0, 0xF0):  # BNE/BEQ
+        nxt = pc + 2
+        if bool(cpu["p"] & 0x02) == (op == 0xF0):
+            nxt += lo - 256 if lo & 0x80 else lo
+    else:
+        return False
+    cpu["pc"] = nxt & 0xFFFF
+    cpu["lastop"] = op
+    return True
+
+
+def regs():
+    flags = "".join(f if cpu["p"] & (0x80 >> i) else "." for i, f in enumerate("NVEBDIZC"))
+    return LINE + "%04X %02X %02X %02X %02X %02X %04X %04X %04X %02X       %02X %02X %s\r\n" % (
+        cpu["pc"], cpu["a"], cpu["x"], cpu["y"], cpu["z"], cpu["b"], cpu["sp"], 0, 0, cpu["lastop"], cpu["p"], 0, flags)
+
+
+def mem_line(addr):
+    return ":%08X:%s\r\n" % (addr, "".join("%02X" % mem_read(addr + i) for i in range(16)))
+
+
+class Monitor:
+    def __init__(self, fd, stats_file):
+        self.fd = fd
+        self.stats_file = stats_file
+        self.line = b""
+        self.after_cr = False
+        self.upload = None  # [address, bytes still to come] while an 'l' is taking binary data
+
+    def send(self, text):
+        os.write(self.fd, text.encode() if isinstance(text, str) else text)
+
+    def count(self, kind):
+        stats[kind] = stats.get(kind, 0) + 1
+        stats["total"] = stats.get("total", 0) + 1
+        if self.stats_file:
+            with open(self.stats_file, "w") as f:
+                f.writelines("%s %d\n" % kv for kv in sorted(stats.items()))
+
+    def feed(self, data):
+        for i, c in enumerate(data):
+            if self.upload:
+                mem_write(self.upload[0], c)
+                self.upload[0] += 1
+                self.upload[1] -= 1
+                if not self.upload[1]:
+                    self.upload = None
+                    self.send(".")
+                continue
+            # a command ends with CR, LF or CR LF (m65dbg follows the LF with a NUL)
+            if c == 0x00:
+                continue
+            if c == 0x0A and self.after_cr:
+                self.after_cr = False
+                continue
+            self.after_cr = c == 0x0D
+            if c in (0x0D, 0x0A):
+                self.command(self.line.decode(errors="replace").strip())
+                self.line = b""
+            else:
+                self.line += bytes([c])
+
+    def command(self, cmd):
+        global tracing, breakpoint
+        echo = cmd + "\r\n"
+        kind = cmd[:2] if cmd.startswith("t") else cmd[:1] or "step"
+        self.count(kind)
+        arg = cmd[1:].split()
+        out = ""
+        if kind == "r":
+            out = regs()
+        elif kind == "step":
+            if tracing:
+                execute()
+            out = regs()
+        elif kind == "t0":
+            tracing = False
+        elif kind == "t1":
+            tracing = True
+        elif kind == "b":
+            breakpoint = int(arg[0], 16) & 0xFFFF if arg else None
+        elif kind == "m":
+            out = mem_line(int(arg[0], 16))
+        elif kind == "M":
+            out = "".join(mem_line(int(arg[0], 16) + k * 16) for k in range(16))
+        elif kind == "s":
+            addr = int(arg[0], 16)
+            for k, v in enumerate(arg[1:]):
+                mem_write(addr + k, int(v, 16))
+        elif kind == "l":
+            start, end = int(arg[0], 16), int(arg[1], 16)
+            count = (end - start) & 0xFFFF
+            if count:
+                self.upload = [start, count]
+                self.send(echo)
+                return
+        else:
+            out = "?\r\n"
+        self.send(echo + out + ".")
+
+    def run(self, budget):
+        """Runs the CPU while not tracing, stopping at the breakpoint."""
+        global tracing
+        for _ in range(budget):
+            if not execute():
+                tracing = True
+                return
+            if cpu["pc"] == breakpoint:
+                tracing = True
+                self.send("\r\n" + regs() + ".")
+                return
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-l", "--link", required=True)
+    parser.add_argument("-n", "--loops", type=lambda v: int(v, 0), default=8)
+    parser.add_argument("-p", "--pc", type=lambda v: int(v, 16), default=0x2000)
+    parser.add_argument("-s", "--stats")
+    args = parser.parse_args()
+
+    load_program(args.loops)
+    cpu["pc"] = args.pc
+
+    master, slave = os.openpty()
+    tty.setraw(slave)
+    if os.path.lexists(args.link):
+        os.remove(args.link)
+    os.symlink(os.ttyname(slave), args.link)
+    signal.signal(signal.SIGTERM, lambda *a: sys.exit(0))
+
+    monitor = Monitor(master, args.stats)
+    try:
+        while True:
+            ready, _, _ = select.select([master], [], [], 0 if not tracing else None)
+            if ready:
+                monitor.feed(os.read(master, 65536))
+            if not tracing:
+                # (in small slices, so that the monitor answers promptly)
+                monitor.run(1000)
+    finally:
+        os.remove(args.link)
+
+
+main()
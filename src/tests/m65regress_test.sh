@@ -0,0 +1,119 @@
+#!/bin/bash
+
+# Runs m65regress against three unittest_monitor_standin.py MEGA65s (two R3s
+# and an R2), replaying made up unit test logs, and checks how the tests were
+# shared out and reported.
+#
+# usage: m65regress_test.sh [-k]
+#
+#   -k  keep the work directory (logs, JUnit XML) and say where it is
+
+set -e
+
+BINDIR=$(cd "${BINDIR:-$(dirname "$0")/../../bin}" && pwd)
+RUNNER=$BINDIR/m65regress
+STANDIN=$(cd "$(dirname "$0")" && pwd)/unittest_monitor_standin.py
+. "$(dirname "$0")/bench_common.sh"
+
+while getopts "k" opt; do
+  case $opt in
+    k) bench_keep=1 ;;
+    *) sed -n '3,9p' "$0"; exit 1 ;;
+  esac
+done
+
+bench_require "$RUNNER"
+bench_setup
+mkdir -p "$workdir/replay" "$workdir/tests"
+
+# make_test <name> <seconds> <result: pass, fail or hang>
+make_test() {
+  local log=$workdir/replay/$1.log
+  {
+    echo "2024-01-01T00:00:00.000Z START (Issue#0042, Test #001 - $1)"
+    echo "2024-01-01T00:00:00.100Z   LOG (Issue#0042, Test #001 - checking things)"
+    if [[ $3 == fail ]]; then
+      printf '2024-01-01T00:00:%02d.000Z  FAIL (Issue#0042, Test #001 - value was $12)\n' "$2"
+    else
+      printf '2024-01-01T00:00:%02d.000Z  PASS (Issue#0042, Test #001 - %s)\n' "$2" "$1"
+    fi
+    if [[ $3 != hang ]]; then
+      printf '2024-01-01T00:00:%02d.000Z  DONE (Issue#0042, Test #001 - %s)\n' "$2" "$1"
+    fi
+  } > "$log"
+  printf '\x01\x08REPLAY %s\0' "$1" > "$workdir/tests/$1.prg"
+}
+
+cat > "$workdir/tests/regression-tests.lst" << EOF
+# TESTNAME TIMEOUT PLATFORM
+test_a.prg 10 all
+test_b.prg 10 all
+test_c.prg 10 all
+test_d.prg 10 all
+test_e.prg 10 all
+test_f.prg 10 all
+test_fail.prg 10 all
+test_hang.prg 2 all
+test_r2.prg 10 mega65r2
+test_nexys.prg 10 nexys4ddr-widget
+# END OF FILE
+EOF
+for t in a b c d e f; do
+  make_test test_$t 2 pass
+done
+make_test test_fail 1 fail
+make_test test_hang 1 hang
+make_test test_r2 1 pass
+make_test test_nexys 1 pass
+
+for n in 0 1 2; do
+  model=3
+  [[ $n -eq 2 ]] && model=2
+  bench_start "$workdir/dev$n" python3 "$STANDIN" -l "$workdir/dev$n" -r "$workdir/replay" -m $model -s "$workdir/dev$n.stats"
+done
+
+set +e
+"$RUNNER" -R 0 -l "$workdir/dev0" -l "$workdir/dev1" -l "$workdir/dev2" -L "$workdir/tests/regression-tests.lst" \
+  -o "$workdir/logs" | tee "$workdir/summary.txt"
+status=${PIPESTATUS[0]}
+set -e
+
+failed=0
+check() {
+  if eval "$2"; then
+    echo "ok: $1"
+  else
+    echo "FAILED: $1"
+    failed=1
+  fi
+}
+
+check "exit status counts the failed and timed out tests" "[[ $status -eq 2 ]]"
+python3 - "$workdir/logs/junit.xml" << 'EOF' > "$workdir/junit.txt"
+import sys
+import xml.etree.ElementTree as ET
+
+suite = ET.parse(sys.argv[1]).getroot().find("testsuite")
+print("counts", *(suite.get(k) for k in ("tests", "failures", "errors", "skipped")))
+for case in suite.findall("testcase"):
+    result = "pass"
+    for kind in ("failure", "error", "skipped"):
+        element = case.find(kind)
+        if element is not None:
+            result = kind + ":" + element.get("type", "")
+    print("case", case.get("name"), case.get("classname"), result, case.get("time"))
+EOF
+check "JUnit XML counts" "grep -qx 'counts 10 1 1 1' $workdir/junit.txt"
+check "failure reported" "grep -q '^case test_fail.prg regression.mega65r[23] failure:fail' $workdir/junit.txt"
+check "timeout reported" "grep -q '^case test_hang.prg regression.mega65r[23] error:timeout' $workdir/junit.txt"
+check "R2 only test ran on the R2" "grep -q '^case test_r2.prg regression.mega65r2 pass' $workdir/junit.txt"
+check "test for a missing platform skipped" "grep -q '^case test_nexys.prg regression.none skipped:' $workdir/junit.txt"
+check "log in the m65 -u format" "grep -q '^===== FAILCOUNT: 0' $workdir/logs/test_a.log && grep -q '^!!!!! FAILCOUNT: 1' $workdir/logs/test_fail.log"
+for n in 0 1 2; do
+  check "device $n ran tests" "grep -q '^replays [1-9]' $workdir/dev$n.stats"
+  check "device $n reset once per test" "[[ \$(awk '\$1 == \"resets\" { print \$2 }' $workdir/dev$n.stats) -eq \$(awk '\$1 == \"runs\" { print \$2 }' $workdir/dev$n.stats) ]]"
+done
+# 9 tests of up to 2 seconds (plus the 2 second timeout) on three devices
+check "tests ran side by side" "awk '/ of tests in / { exit !(\$1 + 0 > 1.8 * (\$5 + 0)) }' $workdir/summary.txt"
+
+exit $failed
@@ -0,0 +1,60 @@
+#!/bin/bash
+
+# Timing of monitor_upload against remotesd_sim, which models the SD
+# controller registers that monitor_upload drives through the serial monitor.
+#
+# usage: monitor_upload_benchmark.sh [-s <size in KB>] [-o <results file>] [-c <baseline file>] [-t <tolerance %>]
+#          [-- <extra remotesd_sim options, e.g. -L 2000 -T 500>]
+#
+#   -c  compare against the results file of an earlier run and fail if any
+#       step got slower by more than the tolerance (default 25%)
+#
+# The second upload of the same file is mostly sector reads, as unchanged
+# sectors are compared and skipped rather than written.
+# Each result line is "<step> <milliseconds>".
+
+set -e
+
+BINDIR=$(cd "${BINDIR:-$(dirname "$0")/../../bin}" && pwd)
+UPLOAD=$BINDIR/monitor_upload
+SIM=$BINDIR/remotesd_sim
+. "$(dirname "$0")/bench_common.sh"
+
+size_kb=64
+results=monitor_upload_benchmark.txt
+
+while getopts "s:o:c:t:" opt; do
+  case $opt in
+    s) size_kb=$OPTARG ;;
+    *) bench_option $opt "$OPTARG" || { sed -n '3,14p' "$0"; exit 1; } ;;
+  esac
+done
+shift $((OPTIND - 1))
+sim_opts="$*"
+
+bench_require "$UPLOAD" "$SIM"
+bench_setup
+
+bench_start "$workdir/tty" "$SIM" -0 1 -C 64 -i "$workdir/sd.img" -l "$workdir/tty" $sim_opts
+
+head -c $((size_kb * 1024)) /dev/urandom > "$workdir/BENCH.BIN"
+
+# run_step <name> <monitor_upload command>
+run_step() {
+  bench_run "$1" "$UPLOAD" -l "$workdir/tty" -c "$2"
+  echo "$1 $bench_ms" | tee -a "$results"
+}
+
+run_step put "put BENCH.BIN"
+run_step reput "put BENCH.BIN"
+if grep -q "Proceeding with physical write" "$workdir/reput.log"; then
+  echo "ERROR: second upload of an unchanged file wrote sectors"
+  exit 1
+fi
+run_step dir "dir"
+if ! grep -q "BENCH.BIN *$((size_kb * 1024))" "$workdir/dir.log"; then
+  echo "ERROR: uploaded file missing from directory listing"
+  exit 1
+fi
+
+bench_compare ms
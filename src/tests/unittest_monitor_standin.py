@@ -0,0 +1,251 @@
+#!/usr/bin/env python3
+"""Stand-in for a MEGA65 running unit test programmes, behind its serial
+monitor, for trying out m65regress without hardware.
+
+usage: unittest_monitor_standin.py -l <link> -r <replay dir> [-m <model>] [-v <bitstream version>]
+                                   [-x <speed up>] [-s <stats file>]
+
+It creates a pty, symlinked at <link>, to give to m65regress with -l. Behind
+it is just enough of a MEGA65 for loading and running a programme the way m65
+does: the m/M/s/l/r/t0/t1/h monitor commands, a reset (!) that boots into C65
+mode, GO64 typed into the keyboard buffer, and RUN.
+
+What a programme does when it is RUN is replayed from a unit test log, in the
+format m65 -u --utlog writes. The programme names its log: it is expected to
+start with "REPLAY <name>", and <replay dir>/<name>.log is played back as the
+unit test tokens that would have produced it, at the pace of its time stamps
+(divided by the speed up). A log without a DONE line leaves the test hanging.
+
+The stats file gets "<what> <count>" lines for resets, runs and the replays
+started, after each of them.
+"""
+
+import argparse
+import os
+import re
+import select
+import signal
+import sys
+import time
+import tty
+
+RAM = bytearray(0x60000)
+IO = {}  # $FFD3xxx
+stats = {"resets": 0, "runs": 0, "replays": 0}
+
+STATES = {"START": 0xF0, "SKIP": 0xF1, "PASS": 0xF2, "FAIL": 0xF3, "ERROR": 0xF4, "LOG": 0xFD, "DONE": 0xFF}
+RESULT = re.compile(r"^(\d{4}-\d\d-\d\dT\d\d:\d\d:\d\d\.\d{3})Z +([A-Z#$0-9]+) \(Issue#(\d+), Test #(\d+)(?: - (.*))?\)$")
+
+
+def set_mode(c64):
+    # what m65's detect_mode() looks at
+    IO[0x030] = 0x00 if c64 else 0x64
+    IO[0x054] = 0x00
+    IO[0x060], IO[0x061], IO[0x062] = 0x00, 0x04 if c64 else 0x08, 0x00
+    RAM[1] = 0x37
+
+
+def reset(model):
+    RAM[0x0800:0x10000] = bytes(0x10000 - 0x0800)
+    RAM[0x20016:0x2001D] = b"V920395"
+    IO.clear()
+    IO[0x60F] = 0x20  # real hardware, not xemu
+    IO[0x629] = model
+    set_mode(False)
+
+
+def mem_read(addr):
+    if (addr >> 16) == 0x777:
+        return RAM[addr & 0xFFFF]
+    if (addr >> 12) == 0xFFD3:
+        return IO.get(addr & 0xFFF, 0)
+    return RAM[addr] if addr < len(RAM) else 0
+
+
+def mem_write(addr, val):
+    if (addr >> 16) == 0x777:
+        addr &= 0xFFFF
+    if (addr >> 12) == 0xFFD3:
+        IO[addr & 0xFFF] = val & 0xFF
+    elif addr < len(RAM):
+        RAM[addr] = val & 0xFF
+
+
+def mem_line(addr):
+    return ":%08X:%s\r\n" % (addr, "".join("%02X" % mem_read(addr + i) for i in range(16)))
+
+
+def load_replay(path):
+    """Turns a unit test log into [(seconds from the start, bytes)]."""
+    events = []
+    name = ""
+    start = None
+    with open(path) as f:
+        for line in f:
+            m = RESULT.match(line.strip())
+            if not m:
+                continue
+            stamp, state, issue, sub, msg = m.groups()
+            state = state.strip()
+            if state not in STATES:
+                continue
+            t = time.mktime(time.strptime(stamp[:19], "%Y-%m-%dT%H:%M:%S")) + int(stamp[20:]) / 1000
+            if start is None:
+                start = t
+            head = bytes([int(issue) & 0xFF, int(issue) >> 8, int(sub)])
+            out = b""
+            if state == "LOG":
+                out = head + b"\xfd" + msg.encode() + b"\\"
+            elif msg and msg != name:
+                if state in ("PASS", "FAIL"):
+                    # (a log message the result was reported with)
+                    out = head + b"\xfd" + msg.encode() + b"\\"
+                else:
+                    name = msg
+                    out = head + b"\xfe" + msg.encode() + b"\\"
+            if state != "LOG":
+                out += head + bytes([STATES[state]])
+            events.append((t - start, out))
+    return events
+
+
+class Monitor:
+    def __init__(self, fd, args):
+        self.fd = fd
+        self.args = args
+        self.line = b""
+        self.upload = None  # [address, bytes still to come] while an 'l' is taking binary data
+        self.replay = []
+        self.replay_start = 0
+        self.typed = b""
+        reset(args.model)
+
+    def send(self, text):
+        os.write(self.fd, text.encode() if isinstance(text, str) else text)
+
+    def count(self, what):
+        stats[what] += 1
+        if self.args.stats:
+            with open(self.args.stats, "w") as f:
+                f.writelines("%s %d\n" % kv for kv in sorted(stats.items()))
+
+    def feed(self, data):
+        for c in data:
+            if self.upload:
+                mem_write(self.upload[0], c)
+                self.upload[0] += 1
+                self.upload[1] -= 1
+                if not self.upload[1]:
+                    self.upload = None
+                    self.send(".")
+                continue
+            if c == 0x15:  # ^U
+                self.line = b""
+            elif c in (0x0D, 0x0A):
+                if self.line:
+                    self.command(self.line.decode(errors="replace").strip())
+                self.line = b""
+            elif c >= 0x20:
+                self.line += bytes([c])
+
+    def command(self, cmd):
+        echo = cmd + "\r\n"
+        arg = cmd[1:].split()
+        out = ""
+        kind = cmd[:2] if cmd[:1] == "t" else cmd[:1]
+        if kind == "h":
+            out = "MEGA65 Serial Monitor\r\nbuild GIT: %s\r\n" % self.args.version
+        elif kind == "r":
+            out = "PC   A  X  Y  Z  B  SP   MAPH MAPL LAST-OP     P  P-FLAGS   RGP uS IO\r\n" \
+                  "E5D4 00 00 00 00 00 01F6 0000 0000 00         20 ..E.....\r\n"
+        elif kind == "m":
+            out = mem_line(int(arg[0], 16))
+        elif kind == "M":
+            out = "".join(mem_line(int(arg[0], 16) + k * 16) for k in range(16))
+        elif kind == "s":
+            addr = int(arg[0], 16)
+            for k, v in enumerate(arg[1:]):
+                mem_write(addr + k, int(v, 16))
+                self.keyboard(addr + k)
+        elif kind == "l":
+            start, end = int(arg[0], 16), int(arg[1], 16)
+            count = (end - start) & 0xFFFF
+            if count:
+                self.upload = [start, count]
+                self.send(echo)
+                return
+        elif kind == "!":
+            # (nothing answers while it boots)
+            self.replay = []
+            self.typed = b""
+            reset(self.args.model)
+            self.count("resets")
+            return
+        # (#, t0, t1 and g need nothing doing)
+        self.send(echo + out + ".")
+
+    def keyboard(self, addr):
+        """The KERNAL taking what was put in its keyboard buffer."""
+        c64 = IO.get(0x030) == 0
+        if addr != (0xC6 if c64 else 0xD0) or not RAM[addr]:
+            return
+        base = 0x277 if c64 else 0x2B0
+        self.typed += bytes(RAM[base:base + RAM[addr]])
+        RAM[addr] = 0
+        if b"GO64\rY\r" in self.typed:
+            set_mode(True)
+            self.typed = b""
+        if c64 and b"RUN" in self.typed:
+            self.typed = b""
+            self.run()
+
+    def run(self):
+        self.count("runs")
+        program = bytes(RAM[0x0801:0x0901]).split(b"\0")[0].decode(errors="replace")
+        if not program.startswith("REPLAY "):
+            return
+        path = os.path.join(self.args.replay, program[7:].strip() + ".log")
+        if not os.path.exists(path):
+            return
+        self.replay = load_replay(path)
+        self.replay_start = time.time()
+        self.count("replays")
+
+    def next_replay(self):
+        """Sends what is due, returns the seconds until the next, or None."""
+        while self.replay:
+            due = self.replay_start + self.replay[0][0] / self.args.speedup
+            if due > time.time():
+                return due - time.time()
+            self.send(self.replay.pop(0)[1])
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-l", "--link", required=True)
+    parser.add_argument("-r", "--replay", required=True)
+    parser.add_argument("-m", "--model", type=lambda v: int(v, 0), default=3)
+    parser.add_argument("-v", "--version", default="development,20240101.00,0123abc")
+    parser.add_argument("-x", "--speedup", type=float, default=1.0)
+    parser.add_argument("-s", "--stats")
+    args = parser.parse_args()
+
+    master, slave = os.openpty()
+    tty.setraw(slave)
+    if os.path.lexists(args.link):
+        os.remove(args.link)
+    os.symlink(os.ttyname(slave), args.link)
+    signal.signal(signal.SIGTERM, lambda *a: sys.exit(0))
+
+    monitor = Monitor(master, args)
+    try:
+        while True:
+            ready, _, _ = select.select([master], [], [], monitor.next_replay())
+            if ready:
+                monitor.feed(os.read(master, 65536))
+    finally:
+        os.remove(args.link)
+
+
+main()
@@ -0,0 +1,121 @@
+#!/bin/bash
+
+# Tokens/sec of vhdl_tokenise, and the time its index of definitions takes to
+# build and to bring up to date after a file changes.
+#
+# usage: vhdl_tokenise_benchmark.sh [-n <files>] [-r <repeats>] [-o <results file>] [<VHDL directory>]
+#
+#   <VHDL directory>  the VHDL to use, e.g. a mega65-core checkout; without it
+#                     -n files of made up VHDL are used (default 200)
+#   -r  times the tokens/sec run goes over the VHDL (default 5)
+#
+# Each result line is "<step> <milliseconds>", and then "tokens_per_sec <n>".
+
+set -e
+
+BINDIR=$(cd "${BINDIR:-$(dirname "$0")/../../bin}" && pwd)
+TOKENISE=$BINDIR/vhdl_tokenise
+. "$(dirname "$0")/bench_common.sh"
+
+nfiles=200
+repeats=5
+results=vhdl_tokenise_benchmark.txt
+
+while getopts "n:r:o:" opt; do
+  case $opt in
+    n) nfiles=$OPTARG ;;
+    r) repeats=$OPTARG ;;
+    o) results=$OPTARG ;;
+    *) sed -n '3,12p' "$0"; exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+bench_require "$TOKENISE"
+bench_setup
+
+# make_vhdl <number>: an entity with some ports, signals and processes
+make_vhdl() {
+  local n=$1
+  echo "library ieee;"
+  echo "use ieee.std_logic_1164.all;"
+  echo "use ieee.numeric_std.all;"
+  echo
+  echo "-- made up unit $n"
+  echo "entity unit$n is"
+  echo "  generic ( WIDTH : integer := 16#10# );"
+  echo "  port ( clk, reset : in std_logic;"
+  echo "         data_in : in unsigned(WIDTH - 1 downto 0);"
+  echo "         data_out : out unsigned(WIDTH - 1 downto 0) := (others => '0') );"
+  echo "end entity unit$n;"
+  echo
+  echo "architecture behavioural of unit$n is"
+  for s in $(seq 0 19); do
+    echo "  signal reg$s, next$s : unsigned(WIDTH - 1 downto 0) := x\"00_00\";"
+  done
+  echo "begin"
+  for p in $(seq 0 19); do
+    echo "  step$p : process (clk) is"
+    echo "  begin"
+    echo "    if rising_edge(clk) then"
+    echo "      if reset = '1' then"
+    echo "        reg$p <= (others => '0');"
+    echo "      elsif clk'event and data_in /= reg$p then"
+    echo "        reg$p <= data_in + to_unsigned($p, WIDTH) ** 1; -- next value"
+    echo "        next$p <= reg$p xor \"0101\" & x\"ABC\";"
+    echo "      end if;"
+    echo "    end if;"
+    echo "  end process step$p;"
+  done
+  echo "  data_out <= reg0;"
+  echo "end behavioural;"
+}
+
+if [[ $# -gt 0 ]]; then
+  vhdl=$(cd "$1" && pwd)
+else
+  vhdl=$workdir/vhdl
+  mkdir -p "$vhdl"
+  for n in $(seq "$nfiles"); do
+    make_vhdl $n > "$vhdl/unit$n.vhd"
+  done
+fi
+
+# run_step <name> <vhdl_tokenise options>: times it, output in $workdir/<name>.log
+run_step() {
+  bench_run "$1" "$TOKENISE" "${@:2}" "$vhdl"
+  echo "$1 $bench_ms" >> "$results"
+  sed "s/^/$1: /" "$workdir/$1.log"
+}
+
+run_step tokenise -b -r "$repeats"
+awk '{ for (i = 1; i < NF; i++) if ($(i + 1) == "tokens/sec,") print "tokens_per_sec", $i }' "$workdir/tokenise.log" >> "$results"
+
+index=$workdir/index
+run_step index_full -i "$index"
+run_step index_unchanged -i "$index"
+first=$(find "$vhdl" -name '*.vhd*' | sort | head -1)
+if [[ -w $first ]]; then
+  touch "$first"
+  run_step index_one_changed -i "$index"
+fi
+
+cat "$results"
+
+# (these only hold for the made up VHDL)
+if [[ $# -eq 0 ]]; then
+  failed=0
+  check() {
+    if eval "$2"; then
+      echo "ok: $1"
+    else
+      echo "FAILED: $1"
+      failed=1
+    fi
+  }
+  check "every file indexed" "grep -q '^$nfiles files ($nfiles read again, 0 gone), $((nfiles * 65)) definitions' $workdir/index_full.log"
+  check "nothing read again when unchanged" "grep -q '(0 read again, 0 gone)' $workdir/index_unchanged.log"
+  check "only the changed file read again" "grep -q '(1 read again, 0 gone)' $workdir/index_one_changed.log"
+  check "definitions found" "\"$TOKENISE\" -i $index -q next7 $vhdl 2>/dev/null | grep -q 'unit1.vhd:[0-9]*: signal next7 (unit1)'"
+  exit $failed
+fi
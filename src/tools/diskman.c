@@ -2,7 +2,19 @@
 #include <string.h>
 #include <ctype.h>
 
-char data[819200];
+#include "diskman.h"
+
+#define D81_TRACKS 80
+#define D81_SECTORS_PER_TRACK 40
+#define D81_DIR_TRACK 40
+#define D81_FIRST_DIR_SECTOR 3
+#define D81_DIR_ENTRIES_PER_SECTOR 8
+
+char data[D81_SIZE];
+
+// which 256 byte sectors of the image in data[] hold something (header, bam, directory or file data)
+unsigned char sector_used[D81_TRACKS * D81_SECTORS_PER_TRACK];
+unsigned char upload_map[D81_UPLOAD_SECTORS];
 
 void write_tso_byte(int track, int sector, int offset, int val)
 {
@@ -22,6 +34,8 @@ void write_tso_str(int track, int sector, int offset, char *str, int maxlen)
   }
 }
 
+void update_bam(int track, int sector);
+
 void write_header(char *disk_name, char *disk_id)
 {
   write_tso_byte(40, 0, 0x00, 40); // write T/S location of first directory sector
@@ -60,6 +74,14 @@ void write_header(char *disk_name, char *disk_id)
   // initialise bam entries for tracks (set all sectors as empty)
   for (int k = 0; k < 40; k++)
     write_tso_str(40, 2, 0x10 + k * 6, "\x28\xff\xff\xff\xff\xff", 6);
+
+  // first (empty) directory sector
+  write_tso_byte(40, 3, 0x00, 0x00);
+  write_tso_byte(40, 3, 0x01, 0xff);
+
+  // header, both bam sectors and the first directory sector are in use
+  for (int s = 0; s <= D81_FIRST_DIR_SECTOR; s++)
+    update_bam(D81_DIR_TRACK, s);
 }
 
 #define FTYPE_DEL 0
@@ -70,21 +92,6 @@ void write_header(char *disk_name, char *disk_id)
 #define FTYPE_CBM 5
 #define FTYPE_CLOSEDFLAG 0x80
 
-void write_direntry(char *prgname, int firsttrack, int firstsector, int sectorcnt)
-{
-  write_tso_byte(40, 3, 0x00, 0x00); // write T/S location of next dir-entry sector (0x00 and 0xff for last sector)
-  write_tso_byte(40, 3, 0x01, 0xff);
-  write_tso_byte(40, 3, 0x02, FTYPE_PRG | FTYPE_CLOSEDFLAG);
-  write_tso_byte(40, 3, 0x03, firsttrack);
-  write_tso_byte(40, 3, 0x04, firstsector);
-  write_tso_str(40, 3, 0x05, prgname, 16);
-  write_tso_byte(40, 3, 0x15, 0x00);
-  write_tso_byte(40, 3, 0x16, 0x00);
-  write_tso_byte(40, 3, 0x17, 0x00);
-  write_tso_byte(40, 3, 0x1E, sectorcnt & 0xff);
-  write_tso_byte(40, 3, 0x1F, sectorcnt >> 8);
-}
-
 void get_nice_prgname(char *dest, char *src)
 {
   char *pdest = dest;
@@ -104,44 +111,55 @@ void get_nice_d81name(char *dest, char *src)
   strcat(dest, ".D81");
 }
 
+// directory entry name: file name without path and extension, at most 16 chars
+void get_nice_cbmname(char *dest, char *src)
+{
+  char *base = strrchr(src, '/');
+  get_nice_prgname(dest, base ? base + 1 : src);
+  dest[16] = '\0';
+}
+
 int calc_offset(int track, int sector, int offset)
 {
   return (track - 1) * (256 * 40) + sector * 256 + offset;
 }
 
+char *get_bamentry(int track)
+{
+  // first bam sector is at t/s = 40/1, 2nd bam is at t/s = 40/2
+  if (track <= 40)
+    return &data[calc_offset(40, 1, 0x10) + (track - 1) * 0x06]; // 6 bytes per track BAM entry
+  return &data[calc_offset(40, 2, 0x10) + (track - 41) * 0x06];
+}
+
 void mark_sector_used(char *bamentry, int sector)
 {
   int offs = sector >> 3;
-  int bitloc = sector & 0x0f;
+  int bitloc = 1 << (sector & 0x07);
   bamentry[1 + offs] &= ~bitloc;
 }
 
+int is_sector_free(int track, int sector)
+{
+  char *bamentry = get_bamentry(track);
+  return (bamentry[1 + (sector >> 3)] >> (sector & 0x07)) & 1;
+}
+
 int calc_sectors_free(char *bamentry)
 {
   int cnt = 0;
-  for (int k = 1; k < 6; k++) {
-    int byteval = bamentry[k];
-    for (int z = 0; z < 8; z++) {
-      if (byteval & (1 << z))
-        cnt++;
-    }
-  }
+  for (int k = 1; k < 6; k++)
+    cnt += __builtin_popcount((unsigned char)bamentry[k]);
   return cnt;
 }
 
 void update_bam(int track, int sector)
 {
-  int offs;
-  if (track <= 40)
-    offs = calc_offset(40, 1, 0x10) + (track - 1) * 0x06; // 6 bytes per track BAM entry
-  else
-    offs = calc_offset(40, 2, 0x10) + (track - 41) * 0x06; // 6 bytes per track BAM entry
-
-  // first bam sector is at t/s = 40/1, 2nd bam is at t/s = 40/2
-  char *bamentry = &data[offs];
+  char *bamentry = get_bamentry(track);
 
   mark_sector_used(bamentry, sector);
   bamentry[0x00] = calc_sectors_free(bamentry); // number of free sectors on the track
+  sector_used[(track - 1) * D81_SECTORS_PER_TRACK + sector] = 1;
 }
 
 void update_tsptr(int track, int sector, int t, int s)
@@ -156,10 +174,146 @@ static void write_sector(int track, int sector, char *chunk)
   char *dest = &data[(track - 1) * (256 * 40) + sector * 256];
   memcpy(dest, chunk, 256);
 
-  // update bam?
   update_bam(track, sector);
 }
 
+/*
+ * Returns the first free sector on the track, searching upwards from start_sector
+ * and wrapping around, or -1 if the track is full.
+ */
+int find_free_sector_on_track(int track, int start_sector)
+{
+  if (!get_bamentry(track)[0])
+    return -1;
+  for (int k = 0; k < D81_SECTORS_PER_TRACK; k++) {
+    int sector = (start_sector + k) % D81_SECTORS_PER_TRACK;
+    if (is_sector_free(track, sector))
+      return sector;
+  }
+  return -1;
+}
+
+/*
+ * Picks the sector for the next block of a file. Like the 1581 DOS, the first block goes
+ * as close to the directory track as possible, and following blocks stay on the same track
+ * (interleave sectors further on) until it is full. Then the search continues on the next
+ * track away from the directory track, and finally on the other half of the disk.
+ * Returns 0 on success, -1 if the disk is full.
+ */
+int alloc_file_sector(int *track, int *sector, int first_block, int interleave)
+{
+  int t, s;
+
+  if (first_block) {
+    for (int dist = 1; dist < D81_DIR_TRACK; dist++) {
+      int tracks[2] = { D81_DIR_TRACK - dist, D81_DIR_TRACK + dist };
+      for (int k = 0; k < 2; k++) {
+        t = tracks[k];
+        if (t < 1 || t > D81_TRACKS)
+          continue;
+        if ((s = find_free_sector_on_track(t, 0)) >= 0) {
+          *track = t;
+          *sector = s;
+          return 0;
+        }
+      }
+    }
+    return -1;
+  }
+
+  if ((s = find_free_sector_on_track(*track, *sector + interleave)) >= 0) {
+    *sector = s;
+    return 0;
+  }
+
+  t = *track;
+  for (int k = 0; k < D81_TRACKS; k++) {
+    t = (t < D81_DIR_TRACK) ? t - 1 : t + 1;
+    if (t < 1)
+      t = D81_DIR_TRACK + 1;
+    if (t > D81_TRACKS)
+      t = D81_DIR_TRACK - 1;
+    if ((s = find_free_sector_on_track(t, 0)) >= 0) {
+      *track = t;
+      *sector = s;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Finds a free directory entry slot, extending the directory chain on track 40 by another
+ * sector if all entries are taken. Returns the offset of the entry in data[], -1 if the
+ * directory is full, or -2 if an entry of that name already exists.
+ */
+int find_direntry_slot(char *name)
+{
+  char padded[16];
+  int track = D81_DIR_TRACK;
+  int sector = D81_FIRST_DIR_SECTOR;
+  int slot = -1;
+
+  for (int k = 0; k < 16; k++)
+    padded[k] = (k < strlen(name)) ? name[k] : (char)0xa0;
+
+  while (1) {
+    for (int k = 0; k < D81_DIR_ENTRIES_PER_SECTOR; k++) {
+      int offs = calc_offset(track, sector, k * 32);
+      if (!data[offs + 0x02]) {
+        if (slot < 0)
+          slot = offs;
+      }
+      else if (!memcmp(&data[offs + 0x05], padded, 16))
+        return -2;
+    }
+    int next_track = (unsigned char)data[calc_offset(track, sector, 0)];
+    int next_sector = (unsigned char)data[calc_offset(track, sector, 1)];
+    if (!next_track)
+      break;
+    track = next_track;
+    sector = next_sector;
+  }
+
+  if (slot >= 0)
+    return slot;
+
+  // directory chain is full, continue it on the next free sector of the directory track
+  int new_sector = find_free_sector_on_track(D81_DIR_TRACK, sector + 1);
+  if (new_sector < 0)
+    return -1;
+  update_tsptr(track, sector, D81_DIR_TRACK, new_sector);
+  update_tsptr(D81_DIR_TRACK, new_sector, 0x00, 0xff);
+  update_bam(D81_DIR_TRACK, new_sector);
+  return calc_offset(D81_DIR_TRACK, new_sector, 0);
+}
+
+int write_direntry(char *prgname, int ftype, int firsttrack, int firstsector, int sectorcnt)
+{
+  int offs = find_direntry_slot(prgname);
+  if (offs == -2) {
+    printf("ERROR: \"%s\" is already on the disk image\n", prgname);
+    return -1;
+  }
+  if (offs < 0) {
+    printf("ERROR: Directory of disk image is full\n");
+    return -1;
+  }
+
+  char *entry = &data[offs];
+  entry[0x02] = ftype | FTYPE_CLOSEDFLAG;
+  entry[0x03] = firsttrack;
+  entry[0x04] = firstsector;
+  for (int k = 0; k < 16; k++)
+    entry[0x05 + k] = (k < strlen(prgname)) ? prgname[k] : (char)0xa0;
+  entry[0x15] = 0x00;
+  entry[0x16] = 0x00;
+  entry[0x17] = 0x00;
+  entry[0x1E] = sectorcnt & 0xff;
+  entry[0x1F] = sectorcnt >> 8;
+  return 0;
+}
+
 int check_file_access(char *file)
 {
   FILE *f = fopen(file, "rb");
@@ -170,51 +324,98 @@ int check_file_access(char *file)
   return 0;
 }
 
-void add_prg(char *fname)
+int has_extension(char *fname, char *ext)
+{
+  int len = strlen(fname);
+  int extlen = strlen(ext);
+  if (len < extlen)
+    return 0;
+  for (int k = 0; k < extlen; k++)
+    if (tolower(fname[len - extlen + k]) != tolower(ext[k]))
+      return 0;
+  return 1;
+}
+
+int add_file(char *fname, int ftype, int interleave)
 {
   // load the prg
   FILE *f = fopen(fname, "rb");
+  if (!f) {
+    printf("ERROR: Cannot open file '%s'\n", fname);
+    return -1;
+  }
   char prgname[256];
-  get_nice_prgname(prgname, fname);
+  get_nice_cbmname(prgname, fname);
   char chunk[256] = { 0 };
 
-  int starttrack = 1;
+  int starttrack = 0;
   int startsector = 0;
-  int curtrack = starttrack;
-  int cursector = startsector;
+  int curtrack = 0;
+  int cursector = 0;
   int prevtrack = 0;
   int prevsector = 0;
 
   int bytes;
   int sectorcnt = 0;
-  while ((bytes = fread(chunk + 2, 1, 254, f)) != 0) {
+  // empty files still get one (empty) block
+  while ((bytes = fread(chunk + 2, 1, 254, f)) != 0 || sectorcnt == 0) {
+    if (alloc_file_sector(&curtrack, &cursector, sectorcnt == 0, interleave)) {
+      printf("ERROR: Disk image is full, cannot add \"%s\"\n", fname);
+      fclose(f);
+      return -1;
+    }
     if (sectorcnt != 0) {
       update_tsptr(prevtrack, prevsector, curtrack, cursector);
     }
-    chunk[0] = 0x00; // assume this is the last chunk
-    chunk[1] = 0xff; // (can overwrite it later)
+    else {
+      starttrack = curtrack;
+      startsector = cursector;
+    }
+    chunk[0] = 0x00;      // assume this is the last chunk
+    chunk[1] = bytes + 1; // index of its last byte (link gets overwritten if there is a next one)
     write_sector(curtrack, cursector, chunk);
     prevtrack = curtrack;
     prevsector = cursector;
     sectorcnt++;
     memset(chunk, 0, 256);
-    cursector++;
-    if (cursector >= 40) {
-      cursector = 0;
-      curtrack++;
-    }
   }
 
-  write_direntry(prgname, starttrack, startsector, sectorcnt);
-
   fclose(f);
+
+  return write_direntry(prgname, ftype, starttrack, startsector, sectorcnt);
+}
+
+void add_prg(char *fname)
+{
+  add_file(fname, FTYPE_PRG, 1);
 }
 
-void save_d81(char *fname)
+int blocks_free(void)
+{
+  int cnt = 0;
+  for (int t = 1; t <= D81_TRACKS; t++)
+    if (t != D81_DIR_TRACK)
+      cnt += (unsigned char)get_bamentry(t)[0];
+  return cnt;
+}
+
+int save_d81(char *fname)
 {
   FILE *f = fopen(fname, "wb");
-  fwrite(data, 1, 819200, f);
+  if (!f) {
+    printf("ERROR: Cannot create '%s'\n", fname);
+    return -1;
+  }
+  fwrite(data, 1, D81_SIZE, f);
   fclose(f);
+  return 0;
+}
+
+void init_d81(char *disk_name)
+{
+  memset(data, 0, D81_SIZE);
+  memset(sector_used, 0, sizeof(sector_used));
+  write_header(disk_name, "GI");
 }
 
 char *create_d81_for_prg(char *prgfname)
@@ -226,19 +427,39 @@ char *create_d81_for_prg(char *prgfname)
     return NULL;
   }
 
-  memset(data, 0, 819200);
-  write_header("PRG WRAPPER", "GI");
+  init_d81("PRG WRAPPER");
   add_prg(prgfname);
 
   get_nice_d81name(d81name, prgfname);
   printf("Wrapping \"%s\" into \"%s\"...\n", prgfname, d81name);
-  save_d81(d81name);
+  if (save_d81(d81name))
+    return NULL;
   return d81name;
 }
 
-/*
-void main(void)
+int create_d81_for_files(char *d81name, char **files, int file_count, int interleave)
+{
+  char disk_name[256];
+  get_nice_cbmname(disk_name, d81name);
+
+  if (interleave < 1 || interleave >= D81_SECTORS_PER_TRACK) {
+    printf("ERROR: Invalid interleave %d\n", interleave);
+    return -1;
+  }
+
+  init_d81(disk_name);
+  for (int k = 0; k < file_count; k++) {
+    if (add_file(files[k], has_extension(files[k], ".seq") ? FTYPE_SEQ : FTYPE_PRG, interleave))
+      return -1;
+  }
+
+  printf("Built \"%s\" with %d files, %d blocks free.\n", d81name, file_count, blocks_free());
+  return save_d81(d81name);
+}
+
+unsigned char *d81_used_sectors(void)
 {
-  create_d81_for_prg("momo.prg");
+  for (int k = 0; k < D81_UPLOAD_SECTORS; k++)
+    upload_map[k] = sector_used[k * 2] | sector_used[k * 2 + 1];
+  return upload_map;
 }
-*/
@@ -1,6 +1,13 @@
 #ifndef DISKMAN_H
 #define DISKMAN_H
 
+#define D81_SIZE 819200
+#define D81_UPLOAD_SECTORS (D81_SIZE / 512)
+
 char *create_d81_for_prg(char *prgfname);
+int create_d81_for_files(char *d81name, char **files, int file_count, int interleave);
+
+// one flag per 512 byte sector of the last built image, set if the sector holds any data
+unsigned char *d81_used_sectors(void);
 
 #endif // DISKMAN_H
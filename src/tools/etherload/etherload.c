@@ -15,6 +15,11 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <limits.h> // PATH_MAX
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef WINDOWS
+#include <io.h>
+#endif
 
 #include <logging.h>
 
@@ -69,6 +74,8 @@ int bin_load_addr = 0;
 int file_offset = 0;
 char ip_address[40];
 char network_interface[256];
+int delta_upload = 0;
+int forget_shadow = 0;
 char *filename = NULL;
 char *d81_image = NULL;
 char *rom_file = NULL;
@@ -201,6 +208,9 @@ void init_cmd_options(void)
   CMD_OPTION("mount",       required_argument, 0,            'm', "file",   "Mount d81 file image <file> from SD card root folder (eg. MEGA65.D81).");
   CMD_OPTION("pal",         no_argument,       &set_pal,     1,     "",     "Set PAL video mode when doing reset.");
   CMD_OPTION("ntsc",        no_argument,       &set_ntsc,    1,     "",     "Set NTSC video mode when doing reset.");
+  CMD_OPTION("delta",       no_argument,       &delta_upload, 1,    "",     "Only send the packets that differ from what was last uploaded to this MEGA65. "
+                                                                                 "Only kept with --halt. Do not use this if the MEGA65 may have changed that memory since (see --forget).");
+  CMD_OPTION("forget",      no_argument,       &forget_shadow, 1,   "",     "Forget what was last uploaded to this MEGA65, so that --delta sends everything.");
   // clang-format on
 }
 
@@ -257,11 +267,272 @@ void discover_mega65(const char *progname)
   printf("MEGA65 found at %s%%%s\n", ethl_get_ip_address(), ethl_get_interface_name());
 }
 
+long long gettime_ms(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+/*
+  Shadow of the memory uploaded to a MEGA65, so that --delta only sends the
+  packets whose bytes differ from it. It is kept per target (by its IPv6
+  address) under $M65_ETHERLOAD_CACHE, or else etherload in the usual per-user
+  cache directory, as the ranges uploaded and their contents.
+
+  It can only be trusted while nothing else changes that memory on the
+  MEGA65. So its file is removed while a transfer is going on, and it is
+  only kept when the MEGA65 is left halted (--halt): a reset, --run or
+  --jump runs code that may change any of memory, what was just uploaded
+  included. --forget drops it too.
+*/
+
+#define SHADOW_MAGIC "M65SHADOW1\n"
+// data bytes in a dmaload packet
+#define PACKET_DATA_SIZE 1024
+
+typedef struct {
+  unsigned int addr;
+  int len;
+  unsigned char *data;
+} shadow_range;
+
+typedef struct {
+  shadow_range *ranges; // in address order, neither overlapping nor touching
+  int count;
+} shadow_map;
+
+shadow_map shadow = { NULL, 0 };
+char shadow_name[1200] = "";
+int shadow_existed = 0;
+
+int make_dir(char *path)
+{
+#ifdef WINDOWS
+  return mkdir(path);
+#else
+  return mkdir(path, 0755);
+#endif
+}
+
+// Returns -1 if there is nowhere to keep it
+int shadow_file_name(void)
+{
+  char dir[1024];
+  char *env = getenv("M65_ETHERLOAD_CACHE");
+  if (env && env[0])
+    snprintf(dir, sizeof(dir), "%s", env);
+  else {
+#ifdef WINDOWS
+    char *base = getenv("LOCALAPPDATA");
+    if (!base)
+      return -1;
+    snprintf(dir, sizeof(dir), "%s/etherload", base);
+#else
+    char *base = getenv("XDG_CACHE_HOME");
+    if (base && base[0])
+      snprintf(dir, sizeof(dir), "%s/etherload", base);
+    else if ((base = getenv("HOME")))
+      snprintf(dir, sizeof(dir), "%s/.cache/etherload", base);
+    else
+      return -1;
+#endif
+  }
+
+  // create each level of it
+  for (char *p = dir + 1; *p; p++)
+    if (*p == '/') {
+      *p = '\0';
+      make_dir(dir);
+      *p = '/';
+    }
+  make_dir(dir);
+
+  struct stat st;
+  if (stat(dir, &st) || !(st.st_mode & S_IFDIR)) {
+    log_warn("can not create cache directory '%s'", dir);
+    return -1;
+  }
+
+  // (colons are no good in file names on Windows)
+  char target[INET6_ADDRSTRLEN];
+  snprintf(target, sizeof(target), "%s", ethl_get_ip_address());
+  for (char *p = target; *p; p++)
+    if (*p == ':')
+      *p = '_';
+  snprintf(shadow_name, sizeof(shadow_name), "%s/%s.shadow", dir, target);
+  return 0;
+}
+
+void shadow_free(shadow_map *map)
+{
+  for (int i = 0; i < map->count; i++)
+    free(map->ranges[i].data);
+  free(map->ranges);
+  map->ranges = NULL;
+  map->count = 0;
+}
+
+// Records that len bytes of data are now at addr
+void shadow_store(shadow_map *map, unsigned int addr, unsigned char *data, int len)
+{
+  unsigned int end = addr + len;
+  int first, last;
+
+  // the ranges it overlaps or touches are merged into it
+  for (first = 0; first < map->count && map->ranges[first].addr + map->ranges[first].len < addr; first++)
+    ;
+  for (last = first; last < map->count && map->ranges[last].addr <= end; last++)
+    ;
+
+  unsigned int new_addr = addr, new_end = end;
+  if (first < last) {
+    if (map->ranges[first].addr < new_addr)
+      new_addr = map->ranges[first].addr;
+    if (map->ranges[last - 1].addr + map->ranges[last - 1].len > new_end)
+      new_end = map->ranges[last - 1].addr + map->ranges[last - 1].len;
+  }
+
+  unsigned char *merged = malloc(new_end - new_addr);
+  if (!merged) {
+    log_crit("out of memory");
+    exit(-1);
+  }
+  for (int i = first; i < last; i++) {
+    memcpy(merged + map->ranges[i].addr - new_addr, map->ranges[i].data, map->ranges[i].len);
+    free(map->ranges[i].data);
+  }
+  memcpy(merged + addr - new_addr, data, len);
+
+  if (first == last) {
+    map->ranges = realloc(map->ranges, (map->count + 1) * sizeof(shadow_range));
+    memmove(&map->ranges[first + 1], &map->ranges[first], (map->count - first) * sizeof(shadow_range));
+    map->count++;
+  }
+  else {
+    memmove(&map->ranges[first + 1], &map->ranges[last], (map->count - last) * sizeof(shadow_range));
+    map->count -= last - first - 1;
+  }
+  map->ranges[first].addr = new_addr;
+  map->ranges[first].len = new_end - new_addr;
+  map->ranges[first].data = merged;
+}
+
+// Returns 1 if the shadow says the MEGA65 already has these len bytes at addr
+int shadow_matches(unsigned int addr, unsigned char *data, int len)
+{
+  for (int i = 0; i < shadow.count; i++) {
+    shadow_range *r = &shadow.ranges[i];
+    if (r->addr <= addr && addr + len <= r->addr + r->len)
+      return !memcmp(r->data + addr - r->addr, data, len);
+  }
+  return 0;
+}
+
+// Reads the shadow of the target, and removes its file until the transfer is done
+void shadow_load(void)
+{
+  if (shadow_file_name())
+    return;
+
+  FILE *f = fopen(shadow_name, "rb");
+  if (!f)
+    return;
+  shadow_existed = 1;
+
+  char magic[sizeof(SHADOW_MAGIC)];
+  if (fread(magic, 1, strlen(SHADOW_MAGIC), f) != strlen(SHADOW_MAGIC) || memcmp(magic, SHADOW_MAGIC, strlen(SHADOW_MAGIC)))
+    log_warn("ignoring damaged shadow '%s'", shadow_name);
+  else {
+    unsigned char header[8];
+    while (fread(header, 1, 8, f) == 8) {
+      unsigned int addr = header[0] | (header[1] << 8) | (header[2] << 16) | ((unsigned int)header[3] << 24);
+      int len = header[4] | (header[5] << 8) | (header[6] << 16) | (header[7] << 24);
+      unsigned char *data = len > 0 && len <= 0x10000000 ? malloc(len) : NULL;
+      if (!data || fread(data, 1, len, f) != len) {
+        log_warn("ignoring damaged shadow '%s'", shadow_name);
+        free(data);
+        shadow_free(&shadow);
+        break;
+      }
+      shadow_store(&shadow, addr, data, len);
+      free(data);
+    }
+  }
+  fclose(f);
+  unlink(shadow_name);
+}
+
+void shadow_save(void)
+{
+  if (!shadow_name[0] || !shadow.count || !(delta_upload || shadow_existed))
+    return;
+
+  char tmpname[1210];
+  snprintf(tmpname, sizeof(tmpname), "%s.new", shadow_name);
+  FILE *f = fopen(tmpname, "wb");
+  if (!f) {
+    log_warn("can not write shadow '%s'", tmpname);
+    return;
+  }
+  int ok = fwrite(SHADOW_MAGIC, 1, strlen(SHADOW_MAGIC), f) == strlen(SHADOW_MAGIC);
+  for (int i = 0; ok && i < shadow.count; i++) {
+    unsigned char header[8];
+    for (int b = 0; b < 4; b++) {
+      header[b] = shadow.ranges[i].addr >> (b * 8);
+      header[4 + b] = shadow.ranges[i].len >> (b * 8);
+    }
+    ok = fwrite(header, 1, 8, f) == 8 && fwrite(shadow.ranges[i].data, 1, shadow.ranges[i].len, f) == shadow.ranges[i].len;
+  }
+  if (fclose(f) || !ok || rename(tmpname, shadow_name)) {
+    log_warn("can not write shadow '%s'", shadow_name);
+    unlink(tmpname);
+  }
+}
+
+/*
+  Sends len bytes of data to addr, in packets of PACKET_DATA_SIZE from its
+  start. With --delta, the packets the MEGA65 already has are skipped, and
+  the rest go as runs of consecutive packets.
+*/
+int upload(unsigned int start_addr, unsigned char *data, int len, int timeout_ms)
+{
+  long long start = gettime_ms();
+  int sent = 0, runs = 0, offset = 0;
+
+  while (offset < len) {
+    int bytes = len - offset < PACKET_DATA_SIZE ? len - offset : PACKET_DATA_SIZE;
+    if (delta_upload && shadow_matches(start_addr + offset, data + offset, bytes)) {
+      offset += bytes;
+      continue;
+    }
+
+    runs++;
+    unsigned int run_addr = start_addr + offset;
+    do {
+      if (send_mem(start_addr + offset, data + offset, bytes, timeout_ms) < 0) {
+        log_error("Failed to send data to MEGA65");
+        return -1;
+      }
+      sent += bytes;
+      offset += bytes;
+      bytes = len - offset < PACKET_DATA_SIZE ? len - offset : PACKET_DATA_SIZE;
+    } while (offset < len && !(delta_upload && shadow_matches(start_addr + offset, data + offset, bytes)));
+    log_debug("Sent run $%07x-$%07x", run_addr, start_addr + offset - 1);
+  }
+
+  shadow_store(&shadow, start_addr, data, len);
+
+  log_note("Sent %d of %d bytes to $%07x in %d run%s, %lldms", sent, len, start_addr, runs, runs == 1 ? "" : "s",
+      gettime_ms() - start);
+  return sent;
+}
+
 /**
  * @brief Loads a file into memory at the specified address.
  *
- * This function reads a file from the specified file descriptor and loads it into memory
- * starting at the specified address.
+ * This function reads the rest of a file from the specified file descriptor and loads it
+ * into memory starting at the specified address (see upload()).
  *
  * @param fd The file descriptor of the file to load.
  * @param start_addr The address to start loading the file into memory.
@@ -269,22 +540,27 @@ void discover_mega65(const char *progname)
  */
 int load_file(int fd, int start_addr, int timeout_ms)
 {
-  unsigned char buffer[1024];
-  int offset = 0;
+  unsigned char *buffer = NULL;
+  int size = 0, len = 0;
   int bytes;
-  int address = start_addr;
 
-  while ((bytes = read(fd, buffer, 1024)) != 0) {
-    log_debug("Read %d bytes at offset %d", bytes, offset);
-    offset += bytes;
-    if (send_mem(address, buffer, bytes, timeout_ms) < 0) {
-      log_error("Failed to send data to MEGA65");
-      return -1;
+  do {
+    if (len == size) {
+      size = size ? size * 2 : 65536;
+      if (!(buffer = realloc(buffer, size))) {
+        log_crit("out of memory");
+        exit(-1);
+      }
     }
-    address += bytes;
-  }
+    bytes = read(fd, buffer + len, size - len);
+    if (bytes > 0)
+      len += bytes;
+  } while (bytes > 0);
+  log_debug("Read %d bytes", len);
 
-  return address - start_addr;
+  int result = upload(start_addr, buffer, len, timeout_ms);
+  free(buffer);
+  return result < 0 ? -1 : len;
 }
 
 int main(int argc, char **argv)
@@ -515,6 +791,10 @@ int main(int argc, char **argv)
   ethl_setup_dmaload();
   ethl_set_queue_length(32);
 
+  shadow_load();
+  if (forget_shadow)
+    shadow_free(&shadow);
+
   // Try to get MEGA65 to trigger the ethernet remote control hypperrupt
   if (trigger_eth_hyperrupt() < 0) {
     etherload_finish();
@@ -661,6 +941,11 @@ int main(int argc, char **argv)
     }
   }
 
+  // once the MEGA65 runs code, nothing in the shadow can be relied on
+  if (!halt)
+    shadow_free(&shadow);
+  shadow_save();
+
   etherload_finish();
 
   return 0;
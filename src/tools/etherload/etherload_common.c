@@ -48,6 +48,13 @@ static int frame_unacked[MAX_UNACKED_FRAMES] = { 0 };
 static unsigned char unacked_frame_payloads[MAX_UNACKED_FRAMES][1500];
 static int unacked_frame_lengths[MAX_UNACKED_FRAMES] = { 0 };
 static long long unacked_sent_times[MAX_UNACKED_FRAMES] = { 0 };
+static unsigned long long unacked_trace_start[MAX_UNACKED_FRAMES] = { 0 };
+
+TRACE_SPAN(span_udp_send, "udp_send");
+TRACE_SPAN(span_udp_resend, "udp_resend");
+TRACE_SPAN(span_udp_recv, "udp_recv");
+TRACE_SPAN(span_udp_ack, "udp_ack");
+TRACE_SPAN(span_udp_wait_slot, "udp_wait_slot");
 
 static int queue_length = 4;
 static int retx_interval = 1000;
@@ -439,6 +446,7 @@ int check_if_ack(uint8_t *rx_payload, int len)
     if (frame_unacked[i]) {
       if ((*match_payloads)(rx_payload, len, unacked_frame_payloads[i], unacked_frame_lengths[i])) {
         log_debug("Found match in slot #%d, freeing...", i);
+        trace_end(&span_udp_ack, unacked_trace_start[i]);
         frame_unacked[i] = 0;
         last_resend_time = gettime_us();
         return 1;
@@ -477,6 +485,7 @@ int expect_ack(uint8_t *payload, int len, int timeout_ms)
       memcpy(unacked_frame_payloads[free_slot], payload, len);
       unacked_frame_lengths[free_slot] = len;
       unacked_sent_times[free_slot] = gettime_us();
+      unacked_trace_start[free_slot] = trace_begin();
       frame_unacked[free_slot] = 1;
       last_resend_time = gettime_us();
       return 0;
@@ -493,8 +502,10 @@ int expect_ack(uint8_t *payload, int len, int timeout_ms)
     socklen_t addr_len = sizeof(src_address);
 
     while (r > -1 /*&& count++ < 100*/) {
+      unsigned long long t = trace_begin();
       r = recvfrom(sockfd, (void *)ackbuf, sizeof(ackbuf), 0, (struct sockaddr *)&src_address, &addr_len);
       if (r > -1) {
+        trace_end(&span_udp_recv, t);
         if (memcmp(&(src_address.sin6_addr), &(servaddr.sin6_addr), 16) != 0 || src_address.sin6_port != htons(PORTNUM)) {
           char str[INET6_ADDRSTRLEN];
           inet_ntop(AF_INET6, &(src_address.sin6_addr), str, INET6_ADDRSTRLEN);
@@ -568,8 +579,10 @@ void maybe_send_ack(void)
       log_debug("Resending packet seq #%d", get_packet_seq(unacked_frame_payloads[id], unacked_frame_lengths[id]));
       ++retx_cnt;
       update_retx_interval();
+      unsigned long long t = trace_begin();
       sendto(sockfd, (void *)unacked_frame_payloads[id], unacked_frame_lengths[id], 0, (struct sockaddr *)&servaddr,
           sizeof(servaddr));
+      trace_end(&span_udp_resend, t);
       last_resend_time = gettime_us();
       log_debug("Pending acks:");
       for (int i = 0; i < queue_length; i++) {
@@ -601,8 +614,10 @@ int wait_ack_slots_available(int num_free_slots_needed, int timeout_ms)
     socklen_t addr_len = sizeof(src_address);
 
     while (r > -1 /*&& count++ < 100*/) {
+      unsigned long long t = trace_begin();
       r = recvfrom(sockfd, (void *)ackbuf, sizeof(ackbuf), 0, (struct sockaddr *)&src_address, &addr_len);
       if (r > -1) {
+        trace_end(&span_udp_recv, t);
         if (memcmp(&(src_address.sin6_addr), &(servaddr.sin6_addr), 16) != 0 || src_address.sin6_port != htons(PORTNUM)) {
           char str[INET6_ADDRSTRLEN];
           inet_ntop(AF_INET6, &(src_address.sin6_addr), str, INET6_ADDRSTRLEN);
@@ -629,7 +644,10 @@ int wait_all_acks(int timeout_ms)
 
 int send_ethlet(const uint8_t data[], const int bytes)
 {
-  return sendto(sockfd, (char *)data, bytes, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
+  unsigned long long t = trace_begin();
+  int ret = sendto(sockfd, (char *)data, bytes, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
+  trace_end(&span_udp_send, t);
+  return ret;
 }
 
 int singlecmd_get_packet_seq(uint8_t *payload, int len)
@@ -757,19 +775,25 @@ int dmaload_embed_packet_seq(uint8_t *payload, int len, int seq_num)
 int ethl_send_packet(uint8_t *payload, int len, int timeout_ms)
 {
   int ret = 0;
+  unsigned long long t = trace_begin();
   if (expect_ack(payload, len, timeout_ms) < 0) {
     log_debug("Timeout waiting for new ack slot");
     return -1;
   }
+  trace_end(&span_udp_wait_slot, t);
+  t = trace_begin();
   do {
     ret = sendto(sockfd, (char *)payload, len, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
   } while (ret < 0 && errno == EAGAIN);
+  trace_end(&span_udp_send, t);
   return 0;
 }
 
 int ethl_send_packet_unscheduled(uint8_t *payload, int len)
 {
+  unsigned long long t = trace_begin();
   sendto(sockfd, (char *)payload, len, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
+  trace_end(&span_udp_send, t);
   return 0;
 }
 
@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WINDOWS
+#include <pthread.h>
+#endif
+
+#include "m65common.h"
+#include "file_pipeline.h"
+
+#define PIPELINE_BLOCK_SIZE 65536
+#define PIPELINE_BLOCKS 8
+
+struct file_pipeline {
+  FILE *f;
+  int writing;
+  unsigned char *blocks[PIPELINE_BLOCKS];
+  int block_len[PIPELINE_BLOCKS];
+  int head;  // next block the reader thread fills / the link thread writes into
+  int tail;  // next block the link thread consumes / the writer thread drains
+  int count; // blocks between tail and head
+  int pos;   // read position of the link thread in the tail block (fill level of the head block when writing)
+  int eof;
+  int error;
+  int stop;
+  long long link_idle_us;
+  long long io_idle_us;
+#ifndef WINDOWS
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+};
+
+#ifndef WINDOWS
+
+// waits on the condition, adding the time spent to *idle_us
+static void pipeline_wait(file_pipeline *p, long long *idle_us)
+{
+  long long start = gettime_us();
+  pthread_cond_wait(&p->cond, &p->lock);
+  *idle_us += gettime_us() - start;
+}
+
+static void *pipeline_reader(void *arg)
+{
+  file_pipeline *p = arg;
+
+  while (1) {
+    pthread_mutex_lock(&p->lock);
+    while (p->count == PIPELINE_BLOCKS && !p->stop)
+      pipeline_wait(p, &p->io_idle_us);
+    if (p->stop) {
+      pthread_mutex_unlock(&p->lock);
+      break;
+    }
+    int idx = p->head;
+    pthread_mutex_unlock(&p->lock);
+
+    // the block at head isn't visible to the link thread until count covers it
+    int bytes = fread(p->blocks[idx], 1, PIPELINE_BLOCK_SIZE, p->f);
+
+    pthread_mutex_lock(&p->lock);
+    p->block_len[idx] = bytes;
+    p->head = (p->head + 1) % PIPELINE_BLOCKS;
+    p->count++;
+    if (bytes < PIPELINE_BLOCK_SIZE) {
+      p->error = ferror(p->f) ? 1 : 0;
+      p->eof = 1;
+    }
+    pthread_cond_broadcast(&p->cond);
+    int done = p->eof;
+    pthread_mutex_unlock(&p->lock);
+    if (done)
+      break;
+  }
+  return NULL;
+}
+
+static void *pipeline_writer(void *arg)
+{
+  file_pipeline *p = arg;
+
+  while (1) {
+    pthread_mutex_lock(&p->lock);
+    while (p->count == 0 && !p->stop)
+      pipeline_wait(p, &p->io_idle_us);
+    if (p->count == 0) {
+      pthread_mutex_unlock(&p->lock);
+      break;
+    }
+    int idx = p->tail;
+    pthread_mutex_unlock(&p->lock);
+
+    int failed = fwrite(p->blocks[idx], 1, p->block_len[idx], p->f) != p->block_len[idx];
+
+    pthread_mutex_lock(&p->lock);
+    if (failed)
+      p->error = 1;
+    p->tail = (p->tail + 1) % PIPELINE_BLOCKS;
+    p->count--;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+  }
+  return NULL;
+}
+
+#endif
+
+static file_pipeline *pipeline_open(FILE *f, int writing)
+{
+  file_pipeline *p = calloc(1, sizeof(file_pipeline));
+  if (!p)
+    return NULL;
+  p->f = f;
+  p->writing = writing;
+
+#ifndef WINDOWS
+  int ok = 1;
+  for (int i = 0; i < PIPELINE_BLOCKS; i++)
+    if (!(p->blocks[i] = malloc(PIPELINE_BLOCK_SIZE)))
+      ok = 0;
+  if (ok) {
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (pthread_create(&p->thread, NULL, writing ? pipeline_writer : pipeline_reader, p)) {
+      pthread_mutex_destroy(&p->lock);
+      pthread_cond_destroy(&p->cond);
+      ok = 0;
+    }
+  }
+  if (!ok) {
+    // no ring or no thread: fall back to doing the file i/o inline
+    for (int i = 0; i < PIPELINE_BLOCKS; i++) {
+      free(p->blocks[i]);
+      p->blocks[i] = NULL;
+    }
+  }
+#endif
+
+  return p;
+}
+
+file_pipeline *pipeline_open_read(FILE *f)
+{
+  return pipeline_open(f, 0);
+}
+
+file_pipeline *pipeline_open_write(FILE *f)
+{
+  return pipeline_open(f, 1);
+}
+
+int pipeline_read(file_pipeline *p, void *buf, int len)
+{
+  long long start;
+  int bytes = 0;
+
+  if (!p->blocks[0]) {
+    start = gettime_us();
+    bytes = fread(buf, 1, len, p->f);
+    p->link_idle_us += gettime_us() - start;
+    return bytes;
+  }
+
+#ifndef WINDOWS
+  unsigned char *dest = buf;
+  pthread_mutex_lock(&p->lock);
+  while (bytes < len) {
+    while (p->count == 0 && !p->eof)
+      pipeline_wait(p, &p->link_idle_us);
+    if (p->count == 0)
+      break;
+
+    int n = p->block_len[p->tail] - p->pos;
+    if (n > len - bytes)
+      n = len - bytes;
+    memcpy(dest + bytes, p->blocks[p->tail] + p->pos, n);
+    bytes += n;
+    p->pos += n;
+    if (p->pos == p->block_len[p->tail]) {
+      p->pos = 0;
+      p->tail = (p->tail + 1) % PIPELINE_BLOCKS;
+      p->count--;
+      pthread_cond_broadcast(&p->cond);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+#endif
+  return bytes;
+}
+
+int pipeline_write(file_pipeline *p, const void *buf, int len)
+{
+  long long start;
+
+  if (!p->blocks[0]) {
+    start = gettime_us();
+    int bytes = fwrite(buf, 1, len, p->f);
+    p->link_idle_us += gettime_us() - start;
+    if (bytes != len)
+      p->error = 1;
+    return bytes == len ? len : -1;
+  }
+
+#ifndef WINDOWS
+  const unsigned char *src = buf;
+  int bytes = 0;
+  pthread_mutex_lock(&p->lock);
+  while (bytes < len) {
+    // the block at head belongs to us until it is full and counted
+    while (p->count == PIPELINE_BLOCKS)
+      pipeline_wait(p, &p->link_idle_us);
+
+    int n = PIPELINE_BLOCK_SIZE - p->pos;
+    if (n > len - bytes)
+      n = len - bytes;
+    memcpy(p->blocks[p->head] + p->pos, src + bytes, n);
+    bytes += n;
+    p->pos += n;
+    if (p->pos == PIPELINE_BLOCK_SIZE) {
+      p->block_len[p->head] = p->pos;
+      p->head = (p->head + 1) % PIPELINE_BLOCKS;
+      p->count++;
+      p->pos = 0;
+      pthread_cond_broadcast(&p->cond);
+    }
+  }
+  int error = p->error;
+  pthread_mutex_unlock(&p->lock);
+  if (error)
+    return -1;
+#endif
+  return len;
+}
+
+int pipeline_close(file_pipeline *p)
+{
+  int retVal = 0;
+
+  if (!p)
+    return 0;
+
+#ifndef WINDOWS
+  if (p->blocks[0]) {
+    pthread_mutex_lock(&p->lock);
+    if (p->writing && p->pos) {
+      // hand over the partly filled last block (count < PIPELINE_BLOCKS while we own it)
+      p->block_len[p->head] = p->pos;
+      p->head = (p->head + 1) % PIPELINE_BLOCKS;
+      p->count++;
+    }
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+  }
+  for (int i = 0; i < PIPELINE_BLOCKS; i++)
+    free(p->blocks[i]);
+#endif
+
+  if (p->error)
+    retVal = -1;
+  free(p);
+  return retVal;
+}
+
+long long pipeline_link_idle_us(file_pipeline *p)
+{
+  return p->link_idle_us;
+}
+
+long long pipeline_io_idle_us(file_pipeline *p)
+{
+  return p->io_idle_us;
+}
@@ -0,0 +1,28 @@
+#ifndef FILE_PIPELINE_H
+#define FILE_PIPELINE_H
+
+#include <stdio.h>
+
+/*
+ * Moves local file I/O of mega65_ftp off the thread that drives the serial/ethernet link.
+ * A reader thread prefetches the file to upload in large blocks, and a writer thread drains
+ * downloaded data to disk, both through a bounded ring of blocks.
+ */
+typedef struct file_pipeline file_pipeline;
+
+file_pipeline *pipeline_open_read(FILE *f);
+file_pipeline *pipeline_open_write(FILE *f);
+
+// like fread/fwrite: returns the number of bytes read (0 at end of file), or -1 on write error
+int pipeline_read(file_pipeline *p, void *buf, int len);
+int pipeline_write(file_pipeline *p, const void *buf, int len);
+
+// stops the i/o thread (flushing pending writes) and frees p, but doesn't fclose the file.
+// returns -1 if a read or write on the local file failed.
+int pipeline_close(file_pipeline *p);
+
+// time the link thread waited for local file i/o, and time the i/o thread waited for the link
+long long pipeline_link_idle_us(file_pipeline *p);
+long long pipeline_io_idle_us(file_pipeline *p);
+
+#endif // FILE_PIPELINE_H
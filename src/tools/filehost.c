@@ -3,7 +3,13 @@
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifdef WINDOWS
+#include <io.h>
+#endif
 #include "m65common.h"
+#include "logging.h"
 
 #define FINISHED -1
 
@@ -37,13 +43,14 @@ typedef struct file_info {
   char published[64];
 } tfile_info;
 
-typedef struct list_item {
-  struct list_item *prev;
-  struct list_item *next;
-  void *cur;
-} tlist_item;
+// The catalogue as the server sent it, already filtered down to MEGA65 files
+tfile_info *catalogue = NULL;
+int catalogue_count = 0;
+int catalogue_size = 0;
 
-tlist_item *lst_finfos = NULL;
+// Order of the last listing, which is what fhget numbers refer to
+int *listing = NULL;
+int listing_count = 0;
 
 void clean_copy(char *dest, char *src)
 {
@@ -133,54 +140,16 @@ int read_in_key_or_value_string(tfile_info *finfo, char prevc, char c, int *iske
   return 0;
 }
 
-void add_to_list(tfile_info *finfo)
+void add_to_catalogue(tfile_info *finfo)
 {
-  // make first item in list?
-  if (lst_finfos == NULL) {
-    lst_finfos = malloc(sizeof(tlist_item));
-    memset(lst_finfos, 0, sizeof(tlist_item));
-  }
-
-  tlist_item *itm = lst_finfos;
-
-  // scan to end of list
-  while (itm->cur != NULL) {
-    if (sort_date_flag) {
-      // compare date of currently iterated item against new item
-      if (strcmp(finfo->published, ((tfile_info *)itm->cur)->published) <= 0) {
-        tlist_item *newitem = malloc(sizeof(tlist_item));
-
-        newitem->next = itm;
-        newitem->prev = itm->prev;
-
-        if (itm->prev)
-          ((tlist_item *)itm->prev)->next = newitem;
-        else
-          lst_finfos = newitem; //  push into the first item in the list
-
-        itm->prev = newitem;
-
-        itm = newitem;
-        break;
-      }
-    }
-    if (itm->next) {
-      itm = itm->next;
-    }
-    else {
-      tlist_item *newitem = malloc(sizeof(tlist_item));
-      memset(newitem, 0, sizeof(tlist_item));
-      newitem->prev = itm;
-      itm->next = newitem;
-      itm = itm->next;
-      break;
-    }
+  if (catalogue_count == catalogue_size) {
+    catalogue_size = catalogue_size ? catalogue_size * 2 : 256;
+    catalogue = realloc(catalogue, catalogue_size * sizeof(tfile_info));
   }
-
-  itm->cur = malloc(sizeof(tfile_info));
-  memcpy(itm->cur, finfo, sizeof(tfile_info));
+  memcpy(&catalogue[catalogue_count++], finfo, sizeof(tfile_info));
 }
 
+// read_rows(NULL, 0) forgets any half-parsed response
 int read_rows(char *str, int strcnt)
 {
   static int squarebrackstart = 0;
@@ -189,10 +158,20 @@ int read_rows(char *str, int strcnt)
   static tfile_info finfo = { "", "", "", "", "", "" };
 
   static int iskey = 1;
+  static char lastc = 0;
   char prevc = 0;
 
+  if (!str) {
+    squarebrackstart = curlbrackstart = quotestart = 0;
+    iskey = 1;
+    lastc = 0;
+    return 1;
+  }
+
   for (int k = 0; k < strcnt; k++) {
     char c = str[k];
+    char before = lastc;
+    lastc = c;
 
     // skip header bytes and wait for '['
     if (!squarebrackstart) {
@@ -234,7 +213,7 @@ int read_rows(char *str, int strcnt)
         // are we expecting an end of curly-bracket?
         if (c == '}') {
           if (finfo.author[0] != '\0' && strstr(finfo.os, "MEGA65") != NULL) {
-            add_to_list(&finfo);
+            add_to_catalogue(&finfo);
             memset(&finfo, 0, sizeof(tfile_info));
           }
           curlbrackstart = 0;
@@ -243,7 +222,7 @@ int read_rows(char *str, int strcnt)
       }
     }
 
-    if (c == '"' && str[k - 1] != '\\' && check_char_startflag(c, '"', &quotestart))
+    if (c == '"' && before != '\\' && check_char_startflag(c, '"', &quotestart))
       continue;
 
     if (read_in_key_or_value_string(&finfo, prevc, c, &iskey, &quotestart)) { }
@@ -253,24 +232,445 @@ int read_rows(char *str, int strcnt)
   return 1;
 }
 
+/*
+  Search index: every (lower case) trigram of the title, filename and author of
+  an entry, sorted. A search pattern must contain the trigrams of each of its
+  literal runs of three or more characters, so only the entries that have all
+  of those need to go through is_match().
+*/
+
+typedef struct trigram {
+  uint32_t key;
+  int idx;
+} ttrigram;
+
+ttrigram *trigrams = NULL;
+int trigram_count = 0;
+
+uint32_t trigram_key(const char *s)
+{
+  return (tolower((unsigned char)s[0]) << 16) | (tolower((unsigned char)s[1]) << 8) | tolower((unsigned char)s[2]);
+}
+
+int compare_trigrams(const void *a, const void *b)
+{
+  const ttrigram *ta = a, *tb = b;
+  if (ta->key != tb->key)
+    return ta->key < tb->key ? -1 : 1;
+  return ta->idx - tb->idx;
+}
+
+void build_index(void)
+{
+  int size = 0;
+  for (int i = 0; i < catalogue_count; i++)
+    size += strlen(catalogue[i].title) + strlen(catalogue[i].filename) + strlen(catalogue[i].author);
+  trigrams = realloc(trigrams, (size + 1) * sizeof(ttrigram));
+  trigram_count = 0;
+
+  for (int i = 0; i < catalogue_count; i++) {
+    char *fields[3] = { catalogue[i].title, catalogue[i].filename, catalogue[i].author };
+    for (int f = 0; f < 3; f++)
+      for (int k = 0; fields[f][k] && fields[f][k + 1] && fields[f][k + 2]; k++) {
+        trigrams[trigram_count].key = trigram_key(&fields[f][k]);
+        trigrams[trigram_count].idx = i;
+        trigram_count++;
+      }
+  }
+  qsort(trigrams, trigram_count, sizeof(ttrigram), compare_trigrams);
+
+  // drop repeats of the same trigram within an entry
+  int out = 0;
+  for (int i = 0; i < trigram_count; i++)
+    if (!out || compare_trigrams(&trigrams[out - 1], &trigrams[i]))
+      trigrams[out++] = trigrams[i];
+  trigram_count = out;
+}
+
+// Clears candidate[] for every entry that does not have this trigram
+void filter_by_trigram(uint32_t key, unsigned char *candidate)
+{
+  int lo = 0, hi = trigram_count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (trigrams[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  int idx = 0;
+  for (; lo < trigram_count && trigrams[lo].key == key; lo++) {
+    while (idx < trigrams[lo].idx)
+      candidate[idx++] = 0;
+    idx++;
+  }
+  while (idx < catalogue_count)
+    candidate[idx++] = 0;
+}
+
 // borrow this from mega65_ftp.c for now...
 int is_match(char *line, char *pattern, int case_sensitive);
 
 void print_items(char *searchterm)
 {
-  int cnt = 1;
-  tlist_item *itm = lst_finfos;
-  while (itm != NULL) {
-    tfile_info *pfinfo = (tfile_info *)itm->cur;
-    if (!searchterm || (searchterm && strlen(searchterm) == 0) || is_match(pfinfo->title, searchterm, 0)
-        || is_match(pfinfo->filename, searchterm, 0) || is_match(pfinfo->author, searchterm, 0)) {
-      printf("%d: %s - \"%s\" - author: %s - published: %s\n", cnt, pfinfo->title, pfinfo->filename, pfinfo->author,
+  int all = !searchterm || strlen(searchterm) == 0;
+  unsigned char *candidate = malloc(catalogue_count + 1);
+  memset(candidate, 1, catalogue_count + 1);
+
+  if (!all) {
+    int run = 0;
+    for (char *p = searchterm; *p; p++) {
+      if (*p == '*' || *p == '?') {
+        run = 0;
+        continue;
+      }
+      if (++run >= 3)
+        filter_by_trigram(trigram_key(p - 2), candidate);
+    }
+  }
+
+  for (int n = 0; n < listing_count; n++) {
+    int i = listing[n];
+    if (!candidate[i])
+      continue;
+    tfile_info *pfinfo = &catalogue[i];
+    if (all || is_match(pfinfo->title, searchterm, 0) || is_match(pfinfo->filename, searchterm, 0)
+        || is_match(pfinfo->author, searchterm, 0)) {
+      printf("%d: %s - \"%s\" - author: %s - published: %s\n", n + 1, pfinfo->title, pfinfo->filename, pfinfo->author,
           pfinfo->published);
     }
+  }
+  free(candidate);
+}
+
+// Oldest first; among equal dates the later entry comes first, as it always has
+int compare_published(const void *a, const void *b)
+{
+  int ia = *(const int *)a, ib = *(const int *)b;
+  int c = strcmp(catalogue[ia].published, catalogue[ib].published);
+  if (c)
+    return c;
+  return ib - ia;
+}
+
+void make_listing(void)
+{
+  listing = realloc(listing, (catalogue_count + 1) * sizeof(int));
+  listing_count = catalogue_count;
+  for (int i = 0; i < catalogue_count; i++)
+    listing[i] = i;
+  if (sort_date_flag)
+    qsort(listing, listing_count, sizeof(int), compare_published);
+}
+
+/*
+  HTTP. Requests are HTTP/1.0, so that the body is never chunked.
+*/
+
+char filehost_host[128] = "";
+char filehost_user[64] = "";
+
+// files.mega65.org, unless M65_FILEHOST points at another host:port (e.g. a local stand-in)
+char *get_filehost_host(void)
+{
+  if (!filehost_host[0]) {
+    char *env = getenv("M65_FILEHOST");
+    snprintf(filehost_host, sizeof(filehost_host), "%s", env && env[0] ? env : "files.mega65.org:80");
+  }
+  return filehost_host;
+}
+
+typedef struct http_response {
+  int status;
+  long content_length; // -1 if not given
+  long received; // bytes of body passed to the sink
+  char etag[256];
+  char last_modified[64];
+} thttp_response;
+
+// body sink: returns 1 for more, 0 once it has seen the end of what it wanted, -1 on error
+typedef int (*http_sink)(void *ctx, char *data, int len);
+
+#define HTTP_IDLE_TIMEOUT 30
+
+void copy_header_value(char *dest, int size, char *value)
+{
+  while (*value == ' ')
+    value++;
+  int len = strcspn(value, "\r\n");
+  if (len >= size)
+    len = size - 1;
+  memcpy(dest, value, len);
+  dest[len] = '\0';
+}
+
+void parse_http_headers(char *header, thttp_response *resp)
+{
+  resp->status = 0;
+  resp->content_length = -1;
+  resp->received = 0;
+  resp->etag[0] = '\0';
+  resp->last_modified[0] = '\0';
+  sscanf(header, "HTTP/%*s %d", &resp->status);
+  for (char *line = strstr(header, "\r\n"); line && line[2]; line = strstr(line + 2, "\r\n")) {
+    char *field = line + 2;
+    if (!strncasecmp(field, "Content-Length:", 15))
+      resp->content_length = atol(field + 15);
+    else if (!strncasecmp(field, "ETag:", 5))
+      copy_header_value(resp->etag, sizeof(resp->etag), field + 5);
+    else if (!strncasecmp(field, "Last-Modified:", 14))
+      copy_header_value(resp->last_modified, sizeof(resp->last_modified), field + 14);
+  }
+}
+
+int http_get(char *path, char *extra_headers, http_sink sink, void *ctx, thttp_response *resp)
+{
+  char str[4096];
+  char header[16384];
+  int header_len = 0;
+  int in_body = 0;
+  long total = 0;
+  int retVal = -1;
+
+  snprintf(str, sizeof(str), "tcp#%s", get_filehost_host());
+  PORT_TYPE fd = open_tcp_port(str);
+  snprintf(str, sizeof(str), "GET /php/%s HTTP/1.0\r\nHost: %s\r\n%s\r\n", path, get_filehost_host(),
+      extra_headers ? extra_headers : "");
+  do_write(fd, str);
+
+  time_t last_data = time(0);
+  while (1) {
+    int count = do_read(fd, str, sizeof(str));
+#ifndef WINDOWS
+    // (on windows, 0 just means nothing has arrived yet)
+    if (count == 0) {
+      // connection closed: complete, unless it was cut short
+      if (in_body && (resp->content_length < 0 || total == resp->content_length))
+        retVal = 0;
+      break;
+    }
+#endif
+    if (count <= 0) {
+      if (time(0) - last_data > HTTP_IDLE_TIMEOUT) {
+        printf("ERROR: Timed out waiting for the filehost\n");
+        break;
+      }
+      do_usleep(10000);
+      continue;
+    }
+    last_data = time(0);
+
+    char *data = str;
+    if (!in_body) {
+      int n = count < (int)sizeof(header) - 1 - header_len ? count : (int)sizeof(header) - 1 - header_len;
+      memcpy(&header[header_len], str, n);
+      header_len += n;
+      header[header_len] = '\0';
+      char *end = strstr(header, "\r\n\r\n");
+      if (!end) {
+        if (header_len == sizeof(header) - 1) {
+          printf("ERROR: HTTP response header too long\n");
+          break;
+        }
+        continue;
+      }
+      end[2] = '\0';
+      parse_http_headers(header, resp);
+      in_body = 1;
+      // whatever followed the header in this read is body
+      int body_start = (end + 4 - header) - (header_len - n);
+      data = &str[body_start];
+      count -= body_start;
+      if (resp->status != 200) {
+        // nothing of interest in the body
+        retVal = 0;
+        break;
+      }
+    }
+
+    if (resp->content_length >= 0 && total + count > resp->content_length)
+      count = resp->content_length - total;
+    total += count;
+    resp->received = total;
+    int more = count > 0 ? sink(ctx, data, count) : 1;
+    if (more <= 0) {
+      retVal = more;
+      break;
+    }
+    if (resp->content_length >= 0 && total == resp->content_length) {
+      retVal = 0;
+      break;
+    }
+  }
+
+  close_tcp_port(fd);
+  return retVal;
+}
+
+/*
+  Local cache, under $M65_FILEHOST_CACHE, or else mega65_ftp/filehost in the
+  usual per-user cache directory. It holds the parsed catalogue along with the
+  ETag and Last-Modified that came with it, so that it is only fetched again
+  when it has changed, and a copy of every downloaded file.
+*/
+
+#define CATALOGUE_CACHE_MAGIC "M65FHCAT1"
+
+char cache_dir[1024] = "";
+
+int make_dir(char *path)
+{
+#ifdef WINDOWS
+  return mkdir(path);
+#else
+  return mkdir(path, 0755);
+#endif
+}
+
+// Returns NULL if there is nowhere to cache things
+char *get_cache_dir(void)
+{
+  if (cache_dir[0])
+    return cache_dir;
+
+  char *env = getenv("M65_FILEHOST_CACHE");
+  if (env && env[0])
+    snprintf(cache_dir, sizeof(cache_dir), "%s", env);
+  else {
+#ifdef WINDOWS
+    char *base = getenv("LOCALAPPDATA");
+    if (!base)
+      return NULL;
+    snprintf(cache_dir, sizeof(cache_dir), "%s/mega65_ftp/filehost", base);
+#else
+    char *base = getenv("XDG_CACHE_HOME");
+    if (base && base[0])
+      snprintf(cache_dir, sizeof(cache_dir), "%s/mega65_ftp/filehost", base);
+    else if ((base = getenv("HOME")))
+      snprintf(cache_dir, sizeof(cache_dir), "%s/.cache/mega65_ftp/filehost", base);
+    else
+      return NULL;
+#endif
+  }
+
+  // create each level of it, and the files directory beneath
+  char path[1100];
+  snprintf(path, sizeof(path), "%s/files", cache_dir);
+  for (char *p = path + 1; *p; p++)
+    if (*p == '/') {
+      *p = '\0';
+      make_dir(path);
+      *p = '/';
+    }
+  make_dir(path);
 
-    itm = (tlist_item *)itm->next;
-    cnt++;
+  struct stat st;
+  if (stat(path, &st) || !(st.st_mode & S_IFDIR)) {
+    log_warn("can not create filehost cache directory '%s'", path);
+    cache_dir[0] = '\0';
+    return NULL;
+  }
+  return cache_dir;
+}
+
+// Logged in users can see more of the catalogue, so each gets their own copy
+int catalogue_cache_name(char *name, int size)
+{
+  if (!get_cache_dir())
+    return -1;
+  snprintf(name, size, "%s/catalogue%s%s.txt", cache_dir, filehost_user[0] ? "-" : "", filehost_user);
+  return 0;
+}
+
+void sanitise_field(char *dest, int size, char *src)
+{
+  snprintf(dest, size, "%s", src);
+  for (char *p = dest; *p; p++)
+    if (*p == '\t' || *p == '\r' || *p == '\n')
+      *p = ' ';
+}
+
+void save_catalogue_cache(thttp_response *resp)
+{
+  char name[1200], tmpname[1210];
+  if (catalogue_cache_name(name, sizeof(name)))
+    return;
+  snprintf(tmpname, sizeof(tmpname), "%s.new", name);
+
+  FILE *f = fopen(tmpname, "w");
+  if (!f) {
+    log_warn("can not write filehost catalogue cache '%s'", tmpname);
+    return;
   }
+  fprintf(f, "%s\n%s\n%s\n", CATALOGUE_CACHE_MAGIC, resp->etag, resp->last_modified);
+  for (int i = 0; i < catalogue_count; i++) {
+    tfile_info fi;
+    sanitise_field(fi.title, sizeof(fi.title), catalogue[i].title);
+    sanitise_field(fi.os, sizeof(fi.os), catalogue[i].os);
+    sanitise_field(fi.filename, sizeof(fi.filename), catalogue[i].filename);
+    sanitise_field(fi.location, sizeof(fi.location), catalogue[i].location);
+    sanitise_field(fi.author, sizeof(fi.author), catalogue[i].author);
+    sanitise_field(fi.published, sizeof(fi.published), catalogue[i].published);
+    fprintf(f, "%s\t%s\t%s\t%s\t%s\t%s\n", fi.title, fi.os, fi.filename, fi.location, fi.author, fi.published);
+  }
+  if (fclose(f)) {
+    remove(tmpname);
+    return;
+  }
+  remove(name); // windows will not rename over it
+  rename(tmpname, name);
+}
+
+void copy_field(char *dest, int size, char **line)
+{
+  int len = strcspn(*line, "\t\n");
+  snprintf(dest, size, "%.*s", len, *line);
+  *line += len;
+  if (**line == '\t')
+    (*line)++;
+}
+
+// Fills the catalogue from the cache, and resp with the validators it was saved with
+int load_catalogue_cache(thttp_response *resp)
+{
+  char name[1200];
+  static char line[2048];
+  if (catalogue_cache_name(name, sizeof(name)))
+    return -1;
+
+  FILE *f = fopen(name, "r");
+  if (!f)
+    return -1;
+
+  int retVal = -1;
+  do {
+    if (!fgets(line, sizeof(line), f) || strncmp(line, CATALOGUE_CACHE_MAGIC "\n", sizeof(CATALOGUE_CACHE_MAGIC)))
+      break;
+    if (!fgets(line, sizeof(line), f))
+      break;
+    copy_header_value(resp->etag, sizeof(resp->etag), line);
+    if (!fgets(line, sizeof(line), f))
+      break;
+    copy_header_value(resp->last_modified, sizeof(resp->last_modified), line);
+
+    catalogue_count = 0;
+    while (fgets(line, sizeof(line), f)) {
+      tfile_info fi;
+      char *p = line;
+      copy_field(fi.title, sizeof(fi.title), &p);
+      copy_field(fi.os, sizeof(fi.os), &p);
+      copy_field(fi.filename, sizeof(fi.filename), &p);
+      copy_field(fi.location, sizeof(fi.location), &p);
+      copy_field(fi.author, sizeof(fi.author), &p);
+      copy_field(fi.published, sizeof(fi.published), &p);
+      add_to_catalogue(&fi);
+    }
+    retVal = 0;
+  } while (0);
+
+  fclose(f);
+  return retVal;
 }
 
 char cookies[256] = "";
@@ -280,9 +680,11 @@ void log_in_and_get_cookie(char *username, char *password)
   char str[4096];
   char data[4096];
   sprintf(data, "logindata%%5Busername%%5D=%s&logindata%%5Bpassword%%5D=%s", username, password);
-  PORT_TYPE fd = open_tcp_port("tcp#files.mega65.org:80");
+  snprintf(str, sizeof(str), "tcp#%s", get_filehost_host());
+  PORT_TYPE fd = open_tcp_port(str);
   do_write(fd, "POST /php/login.php HTTP/1.1\r\n");
-  do_write(fd, "Host: files.mega65.org\r\n");
+  snprintf(str, sizeof(str), "Host: %s\r\n", get_filehost_host());
+  do_write(fd, str);
   do_write(fd, "Accept: */*\r\n");
   do_write(fd, "Content-Type: application/x-www-form-urlencoded; charset=UTF-8\r\n");
   do_write(fd, "X-Requested-With: XMLHttpRequest\r\n");
@@ -320,30 +722,69 @@ void log_in_and_get_cookie(char *username, char *password)
     ptr = strtok(NULL, "\n");
   } while (ptr != NULL);
 
+  snprintf(filehost_user, sizeof(filehost_user), "%s", username);
+  for (char *p = filehost_user; *p; p++)
+    if (!isalnum((unsigned char)*p))
+      *p = '_';
+
   close_tcp_port(fd);
 }
 
-void clear_list(void)
+int parse_catalogue_body(void *ctx, char *data, int len)
 {
-  tlist_item *itm = lst_finfos;
-  while (itm != NULL) {
-    if (itm->cur)
-      free(itm->cur); // delete the file-info
-
-    tlist_item *tmp = (tlist_item *)itm->next;
-
-    free(itm);
+  return read_rows(data, len);
+}
 
-    itm = tmp;
+// Brings the catalogue up to date, fetching it only if the server says it has changed
+int load_catalogue(void)
+{
+  thttp_response cached = { 0, -1, 0, "", "" };
+  thttp_response resp;
+  char headers[1024] = "";
+  int len = 0;
+
+  int have_cache = !load_catalogue_cache(&cached);
+  if (have_cache) {
+    if (cached.etag[0])
+      len += snprintf(&headers[len], sizeof(headers) - len, "If-None-Match: %s\r\n", cached.etag);
+    if (cached.last_modified[0])
+      len += snprintf(&headers[len], sizeof(headers) - len, "If-Modified-Since: %s\r\n", cached.last_modified);
+  }
+  if (cookies[0] != '\0')
+    // (without the trailing ';')
+    len += snprintf(&headers[len], sizeof(headers) - len, "Cookie:%.*s\r\n", (int)strlen(cookies) - 1, cookies);
+
+  int cached_count = catalogue_count;
+  catalogue_count = 0;
+  read_rows(NULL, 0);
+  int r = http_get("readfilespublic.php", headers, parse_catalogue_body, NULL, &resp);
+
+  if (!r && resp.status == 200) {
+    save_catalogue_cache(&resp);
+    log_debug("fetched filehost catalogue of %d entries", catalogue_count);
+  }
+  else if (have_cache && !r && resp.status == 304) {
+    catalogue_count = cached_count;
+    log_debug("filehost catalogue unchanged, %d entries from the cache", catalogue_count);
+  }
+  else if (have_cache) {
+    // reload what the failed fetch may have trampled on
+    load_catalogue_cache(&cached);
+    printf("WARNING: Could not fetch the filehost catalogue (HTTP status %d), showing the cached copy\n", r ? 0 : resp.status);
+  }
+  else {
+    printf("ERROR: Could not fetch the filehost catalogue (HTTP status %d)\n", r ? 0 : resp.status);
+    catalogue_count = 0;
+    return -1;
   }
 
-  lst_finfos = NULL;
+  build_index();
+  make_listing();
+  return 0;
 }
 
 void read_filehost_struct(char *searchterm)
 {
-  char str[4096];
-
   if (searchterm && strcmp(searchterm, "-t") == 0) {
     sort_date_flag = 1;
     searchterm[0] = '\0';
@@ -351,95 +792,69 @@ void read_filehost_struct(char *searchterm)
   else
     sort_date_flag = 0;
 
-  clear_list();
-  PORT_TYPE fd = open_tcp_port("tcp#files.mega65.org:80");
-  do_write(fd, "GET /php/readfilespublic.php HTTP/1.1\r\n");
-  do_write(fd, "Host: files.mega65.org\r\n");
-  if (cookies[0] != '\0') {
-    cookies[strlen(cookies) - 1] = '\0'; // remove last ';'
-    sprintf(str, "Cookie:%s\r\n", cookies);
-    do_write(fd, str);
-  }
-  do_write(fd, "\r\n");
-
-  do_usleep(100000);
-
-  int count = 0, total = 0;
-  while ((count = do_read(fd, str, 4096)) != 0 || total == 0) {
-    if (!read_rows(str, count))
-      break;
-  }
+  if (load_catalogue())
+    return;
 
   print_items(searchterm);
-
-  close_tcp_port(fd);
 }
 
-int check_file_start(char c)
+void strupper(char *dest, char *src)
 {
-  static char *term = "\r\n\r\n";
-  static int termidx = 0;
-
-  if (c == term[termidx]) {
-    termidx++;
-    if (term[termidx] == '\0') {
-      termidx = 0;
-      return 1;
-    }
+  char *psrc = src;
+  char *pdest = dest;
+  while (*psrc != '\0') {
+    *pdest = toupper(*psrc);
+    psrc++;
+    pdest++;
   }
-  else
-    termidx = 0;
-
-  return 0;
+  *pdest = '\0';
 }
 
-void check_content_length(char c, int *content_length)
+int copy_local_file(char *src, char *dest)
 {
-  static char *term = "Content-Length: ";
-  static int termmatch = 0;
-  static int termidx = 0;
-  static char value[128] = "";
-  static int valueidx = 0;
-
-  if (!termmatch) {
-    if (c == term[termidx]) {
-      termidx++;
-      if (term[termidx] == '\0') {
-        termmatch = 1;
-        termidx = 0;
-      }
-    }
-    else
-      termidx = 0;
+  char buf[65536];
+  FILE *in = fopen(src, "rb");
+  if (!in)
+    return -1;
+  FILE *out = fopen(dest, "wb");
+  if (!out) {
+    fclose(in);
+    return -1;
   }
-  // checking for value now
-  else {
-    if (c == '\r' || c == '\n') {
-      // We reached the end of the value, now parse it
-      value[valueidx] = '\0';
-      *content_length = atoi(value);
-      // reset vars for next time
-      termmatch = 0;
-      termidx = 0;
-      valueidx = 0;
-    }
-    else {
-      value[valueidx] = c;
-      valueidx++;
+  int retVal = 0;
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    if (fwrite(buf, 1, n, out) != n) {
+      retVal = -1;
+      break;
     }
-  }
+  fclose(in);
+  if (fclose(out))
+    retVal = -1;
+  return retVal;
 }
 
-void strupper(char *dest, char *src)
+// Where the content cache keeps a copy of this file: its location and publishing date make it unique
+int content_cache_name(tfile_info *pfi, char *fname, char *name, int size)
 {
-  char *psrc = src;
-  char *pdest = dest;
-  while (*psrc != '\0') {
-    *pdest = toupper(*psrc);
-    psrc++;
-    pdest++;
+  if (!get_cache_dir())
+    return -1;
+
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  char *parts[2] = { pfi->location, pfi->published };
+  for (int i = 0; i < 2; i++) {
+    for (char *p = parts[i]; *p; p++)
+      hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+    hash = (hash ^ '|') * 0x100000001b3ULL;
   }
-  *pdest = '\0';
+  snprintf(name, size, "%s/files/%016llx-%s", cache_dir, (unsigned long long)hash, fname);
+  return 0;
+}
+
+int write_body_to_file(void *ctx, char *data, int len)
+{
+  return fwrite(data, 1, len, (FILE *)ctx) == (size_t)len ? 1 : -1;
 }
 
 char *download_file_from_filehost(int fileidx)
@@ -447,91 +862,74 @@ char *download_file_from_filehost(int fileidx)
   char *path;
   static char fname[256];
   char *retfname = NULL;
+  char cached[1400], partial[1410];
 
   fname[0] = '\0';
 
-  tlist_item *ptr = lst_finfos;
-  int cnt = 1;
-  while (ptr != NULL) {
-    if (fileidx == cnt)
-      break;
-    ptr = (tlist_item *)ptr->next;
-    cnt++;
-  }
+  // a listing from an earlier session is still numbered the same, as long as the catalogue has not changed
+  if (!listing_count)
+    load_catalogue();
 
-  if (fileidx != cnt) {
+  if (fileidx < 1 || fileidx > listing_count) {
     printf("ERROR: Invalid file index\n");
     return NULL;
   }
 
-  tfile_info *pfi = (tfile_info *)ptr->cur;
+  tfile_info *pfi = &catalogue[listing[fileidx - 1]];
 
   path = pfi->location;
   strupper(fname, pfi->filename);
 
-  printf("Downloading \"%s\"...\n", fname);
-
-  char str[4096];
-  PORT_TYPE fd = open_tcp_port("tcp#files.mega65.org:80");
-  sprintf(str, "GET /php/%s HTTP/1.1\r\n", path);
-  do_write(fd, str);
-  do_write(fd, "Host: files.mega65.org\r\n\r\n");
+  int use_cache = !content_cache_name(pfi, fname, cached, sizeof(cached));
+  if (use_cache && !copy_local_file(cached, fname)) {
+    printf("Using cached copy of \"%s\"\n", fname);
+    return fname;
+  }
 
-  do_usleep(100000);
+  printf("Downloading \"%s\"...\n", fname);
 
-  int count = 0, total = 0;
-  int content_length = 0;
-  int file_started = 0;
-  FILE *f = NULL;
-  while (content_length == 0 || total != content_length) {
-    count = do_read(fd, str, 4096);
-    if (count == 0) {
-      do_usleep(10000);
-      continue;
-    }
+  // into the cache, and only once complete does it get its proper name
+  snprintf(partial, sizeof(partial), "%s.part", use_cache ? cached : fname);
+  FILE *f = fopen(partial, "wb");
+  if (!f) {
+    printf("ERROR: Could not create \"%s\"\n", partial);
+    return NULL;
+  }
 
-    // printf("reading %d bytes...\n", count);
-    for (int k = 0; k < count; k++) {
-      char c = str[k];
-      if (!content_length) {
-        check_content_length(c, &content_length);
-        if (!content_length)
-          continue;
-        printf("content_length=%d\n", content_length);
-      }
+  thttp_response resp;
+  int r = http_get(path, NULL, write_body_to_file, f, &resp);
+  if (fclose(f) && !r) {
+    printf("ERROR: Could not write \"%s\"\n", partial);
+    r = -1;
+  }
+  if (r || resp.status != 200) {
+    printf("ERROR: Download of \"%s\" failed (HTTP status %d)\n", fname, r ? 0 : resp.status);
+    remove(partial);
+    return NULL;
+  }
+  if (resp.content_length >= 0 && resp.received != resp.content_length) {
+    printf("ERROR: Download of \"%s\" is incomplete (%ld of %ld bytes)\n", fname, resp.received, resp.content_length);
+    remove(partial);
+    return NULL;
+  }
+  printf("content_length=%ld\n", resp.content_length);
 
-      if (!file_started) {
-        // wait for header to finish
-        if (check_file_start(c)) {
-          file_started = 1;
-          f = fopen(fname, "wb");
-        }
-      }
-      else {
-        // now start saving out bytes
-        fputc(c, f);
-        total++;
-        if (total == content_length) {
-          printf("Download of \"%s\" file complete\n", fname);
-          fclose(f);
-          retfname = fname;
-          break;
-        }
-      }
+  if (use_cache) {
+    remove(cached);
+    if (rename(partial, cached) || copy_local_file(cached, fname)) {
+      printf("ERROR: Could not copy \"%s\" out of the filehost cache\n", fname);
+      return NULL;
     }
-    if (content_length != 0 && total == content_length) {
-      break;
+  }
+  else {
+    remove(fname);
+    if (rename(partial, fname)) {
+      printf("ERROR: Could not rename \"%s\"\n", partial);
+      return NULL;
     }
   }
 
-  close_tcp_port(fd);
+  printf("Download of \"%s\" file complete\n", fname);
+  retfname = fname;
   return retfname;
 }
-
-/*
-void main(void)
-{
-  read_filehost_struct();
-  download_file_from_filehost(25);
-}
-*/
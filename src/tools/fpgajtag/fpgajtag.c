@@ -40,6 +40,8 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
 
 #include "m65common.h"
 
@@ -51,6 +53,7 @@
 #include <libusb.h>
 
 #include <logging.h>
+#include <fpgajtag.h>
 
 #include "util.h"
 #include "fpga.h"
@@ -511,6 +514,273 @@ void write_creg(int regname)
   EXIT();
 }
 
+typedef struct {
+  int extra_shift;
+  uint8_t *pdata;
+  int psize;
+  int opttail;
+  int swapbits;
+  int limit_len;
+} data_file_job;
+
+static void send_data_chunks(void *arg)
+{
+  data_file_job *job = (data_file_job *)arg;
+
+  while (job->psize) {
+    int size = FILE_READSIZE;
+    if (job->psize < size)
+      size = job->psize;
+    job->psize -= size;
+    write_bytes(0, (!job->psize && !job->extra_shift) ? 'E' : 'P', job->pdata, size, job->limit_len,
+        job->psize || job->opttail, job->swapbits, 1);
+    flush_write(NULL);
+    job->limit_len = MAX_SINGLE_USB_DATA;
+    job->pdata += size;
+  };
+}
+
+static void send_chunks(void (*produce)(void *arg), void *arg, int psize)
+{
+  if (fpgajtag_stream_enable && psize > FILE_READSIZE) {
+    // encode on another thread, while several USB transfers are in flight
+    stream_stats stats;
+    if (stream_writes(produce, arg, &stats) < 0) {
+      log_crit("fpgajtag: streaming the bitstream failed");
+      exit(-1);
+    }
+    log_note("fpgajtag: Sent %" PRIu64 " bytes in %d transfers, %.0fms (%.2f MB/s), USB busy %.0f%% of the time", stats.bytes,
+        stats.transfers, stats.elapsed_ms, stats.elapsed_ms > 0 ? stats.bytes / stats.elapsed_ms / 1000.0 : 0,
+        stats.elapsed_ms > 0 ? 100.0 * stats.busy_ms / stats.elapsed_ms : 0);
+  }
+  else
+    produce(arg);
+}
+
+/*
+ * Cache of the MPSSE commands send_data_chunks() makes of a bitstream, under
+ * $M65_JTAG_CACHE, or else m65/fpgajtag in the usual per-user cache directory.
+ * They depend on the bitstream and on the layout of the JTAG chain, so both go
+ * into the name of an entry. Each entry is the flushes recorded by
+ * write_capture_end(), which are replayed flush by flush, so that the FTDI
+ * sees exactly the same transfers. Only the JTAG_CACHE_ENTRIES most recently
+ * used are kept.
+ */
+
+#define JTAG_CACHE_MAGIC "M65MPSSE1\n"
+#define JTAG_CACHE_ENTRIES 4
+
+typedef struct {
+  uint8_t *records;
+  int size;
+} cached_records;
+
+static char jtag_cache_dir[1024];
+
+static int record_length(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+}
+
+// Returns NULL if there is nowhere to cache things
+static char *get_jtag_cache_dir(void)
+{
+  if (jtag_cache_dir[0])
+    return jtag_cache_dir;
+
+  char *env = getenv("M65_JTAG_CACHE");
+  if (env && env[0])
+    snprintf(jtag_cache_dir, sizeof(jtag_cache_dir), "%s", env);
+  else {
+#ifdef WINDOWS
+    char *base = getenv("LOCALAPPDATA");
+    if (!base)
+      return NULL;
+    snprintf(jtag_cache_dir, sizeof(jtag_cache_dir), "%s/m65/fpgajtag", base);
+#else
+    char *base = getenv("XDG_CACHE_HOME");
+    if (base && base[0])
+      snprintf(jtag_cache_dir, sizeof(jtag_cache_dir), "%s/m65/fpgajtag", base);
+    else if ((base = getenv("HOME")))
+      snprintf(jtag_cache_dir, sizeof(jtag_cache_dir), "%s/.cache/m65/fpgajtag", base);
+    else
+      return NULL;
+#endif
+  }
+
+  // create each level of it
+  for (char *p = jtag_cache_dir + 1; *p; p++)
+    if (*p == '/') {
+      *p = '\0';
+#ifdef WINDOWS
+      mkdir(jtag_cache_dir);
+#else
+      mkdir(jtag_cache_dir, 0755);
+#endif
+      *p = '/';
+    }
+#ifdef WINDOWS
+  mkdir(jtag_cache_dir);
+#else
+  mkdir(jtag_cache_dir, 0755);
+#endif
+
+  struct stat st;
+  if (stat(jtag_cache_dir, &st) || !(st.st_mode & S_IFDIR)) {
+    log_warn("fpgajtag: can not create cache directory '%s'", jtag_cache_dir);
+    jtag_cache_dir[0] = '\0';
+    return NULL;
+  }
+  return jtag_cache_dir;
+}
+
+static int jtag_cache_name(char *name, int size, data_file_job *job)
+{
+  if (!get_jtag_cache_dir())
+    return -1;
+
+  // FNV-1a of the bitstream
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (int i = 0; i < job->psize; i++)
+    hash = (hash ^ job->pdata[i]) * 0x100000001b3ULL;
+
+  snprintf(name, size, "%s/%016llx-%d-c%dj%dx%d-%d%d%d-%d.mpsse", jtag_cache_dir, (unsigned long long)hash, job->psize,
+      idcode_count, jtag_index, found_cortex, job->extra_shift, job->opttail, job->swapbits, job->limit_len);
+  return 0;
+}
+
+static uint8_t *read_jtag_cache(char *name, int *size)
+{
+  uint8_t *records = NULL;
+  FILE *f = fopen(name, "rb");
+  if (!f)
+    return NULL;
+
+  do {
+    char magic[sizeof(JTAG_CACHE_MAGIC)];
+    if (fread(magic, 1, strlen(JTAG_CACHE_MAGIC), f) != strlen(JTAG_CACHE_MAGIC)
+        || memcmp(magic, JTAG_CACHE_MAGIC, strlen(JTAG_CACHE_MAGIC)))
+      break;
+    long start = ftell(f);
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f) - start;
+    fseek(f, start, SEEK_SET);
+    if (*size <= 0 || !(records = (uint8_t *)malloc(*size)))
+      break;
+    if ((int)fread(records, 1, *size, f) != *size) {
+      free(records);
+      records = NULL;
+      break;
+    }
+
+    // the records must fill it exactly, or it is not to be trusted
+    int pos = 0;
+    while (pos + 4 <= *size) {
+      int len = record_length(records + pos);
+      if (len < 0 || len > *size - pos - 4)
+        break;
+      pos += 4 + len;
+    }
+    if (pos != *size) {
+      free(records);
+      records = NULL;
+    }
+  } while (0);
+  fclose(f);
+
+  if (!records)
+    log_warn("fpgajtag: ignoring damaged cache entry %s", name);
+  else
+    // (the eviction goes by modification time)
+    utime(name, NULL);
+  return records;
+}
+
+static void evict_jtag_cache(void)
+{
+  DIR *dir = opendir(jtag_cache_dir);
+  if (!dir)
+    return;
+
+  while (1) {
+    char path[1300], oldest[1300] = "";
+    time_t oldest_time = 0;
+    int count = 0;
+    struct dirent *de;
+    rewinddir(dir);
+    while ((de = readdir(dir))) {
+      int len = strlen(de->d_name);
+      struct stat st;
+      if (len < 6 || strcmp(de->d_name + len - 6, ".mpsse"))
+        continue;
+      snprintf(path, sizeof(path), "%s/%s", jtag_cache_dir, de->d_name);
+      if (stat(path, &st))
+        continue;
+      count++;
+      if (!oldest[0] || st.st_mtime < oldest_time) {
+        oldest_time = st.st_mtime;
+        strcpy(oldest, path);
+      }
+    }
+    if (count <= JTAG_CACHE_ENTRIES || unlink(oldest))
+      break;
+  }
+  closedir(dir);
+}
+
+static void write_jtag_cache(char *name, cached_records *entry)
+{
+  char tmpname[1210];
+  snprintf(tmpname, sizeof(tmpname), "%s.new", name);
+
+  FILE *f = fopen(tmpname, "wb");
+  if (!f) {
+    log_warn("fpgajtag: can not write cache entry '%s'", tmpname);
+    return;
+  }
+  int ok = fwrite(JTAG_CACHE_MAGIC, 1, strlen(JTAG_CACHE_MAGIC), f) == strlen(JTAG_CACHE_MAGIC)
+        && (int)fwrite(entry->records, 1, entry->size, f) == entry->size;
+  if (fclose(f) || !ok) {
+    log_warn("fpgajtag: can not write cache entry '%s'", tmpname);
+    unlink(tmpname);
+    return;
+  }
+#ifdef WINDOWS
+  unlink(name);
+#endif
+  if (rename(tmpname, name)) {
+    unlink(tmpname);
+    return;
+  }
+  log_debug("fpgajtag: cached the MPSSE commands in %s", name);
+  evict_jtag_cache();
+}
+
+// Returns 0 if they are the same
+static int compare_records(cached_records *cached, cached_records *fresh)
+{
+  int pos;
+  for (pos = 0; pos < cached->size && pos < fresh->size && cached->records[pos] == fresh->records[pos]; pos++)
+    ;
+  if (pos == cached->size && pos == fresh->size) {
+    log_note("fpgajtag: Cached MPSSE commands match freshly made ones (%d bytes)", fresh->size);
+    return 0;
+  }
+  log_warn("fpgajtag: Cached MPSSE commands differ from freshly made ones at byte %d of %d (fresh %d), replacing them",
+      pos, cached->size, fresh->size);
+  return 1;
+}
+
+static void send_cached_chunks(void *arg)
+{
+  cached_records *cached = (cached_records *)arg;
+
+  for (int pos = 0; pos < cached->size; pos += 4 + record_length(cached->records + pos)) {
+    write_data(cached->records + pos + 4, record_length(cached->records + pos));
+    flush_write(NULL);
+  }
+}
+
 static void send_data_file(
     int read, int extra_shift, uint8_t *pdata, int psize, uint8_t *pre, uint8_t *post, int opttail, int swapbits)
 {
@@ -533,17 +803,28 @@ static void send_data_file(
   for (tremain = 0; tremain < (1 + mid) && idcode_count > 1; tremain++)
     write_req(0, zerod, idcode_count - 9 + tremain * (found_cortex != -1) - mid * (idcode_count - 1 - jtag_index));
   write_int32(post);
-  int limit_len = MAX_SINGLE_USB_DATA - buffer_current_size();
-  while (psize) {
-    int size = FILE_READSIZE;
-    if (psize < size)
-      size = psize;
-    psize -= size;
-    write_bytes(0, (!psize && !extra_shift) ? 'E' : 'P', pdata, size, limit_len, psize || opttail, swapbits, 1);
-    flush_write(NULL);
-    limit_len = MAX_SINGLE_USB_DATA;
-    pdata += size;
-  };
+  data_file_job job = { extra_shift, pdata, psize, opttail, swapbits, MAX_SINGLE_USB_DATA - buffer_current_size() };
+  char cache_name[1200];
+  int use_cache = (fpgajtag_cache_enable || fpgajtag_cache_verify) && psize > FILE_READSIZE && !jtag_cache_name(cache_name, sizeof(cache_name), &job);
+  cached_records cached = { NULL, 0 }, fresh = { NULL, 0 };
+  if (use_cache)
+    cached.records = read_jtag_cache(cache_name, &cached.size);
+  if (cached.records && !fpgajtag_cache_verify) {
+    log_note("fpgajtag: Sending cached MPSSE commands from %s", cache_name);
+    send_chunks(send_cached_chunks, &cached, psize);
+  }
+  else {
+    if (use_cache)
+      write_capture_start();
+    send_chunks(send_data_chunks, &job, psize);
+    if (use_cache) {
+      fresh.records = write_capture_end(&fresh.size);
+      if (!cached.records || compare_records(&cached, &fresh))
+        write_jtag_cache(cache_name, &fresh);
+    }
+  }
+  free(cached.records);
+  free(fresh.records);
   if (extra_shift)
     write_fill(0, 0, 'E');
   ENTER_TMS_STATE('I');
@@ -957,6 +1238,7 @@ int fpgajtag_main(char *bitstream)
   /*
    * Step 2: Initialization
    */
+  unsigned long long config_start = gettime_ms();
   marker_for_reset(0);
   write_cirreg(0, IRREG_JPROGRAM);
   write_cirreg(0, IRREG_ISC_NOOP);
@@ -1001,6 +1283,7 @@ int fpgajtag_main(char *bitstream)
     log_debug("[%s:%d] expect %x mismatch %x", __FUNCTION__, __LINE__, 0xf07910, ret);
   log_debug("STATUS %08x done %x release_done %x eos %x startup_state %x", status, status & 0x4000, status & 0x2000,
       status & 0x10, (status >> 18) & 7);
+  log_note("fpgajtag: Configuration took %llums", gettime_ms() - config_start);
   access_mdm(0, 0, 1);
   // rescan = 1;
 
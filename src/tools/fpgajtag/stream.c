@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "stream.h"
+
+enum { SLOT_FREE, SLOT_FILLING, SLOT_READY, SLOT_SENDING };
+
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stream_changed = PTHREAD_COND_INITIALIZER;
+
+static uint8_t buffers[STREAM_BUFFERS][STREAM_BUFSIZE];
+static int slot_state[STREAM_BUFFERS];
+static int slot_len[STREAM_BUFFERS];
+
+// filled buffers, in the order they are to go
+static int ready[STREAM_BUFFERS];
+static int ready_head, ready_count;
+
+static int in_flight, producer_done, failed;
+static double busy_since;
+static stream_stats totals;
+
+static double now_ms(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+typedef struct {
+  void (*produce)(void *arg);
+  void *arg;
+} producer_job;
+
+static void *producer_thread(void *arg)
+{
+  producer_job *job = (producer_job *)arg;
+
+  job->produce(job->arg);
+
+  pthread_mutex_lock(&stream_lock);
+  producer_done = 1;
+  pthread_cond_broadcast(&stream_changed);
+  pthread_mutex_unlock(&stream_lock);
+  return NULL;
+}
+
+int stream_run(stream_sink *sink, void (*produce)(void *arg), void *arg, stream_stats *stats)
+{
+  producer_job job = { produce, arg };
+  pthread_t producer;
+
+  memset(slot_state, 0, sizeof(slot_state));
+  memset(&totals, 0, sizeof(totals));
+  ready_head = ready_count = 0;
+  in_flight = producer_done = failed = 0;
+  double start = now_ms();
+
+  if (pthread_create(&producer, NULL, producer_thread, &job)) {
+    fprintf(stderr, "ERROR: could not start the stream's producer thread\n");
+    return -1;
+  }
+
+  pthread_mutex_lock(&stream_lock);
+  while (1) {
+    // keep as many transfers going as allowed
+    while (ready_count && in_flight < STREAM_IN_FLIGHT) {
+      int slot = ready[ready_head];
+      ready_head = (ready_head + 1) % STREAM_BUFFERS;
+      ready_count--;
+
+      if (failed) {
+        slot_state[slot] = SLOT_FREE;
+        pthread_cond_broadcast(&stream_changed);
+        continue;
+      }
+
+      slot_state[slot] = SLOT_SENDING;
+      if (!in_flight++)
+        busy_since = now_ms();
+      if (in_flight > totals.max_in_flight)
+        totals.max_in_flight = in_flight;
+      totals.transfers++;
+      totals.bytes += slot_len[slot];
+
+      pthread_mutex_unlock(&stream_lock);
+      int ret = sink->submit(sink, slot, buffers[slot], slot_len[slot]);
+      pthread_mutex_lock(&stream_lock);
+
+      if (ret < 0) {
+        failed = 1;
+        slot_state[slot] = SLOT_FREE;
+        if (!--in_flight)
+          totals.busy_ms += now_ms() - busy_since;
+        pthread_cond_broadcast(&stream_changed);
+      }
+    }
+
+    if (producer_done && !ready_count && !in_flight)
+      break;
+
+    if (in_flight) {
+      pthread_mutex_unlock(&stream_lock);
+      int ret = sink->wait(sink);
+      pthread_mutex_lock(&stream_lock);
+
+      if (ret < 0) {
+        // no telling when (or if) the transfers will end: give up on them
+        failed = 1;
+        for (int slot = 0; slot < STREAM_BUFFERS; slot++)
+          if (slot_state[slot] == SLOT_SENDING)
+            slot_state[slot] = SLOT_FREE;
+        in_flight = 0;
+        totals.busy_ms += now_ms() - busy_since;
+        pthread_cond_broadcast(&stream_changed);
+      }
+    }
+    else
+      pthread_cond_wait(&stream_changed, &stream_lock);
+  }
+  pthread_mutex_unlock(&stream_lock);
+
+  pthread_join(producer, NULL);
+
+  totals.elapsed_ms = now_ms() - start;
+  if (stats)
+    *stats = totals;
+
+  return failed ? -1 : 0;
+}
+
+uint8_t *stream_get(void)
+{
+  int slot = 0;
+
+  pthread_mutex_lock(&stream_lock);
+  while (1) {
+    for (slot = 0; slot < STREAM_BUFFERS && slot_state[slot] != SLOT_FREE; slot++)
+      ;
+    if (slot < STREAM_BUFFERS)
+      break;
+    pthread_cond_wait(&stream_changed, &stream_lock);
+  }
+  slot_state[slot] = SLOT_FILLING;
+  pthread_mutex_unlock(&stream_lock);
+
+  return buffers[slot];
+}
+
+void stream_put(uint8_t *buf, int len)
+{
+  int slot = (buf - buffers[0]) / STREAM_BUFSIZE;
+
+  pthread_mutex_lock(&stream_lock);
+  if (len > 0) {
+    slot_len[slot] = len;
+    slot_state[slot] = SLOT_READY;
+    ready[(ready_head + ready_count++) % STREAM_BUFFERS] = slot;
+  }
+  else
+    slot_state[slot] = SLOT_FREE;
+  pthread_cond_broadcast(&stream_changed);
+  pthread_mutex_unlock(&stream_lock);
+}
+
+void stream_transfer_done(int slot, int status)
+{
+  pthread_mutex_lock(&stream_lock);
+  if (status)
+    failed = 1;
+  slot_state[slot] = SLOT_FREE;
+  if (!--in_flight)
+    totals.busy_ms += now_ms() - busy_since;
+  pthread_cond_broadcast(&stream_changed);
+  pthread_mutex_unlock(&stream_lock);
+}
@@ -0,0 +1,55 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+
+/*
+ * Streamed writes to the FTDI: a producer thread fills buffers of MPSSE
+ * commands, while the thread that started the stream keeps up to
+ * STREAM_IN_FLIGHT of them in bulk transfers at once. Each completed transfer
+ * frees its buffer for the producer and lets the next filled one go.
+ *
+ * Only one stream can run at a time.
+ */
+
+#define STREAM_IN_FLIGHT 4
+#define STREAM_BUFFERS (STREAM_IN_FLIGHT * 2)
+#define STREAM_BUFSIZE 4096
+
+typedef struct stream_sink {
+  // starts sending len bytes of buffer slot; its end must be reported with
+  // stream_transfer_done(), from within wait()
+  int (*submit)(struct stream_sink *sink, int slot, uint8_t *buf, int len);
+  // waits for at least one transfer to end
+  int (*wait)(struct stream_sink *sink);
+  void *ctx;
+} stream_sink;
+
+typedef struct {
+  uint64_t bytes;
+  int transfers;
+  int max_in_flight;
+  double elapsed_ms;
+  double busy_ms; // with at least one transfer in flight
+} stream_stats;
+
+/*
+ * stream_run(sink, produce, arg, stats)
+ *
+ * runs produce(arg) on a thread of its own, sending the buffers it hands over
+ * with stream_put() through sink, in order. Returns once all are sent: 0, or
+ * -1 if a transfer failed (the rest are then dropped). stats may be NULL.
+ */
+int stream_run(stream_sink *sink, void (*produce)(void *arg), void *arg, stream_stats *stats);
+
+// (producer) waits for an empty buffer of STREAM_BUFSIZE bytes
+uint8_t *stream_get(void);
+
+// (producer) sends the first len bytes of buf, which came from stream_get()
+// (len 0 just gives it back)
+void stream_put(uint8_t *buf, int len);
+
+// (sink) reports the end of the transfer of slot, status 0 if it went well
+void stream_transfer_done(int slot, int status);
+
+#endif /* STREAM_H */
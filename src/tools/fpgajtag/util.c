@@ -33,10 +33,14 @@
 #include <sys/select.h>
 #endif
 #include "util.h"
+#include "stream.h"
 #include "elfdef.h"
 
 int fpgajtag_usbdk_enable = 0;
 int fpgajtag_libusb_open_failed = 0;
+int fpgajtag_stream_enable = 1;
+int fpgajtag_cache_enable = 0;
+int fpgajtag_cache_verify = 0;
 
 // clang-format off
 static int usbValidDeviceList[][2] = {
@@ -116,6 +120,8 @@ static USB_INFO usbinfo_array[MAX_USB_DEVICECOUNT];
 static int usbinfo_array_index;
 static uint8_t usbreadbuffer[USB_CHUNKSIZE];
 static uint8_t *usbreadbuffer_ptr = usbreadbuffer;
+static uint8_t *usbwritebuffer = usbreadbuffer; // (a stream buffer while streaming)
+static int streaming;
 static int read_size[MAX_ITEM_LENGTH];
 static int read_size_ptr;
 
@@ -236,25 +242,78 @@ void write_item(uint8_t *buf)
 
 int buffer_current_size(void)
 {
-  return usbreadbuffer_ptr - usbreadbuffer;
+  return usbreadbuffer_ptr - usbwritebuffer;
 }
 uint8_t *buffer_current_ptr(void)
 {
   return usbreadbuffer_ptr;
 }
 
+/*
+ * Capture of flushed writes: each flush is recorded as a 4 byte (little
+ * endian) length and its bytes
+ */
+static uint8_t *capture_buf;
+static int capture_len, capture_size, capture_skip, capturing;
+
+void write_capture_start(void)
+{
+  capture_len = 0;
+  // (what is buffered already was not written by the caller)
+  capture_skip = buffer_current_size();
+  capturing = 1;
+}
+
+uint8_t *write_capture_end(int *size)
+{
+  uint8_t *buf = capture_buf;
+
+  capturing = 0;
+  *size = capture_len;
+  capture_buf = NULL;
+  capture_len = capture_size = 0;
+  return buf;
+}
+
+static void capture_flush(const uint8_t *buf, int len)
+{
+  buf += capture_skip;
+  len -= capture_skip;
+  capture_skip = 0;
+  if (capture_len + 4 + len > capture_size) {
+    capture_size = (capture_len + 4 + len) * 2;
+    if (!(capture_buf = (uint8_t *)realloc(capture_buf, capture_size))) {
+      log_crit("fpgajtag: out of memory capturing writes");
+      exit(-1);
+    }
+  }
+  for (int i = 0; i < 4; i++)
+    capture_buf[capture_len++] = len >> (i * 8);
+  memcpy(capture_buf + capture_len, buf, len);
+  capture_len += len;
+}
+
 void flush_write(uint8_t *req)
 {
   if (req)
     write_item(req);
+  uint8_t *buf = usbwritebuffer;
   int write_length = buffer_current_size();
-  usbreadbuffer_ptr = usbreadbuffer;
+  int len = write_length;
+  usbreadbuffer_ptr = usbwritebuffer;
   if (!write_length)
     return;
-  ftdi_write_data(global_ftdi, usbreadbuffer, write_length);
+  if (streaming) {
+    if (logging)
+      formatwrite(1, buf, write_length, "WRITE");
+  }
+  else
+    ftdi_write_data(global_ftdi, buf, write_length);
+  if (capturing)
+    capture_flush(buf, len);
   read_size_ptr = 0;
 
-  const uint8_t *p = usbreadbuffer;
+  const uint8_t *p = buf;
   while (write_length > 0) {
     int plen = 1;
     uint8_t ch = *p;
@@ -306,6 +365,80 @@ void flush_write(uint8_t *req)
       write_length -= tlen;
     }
   }
+
+  if (streaming) {
+    stream_put(buf, len);
+    usbwritebuffer = usbreadbuffer_ptr = stream_get();
+  }
+}
+
+/*
+ * Streamed writes: see stream.h
+ */
+#if !defined(NO_LIBUSB) && !defined(USE_LIBFTDI)
+static struct libusb_transfer *stream_transfers[STREAM_BUFFERS];
+
+static void LIBUSB_CALL stream_transfer_callback(struct libusb_transfer *transfer)
+{
+  int ok = transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length == transfer->length;
+  if (!ok)
+    log_crit("fpgajtag: usb bulk write failed: status %d req size %d act %d", transfer->status, transfer->length,
+        transfer->actual_length);
+  stream_transfer_done((int)(intptr_t)transfer->user_data, ok ? 0 : -1);
+}
+
+static int usb_stream_submit(stream_sink *sink, int slot, uint8_t *buf, int len)
+{
+  if (!stream_transfers[slot] && !(stream_transfers[slot] = libusb_alloc_transfer(0)))
+    return -1;
+  libusb_fill_bulk_transfer(stream_transfers[slot], usbhandle, ENDPOINT_IN, buf, len, stream_transfer_callback,
+      (void *)(intptr_t)slot, USB_TIMEOUT);
+  return libusb_submit_transfer(stream_transfers[slot]);
+}
+
+static int usb_stream_wait(stream_sink *sink)
+{
+  int ret = libusb_handle_events(usb_context);
+  return ret == LIBUSB_ERROR_INTERRUPTED ? 0 : ret;
+}
+#endif
+
+static void (*stream_producer)(void *arg);
+
+// (on the stream's producer thread)
+static void produce_stream_writes(void *arg)
+{
+  // carry on from whatever is already buffered
+  int held = buffer_current_size();
+  uint8_t *buf = stream_get();
+  memcpy(buf, usbwritebuffer, held);
+  usbwritebuffer = buf;
+  usbreadbuffer_ptr = buf + held;
+  streaming = 1;
+
+  stream_producer(arg);
+
+  // and leave what was not flushed buffered, for after the stream
+  streaming = 0;
+  held = buffer_current_size();
+  memcpy(usbreadbuffer, usbwritebuffer, held);
+  stream_put(usbwritebuffer, 0);
+  usbwritebuffer = usbreadbuffer;
+  usbreadbuffer_ptr = usbreadbuffer + held;
+}
+
+int stream_writes(void (*produce)(void *arg), void *arg, stream_stats *stats)
+{
+#if !defined(NO_LIBUSB) && !defined(USE_LIBFTDI)
+  static stream_sink sink = { usb_stream_submit, usb_stream_wait, NULL };
+
+  stream_producer = produce;
+  return stream_run(&sink, produce_stream_writes, arg, stats);
+#else
+  produce(arg);
+  memset(stats, 0, sizeof(*stats));
+  return 0;
+#endif
 }
 
 /*
@@ -21,6 +21,8 @@
 // CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include "stream.h"
+
 // #define USE_LOGGING
 #ifdef USE_LOGGING
 extern int log_depth;
@@ -118,6 +120,23 @@ void init_ftdi(int device_index, int interface_id);
 void write_data(uint8_t *buf, int size);
 void write_item(uint8_t *buf);
 void flush_write(uint8_t *req);
+/*
+ * stream_writes(produce, arg, stats)
+ *
+ * runs produce(arg) on a thread of its own, streaming what it flushes with
+ * several USB transfers at a time (see stream.h). It must only write, not read.
+ * Returns -1 if a transfer failed.
+ */
+int stream_writes(void (*produce)(void *arg), void *arg, stream_stats *stats);
+/*
+ * write_capture_start() ... write_capture_end(&size)
+ *
+ * records every flush in between (less what was already buffered at the
+ * start), as a 4 byte little endian length followed by that many bytes.
+ * Returns the records, malloc()ed, or NULL if there were none.
+ */
+void write_capture_start(void);
+uint8_t *write_capture_end(int *size);
 int buffer_current_size(void);
 uint8_t *buffer_current_ptr(void);
 
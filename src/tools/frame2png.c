@@ -2,43 +2,226 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #define PNG_DEBUG 3
 #include <png.h>
 
 #define MAXX 250
 #define MAXY 150
-unsigned char frame[MAXY][MAXX * 4];
 
-int maxx = 0;
-int maxy = 0;
+/*
+  Completed frames are handed to worker threads for PNG encoding through a bounded queue, so
+  reading the simulation report doesn't stall while an image is written. Frame buffers are
+  recycled rather than cleared in full: only the rows a frame actually touched are zeroed
+  once it has been written.
+*/
+#define FRAME_BUFFERS 8
+#define MAX_WORKERS 16
+
+struct frame {
+  unsigned char pixels[MAXY][MAXX * 4];
+  unsigned char dirty[MAXY];
+  int maxy;
+  int image_number;
+};
+
+struct frame frames[FRAME_BUFFERS];
+
+// frames waiting to be encoded, and frames free for reuse
+struct frame *encode_queue[FRAME_BUFFERS];
+int encode_head = 0, encode_count = 0;
+struct frame *free_frames[FRAME_BUFFERS];
+int free_count = 0;
+int stop_workers = 0;
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+int worker_count = 2;
+pthread_t workers[MAX_WORKERS];
+
+int quiet = 0;
+int benchmark = 0;
 
 int image_number = 0;
 
-void write_image(int image_number);
+void write_image(struct frame *fr);
 
-int main(int argc, char **argv)
+// Zeroes the rows a frame has touched, ready for the next one
+void clear_frame(struct frame *fr)
 {
+  for (int y = 0; y < MAXY; y++)
+    if (fr->dirty[y]) {
+      bzero(fr->pixels[y], sizeof(fr->pixels[y]));
+      fr->dirty[y] = 0;
+    }
+  fr->maxy = 0;
+}
 
-  int count = 0;
-  int x, y, r, g, b;
+void release_frame(struct frame *fr)
+{
+  clear_frame(fr);
+  pthread_mutex_lock(&queue_lock);
+  free_frames[free_count++] = fr;
+  pthread_cond_broadcast(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+}
 
-  char line[1024];
+void *encode_worker(void *arg)
+{
+  while (1) {
+    pthread_mutex_lock(&queue_lock);
+    while (!encode_count && !stop_workers)
+      pthread_cond_wait(&queue_cond, &queue_lock);
+    if (!encode_count) {
+      pthread_mutex_unlock(&queue_lock);
+      break;
+    }
+    struct frame *fr = encode_queue[encode_head];
+    encode_head = (encode_head + 1) % FRAME_BUFFERS;
+    encode_count--;
+    pthread_mutex_unlock(&queue_lock);
 
-  printf("Clear frame...\n");
+    write_image(fr);
+    release_frame(fr);
+  }
+  return NULL;
+}
 
-  for (y = 0; y < MAXY; y++)
-    for (x = 0; x < MAXX * 4; x++)
-      frame[y][x] = 0;
+// Waits for a clean frame to assemble the next image in
+struct frame *get_free_frame(void)
+{
+  pthread_mutex_lock(&queue_lock);
+  while (!free_count)
+    pthread_cond_wait(&queue_cond, &queue_lock);
+  struct frame *fr = free_frames[--free_count];
+  pthread_mutex_unlock(&queue_lock);
+  return fr;
+}
 
-  printf("Read pixels...\n");
+// Queues a completed frame for encoding (or writes it directly without workers),
+// and returns a clean frame to assemble the next image in
+struct frame *submit_frame(struct frame *fr)
+{
+  if (!worker_count) {
+    write_image(fr);
+    clear_frame(fr);
+    return fr;
+  }
 
-  line[0] = 0;
-  fgets(line, 1024, stdin);
+  pthread_mutex_lock(&queue_lock);
+  encode_queue[(encode_head + encode_count++) % FRAME_BUFFERS] = fr;
+  pthread_cond_broadcast(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+  return get_free_frame();
+}
+
+void start_workers(void)
+{
+  for (int i = 0; i < FRAME_BUFFERS; i++)
+    free_frames[free_count++] = &frames[i];
+  for (int i = 0; i < worker_count; i++)
+    pthread_create(&workers[i], NULL, encode_worker, NULL);
+}
+
+void stop_all_workers(void)
+{
+  pthread_mutex_lock(&queue_lock);
+  stop_workers = 1;
+  pthread_cond_broadcast(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+  for (int i = 0; i < worker_count; i++)
+    pthread_join(workers[i], NULL);
+}
+
+/*
+  Parses a GHDL report line of the form
+
+    viciv.vhdl:1234:8:@5678ps:(report note): PIXEL (12,34) = $05, RGBA = $ff00ff00
+
+  the way sscanf() with the pattern
+    "%*[^\\.].vhdl:%*[^:]:%*d:%*[^:]:(report note): PIXEL (%d,%d) = $%x, RGBA = $%x"
+  would, but without re-interpreting the pattern for each of the millions of lines in a run.
+  Returns 1 if the line is a pixel report.
+*/
+
+// Matches literal text, where a space matches any amount of white space, as in scanf()
+static int match_text(const char **s, const char *text)
+{
+  const char *p = *s;
+  for (; *text; text++) {
+    if (*text == ' ') {
+      while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+        p++;
+    }
+    else if (*p++ != *text)
+      return 0;
+  }
+  *s = p;
+  return 1;
+}
+
+// Skips a non-empty run of characters up to one of the stop characters
+static int skip_until(const char **s, const char *stop)
+{
+  const char *p = *s;
+  while (*p && !strchr(stop, *p))
+    p++;
+  if (p == *s)
+    return 0;
+  *s = p;
+  return 1;
+}
+
+static int scan_number(const char **s, int base, long *value)
+{
+  char *end;
+  *value = strtol(*s, &end, base);
+  if (end == *s)
+    return 0;
+  *s = end;
+  return 1;
+}
+
+int parse_pixel_line(const char *line, int *x, int *y, unsigned int *p, unsigned int *rgba)
+{
+  const char *s = line;
+  long v[4];
+
+  if (!skip_until(&s, "\\.") || !match_text(&s, ".vhdl:") || !skip_until(&s, ":") || !match_text(&s, ":")
+      || !scan_number(&s, 10, &v[0]) || !match_text(&s, ":") || !skip_until(&s, ":")
+      || !match_text(&s, ":(report note): PIXEL (") || !scan_number(&s, 10, &v[0]) || !match_text(&s, ",")
+      || !scan_number(&s, 10, &v[1]) || !match_text(&s, ") = $") || !scan_number(&s, 16, &v[2])
+      || !match_text(&s, ", RGBA = $") || !scan_number(&s, 16, &v[3]))
+    return 0;
+  *x = v[0];
+  *y = v[1];
+  *p = v[2];
+  *rgba = v[3];
+  return 1;
+}
+
+/*
+  Reads a GHDL pixel report, writing a PNG every time the raster wraps back to the top.
+  Returns the number of lines read.
+*/
+long process_report(FILE *in)
+{
+  int x, y, r, g, b;
+  long lines = 0;
+  char line[1024];
   unsigned int rgba, p;
+
+  struct frame *fr = worker_count ? get_free_frame() : &frames[0];
+  int maxx = 0;
+
+  line[0] = 0;
+  fgets(line, 1024, in);
   while (line[0]) {
-    if (sscanf(line, "%*[^\\.].vhdl:%*[^:]:%*d:%*[^:]:(report note): PIXEL (%d,%d) = $%x, RGBA = $%x", &x, &y, &p, &rgba)
-        == 4) {
+    lines++;
+    if (parse_pixel_line(line, &x, &y, &p, &rgba)) {
       r = (rgba >> 24) & 0xff;
       g = (rgba >> 16) & 0xff;
       b = (rgba >> 8) & 0xff;
@@ -60,40 +243,29 @@ int main(int argc, char **argv)
         // printf("Colour patched to $%02x%02x%02x00\n",r,g,b);
       }
       //      printf("x=%d,y=%d, max=%d,%d\n",x,y,maxx,maxy);
-      if (y < maxy) {
-        printf("Writing image %d\n", ++image_number);
-        write_image(image_number);
-        // Clear frame for next one
+      if (y < fr->maxy) {
+        if (!quiet)
+          printf("Writing image %d\n", image_number + 1);
+        fr->image_number = ++image_number;
+        fr = submit_frame(fr);
         maxx = 0;
-        maxy = 0;
-        for (y = 0; y < MAXY; y++)
-          for (x = 0; x < MAXX * 4; x++)
-            frame[y][x] = 0;
       }
       if (x >= 0 && x < MAXX && y >= 0 && y < MAXY) {
-        printf("%s", line);
-        frame[y][x * 4 + 0] = r;
-        frame[y][x * 4 + 1] = g;
-        frame[y][x * 4 + 2] = b;
-        frame[y][x * 4 + 3] = 0xff;
+        if (!quiet)
+          fputs(line, stdout);
+        fr->pixels[y][x * 4 + 0] = r;
+        fr->pixels[y][x * 4 + 1] = g;
+        fr->pixels[y][x * 4 + 2] = b;
+        fr->pixels[y][x * 4 + 3] = 0xff;
+        fr->dirty[y] = 1;
         if (x > maxx)
           maxx = x;
-        if (y > maxy)
-          maxy = y;
-      }
-      if (x == 20 && (maxy > 1)) {
-        // Save image progressively as each line written
-        //	      printf("  Got raster %d\n",y-1);
-        //	      count++;
-        //	      if (count==160) {
-        //	printf("  Writing raster %d\n",y-1);
-        //	write_image(image_number);
-        //	count=0;
-        //      }
+        if (y > fr->maxy)
+          fr->maxy = y;
       }
     }
     else {
-      if (
+      if (!benchmark &&
           //	  (strstr(line,"MAP"))||
           (strstr(line, "LEGACY")))
         printf("%s", line);
@@ -101,12 +273,122 @@ int main(int argc, char **argv)
     }
 
     line[0] = 0;
-    fgets(line, 1024, stdin);
+    fgets(line, 1024, in);
+  }
+
+  // the last frame is incomplete, so it is dropped as before
+  if (worker_count)
+    release_frame(fr);
+  else
+    clear_frame(fr);
+  return lines;
+}
+
+/*
+  Writes a synthetic pixel report of the given number of frames, for benchmarking.
+*/
+void generate_report(FILE *out, int frame_count)
+{
+  long t = 0;
+  for (int n = 0; n < frame_count; n++) {
+    for (int y = 0; y < MAXY; y++) {
+      fprintf(out, "viciv.vhdl:4242:8:@%ldps:(report note): LEGACY raster %d\n", t, y);
+      for (int x = 0; x < MAXX; x++) {
+        unsigned int p = (x + y + n) & 0xff;
+        unsigned int rgba = (x & 0x0f) ? ((x << 24) | (y << 16) | (n << 8)) : 0;
+        fprintf(out, "viciv.vhdl:4567:10:@%ldps:(report note): PIXEL (%d,%d) = $%02x, RGBA = $%08x\n", t, x, y, p, rgba);
+        t += 25000;
+      }
+    }
+  }
+}
+
+long long gettime_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+void usage(void)
+{
+  fprintf(stderr, "usage: frame2png [-q] [-j <encoder threads>] < ghdl-report\n"
+                  "       frame2png -g <frames>\n"
+                  "       frame2png -b <frames> [-j <encoder threads>]\n"
+                  "  -q - quiet: don't echo pixel lines or the rows of each image written.\n"
+                  "  -j - number of threads encoding PNGs (default 2, 0 to encode while reading stops).\n"
+                  "  -g - write a synthetic pixel report of the given number of frames to stdout.\n"
+                  "  -b - benchmark reading a synthetic report of the given number of frames,\n"
+                  "       encoding the images without writing them.\n");
+  exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+  int generate_frames = 0;
+  int benchmark_frames = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:g:j:q")) != -1) {
+    switch (opt) {
+    case 'b':
+      benchmark_frames = atoi(optarg);
+      break;
+    case 'g':
+      generate_frames = atoi(optarg);
+      break;
+    case 'j':
+      worker_count = atoi(optarg);
+      if (worker_count < 0 || worker_count > MAX_WORKERS)
+        usage();
+      break;
+    case 'q':
+      quiet = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc)
+    usage();
+
+  if (generate_frames) {
+    generate_report(stdout, generate_frames);
+    return 0;
+  }
+
+  FILE *in = stdin;
+  if (benchmark_frames) {
+    in = tmpfile();
+    if (!in) {
+      fprintf(stderr, "ERROR: Could not create temporary file\n");
+      exit(-1);
+    }
+    // one more frame, as the last one is only complete once the next starts
+    generate_report(in, benchmark_frames + 1);
+    rewind(in);
+    quiet = 1;
+    benchmark = 1;
   }
+
+  if (!quiet)
+    printf("Read pixels...\n");
+
+  if (worker_count)
+    start_workers();
+  long long start = gettime_us();
+  long lines = process_report(in);
+  if (worker_count)
+    stop_all_workers();
+  long long elapsed = gettime_us() - start;
+
+  if (benchmark_frames)
+    fprintf(stderr, "%ld lines, %d images in %.2f seconds: %.0f lines/sec, %.1f images/sec\n", lines, image_number,
+        elapsed / 1000000.0, lines * 1000000.0 / elapsed, image_number * 1000000.0 / elapsed);
   return 0;
 }
 
-void write_image(int image_number)
+void write_image(struct frame *fr)
 {
   int y;
   png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
@@ -121,8 +403,8 @@ void write_image(int image_number)
     abort();
 
   char filename[1024];
-  snprintf(filename, 1024, "frame-%d.png", image_number);
-  FILE *f = fopen(filename, "wb");
+  snprintf(filename, 1024, "frame-%d.png", fr->image_number);
+  FILE *f = fopen(benchmark ? "/dev/null" : filename, "wb");
   if (!f)
     abort();
 
@@ -133,10 +415,12 @@ void write_image(int image_number)
 
   png_write_info(png, info);
 
-  for (y = 0; y < maxy; y++) {
-    printf("  writing y=%d\n", y);
-    fflush(stdout);
-    png_write_row(png, frame[y]);
+  for (y = 0; y < fr->maxy; y++) {
+    if (!quiet) {
+      printf("  writing y=%d\n", y);
+      fflush(stdout);
+    }
+    png_write_row(png, fr->pixels[y]);
   }
   unsigned char empty_row[MAXX * 4];
   bzero(empty_row, sizeof(empty_row));
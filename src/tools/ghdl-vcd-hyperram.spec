@@ -0,0 +1,31 @@
+# ghdl-vcd signal spec for the hyperram simulation reports
+# (see the top of ghdl-vcd.c for the format, and keep builtin_spec there the same)
+
+timescale 1ns
+
+# as the old converter did: up to 10000 samples before the first register
+# write, and 1000 after the last one, where it stops
+start Writing to register
+samples 1000 hr_cs0 10000
+
+scope hr
+hr_cs0 1
+hr_clk_p 1
+hr_reset 1
+hr_rwds 1
+hr_d 8 lsb-first
+hr_sample 1
+upscope
+
+scope hr2
+hr2_cs0 1
+hr2_clk_p 1
+hr2_reset 1
+hr2_rwds 1
+hr2_d 8 lsb-first
+upscope
+
+scope i2c
+SDA 1
+SCL 1
+upscope
@@ -1,139 +1,613 @@
+/*
+  Turns the report notes of a GHDL simulation into a VCD file.
+
+  usage: ghdl-vcd [-s <signal spec>] [-o <vcd file>] [<ghdl output>]
+
+  (without a file, the GHDL output is read from stdin, so that it can be piped
+  straight from ghdl -r)
+
+  Which signals there are, and where their values come from, is in the spec
+  file (see ghdl-vcd-hyperram.spec, of which there is a copy built in for
+  when there is no -s):
+
+    # a comment
+    timescale <number><unit>      the VCD time unit (default 1ns)
+    start <text>                  ignore reports until one containing <text>
+    samples <n> <report key> [<m>]
+                                  stop <n> reports of <report key> after the
+                                  last report containing the start text (and
+                                  convert the first <m> before it)
+    scope <name>                  the signals that follow are in <name>...
+    upscope                       ...up to here
+    <report key> <width> [lsb-first]
+
+  A report line like
+
+    hyperram.vhdl:1234:9:@12345ps:(report note): hr_cs0 = '0', hr_d = '1''0''0''0''0''0''0''1', x=$3F
+
+  gives values to the signals whose keys it has (hr_cs0, hr_d and x), as
+  '<bit>' characters (one each, or run together), "<bits>", x"<hex>", $<hex>,
+  a decimal number, or true/false. lsb-first is for vectors reported bit 0
+  first. Only the values that have changed are written to the VCD.
+*/
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <getopt.h>
 #include <time.h>
 
-int main(int argc, char **argv)
+#define MAX_VARS 512
+#define MAX_WIDTH 256
+#define MAX_NAME 64
+#define TRIE_ALPHABET 64
+#define READ_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+  char name[MAX_NAME];
+  int width;
+  int lsb_first;
+  char id[8];             // the VCD identifier
+  char value[MAX_WIDTH + 1];
+  int changed;
+} vcd_var_t;
+
+/*
+  The report keys, in a trie, for finding them in a report in one pass.
+*/
+typedef struct {
+  short next[TRIE_ALPHABET];
+  short var; // the signal a key ending here is for, or -1
+} trie_node_t;
+
+static vcd_var_t vars[MAX_VARS];
+static int var_count = 0;
+static trie_node_t *trie = NULL;
+static int trie_count = 0, trie_size = 0;
+static unsigned char key_char[256]; // position in the trie's alphabet + 1, or 0 for characters that can't be in a key
+
+static unsigned long long timescale_fs = 1000000; // 1ns
+static char timescale_text[MAX_NAME] = "1ns";
+static char *start_text = NULL;
+static long window_samples = 0; // 0 without a samples directive
+static long window_lead = 0;    // reports of window_var converted before the start text
+static char window_key[MAX_NAME];
+static int window_var = -1;
+static long window_left = -1; // reports of window_var still to convert, 0 when closed, -1 for no limit
+static int window_hit = 0;
+static int done = 0;
+
+// the same as ghdl-vcd-hyperram.spec
+static const char builtin_spec[] = "timescale 1ns\n"
+                                   "start Writing to register\n"
+                                   "samples 1000 hr_cs0 10000\n"
+                                   "scope hr\n"
+                                   "hr_cs0 1\n"
+                                   "hr_clk_p 1\n"
+                                   "hr_reset 1\n"
+                                   "hr_rwds 1\n"
+                                   "hr_d 8 lsb-first\n"
+                                   "hr_sample 1\n"
+                                   "upscope\n"
+                                   "scope hr2\n"
+                                   "hr2_cs0 1\n"
+                                   "hr2_clk_p 1\n"
+                                   "hr2_reset 1\n"
+                                   "hr2_rwds 1\n"
+                                   "hr2_d 8 lsb-first\n"
+                                   "upscope\n"
+                                   "scope i2c\n"
+                                   "SDA 1\n"
+                                   "SCL 1\n"
+                                   "upscope\n";
+
+static int changed[MAX_VARS];
+static int changed_count = 0;
+static unsigned long long last_time = ~0ULL;
+
+static void trie_init(void)
 {
-  char line[1024];
-  int timepoint;
-  int regnum;
-  int active = 10000;
-  char sda, scl;
-  unsigned char hr_cs0, hr_clk_p, hr_reset, hr_rwds;
-  unsigned char hr_d[8];
-  unsigned char hr2_cs0, hr2_clk_p, hr2_reset, hr2_rwds;
-  unsigned char hr2_d[8];
-  unsigned char hr_sample, hr_return;
-
-  time_t t = time(0);
-
-  printf("$date\n"
-         "   Mon Feb 17 15:29:53 2020\n"
-         "\n"
-         "$end\n"
-         "$version\n"
-         "   MEGA65 monitor_load JTAG scan tool.\n"
-         "$end\n"
-         "$comment\n"
-         "   No comment.\n"
-         "$end\n"
-         "$timescale 1us $end\n"
-         "$scope module logic $end\n"
-
-         "$var wire 1 ! hr_cs0 $end\n"
-         "$var wire 1 \" hr_clk_p $end\n"
-         "$var wire 1 & hr_reset $end\n"
-         "$var wire 1 %% hr_rwds $end\n"
-         "$var wire 8 ^ hr_d $end\n"
-
-         "$var wire 1 A hr2_cs0 $end\n"
-         "$var wire 1 B hr2_clk_p $end\n"
-         "$var wire 1 C hr2_reset $end\n"
-         "$var wire 1 D hr2_rwds $end\n"
-         "$var wire 8 E hr2_d $end\n"
-         "$var wire 1 F hr_sample $end\n"
-
-         "$upscope $end\n"
-         "$enddefinitions $end\n"
-         "$dumpvars\n"
-         "x!\n"
-         "x\"\n"
-         "x&\n"
-         "x%%\n"
-         "bxxxxxxxx ^\n"
-         "xA\n"
-         "xB\n"
-         "xC\n"
-         "xD\n"
-         "bxxxxxxxx E\n"
-         "$end\n"
-         "\n");
-
-  line[0] = 0;
-  fgets(line, 1024, stdin);
-  while (line[0]) {
-    if (sscanf(line, "%*[^@]@%dns:(report note): Writing to register $%x", &timepoint, &regnum) == 2) {
-      active = 1000;
-    }
-    if (sscanf(line, "%*[^@]@%dus:(report note): Writing to register $%x", &timepoint, &regnum) == 2) {
-      timepoint *= 1000; // usec to ns
-      active = 1000;
-    }
-    if (active) {
-      int n = sscanf(line,
-          "%*[^@]@%dns:(report note): hr_cs0 = '%c', hr_clk_p = '%c', hr_reset = '%c', hr_rwds = '%c', hr_d = "
-          "'%c''%c''%c''%c''%c''%c''%c''%c', ",
-          &timepoint, &hr_cs0, &hr_clk_p, &hr_reset, &hr_rwds, &hr_d[0], &hr_d[1], &hr_d[2], &hr_d[3], &hr_d[4], &hr_d[5],
-          &hr_d[6], &hr_d[7]);
-      if (n < 13) {
-        n = sscanf(line,
-            "%*[^@]@%dus:(report note): hr_cs0 = '%c', hr_clk_p = '%c', hr_reset = '%c', hr_rwds = '%c', hr_d = "
-            "'%c''%c''%c''%c''%c''%c''%c''%c', ",
-            &timepoint, &hr_cs0, &hr_clk_p, &hr_reset, &hr_rwds, &hr_d[0], &hr_d[1], &hr_d[2], &hr_d[3], &hr_d[4], &hr_d[5],
-            &hr_d[6], &hr_d[7]);
-        timepoint *= 1000; // us to ns
+  int n = 1;
+  for (int c = 0; c < 256; c++)
+    if (isalnum(c) || c == '_' || c == '.')
+      key_char[c] = n++;
+  // (62 letters and digits, '_' and '.' just fit)
+}
+
+static int trie_new_node(void)
+{
+  if (trie_count == trie_size) {
+    trie_size = trie_size ? trie_size * 2 : 256;
+    trie = realloc(trie, trie_size * sizeof(trie_node_t));
+  }
+  memset(&trie[trie_count], 0, sizeof(trie_node_t));
+  trie[trie_count].var = -1;
+  return trie_count++;
+}
+
+static int trie_add(const char *key, int var)
+{
+  int node = 0;
+  for (const char *k = key; *k; k++) {
+    int c = key_char[(unsigned char)*k] - 1;
+    if (c < 0)
+      return -1;
+    if (!trie[node].next[c]) {
+      int n = trie_new_node();
+      trie[node].next[c] = n;
+    }
+    node = trie[node].next[c];
+  }
+  if (trie[node].var >= 0)
+    return -1;
+  trie[node].var = var;
+  return 0;
+}
+
+/*
+  A <number><unit> time, in femtoseconds, into *fs, leaving *end after it.
+  Returns -1 if it isn't one.
+*/
+static int parse_time(const char *s, const char *limit, unsigned long long *fs, const char **end)
+{
+  static const struct {
+    const char *unit;
+    unsigned long long fs;
+  } units[] = { { "fs", 1ULL }, { "ps", 1000ULL }, { "ns", 1000000ULL }, { "us", 1000000000ULL }, { "ms", 1000000000000ULL },
+    { "sec", 1000000000000000ULL }, { "s", 1000000000000000ULL }, { NULL, 0 } };
+  unsigned long long whole = 0, frac = 0, frac_div = 1;
+  const char *p = s;
+
+  while (p < limit && isdigit((unsigned char)*p))
+    whole = whole * 10 + (*p++ - '0');
+  if (p == s)
+    return -1;
+  if (p < limit && *p == '.') {
+    for (p++; p < limit && isdigit((unsigned char)*p); p++)
+      if (frac_div < 1000000000ULL) {
+        frac = frac * 10 + (*p - '0');
+        frac_div *= 10;
       }
-      if (n == 13) {
-        printf("#%d\n%c!\n%c\"\n%c&\n%c%%\nb%c%c%c%c%c%c%c%c ^\n", timepoint, (char)hr_cs0, (char)hr_clk_p, (char)hr_reset,
-            (char)hr_rwds, hr_d[7], hr_d[6], hr_d[5], hr_d[4], hr_d[3], hr_d[2], hr_d[1], hr_d[0]);
-        active--;
-        if (!active) {
+  }
+  while (p < limit && *p == ' ')
+    p++;
+  for (int i = 0; units[i].unit; i++) {
+    int len = strlen(units[i].unit);
+    if (limit - p >= len && !memcmp(p, units[i].unit, len) && (limit - p == len || !isalpha((unsigned char)p[len]))) {
+      *end = p + len;
+      *fs = whole * units[i].fs + frac * units[i].fs / frac_div;
+      return 0;
+    }
+  }
+  return -1;
+}
 
-          exit(0);
-        }
+// The spec in path, or the built-in one if it is NULL
+int read_spec(const char *path)
+{
+  FILE *f = path ? fopen(path, "r") : fmemopen((void *)builtin_spec, strlen(builtin_spec), "r");
+  char line[1024];
+  int lineno = 0;
+
+  if (!path)
+    path = "(built-in hyperram spec)";
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not read signal spec '%s'\n", path);
+    return -1;
+  }
+  trie_init();
+  trie_new_node();
+
+  while (fgets(line, sizeof(line), f)) {
+    char key[MAX_NAME], arg[MAX_NAME], flag[MAX_NAME];
+    int width = 0;
+    lineno++;
+    line[strcspn(line, "\r\n#")] = 0;
+
+    int n = sscanf(line, "%63s %63s %63s", key, arg, flag);
+    if (n < 1)
+      continue;
+    if (!strcmp(key, "timescale") && n >= 2) {
+      const char *end = NULL;
+      if (parse_time(arg, arg + strlen(arg), &timescale_fs, &end) || !timescale_fs || *end) {
+        fprintf(stderr, "ERROR: %s:%d: '%s' is not a time\n", path, lineno, arg);
+        return -1;
       }
+      snprintf(timescale_text, sizeof(timescale_text), "%s", arg);
+    }
+    else if (!strcmp(key, "start") && n >= 2) {
+      char *text = line + strspn(line, " \t") + strlen("start");
+      text += strspn(text, " \t");
+      for (char *e = text + strlen(text); e > text && isspace((unsigned char)e[-1]);)
+        *--e = 0;
+      start_text = strdup(text);
+    }
+    else if (!strcmp(key, "samples") && n == 3) {
+      if (sscanf(line, "%*s %ld %*s %ld", &window_samples, &window_lead) < 1 || window_samples <= 0 || window_lead < 0) {
+        fprintf(stderr, "ERROR: %s:%d: could not make sense of '%s'\n", path, lineno, line);
+        return -1;
+      }
+      snprintf(window_key, sizeof(window_key), "%s", flag);
+    }
+    else if (!strcmp(key, "scope") && n >= 2) {
+      // (kept in the var list as a width 0 entry)
+      snprintf(vars[var_count].name, MAX_NAME, "%s", arg);
+      vars[var_count++].width = 0;
+    }
+    else if (!strcmp(key, "upscope") && n == 1) {
+      vars[var_count++].width = -1;
+    }
+    else if (n >= 2 && sscanf(arg, "%d", &width) == 1 && width > 0 && width <= MAX_WIDTH
+             && (n == 2 || !strcmp(flag, "lsb-first"))) {
+      vcd_var_t *v = &vars[var_count];
+      snprintf(v->name, MAX_NAME, "%s", key);
+      v->width = width;
+      v->lsb_first = n == 3;
+      memset(v->value, 'x', width);
+      v->value[width] = 0;
+      if (trie_add(key, var_count)) {
+        fprintf(stderr, "ERROR: %s:%d: '%s' is not a usable report key (or is there twice)\n", path, lineno, key);
+        return -1;
+      }
+      var_count++;
+    }
+    else {
+      fprintf(stderr, "ERROR: %s:%d: could not make sense of '%s'\n", path, lineno, line);
+      return -1;
+    }
+    if (var_count >= MAX_VARS - 1) {
+      fprintf(stderr, "ERROR: %s:%d: too many signals\n", path, lineno);
+      return -1;
+    }
+  }
+  fclose(f);
 
-      if (active) {
-        int n = sscanf(line, "%*[^@]@%dns:(report note): hr_sample='%c'", &timepoint, &hr_sample);
-        if (n < 2) {
-          n = sscanf(line, "%*[^@]@%dus:(report note): hr_sample='%c'", &timepoint, &hr_sample);
-          timepoint *= 1000; // us to ns
-        }
-        if (n == 2) {
-          if (hr_sample == '0')
-            timepoint++;
-          printf("#%d\n%cF\n", timepoint, (char)hr_sample);
+  if (window_samples) {
+    for (int i = 0; i < var_count; i++)
+      if (vars[i].width > 0 && !strcmp(vars[i].name, window_key))
+        window_var = i;
+    if (window_var < 0) {
+      fprintf(stderr, "ERROR: %s: the samples directive's '%s' is not a signal\n", path, window_key);
+      return -1;
+    }
+  }
+  // without a start text, the window opens at the first report
+  window_left = start_text ? window_lead : window_samples ? window_samples : -1;
+
+  // VCD identifiers: printable characters, as a base 94 number
+  int id = 0;
+  for (int i = 0; i < var_count; i++) {
+    if (vars[i].width <= 0)
+      continue;
+    int k = 0;
+    for (int n = id++; k == 0 || n; n /= 94)
+      vars[i].id[k++] = '!' + n % 94;
+    vars[i].id[k] = 0;
+  }
+  return 0;
+}
+
+void write_header(FILE *out)
+{
+  time_t now = time(0);
+  char date[64];
+  strftime(date, sizeof(date), "%a %b %d %H:%M:%S %Y", localtime(&now));
+
+  fprintf(out,
+      "$date\n   %s\n$end\n"
+      "$version\n   MEGA65 ghdl-vcd GHDL report converter.\n$end\n"
+      "$timescale %s $end\n"
+      "$scope module logic $end\n",
+      date, timescale_text);
+  for (int i = 0; i < var_count; i++) {
+    if (vars[i].width == 0)
+      fprintf(out, "$scope module %s $end\n", vars[i].name);
+    else if (vars[i].width < 0)
+      fprintf(out, "$upscope $end\n");
+    else
+      fprintf(out, "$var wire %d %s %s $end\n", vars[i].width, vars[i].id, vars[i].name);
+  }
+  fprintf(out, "$upscope $end\n$enddefinitions $end\n$dumpvars\n");
+  for (int i = 0; i < var_count; i++) {
+    if (vars[i].width == 1)
+      fprintf(out, "x%s\n", vars[i].id);
+    else if (vars[i].width > 1)
+      fprintf(out, "bx %s\n", vars[i].id);
+  }
+  fprintf(out, "$end\n");
+}
+
+static char vcd_bit(char c)
+{
+  switch (c) {
+  case '0':
+  case 'L':
+  case 'l':
+    return '0';
+  case '1':
+  case 'H':
+  case 'h':
+    return '1';
+  case 'Z':
+  case 'z':
+    return 'z';
+  default: // U, X, W, -
+    return 'x';
+  }
+}
+
+static int hex_digit(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+/*
+  Reads a value at p into bits, returning the number of bits, and leaving *end
+  after it. *number is set for the values that are numbers, and so always most
+  significant bit first.
+*/
+static int parse_value(const char *p, const char *limit, char *bits, const char **end, int *number)
+{
+  int n = 0;
+
+  *number = p < limit && *p != '\'' && *p != '"';
+
+  if (p < limit && *p == '\'') {
+    // '1' or '1''0''1'...
+    while (p + 2 < limit && p[0] == '\'' && p[2] == '\'') {
+      if (n < MAX_WIDTH)
+        bits[n++] = vcd_bit(p[1]);
+      p += 3;
+    }
+  }
+  else if (p < limit && *p == '"') {
+    for (p++; p < limit && *p != '"'; p++)
+      if (n < MAX_WIDTH && *p != '_')
+        bits[n++] = vcd_bit(*p);
+    p++;
+  }
+  else if (p + 1 < limit && (*p == '$' || ((*p == 'x' || *p == 'X') && p[1] == '"'))) {
+    int quoted = *p != '$';
+    for (p += 1 + quoted; p < limit; p++) {
+      int d = hex_digit(*p);
+      if (d < 0 && *p != '_' && !(quoted && strchr("UXZuxz-", *p)))
+        break;
+      for (int b = 3; b >= 0 && n < MAX_WIDTH && *p != '_'; b--)
+        bits[n++] = d < 0 ? vcd_bit(*p) : ((d >> b) & 1) + '0';
+    }
+    if (quoted && p < limit && *p == '"')
+      p++;
+  }
+  else if (p < limit && (isdigit((unsigned char)*p) || *p == '-')) {
+    // (two's complement, in 64 bits)
+    int negative = *p == '-';
+    unsigned long long v = 0;
+    for (p += negative; p < limit && isdigit((unsigned char)*p); p++)
+      v = v * 10 + (*p - '0');
+    if (negative)
+      v = -v;
+    for (int b = 63; b >= 0; b--)
+      if (n || (v >> b) & 1 || b == 0)
+        bits[n++] = ((v >> b) & 1) + '0';
+  }
+  else if (limit - p >= 4 && !strncasecmp(p, "true", 4)) {
+    bits[n++] = '1';
+    p += 4;
+  }
+  else if (limit - p >= 5 && !strncasecmp(p, "false", 5)) {
+    bits[n++] = '0';
+    p += 5;
+  }
+  *end = p;
+  return n;
+}
+
+static void set_value(int var, const char *bits, int n, int number)
+{
+  vcd_var_t *v = &vars[var];
+  char value[MAX_WIDTH + 1];
+
+  // (shorter values are zero extended, longer ones keep their low bits)
+  for (int i = 0; i < v->width; i++) {
+    int from = v->lsb_first && !number ? i : n - 1 - i; // bit i, counting from the least significant
+    value[v->width - 1 - i] = from >= 0 && from < n ? bits[from] : '0';
+  }
+  value[v->width] = 0;
+
+  if (memcmp(value, v->value, v->width)) {
+    memcpy(v->value, value, v->width);
+    if (!v->changed) {
+      v->changed = 1;
+      changed[changed_count++] = var;
+    }
+  }
+}
+
+/*
+  The key = value pairs of a report message.
+*/
+static void scan_message(const char *p, const char *limit)
+{
+  char bits[MAX_WIDTH];
+
+  while (p < limit) {
+    if (!key_char[(unsigned char)*p]) {
+      p++;
+      continue;
+    }
+
+    // the longest key that is the whole of this word
+    int node = 0;
+    const char *word = p;
+    while (p < limit && key_char[(unsigned char)*p]) {
+      node = trie[node].next[key_char[(unsigned char)*p] - 1];
+      if (!node)
+        break;
+      p++;
+    }
+    if (node && trie[node].var >= 0 && (p == limit || !key_char[(unsigned char)*p])) {
+      const char *q = p;
+      while (q < limit && *q == ' ')
+        q++;
+      if (q < limit && *q == '=') {
+        for (q++; q < limit && *q == ' '; q++)
+          continue;
+        int number;
+        int n = parse_value(q, limit, bits, &p, &number);
+        if (n) {
+          set_value(trie[node].var, bits, n, number);
+          window_hit |= trie[node].var == window_var;
         }
+        continue;
       }
+    }
+    // (not a key: skip the rest of the word)
+    p = word;
+    while (p < limit && key_char[(unsigned char)*p])
+      p++;
+  }
+}
 
-      if (active) {
-        int n = sscanf(line,
-            "%*[^@]@%dns:(report note): hr2_cs0 = '%c', hr2_clk_p = '%c', hr2_reset = '%c', hr2_rwds = '%c', hr2_d = "
-            "'%c''%c''%c''%c''%c''%c''%c''%c', ",
-            &timepoint, &hr2_cs0, &hr2_clk_p, &hr2_reset, &hr2_rwds, &hr2_d[0], &hr2_d[1], &hr2_d[2], &hr2_d[3], &hr2_d[4],
-            &hr2_d[5], &hr2_d[6], &hr2_d[7]);
-        if (n < 13) {
-          n = sscanf(line,
-              "%*[^@]@%dus:(report note): hr2_cs0 = '%c', hr2_clk_p = '%c', hr2_reset = '%c', hr2_rwds = '%c', hr2_d = "
-              "'%c''%c''%c''%c''%c''%c''%c''%c', ",
-              &timepoint, &hr2_cs0, &hr2_clk_p, &hr2_reset, &hr2_rwds, &hr2_d[0], &hr2_d[1], &hr2_d[2], &hr2_d[3], &hr2_d[4],
-              &hr2_d[5], &hr2_d[6], &hr2_d[7]);
-          timepoint *= 1000; // us to ns
-        }
-        if (n == 13) {
-          printf("%cA\n%cB\n%cC\n%cD\nb%c%c%c%c%c%c%c%c E\n", (char)hr2_cs0, (char)hr2_clk_p, (char)hr2_reset,
-              (char)hr2_rwds, hr2_d[7], hr2_d[6], hr2_d[5], hr2_d[4], hr2_d[3], hr2_d[2], hr2_d[1], hr2_d[0]);
+/*
+  One line of GHDL output:
+    <file>:<line>:<column>:@<time>:(report <severity>): <message>
+*/
+static void scan_line(const char *line, const char *limit, FILE *out)
+{
+  const char *at = memchr(line, '@', limit - line);
+  const char *p;
+  unsigned long long fs;
+  if (!at || parse_time(at + 1, limit, &fs, &p))
+    return;
+  if (limit - p < 3 || memcmp(p, ":(", 2))
+    return;
+  const char *msg = memchr(p, ')', limit - p);
+  if (!msg || limit - msg < 2 || msg[1] != ':')
+    return;
+  msg += 2;
+  while (msg < limit && *msg == ' ')
+    msg++;
+
+  if (start_text && memmem(msg, limit - msg, start_text, strlen(start_text))) {
+    window_left = window_samples ? window_samples : -1;
+    // (only needed again to reopen the window)
+    if (!window_samples) {
+      free(start_text);
+      start_text = NULL;
+    }
+  }
+  if (!window_left)
+    return;
+
+  window_hit = 0;
+  scan_message(msg, limit);
+  // like the old hyperram converter, that is the end of it once the window closes
+  if (window_hit && window_left > 0 && !--window_left)
+    done = 1;
+  if (!changed_count)
+    return;
+
+  unsigned long long t = fs / timescale_fs;
+  if (t != last_time) {
+    fprintf(out, "#%llu\n", t);
+    last_time = t;
+  }
+  for (int i = 0; i < changed_count; i++) {
+    vcd_var_t *v = &vars[changed[i]];
+    if (v->width == 1)
+      fprintf(out, "%c%s\n", v->value[0], v->id);
+    else
+      fprintf(out, "b%s %s\n", v->value, v->id);
+    v->changed = 0;
+  }
+  changed_count = 0;
+}
+
+void convert(FILE *in, FILE *out)
+{
+  char *buf = malloc(READ_SIZE);
+  size_t have = 0;
+
+  while (!done) {
+    size_t got = fread(buf + have, 1, READ_SIZE - have, in);
+    have += got;
+    if (!have)
+      break;
+
+    char *p = buf, *end = buf + have;
+    while (!done) {
+      char *nl = memchr(p, '\n', end - p);
+      if (!nl) {
+        // (at the end, or a line too long for the buffer: take it as it is)
+        if (!got || p == buf) {
+          scan_line(p, end, out);
+          p = end;
         }
+        break;
       }
-      if (sscanf(line, "%*[^@]@%dns:(report note): SDA='%c', SCL='%c'", &timepoint, &sda, &scl) == 3) {
-        printf("#%d\n%c!\n%c\"\n", timepoint, (char)sda, (char)scl);
-      }
+      scan_line(p, nl, out);
+      p = nl + 1;
+    }
+    have = end - p;
+    memmove(buf, p, have);
+    if (!got && !have)
+      break;
+  }
+  free(buf);
+}
+
+void usage(void)
+{
+  fprintf(stderr, "usage: ghdl-vcd [-s <signal spec>] [-o <vcd file>] [<ghdl output>]\n");
+  exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+  const char *spec = NULL, *out_path = NULL;
+  FILE *in = stdin, *out = stdout;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:o:")) != -1) {
+    switch (opt) {
+    case 's':
+      spec = optarg;
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    default:
+      usage();
     }
+  }
+  if (argc - optind > 1)
+    usage();
+  if (read_spec(spec))
+    return -1;
+
+  if (optind < argc && !(in = fopen(argv[optind], "r"))) {
+    fprintf(stderr, "ERROR: Could not read '%s'\n", argv[optind]);
+    return -1;
+  }
+  if (out_path && !(out = fopen(out_path, "w"))) {
+    fprintf(stderr, "ERROR: Could not write '%s'\n", out_path);
+    return -1;
+  }
+  setvbuf(out, NULL, _IOFBF, 1024 * 1024);
 
-    if ((time(0) - t) > 20)
-      exit(0);
+  write_header(out);
+  convert(in, out);
 
-    line[0] = 0;
-    fgets(line, 1024, stdin);
+  if (fclose(out)) {
+    fprintf(stderr, "ERROR: Could not write the VCD\n");
+    return -1;
   }
+  return 0;
 }
@@ -4,6 +4,10 @@
 #include <time.h>
 #include <sys/time.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef WINDOWS
+#include <windows.h>
+#endif
 
 #include "logging.h"
 
@@ -52,6 +56,9 @@ void log_setup(FILE *outfile, const int level)
     log_file = stderr;
   log_level = level;
   log_fallback = 0;
+#ifndef NO_TRACE
+  trace_setup(NULL);
+#endif
 }
 
 /*
@@ -91,18 +98,23 @@ void log_format(const int level, const char *message, va_list args)
   if (level > log_level)
     return;
 
-  char date[32];
+  // the date part only changes once a second, so only format it then
+  static __thread char date[32];
+  static __thread time_t date_sec = -1;
   char outstring[1024];
   struct timeval currentTime;
   gettimeofday(&currentTime, NULL);
 
+  if (currentTime.tv_sec != date_sec) {
+    date_sec = currentTime.tv_sec;
 #ifndef WINDOWS
-  strftime(date, 31, "%Y-%m-%dT%H:%M:%S", gmtime(&(currentTime.tv_sec)));
+    strftime(date, 31, "%Y-%m-%dT%H:%M:%S", gmtime(&(currentTime.tv_sec)));
 #else
-  // on WINDOWS we need to stay with time/gmtime/strftime
-  time_t now = time(NULL);
-  strftime(date, 31, "%Y-%m-%dT%H:%M:%S", gmtime(&now));
+    // on WINDOWS we need to stay with time/gmtime/strftime
+    time_t now = time(NULL);
+    strftime(date, 31, "%Y-%m-%dT%H:%M:%S", gmtime(&now));
 #endif
+  }
 
 #ifndef __linux__
   // hack: apple and windows sometimes make %03d really long...
@@ -114,7 +126,12 @@ void log_format(const int level, const char *message, va_list args)
   int pos = snprintf(outstring, 1023, "%s.%03ldZ %s ", date, currentTime.tv_usec / 1000, log_level_name[level]);
 #endif
   int pos2 = vsnprintf(outstring + pos, 1023 - pos, message, args);
-  if (outstring[strlen(outstring) - 1] != '\n') {
+  // vsnprintf returns the untruncated length
+  if (pos2 < 0)
+    pos2 = 0;
+  if (pos + pos2 > 1021)
+    pos2 = 1021 - pos;
+  if (pos2 == 0 || outstring[pos + pos2 - 1] != '\n') {
     outstring[pos + pos2] = '\n';
     outstring[pos + pos2 + 1] = 0;
   }
@@ -200,3 +217,208 @@ void log_debug(const char *message, ...)
   log_format(LOG_DEBUG, message, args);
   va_end(args);
 }
+
+/*
+ * Tracing
+ *
+ * Each thread records into its own ring, allocated on its first event and
+ * linked into trace_rings, so recording never takes a lock. When a ring is
+ * full the oldest events are overwritten; the histograms still count them.
+ *
+ * Binary dump format (all little endian as written by the host):
+ *   "M65TRC1\0"
+ *   u32 span count, then per span: u32 id, u32 name length, name
+ *   u32 thread count, then per thread: u32 thread number, u32 event count,
+ *     then per event: u64 start ns, u64 duration ns, u32 span id
+ */
+#ifndef NO_TRACE
+#define TRACE_RING_EVENTS 65536
+
+struct trace_event {
+  unsigned long long start_ns, dur_ns;
+  struct trace_span *span;
+};
+
+struct trace_ring {
+  int thread;
+  unsigned long long head; // total events recorded; slot is head % TRACE_RING_EVENTS
+  struct trace_ring *next;
+  struct trace_event events[TRACE_RING_EVENTS];
+};
+
+int trace_enabled = 0;
+static char *trace_path = NULL;
+static unsigned long long trace_epoch = 0;
+static struct trace_ring *trace_rings = NULL;
+static struct trace_span *trace_spans = NULL;
+static int trace_threads = 0, trace_span_count = 0;
+static __thread struct trace_ring *trace_ring_self = NULL;
+
+static void trace_dump(void);
+
+void trace_setup(const char *path)
+{
+  if (trace_enabled)
+    return;
+  if (path == NULL)
+    path = getenv("M65_TRACE");
+  if (path == NULL || !path[0])
+    return;
+
+  trace_path = strdup(path);
+  trace_epoch = trace_now();
+  trace_enabled = 1;
+  atexit(trace_dump);
+}
+
+unsigned long long trace_now(void)
+{
+#ifdef WINDOWS
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+  if (!freq.QuadPart)
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000000ULL
+       + (unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart + 1;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec + 1;
+#endif
+}
+
+static struct trace_ring *trace_get_ring(void)
+{
+  if (trace_ring_self)
+    return trace_ring_self;
+
+  struct trace_ring *ring = calloc(1, sizeof(struct trace_ring));
+  if (!ring)
+    return NULL;
+  ring->thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+  ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  trace_ring_self = ring;
+  return ring;
+}
+
+void trace_record(struct trace_span *span, unsigned long long start)
+{
+  unsigned long long dur = trace_now() - start;
+
+  if (!__atomic_load_n(&span->id, __ATOMIC_ACQUIRE)) {
+    // first use of this span: give it an id and add it to the list, once
+    int zero = 0;
+    if (__atomic_compare_exchange_n(&span->id, &zero, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      span->next = __atomic_load_n(&trace_spans, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n(&trace_spans, &span->next, span, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+      __atomic_store_n(&span->id, __atomic_add_fetch(&trace_span_count, 1, __ATOMIC_RELAXED), __ATOMIC_RELEASE);
+    }
+  }
+
+  int bucket = 0;
+  for (unsigned long long us = dur / 1000; us > 1 && bucket < TRACE_BUCKETS - 1; us >>= 1)
+    bucket++;
+  __atomic_add_fetch(&span->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&span->total_ns, dur, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&span->buckets[bucket], 1, __ATOMIC_RELAXED);
+  unsigned long long max = __atomic_load_n(&span->max_ns, __ATOMIC_RELAXED);
+  while (dur > max && !__atomic_compare_exchange_n(&span->max_ns, &max, dur, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+
+  struct trace_ring *ring = trace_get_ring();
+  if (!ring)
+    return;
+  struct trace_event *ev = &ring->events[ring->head % TRACE_RING_EVENTS];
+  ev->start_ns = start;
+  ev->dur_ns = dur;
+  ev->span = span;
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_write_json(FILE *f)
+{
+  fprintf(f, "{\"traceEvents\":[\n");
+  int first = 1;
+  for (struct trace_ring *ring = trace_rings; ring; ring = ring->next) {
+    unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long long i = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+    for (; i < head; i++) {
+      struct trace_event *ev = &ring->events[i % TRACE_RING_EVENTS];
+      fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", first ? "" : ",\n",
+          ev->span->name, (int)getpid(), ring->thread, (ev->start_ns - trace_epoch) / 1000.0, ev->dur_ns / 1000.0);
+      first = 0;
+    }
+  }
+  fprintf(f, "\n]}\n");
+}
+
+static void trace_write_u32(FILE *f, unsigned int v)
+{
+  fwrite(&v, sizeof(v), 1, f);
+}
+
+static void trace_write_binary(FILE *f)
+{
+  fwrite("M65TRC1", 8, 1, f);
+  trace_write_u32(f, trace_span_count);
+  for (struct trace_span *span = trace_spans; span; span = span->next) {
+    trace_write_u32(f, span->id);
+    trace_write_u32(f, strlen(span->name));
+    fwrite(span->name, strlen(span->name), 1, f);
+  }
+  trace_write_u32(f, trace_threads);
+  for (struct trace_ring *ring = trace_rings; ring; ring = ring->next) {
+    unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long long i = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+    trace_write_u32(f, ring->thread);
+    trace_write_u32(f, head - i);
+    for (; i < head; i++) {
+      struct trace_event *ev = &ring->events[i % TRACE_RING_EVENTS];
+      unsigned long long start = ev->start_ns - trace_epoch;
+      fwrite(&start, sizeof(start), 1, f);
+      fwrite(&ev->dur_ns, sizeof(ev->dur_ns), 1, f);
+      trace_write_u32(f, ev->span->id);
+    }
+  }
+}
+
+/*
+ * trace_dump()
+ *
+ * logs the span histograms and writes the recorded events to trace_path.
+ * Registered with atexit() by trace_setup().
+ */
+static void trace_dump(void)
+{
+  FILE *out = log_file ? log_file : stderr;
+
+  for (struct trace_span *span = trace_spans; span; span = span->next) {
+    if (!span->count)
+      continue;
+    fprintf(out, "trace: %-20s %10llu calls, mean %9.1fus, max %9.1fus\n", span->name, span->count,
+        span->total_ns / 1000.0 / span->count, span->max_ns / 1000.0);
+    for (int b = 0; b < TRACE_BUCKETS; b++) {
+      if (span->buckets[b])
+        fprintf(out, "trace: %-20s   %8uus %s %10llu\n", "", b ? 1U << b : 0, b < TRACE_BUCKETS - 1 ? "- " : "+ ",
+            span->buckets[b]);
+    }
+  }
+
+  FILE *f = fopen(trace_path, "wb");
+  if (!f) {
+    fprintf(out, "ERROR: could not write trace to '%s'\n", trace_path);
+    return;
+  }
+  int len = strlen(trace_path);
+  if (len > 5 && !strcmp(trace_path + len - 5, ".json"))
+    trace_write_json(f);
+  else
+    trace_write_binary(f);
+  fclose(f);
+  fprintf(out, "trace: events written to '%s'\n", trace_path);
+}
+#endif
@@ -58,6 +58,7 @@
 #include <logging.h>
 #include <screen_shot.h>
 #include <fpgajtag.h>
+#include <unittest.h>
 
 #define UT_TIMEOUT 10
 #define UT_RES_TIMEOUT 127
@@ -339,6 +340,9 @@ void init_cmd_options(void)
   CMD_OPTION("speed",     1, 0,         's', "230400|1000000|1500000|2000000|4000000",
                   "Speed of serial port in <bits per second> (defaults to 2000000). This needs to match the speed your bitstream uses!");
   CMD_OPTION("usedk",     0, 0,         'K', "",      "Use DK backend for libUSB, if available.");
+  CMD_OPTION("nojtagstream", 0, &fpgajtag_stream_enable, 0, "", "Send the bitstream one blocking USB transfer at a time.");
+  CMD_OPTION("jtagcache", 0, &fpgajtag_cache_enable, 1, "", "Cache the JTAG commands made from the bitstream, in $M65_JTAG_CACHE or the user's cache directory.");
+  CMD_OPTION("jtagcacheverify", 0, &fpgajtag_cache_verify, 1, "", "As jtagcache, but make them afresh anyway and compare them with the cached ones.");
 
   CMD_OPTION("bootslot",  1, 0,         'Z', "slot|addr", "Reconfigure FPGA from specified <slot> (argument<8) or <addr>ess (hex) in flash.");
   CMD_OPTION("bit",       1, 0,         'b', "file",  "name of a FPGA bitstream <file> to load.");
@@ -379,7 +383,9 @@ void init_cmd_options(void)
   CMD_OPTION("colourrom", 1, 0,         'c', "file",  "Colour RAM <file> to preload at $FF80000.");
 
   CMD_OPTION("vtype",     1, 0,         't', "-|text",
-                  "Type <text> via keyboard virtualisation.\nThe following escape sequences are supported:\n"
+                  "Type <text> via the KERNAL keyboard buffer, falling back to keyboard virtualisation for keys\n"
+                  "that need it (RUN/STOP, function keys) or when the buffer is not being read.\n"
+                  "The following escape sequences are supported:\n"
                   "    ~M  RETURN      ~T  INST/DEL\n"
                   "    ~C  RUN/STOP    ~1  F1\n"
                   "    ~D  DOWN        ~3  F3\n"
@@ -1014,6 +1020,84 @@ void do_type_key(unsigned char key)
   usleep(20000);
 }
 
+/*
+  Type-ahead for do_type_text(): keys that have a PETSCII code collect here and
+  go out through the KERNAL keyboard buffer in one go (see type_keybuffer()).
+  Keys that only exist on the keyboard matrix (RUN/STOP, function keys) flush
+  what is queued first, and are then pressed on the virtual keyboard.
+*/
+#define TYPE_AHEAD_MAX 4096
+#define TYPE_KEYBUFFER_TIMEOUT_MS 2000
+unsigned char type_ahead[TYPE_AHEAD_MAX];
+int type_ahead_len = 0;
+int type_via_matrix = 0; // set once the KERNAL has stopped reading the keyboard buffer
+unsigned long type_key_count = 0;
+
+unsigned char type_petscii(unsigned char key)
+{
+  // lower case letters are unshifted, upper case shifted, as do_type_key() types them
+  if (key >= 'a' && key <= 'z')
+    return key - 0x20;
+  if (key >= 'A' && key <= 'Z')
+    return key + 0x80;
+  if (key >= ' ' && key <= '@')
+    return key;
+
+  switch (key) {
+  case '[':
+  case ']':
+    return key;
+  case '}':
+    return 0x5c; // British pound
+  case '^':
+    return 0x5e; // up arrow
+  case '_':
+    return 0x5f; // left arrow
+  case '\n':
+    return 0x0d;
+  case 0x0d: // RETURN
+  case 0x11: // cursor down
+  case 0x91: // cursor up
+  case 0x1d: // cursor right
+  case 0x9d: // cursor left
+  case 0x13: // HOME
+  case 0x14: // INST/DEL
+    return key;
+  }
+  return 0;
+}
+
+void type_flush(void)
+{
+  unsigned char petscii[TYPE_AHEAD_MAX];
+  int typed = 0;
+
+  if (!type_ahead_len)
+    return;
+  for (int i = 0; i < type_ahead_len; i++)
+    petscii[i] = type_petscii(type_ahead[i]);
+  if (type_keybuffer(petscii, type_ahead_len, TYPE_KEYBUFFER_TIMEOUT_MS, &typed)) {
+    log_warn("keyboard buffer is not being read, typing the rest via the virtual keyboard");
+    type_via_matrix = 1;
+    for (int i = typed; i < type_ahead_len; i++)
+      do_type_key(type_ahead[i]);
+  }
+  type_ahead_len = 0;
+}
+
+void type_key(unsigned char key)
+{
+  type_key_count++;
+  if (!type_via_matrix && !type_serial_mode && type_petscii(key)) {
+    if (type_ahead_len == TYPE_AHEAD_MAX)
+      type_flush();
+    type_ahead[type_ahead_len++] = key;
+    return;
+  }
+  type_flush();
+  do_type_key(key);
+}
+
 void do_type_text(char *type_text)
 {
   log_note("typing text via virtual keyboard...");
@@ -1039,16 +1123,11 @@ void do_type_text(char *type_text)
           break;
 
         for (int i = 0; line[i]; i++)
-          do_type_key(line[i]);
+          type_key(line[i]);
 
         // carriage return at end of line
-        slow_write(fd, "sffd3615 01 7f 7f \n", 19);
-        // Allow time for a keyboard scan interrupt
-        usleep(20000);
-        // release keys
-        slow_write(fd, "sffd3615 7f 7f 7f \n", 19);
-        // Allow time for a keyboard scan interrupt
-        usleep(20000);
+        type_key(0x0d);
+        type_flush();
 
         // Display screen updates while typing if requested
         if (screen_shot) {
@@ -1192,12 +1271,14 @@ void do_type_text(char *type_text)
   else {
     int i;
     unsigned char c1;
+    unsigned long long start = gettime_ms();
     for (i = 0; type_text[i]; i++) {
       if (type_text[i] == '~') {
         // eos after tilde? break out of loop!
         if (type_text[i + 1] == 0)
           break;
         // control sequences (remember to UPDATE USAGE!)
+        c1 = 0;
         switch (type_text[i + 1]) {
         case 'C':
           c1 = 0x03;
@@ -1236,24 +1317,29 @@ void do_type_text(char *type_text)
           c1 = 0xF7;
           break; // F7
         case 'Z':
+          type_flush();
           sleep(1);
         case 'z':
+          type_flush();
           sleep(1);
           break;
         }
-        do_type_key(c1);
+        if (c1)
+          type_key(c1);
         i++;
       }
       else
-        do_type_key(type_text[i]);
+        type_key(type_text[i]);
     }
 
     // RETURN at end if requested
-    if (type_text_cr) {
-      slow_write(fd, "sffd3615 01 7f 7f \n", 19);
-      // Allow time for a keyboard scan interrupt
-      usleep(20000);
-    }
+    if (type_text_cr)
+      type_key(0x0d);
+    type_flush();
+
+    unsigned long long elapsed = gettime_ms() - start;
+    log_info("typed %lu characters in %llums (%.1f chars/sec)", type_key_count, elapsed,
+        type_key_count * 1000.0 / (elapsed ? elapsed : 1));
   }
   // Stop pressing keys
   slow_write(fd, "sffd3615 7f 7f 7f \n", 19);
@@ -1546,36 +1632,15 @@ void handle_vf011_requests()
   }
 }
 
-char *test_states[16] = { "START", " SKIP", " PASS", " FAIL", "ERROR", "C#$05", "C#$06", "C#$07", "C#$08", "C#$09", "C#$0A",
-  "C#$0B", "C#$0C", "  LOG", " NAME", " DONE" };
-
-char msgbuf[160], *endp;
-char testname[160], testlog[160];
+char *endp;
 unsigned char inbuf[8192];
-unsigned int failcount, test_last_issue, test_last_sub;
 FILE *logPtr;
 
-void unit_test_logline(unsigned short issue, unsigned char sub, unsigned char state, char *msg)
+void unit_test_logline(ut_parser *p, unsigned short issue, unsigned char sub, unsigned char state, const char *msg)
 {
   char outstring[255];
-  char temp[255];
-
-  struct timeval currentTime;
-
-  gettimeofday(&currentTime, NULL);
-  strftime(outstring, 255, "%Y-%m-%dT%H:%M:%S", gmtime((const time_t *)&(currentTime.tv_sec)));
 
-  snprintf(temp, 255, ".%03dZ %s (Issue#%04d, Test #%03d", (unsigned int)currentTime.tv_usec / 1000, test_states[state],
-      issue, sub);
-  strncat(outstring, temp, 254);
-
-  if (msg) {
-    snprintf(temp, 255, " - %s)", msg);
-  }
-  else {
-    snprintf(temp, 255, ")");
-  }
-  strncat(outstring, temp, 254);
+  ut_format_line(outstring, sizeof(outstring), issue, sub, state, msg);
 
   log_note(outstring);
   if (logPtr) {
@@ -1584,67 +1649,24 @@ void unit_test_logline(unsigned short issue, unsigned char sub, unsigned char st
   }
 }
 
-void unit_test_log(unsigned char bytes[4])
+int unit_test_vf011_filter(ut_parser *p, unsigned char recent[4])
 {
-  unsigned short test_issue = bytes[0] + (bytes[1] << 8);
-  unsigned char test_sub = bytes[2];
-  // dump_bytes(0, "bytes", bytes, 4);
-  // fprintf(stderr, "issue = %d, sub = %d\n", test_issue, test_sub);
-
-  // check for log message, but no PASS/FAIL follows
-  if (testlog[0] && bytes[3] != 0xf2 && bytes[3] != 0xf3) {
-    unit_test_logline(test_last_issue, test_last_sub, 0xd, testlog);
-    testlog[0] = 0;
-  }
-
-  unit_test_logline(test_issue, test_sub, bytes[3] - 0xf0, testlog[0] ? testlog : (testname[0] ? testname : NULL));
-  testlog[0] = 0;
-  test_last_issue = test_issue;
-  test_last_sub = test_sub;
-
-  switch (bytes[3]) {
-  case 0xf0: // Starting a test
-    break;
-  case 0xf1: // Skipping a test
-    break;
-  case 0xf2: // Test pass
-    break;
-  case 0xf3: // Test failure (ie test ran, but detected failure of test condition)
-    failcount++;
-    break;
-  case 0xf4: // Error trying to run test
-    failcount++;
-    break;
-  case 0xfd: // Log message
-    break;
-  case 0xfe: // Set name of current test
-    break;
-  case 0xff: // Last test complete
-    log_note("terminating after completion of unit test");
-    if (logPtr) {
-      if (failcount > 0)
-        fprintf(logPtr, "!!!!! FAILCOUNT: %d\n", failcount);
-      else
-        fprintf(logPtr, "===== FAILCOUNT: 0\n");
-      fprintf(logPtr, "<<<<< TEST COMPLETED\n");
-      fclose(logPtr);
-    }
-    do_exit(failcount);
-    break;
-  }
+  memcpy(recent_bytes, recent, 4);
+  int taken = check_for_vf011_requests();
+  memcpy(recent, recent_bytes, 4);
+  if (taken)
+    handle_vf011_requests();
+  return taken;
 }
 
 void enterTestMode()
 {
-  unsigned char receiveString, recent_bytes_fill = 0;
-  int currentMessagePos;
+  ut_parser parser;
   time_t currentTime;
 
   log_note("Entering unit test mode. Waiting for test results.");
-  testname[0] = 0; // initialize test name with empty string
-  testlog[0] = 0;
-  receiveString = 0;
-  failcount = 0;
+  ut_init(&parser, unit_test_logline, NULL);
+  parser.filter = unit_test_vf011_filter;
   logPtr = NULL;
 
   currentTime = time(NULL);
@@ -1658,8 +1680,8 @@ void enterTestMode()
     }
 
     log_note("logging test results in %s", unittest_logfile);
-    fprintf(logPtr, ">>>>> TEST: %s\n===== BITSTREAM: %s\n===== MODELCODE: %02X\n===== MODEL: %s\n===== ROM: %s\n", filename,
-        system_bitstream_version, system_hardware_model, system_hardware_model_name, system_rom_version);
+    ut_log_header(logPtr, filename, system_bitstream_version, system_hardware_model, system_hardware_model_name,
+        system_rom_version);
   }
   log_note("System model: %s", system_hardware_model_name);
   log_note("System CORE version: %s", system_bitstream_version);
@@ -1671,78 +1693,23 @@ void enterTestMode()
       continue;
     int b = serialport_read(fd, inbuf, 8192);
 
-    for (int i = 0; i < b; i++) {
-
-      // message receive mode: fill message buffer until end of string is reached
-      if (receiveString) {
-        msgbuf[currentMessagePos] = inbuf[i];
-
-        // (ugly workaround: use pound sign as string end marker, because zeroes
-        // sometimes get corrupted when using the serial line...)
-        if (msgbuf[currentMessagePos] == 92) {
-          msgbuf[currentMessagePos] = 0;
-          receiveString = 0;
-          // don't check recent_bytes_fill here! msg bytes are not
-          // but into the buffer!
-          if (recent_bytes[3] == 0xfd) { // log message to console
-            strncpy(testlog, msgbuf, 160);
-          }
-          else if (recent_bytes[3] == 0xfe) { // set current test name
-            strncpy(testname, msgbuf, 160);
-          }
-          bzero(recent_bytes, 4);
-          recent_bytes_fill = 0;
-        }
-
-        currentMessagePos++;
-      }
-      else {
-        recent_bytes[0] = recent_bytes[1];
-        recent_bytes[1] = recent_bytes[2];
-        recent_bytes[2] = recent_bytes[3];
-        recent_bytes[3] = inbuf[i];
-        // count if we have 4 bytes in recent_bytes
-        if (recent_bytes_fill < 4)
-          recent_bytes_fill++;
-        // only check for vf011 request if buffer is full!
-        if (recent_bytes_fill > 3)
-          if (check_for_vf011_requests())
-            recent_bytes_fill = 0;
-      }
-      handle_vf011_requests();
-
-      // fprintf(stderr, "recent_bytes_fill: %d\n", recent_bytes_fill);
-      // dump_bytes(0, "bytes", recent_bytes, 4);
-
-      // not receiving a string? handle unit test token if needed
-      if (!receiveString && recent_bytes_fill > 3) {
-        // check if we should receive a string
-        if (recent_bytes[3] == 0xfe || recent_bytes[3] == 0xfd) {
-          // if we are starting to receive a new log line, and already have one, we need to output it
-          if (recent_bytes[3] == 0xfd && testlog[0]) {
-            currentTime = time(NULL);
-            unit_test_logline(test_last_issue, test_last_sub, 0xd, testlog);
-            testlog[0] = 0;
-          }
-          // receive message
-          receiveString = 1;
-          currentMessagePos = 0;
-        }
-        else if (recent_bytes[3] >= 0xf0) {
-          // handle unit test token and update time
-          currentTime = time(NULL);
-          unit_test_log(recent_bytes);
-          recent_bytes_fill = 0;
-        }
+    int result = ut_feed(&parser, inbuf, b);
+    // the timeout runs from the last token
+    if (result & UT_FEED_ACTIVE)
+      currentTime = time(NULL);
+    if (result & UT_FEED_DONE) {
+      log_note("terminating after completion of unit test");
+      if (logPtr) {
+        ut_log_footer(logPtr, parser.failcount, 0);
+        fclose(logPtr);
       }
+      do_exit(parser.failcount);
     }
   }
 
   log_error("timeout encountered while running tests. aborting.");
   if (logPtr) {
-    fprintf(logPtr, "!!!!! TIMEOUT\n");
-    fprintf(logPtr, "!!!!! FAILCOUNT: %d\n", failcount + 1);
-    fprintf(logPtr, "<<<<< TEST COMPLETED\n");
+    ut_log_footer(logPtr, parser.failcount, 1);
     fclose(logPtr);
   }
   do_exit(UT_RES_TIMEOUT);
@@ -639,6 +639,63 @@ int stuff_keybuffer(char *s)
   return 0;
 }
 
+/*
+  Types PETSCII text through the KERNAL keyboard buffer, a buffer-full at a
+  time. Rather than sleeping a fixed time per chunk like stuff_keybuffer(),
+  this polls the buffer count and sends the next chunk as soon as the KERNAL
+  has taken the previous one. Each chunk and its count go out as one monitor
+  write, without stopping the CPU. Returns once the KERNAL has taken
+  everything, or -1 if it stops reading the buffer for timeout_ms (e.g. a
+  program is scanning the keyboard itself). *typed is set to the number of
+  characters placed in the buffer.
+*/
+int type_keybuffer(const unsigned char *s, int len, int timeout_ms, int *typed)
+{
+  int buffer_addr = 0x277;
+  int buffer_len_addr = 0xc6;
+  char cmd[1024];
+  unsigned char pending = 0;
+  int sent = 0;
+
+  if (saw_c65_mode) {
+    buffer_addr = 0x2b0;
+    buffer_len_addr = 0xd0;
+  }
+
+  while (1) {
+    // wait for the KERNAL to empty the buffer
+    unsigned long long start = gettime_ms();
+    fetch_ram(buffer_len_addr, 1, &pending);
+    while (pending) {
+      if (gettime_ms() - start > (unsigned long long)timeout_ms) {
+        if (typed)
+          *typed = sent;
+        return -1;
+      }
+      if (no_rxbuff)
+        do_usleep(1000);
+      fetch_ram(buffer_len_addr, 1, &pending);
+    }
+    if (sent == len)
+      break;
+
+    int n = len - sent;
+    if (n > MAX_KEYBUFFER_CHARS)
+      n = MAX_KEYBUFFER_CHARS;
+    int cmd_len = snprintf(cmd, sizeof(cmd), "s%04x", buffer_addr);
+    for (int i = 0; i < n; i++)
+      cmd_len += snprintf(cmd + cmd_len, sizeof(cmd) - cmd_len, " %02x", s[sent + i]);
+    cmd_len += snprintf(cmd + cmd_len, sizeof(cmd) - cmd_len, "\rs%x %d\r", buffer_len_addr, n);
+    log_debug("type_keybuffer: %s", cmd);
+    slow_write(fd, cmd, cmd_len);
+    sent += n;
+  }
+
+  if (typed)
+    *typed = sent;
+  return 0;
+}
+
 int read_and_print(PORT_TYPE fd)
 {
   char buff[8192];
@@ -1100,6 +1157,248 @@ int fetch_ram_cacheable(unsigned long address, unsigned int count, unsigned char
   return 0;
 }
 
+/*
+  Queued register operations.
+
+  mega65_peek() and mega65_poke() wait for the monitor prompt after every access, so a
+  register sequence costs one serial round trip per access. Instead, the ops can be queued
+  with regop_poke(), regop_peek() and regop_wait(). regop_execute() then sends them as one
+  burst of monitor commands and matches the replies back to the ops in order.
+
+  Nothing queued after a wait op may run before the wait is satisfied, so a burst always
+  ends with a wait op. If the condition doesn't hold yet, only that register is polled
+  again, one round trip per poll.
+*/
+
+#define REGOP_POKE 0
+#define REGOP_PEEK 1
+#define REGOP_WAIT 2
+
+#define REGOP_QUEUE_SIZE 256
+// commands sent without waiting for their replies, so the monitor's receive buffer can't overflow
+#define REGOP_MAX_BURST 16
+// how long a reply may take before the commands are sent again, and how often they are
+#define REGOP_REPLY_TIMEOUT_MS 1000
+#define REGOP_RESENDS 3
+// how long a wait op polls its register before giving up
+#define REGOP_WAIT_TIMEOUT_MS 10000
+
+struct regop {
+  int type;
+  unsigned int addr;
+  unsigned char value; // value to poke, or value to wait for
+  unsigned char mask;
+  unsigned char *result;
+  int pending; // wait op whose condition didn't hold in the last value read
+  char cmd[32];
+};
+
+struct regop regop_queue[REGOP_QUEUE_SIZE];
+int regop_queue_len = 0;
+unsigned long regop_round_trips = 0;
+// set when a full queue had to be executed early and failed, reported by the next regop_execute()
+static int regop_failed = 0;
+
+static struct regop *regop_add(int type, unsigned int addr)
+{
+  if (regop_queue_len == REGOP_QUEUE_SIZE && regop_execute())
+    regop_failed = 1;
+  struct regop *op = &regop_queue[regop_queue_len++];
+  op->type = type;
+  op->addr = addr;
+  op->value = 0;
+  op->mask = 0;
+  op->result = NULL;
+  op->pending = 0;
+  if (type == REGOP_POKE)
+    op->cmd[0] = 0;
+  else
+    snprintf(op->cmd, sizeof(op->cmd), "m%x\r", addr);
+  return op;
+}
+
+void regop_poke(unsigned int addr, unsigned char value)
+{
+  struct regop *op = regop_add(REGOP_POKE, addr);
+  op->value = value;
+  snprintf(op->cmd, sizeof(op->cmd), "s%x %x\r", addr, value);
+}
+
+void regop_peek(unsigned int addr, unsigned char *result)
+{
+  regop_add(REGOP_PEEK, addr)->result = result;
+}
+
+void regop_wait(unsigned int addr, unsigned char mask, unsigned char value, unsigned char *result)
+{
+  struct regop *op = regop_add(REGOP_WAIT, addr);
+  op->mask = mask;
+  op->value = value & mask;
+  op->result = result;
+}
+
+// Reads more monitor output into read_buff (NUL terminated), returns the new fill level,
+// or -1 if the buffer is full or nothing has come by the deadline
+static int regop_read_more(unsigned char *read_buff, int ofs, int size, unsigned long long deadline)
+{
+  if (ofs >= size - 1 || gettime_ms() > deadline)
+    return -1;
+  int b = serialport_read(fd, &read_buff[ofs], size - 1 - ofs);
+  if (b <= 0)
+    return ofs;
+  check_for_vf011_jobs(&read_buff[ofs], b);
+  ofs += b;
+  read_buff[ofs] = 0;
+  return ofs;
+}
+
+/*
+  Consumes the echo, memory dump line (for peeks) and prompt of each of the ops in turn.
+  Returns how many of the ops were answered in full before a reply failed to turn up.
+*/
+static int regop_read_replies(struct regop *ops, int count)
+{
+  unsigned char read_buff[8192];
+  char dump_str[16];
+  int ofs = 0;
+  unsigned long long deadline = gettime_ms() + REGOP_REPLY_TIMEOUT_MS;
+
+  read_buff[0] = 0;
+  for (int i = 0; i < count; i++) {
+    char *p;
+    // the echo of the command skips anything left over from earlier commands
+    while (!(p = strstr((char *)read_buff, ops[i].cmd)))
+      if ((ofs = regop_read_more(read_buff, ofs, sizeof(read_buff), deadline)) < 0)
+        return i;
+    p += strlen(ops[i].cmd);
+
+    if (ops[i].type != REGOP_POKE) {
+      char *found;
+      unsigned char value;
+      snprintf(dump_str, sizeof(dump_str), "\n:%08X:", ops[i].addr);
+      while (!(found = strstr(p, dump_str)) || strlen(found) < 13) {
+        int p_ofs = p - (char *)read_buff;
+        if ((ofs = regop_read_more(read_buff, ofs, sizeof(read_buff), deadline)) < 0)
+          return i;
+        p = (char *)read_buff + p_ofs;
+      }
+      if (parse_byte((unsigned char *)&found[11], &value))
+        log_debug("regop: error parsing %s", found);
+      if (ops[i].result)
+        *ops[i].result = value;
+      ops[i].pending = ops[i].type == REGOP_WAIT && (value & ops[i].mask) != ops[i].value;
+      p = found + 13;
+    }
+
+    while (!strchr(p, '.')) {
+      int p_ofs = p - (char *)read_buff;
+      if ((ofs = regop_read_more(read_buff, ofs, sizeof(read_buff), deadline)) < 0)
+        return i;
+      p = (char *)read_buff + p_ofs;
+    }
+    p = strchr(p, '.') + 1;
+
+    // drop everything consumed so far
+    ofs -= p - (char *)read_buff;
+    memmove(read_buff, p, ofs + 1);
+    deadline = gettime_ms() + REGOP_REPLY_TIMEOUT_MS;
+  }
+  return count;
+}
+
+static void regop_send(struct regop *ops, int count)
+{
+  char cmd[REGOP_MAX_BURST * 32];
+  int len = 0;
+
+  for (int i = 0; i < count; i++)
+    len += sprintf(&cmd[len], "%s", ops[i].cmd);
+  // with an RX buffer, the whole burst can go out in one write
+  if (no_rxbuff)
+    slow_write(fd, cmd, len);
+  else
+    serialport_write(fd, (uint8_t *)cmd, len);
+  regop_round_trips++;
+}
+
+/*
+  Sends ops and reads their replies. Like fetch_ram(), a reply that doesn't come within
+  REGOP_REPLY_TIMEOUT_MS gets the ops from the unanswered one on sent again, once the monitor
+  has been resynchronised, so that a late reply to the first send can't be taken for that to
+  the second. Only peeks and waits are sent again: an unanswered poke may have run already,
+  and a poke to a command register must not happen twice, so that fails instead.
+*/
+static int regop_transact(struct regop *ops, int count)
+{
+  int done = 0;
+
+  for (int resends = 0; done < count; resends++) {
+    if (resends) {
+      for (int i = done; i < count; i++)
+        if (ops[i].type == REGOP_POKE) {
+          log_error("regop: no reply from the monitor to '%.*s'", (int)strcspn(ops[i].cmd, "\r"), ops[i].cmd);
+          return -1;
+        }
+      if (resends > REGOP_RESENDS || monitor_sync()) {
+        log_error("regop: no reply from the monitor to '%.*s'", (int)strcspn(ops[done].cmd, "\r"), ops[done].cmd);
+        return -1;
+      }
+      log_warn("regop: no reply to '%.*s', sending again", (int)strcspn(ops[done].cmd, "\r"), ops[done].cmd);
+    }
+    regop_send(&ops[done], count - done);
+    done += regop_read_replies(&ops[done], count - done);
+  }
+  return 0;
+}
+
+int regop_execute(void)
+{
+  int retVal = regop_failed ? -1 : 0;
+  int cpu_stopped_state = cpu_stopped;
+  int burst_max = no_rxbuff ? 1 : REGOP_MAX_BURST;
+
+  regop_failed = 0;
+  if (!regop_queue_len)
+    return retVal;
+
+  // as in push_ram(), the monitor only keeps up reliably while the CPU is stopped
+  if (!cpu_stopped_state)
+    real_stop_cpu();
+
+  for (int i = 0; i < regop_queue_len && !retVal;) {
+    // a burst runs up to and including the next wait op
+    int n = 0;
+    while (i + n < regop_queue_len && n < burst_max)
+      if (regop_queue[i + n++].type == REGOP_WAIT)
+        break;
+    if (regop_transact(&regop_queue[i], n)) {
+      retVal = -1;
+      break;
+    }
+
+    // poll the register of an unsatisfied wait op on its own until the condition holds
+    struct regop *last = &regop_queue[i + n - 1];
+    unsigned long long give_up = gettime_ms() + REGOP_WAIT_TIMEOUT_MS;
+    while (last->pending) {
+      if (gettime_ms() > give_up) {
+        log_error("regop: $%07X & $%02X did not become $%02X", last->addr, last->mask, last->value);
+        retVal = -1;
+        break;
+      }
+      if (regop_transact(last, 1)) {
+        retVal = -1;
+        break;
+      }
+    }
+    i += n;
+  }
+  regop_queue_len = 0;
+
+  if (!cpu_stopped_state)
+    start_cpu();
+  return retVal;
+}
+
 time_t last_settle_msg_time = 0;
 
 int detect_mode(void)
@@ -1238,6 +1537,9 @@ int detect_mode(void)
 
 int last_read_count = 0;
 
+TRACE_SPAN(span_serial_read, "serial_read");
+TRACE_SPAN(span_serial_write, "serial_write");
+
 #ifdef WINDOWS
 
 unsigned char win_err_use_neutral = 0;
@@ -1400,11 +1702,14 @@ int win_tcp_write(SOCKET sock, uint8_t *buffer, size_t size, const char *func, c
 // Writes bytes to the serial port, returning 0 on success and -1 on failure.
 int do_serial_port_write(WINPORT port, uint8_t *buffer, size_t size, const char *func, const char *file, const int line)
 {
+  int ret = 0;
+  unsigned long long t = trace_begin();
   if (port.type == WINPORT_TYPE_FILE)
-    return win_serial_port_write(port.fdfile, buffer, size, func, file, line);
+    ret = win_serial_port_write(port.fdfile, buffer, size, func, file, line);
   else if (port.type == WINPORT_TYPE_SOCK)
-    return win_tcp_write(port.fdsock, buffer, size, func, file, line);
-  return 0;
+    ret = win_tcp_write(port.fdsock, buffer, size, func, file, line);
+  trace_end(&span_serial_write, t);
+  return ret;
 }
 
 // Reads bytes from the serial port.
@@ -1463,11 +1768,16 @@ SSIZE_T win_tcp_read(SOCKET sock, uint8_t *buffer, size_t size, const char *func
 
 SSIZE_T do_serial_port_read(WINPORT port, uint8_t *buffer, size_t size, const char *func, const char *file, const int line)
 {
+  SSIZE_T count = 0;
+  unsigned long long t = trace_begin();
   if (port.type == WINPORT_TYPE_FILE)
-    return win_serial_port_read(port.fdfile, buffer, size, func, file, line);
+    count = win_serial_port_read(port.fdfile, buffer, size, func, file, line);
   else if (port.type == WINPORT_TYPE_SOCK)
-    return win_tcp_read(port.fdsock, buffer, size, func, file, line);
-  return 0;
+    count = win_tcp_read(port.fdsock, buffer, size, func, file, line);
+  // empty polls would drown out the reads that return data
+  if (count > 0)
+    trace_end(&span_serial_read, t);
+  return count;
 }
 
 void close_serial_port(void)
@@ -1484,13 +1794,17 @@ int do_serial_port_write(int fd, uint8_t *buffer, size_t size, const char *funct
     fprintf(stderr, "%s:%d:%s(): ", file, line, function);
     dump_bytes(0, "serial write (osx)", buffer, size);
   }
-  return write(fd, buffer, size);
+  unsigned long long t = trace_begin();
+  int w = write(fd, buffer, size);
+  trace_end(&span_serial_write, t);
+  return w;
 #else
   size_t offset = 0;
   if (debug_serial) {
     fprintf(stderr, "%s:%d:%s(): ", file, line, function);
     dump_bytes(0, "serial write (linux)", buffer, size);
   }
+  unsigned long long t = trace_begin();
   while (offset < size) {
     int written = write(fd, &buffer[offset], size - offset);
     if (written > 0)
@@ -1500,6 +1814,7 @@ int do_serial_port_write(int fd, uint8_t *buffer, size_t size, const char *funct
       //      printf("Wrote %d bytes\n",written);
     }
   }
+  trace_end(&span_serial_write, t);
 #endif
   return size;
 }
@@ -1507,6 +1822,7 @@ int do_serial_port_write(int fd, uint8_t *buffer, size_t size, const char *funct
 size_t do_serial_port_read(int fd, uint8_t *buffer, size_t size, const char *function, const char *file, const int line)
 {
   int count;
+  unsigned long long t = trace_begin();
 
   if (serial_port_is_tcp) {
 #ifndef __APPLE__
@@ -1517,6 +1833,9 @@ size_t do_serial_port_read(int fd, uint8_t *buffer, size_t size, const char *fun
   }
   else
     count = read(fd, buffer, size);
+  // empty polls would drown out the reads that return data
+  if (count > 0)
+    trace_end(&span_serial_read, t);
   if (last_read_count || count) {
     if (debug_serial) {
       fprintf(stderr, "%s:%d:%s():", file, line, function);
@@ -60,8 +60,7 @@ int traceframe = 0;     // tracks which frame within the backtrace
 int dis_offs = 0;
 int dis_scope = 10;
 
-int softbrkaddr = 0;
-unsigned char softbrkmem[3] = { 0 };
+int hardbrkaddr = -1;
 
 type_command_details command_details[] = { { "?", cmdRawHelp, NULL,
                                                "Shows help information for raw/native monitor commands" },
@@ -84,11 +83,14 @@ type_command_details command_details[] = { { "?", cmdRawHelp, NULL,
       "Step into next instruction. If <count> is specified, perform that many steps" }, // equate to pressing 'enter' in raw
                                                                                         // monitor
   { "n", cmdNext, "[<count>]",
-      "Step over to next instruction (software-based, slow). If <count> is specified, perform that many steps" },
+      "Step over to next instruction (software-based, runs a JSR to its return). If <count> is specified, perform that many "
+      "steps" },
   { "next", cmdHardNext, "[<count>]",
       "Step over to next instruction (hardware-based, fast, xemu-only, for now). If <count> is specified, perform that many "
       "steps" },
   { "finish", cmdFinish, NULL, "Continue running until function returns (ie, step-out-from)" },
+  { "until", cmdUntil, "<addr>",
+      "Continue running until <addr> (or :<line> of the current source file) is reached, via a temporary breakpoint" },
   { "pb", cmdPrintByte, "<addr>", "Prints the byte-value of the given address" },
   { "pw", cmdPrintWord, "<addr>", "Prints the word-value of the given address" },
   { "pd", cmdPrintDWord, "<addr>", "Prints the dword-value of the given address" },
@@ -96,7 +98,10 @@ type_command_details command_details[] = { { "?", cmdRawHelp, NULL,
   { "cls", cmdClearScreen, NULL, "Clears the screen" },
   { "autocls", cmdAutoClearScreen, "0/1", "If set to 1, clears the screen prior to every step/next command" },
   { "break", cmdSetBreakpoint, "<addr>", "Sets the hardware breakpoint to the desired address" },
-  { "sbreak", cmdSetSoftwareBreakpoint, "<addr>", "Sets the software breakpoint to the desired address" },
+  { "sbreak", cmdSetSoftwareBreakpoint, "[<addr>]",
+      "Adds a software breakpoint at the desired address (lists them if no address given)" },
+  { "sbdel", cmdDeleteSoftwareBreakpoint, "<breakpoint#>/all",
+      "Deletes the software breakpoint number specified (use 'sbreak' to get a list of them)" },
   { "wb", cmdWatchByte, "<addr>", "Watches the byte-value of the given address" },
   { "ww", cmdWatchWord, "<addr>", "Watches the word-value of the given address" },
   { "wd", cmdWatchDWord, "<addr>", "Watches the dword-value of the given address" },
@@ -158,9 +163,7 @@ type_offsets *lstModuleOffsets = NULL;
 
 type_watch_entry *lstWatches = NULL;
 
-void clearSoftBreak(void);
 int isCpuStopped(void);
-void setSoftBreakpoint(int addr);
 void step(void);
 
 void add_to_offsets_list(type_offsets mo)
@@ -246,10 +249,14 @@ void add_to_list(type_fileloc fl)
   }
 }
 
+int symmap_generation = 0; // changes with every symbol added (so watches know to resolve their names again)
+
 void add_to_symmap(type_symmap_entry sme)
 {
   type_symmap_entry *iter = lstSymMap;
 
+  symmap_generation++;
+
   // first entry in list?
   if (lstSymMap == NULL) {
     lstSymMap = malloc(sizeof(type_symmap_entry));
@@ -291,12 +298,20 @@ void add_to_symmap(type_symmap_entry sme)
   }
 }
 
+bool watches_changed = true;
+
 void copy_watch(type_watch_entry *dest, type_watch_entry *src)
 {
   dest->type = src->type;
   dest->name = strdup(src->name);
   dest->param1 = src->param1 ? strdup(src->param1) : NULL;
+  dest->addr = -1;
+  dest->len = 0;
+  dest->mem = NULL;
+  dest->prev = NULL;
+  dest->fetched = false;
   dest->next = NULL;
+  watches_changed = true;
 }
 
 void add_to_watchlist(type_watch_entry we)
@@ -402,7 +417,10 @@ void free_watch(type_watch_entry *iter, int wnum)
   free(iter->name);
   if (iter->param1)
     free(iter->param1);
+  free(iter->mem);
+  free(iter->prev);
   free(iter);
+  watches_changed = true;
   if (outputFlag)
     printf("watch#%d deleted!\n", wnum);
 }
@@ -1167,6 +1185,122 @@ void put_mem28array(int addr, unsigned char *data, int size)
   serialRead(inbuf, BUFSIZE);
 }
 
+/*
+  save and load move memory in bursts: a batch of M commands each way in, and
+  'l' uploads each way out, rather than a round trip per 256 or 16 bytes.
+*/
+
+#define MEM_BURST_READS 16  // M commands (256 bytes each) per batch
+#define MEM_UPLOAD_SIZE 4096 // bytes per 'l'
+#define MEM_RETRIES 2        // further tries at a batch or upload that got no complete reply
+
+// Picks the bytes of addr..addr+size-1 out of the ":<addr>:<32 hex digits>"
+// lines of m/M replies (the rest is echoes and prompts), returns how many of them were there
+int parse_mem_lines(char *replies, int addr, unsigned char *buf, int size)
+{
+  char *filled = calloc(size, 1);
+  int count = 0;
+
+  for (char *line = replies; line; line = strchr(line, '\n')) {
+    int lineaddr, val;
+    if (*line == '\n')
+      line++;
+    if (*line != ':' || sscanf(line, ":%X:", &lineaddr) != 1)
+      continue;
+    if (lineaddr + 16 <= addr || lineaddr >= addr + size)
+      continue;
+
+    char *hex = strchr(line + 1, ':');
+    for (int k = 0; hex && k < 16 && sscanf(hex + 1 + k * 2, "%02X", &val) == 1; k++)
+      if (lineaddr + k >= addr && lineaddr + k < addr + size) {
+        buf[lineaddr + k - addr] = val;
+        count += !filled[lineaddr + k - addr];
+        filled[lineaddr + k - addr] = 1;
+      }
+  }
+  free(filled);
+  return count;
+}
+
+// Fills buf with size bytes of 28-bit memory from addr, up to
+// MEM_BURST_READS * 256 at a time. Returns false if not all of them came back.
+bool get_mem_block(int addr, unsigned char *buf, int size)
+{
+  static char batch[MEM_BURST_READS * 16];
+  static char replies[MEM_BURST_READS * 16 * 64];
+  char str[16];
+
+  batch[0] = '\0';
+  int reads = 0;
+  for (int offs = 0; offs < size; offs += 256) {
+    sprintf(str, "M%X\n", addr + offs);
+    strlcat(batch, str, sizeof(batch));
+    reads++;
+  }
+  for (int tries = 0; tries <= MEM_RETRIES; tries++)
+    if (serialWriteBatch(batch, reads, replies, sizeof(replies)) && parse_mem_lines(replies, addr, buf, size) == size)
+      return true;
+  return false;
+}
+
+// Writes size bytes from buf to addr with one 'l' upload, or an 's' command for less than 16,
+// trying again if the monitor doesn't prompt afterwards
+bool put_mem_chunk(int addr, unsigned char *buf, int size)
+{
+  char cmd[64];
+
+  for (int tries = 0; tries <= MEM_RETRIES; tries++) {
+    if (size >= 16) {
+      if (serialUpload(addr, buf, size))
+        return true;
+      continue;
+    }
+    int len = sprintf(cmd, "s%08X", addr);
+    for (int k = 0; k < size; k++)
+      len += sprintf(cmd + len, " %02X", buf[k]);
+    strcpy(cmd + len, "\n");
+    if (serialWriteBatch(cmd, 1, NULL, 0))
+      return true;
+  }
+  return false;
+}
+
+// Writes size bytes from buf to 28-bit memory at addr, with as few 'l' uploads
+// as the 64KB boundaries allow. Returns false if the monitor stopped answering.
+bool put_mem_block(int addr, unsigned char *buf, int size)
+{
+  int i = 0;
+  while (i < size) {
+    int outSize = size - i;
+    if (outSize > MEM_UPLOAD_SIZE)
+      outSize = MEM_UPLOAD_SIZE;
+    // 'l' takes a 16-bit end address
+    int slab = 0xffff - ((addr + i) & 0xffff);
+    if (outSize > slab)
+      outSize = slab;
+
+    if (outSize < 16)
+      outSize = size - i < 16 ? size - i : 16;
+    if (!put_mem_chunk(addr + i, buf + i, outSize))
+      return false;
+    i += outSize;
+  }
+  return true;
+}
+
+// "\r0x%X bytes <what>..." no more than 10 times a second (and at the end)
+void show_progress(const char *what, int done, int total)
+{
+  static unsigned long long last = 0;
+  unsigned long long now = gettime_ms();
+
+  if (done < total && now - last < 100)
+    return;
+  last = now;
+  printf("0x%X bytes %s...\r", done, what);
+  fflush(stdout);
+}
+
 void cmdRawHelp(void)
 {
   serialWrite("?\n");
@@ -2005,79 +2139,349 @@ void cmdMDisassemble(void)
   disassemble(true);
 }
 
-void do_continue(int do_soft_break)
+/*
+  Software breakpoints are a JMP to itself patched over the instruction. The
+  table is only written into memory when the CPU is let go, and taken out
+  again as soon as it stops, a batch of monitor commands each way. So setting
+  one costs nothing by itself, and stepping never runs into a patch.
+*/
+
+#define MAX_SOFT_BREAKS 64
+
+typedef struct {
+  int addr;             // as given: 16-bit CPU address, or 28-bit
+  bool temp;            // dropped once the CPU stops (n/finish/until, 'sc <addr>')
+  bool armed;           // patched into memory
+  bool hw;              // (temp only) could not be patched, so the hardware breakpoint is on it
+  bool verified;        // the CPU has been seen to pick up the patch at phys
+  int phys;             // 28-bit address of the patch
+  unsigned char mem[3]; // what the patch replaced
+} type_softbreak;
+
+type_softbreak softbreaks[MAX_SOFT_BREAKS];
+int softbreak_count = 0;
+
+int add_breakpoint(int addr, bool temp)
 {
-  traceframe = 0;
+  for (int k = 0; k < softbreak_count; k++)
+    if (softbreaks[k].addr == addr) {
+      softbreaks[k].temp &= temp;
+      return k;
+    }
 
-  // get address from parameter?
-  char *token = strtok(NULL, " ");
+  if (softbreak_count == MAX_SOFT_BREAKS) {
+    printf("- Too many software breakpoints (max %d)\n", MAX_SOFT_BREAKS);
+    return -1;
+  }
 
-  // if <addr> field is provided, use it
-  if (token) {
-    int addr = get_sym_value(token);
+  memset(&softbreaks[softbreak_count], 0, sizeof(type_softbreak));
+  softbreaks[softbreak_count].addr = addr;
+  softbreaks[softbreak_count].temp = temp;
+  return softbreak_count++;
+}
 
-    if (do_soft_break) {
-      // set a soft breakpoint (more reliable for now...)
-      // doOneShotAssembly("sei");
-      step(); // step just once, just in-case user wants to repeat the last continue command (e.g., 'c 3aa9')
-      setSoftBreakpoint(addr);
+void delete_breakpoint(int idx)
+{
+  softbreak_count--;
+  for (int k = idx; k < softbreak_count; k++)
+    softbreaks[k] = softbreaks[k + 1];
+}
+
+type_softbreak *find_breakpoint(int pc)
+{
+  for (int k = 0; k < softbreak_count; k++)
+    if ((softbreaks[k].addr & 0xffff) == pc)
+      return &softbreaks[k];
+
+  return NULL;
+}
+
+// Reads the 3 bytes at each of addrs[] with as few m/M commands as their spread allows
+void read_patch_sites(int *addrs, int count, bool useAddr28, unsigned char (*out)[3])
+{
+  int order[MAX_SOFT_BREAKS];
+
+  // sort them
+  for (int k = 0; k < count; k++) {
+    int j = k;
+    for (; j > 0 && addrs[order[j - 1]] > addrs[k]; j--)
+      order[j] = order[j - 1];
+    order[j] = k;
+  }
+
+  for (int k = 0; k < count;) {
+    unsigned char block[256] = { 0 };
+    int base = addrs[order[k]];
+    int last = k;
+    while (last + 1 < count && addrs[order[last + 1]] + 3 <= base + 256)
+      last++;
+
+    if (addrs[order[last]] + 3 <= base + 16) {
+      mem_data mem = get_mem(base, useAddr28);
+      for (int i = 0; i < 16; i++)
+        block[i] = mem.b[i];
     }
     else {
-      // set a hard breakpoint
+      mem_data *multimem = get_mem28array(useAddr28 ? base : 0x7770000 | base);
+      for (int i = 0; i < 256; i++)
+        block[i] = multimem[i / 16].b[i % 16];
+    }
+
+    for (; k <= last; k++)
+      memcpy(out[order[k]], &block[addrs[order[k]] - base], 3);
+  }
+}
+
+bool is_patched(unsigned char *mem, int addr)
+{
+  return mem[0] == 0x4C && mem[1] == (addr & 0xff) && mem[2] == ((addr >> 8) & 0xff);
+}
+
+// Appends the command that puts the 3 bytes at phys to a batch for serialWriteBatch()
+void add_write_to_batch(char *batch, int phys, int b0, int b1, int b2)
+{
+  char str[64];
+  sprintf(str, "s%07X %02X %02X %02X\n", phys, b0, b1, b2);
+  strlcat(batch, str, BUFSIZE * 4);
+}
+
+// Patches all the breakpoints in (CPU stopped). One that the CPU does not
+// then see, as in ROM, is dropped, or for a temporary one, the hardware
+// breakpoint is put there instead.
+void arm_breakpoints(bool in_hv)
+{
+  static char batch[BUFSIZE * 4];
+  int idx[MAX_SOFT_BREAKS], phys[MAX_SOFT_BREAKS], view[MAX_SOFT_BREAKS], check[MAX_SOFT_BREAKS];
+  unsigned char now[MAX_SOFT_BREAKS][3];
+  int count = 0;
+
+  for (int k = 0; k < softbreak_count; k++) {
+    type_softbreak *bp = &softbreaks[k];
+    if (bp->armed || bp->hw)
+      continue;
+    // (user manually enforcing a hypervisor breakpoint? (or any other >64kb for that matter))
+    int where = bp->addr > 0xffff ? bp->addr : in_hv ? bp->addr | 0xfff0000 : bp->addr;
+    if (where != bp->phys)
+      bp->verified = false;
+    bp->phys = where;
+    idx[count] = k;
+    phys[count] = bp->phys;
+    count++;
+  }
+  if (count == 0)
+    return;
+
+  read_patch_sites(phys, count, true, now);
+  batch[0] = '\0';
+  for (int k = 0; k < count; k++) {
+    type_softbreak *bp = &softbreaks[idx[k]];
+    memcpy(bp->mem, now[k], 3);
+    bp->armed = true;
+    add_write_to_batch(batch, bp->phys, 0x4C, bp->addr & 0xff, (bp->addr >> 8) & 0xff);
+  }
+  serialWriteBatch(batch, count, NULL, 0);
+
+  // does the CPU see them?
+  int checks = 0;
+  for (int k = 0; k < count; k++)
+    if (!softbreaks[idx[k]].verified) {
+      int addr = softbreaks[idx[k]].addr;
+      check[checks] = k;
+      view[checks] = addr > 0xffff ? addr : 0x7770000 | addr;
+      checks++;
+    }
+  if (checks == 0)
+    return;
+  read_patch_sites(view, checks, true, now);
+
+  batch[0] = '\0';
+  int undo = 0;
+  for (int c = checks - 1; c >= 0; c--) {
+    int k = check[c];
+    type_softbreak *bp = &softbreaks[idx[k]];
+    if (is_patched(now[c], bp->addr)) {
+      bp->verified = true;
+      continue;
+    }
+
+    add_write_to_batch(batch, bp->phys, bp->mem[0], bp->mem[1], bp->mem[2]);
+    undo++;
+    bp->armed = false;
+    if (bp->temp) {
       char str[100];
-      sprintf(str, "b%04X\n", addr);
+      bp->hw = true;
+      sprintf(str, "b%04X\n", bp->addr & 0xffff);
       serialWrite(str);
       serialRead(inbuf, BUFSIZE);
     }
+    else {
+      printf("- Could not patch software breakpoint at $%04X (ROM?), removed it\n", bp->addr);
+      delete_breakpoint(idx[k]);
+    }
   }
+  if (undo)
+    serialWriteBatch(batch, undo, NULL, 0);
+}
+
+// Takes all the patches out again, then forgets the temporary breakpoints
+// (CPU stopped). Where the program has since rewritten a patch itself, what
+// it wrote is left alone.
+void disarm_breakpoints(void)
+{
+  static char batch[BUFSIZE * 4];
+  int idx[MAX_SOFT_BREAKS], phys[MAX_SOFT_BREAKS];
+  unsigned char now[MAX_SOFT_BREAKS][3];
+  int count = 0;
+
+  for (int k = 0; k < softbreak_count; k++)
+    if (softbreaks[k].armed) {
+      idx[count] = k;
+      phys[count] = softbreaks[k].phys;
+      count++;
+    }
+
+  if (count) {
+    read_patch_sites(phys, count, true, now);
+    batch[0] = '\0';
+    int writes = 0;
+    for (int k = 0; k < count; k++) {
+      type_softbreak *bp = &softbreaks[idx[k]];
+      bp->armed = false;
+      if (is_patched(now[k], bp->addr)) {
+        add_write_to_batch(batch, bp->phys, bp->mem[0], bp->mem[1], bp->mem[2]);
+        writes++;
+      }
+    }
+    if (writes)
+      serialWriteBatch(batch, writes, NULL, 0);
+  }
+
+  for (int k = softbreak_count - 1; k >= 0; k--) {
+    if (softbreaks[k].hw) {
+      // give the user's hardware breakpoint back (b on its own clears it)
+      char str[100];
+      if (hardbrkaddr != -1)
+        sprintf(str, "b%04X\n", hardbrkaddr);
+      else
+        sprintf(str, "b\n");
+      serialWrite(str);
+      serialRead(inbuf, BUFSIZE);
+    }
+    if (softbreaks[k].temp)
+      delete_breakpoint(k);
+  }
+}
+
+bool hw_break_borrowed(void)
+{
+  for (int k = 0; k < softbreak_count; k++)
+    if (softbreaks[k].hw)
+      return true;
+
+  return false;
+}
+
+bool in_patch(int pc)
+{
+  for (int k = 0; k < softbreak_count; k++)
+    if (((pc - softbreaks[k].addr) & 0xffff) < 3)
+      return true;
+
+  return false;
+}
+
+// Lets the stopped CPU go, with the breakpoints in. It is stepped clear of
+// them first, or it would stop again straight away (or run the middle of a
+// JMP patch).
+void resume(reg_data *reg)
+{
+  for (int k = 0; k < 3 && in_patch(reg->pc); k++) {
+    step();
+    *reg = get_regs();
+  }
+
+  arm_breakpoints(reg->maph == 0x3F00);
 
-  // just send an enter command
   serialWrite("t0\n");
   serialRead(inbuf, BUFSIZE);
+}
 
-  // Try keep this in a loop that tests for a breakpoint
-  // getting hit, or the user pressing CTRL-C to force
-  // a "t1" command to turn trace mode back on
+// Waits for the running CPU to stop at a breakpoint (or CTRL-C, or, with
+// stop_if_idle, for its PC to stay put). The monitor reports a hardware
+// breakpoint as soon as it hits; otherwise, poll ever less often.
+reg_data wait_for_break(bool stop_if_idle)
+{
+  reg_data reg;
+  int interval = 1000;
   int cur_pc = -1;
   int same_cnt = 0;
+
   continue_mode = true;
   while (1) {
-    usleep(10000);
+    bool reported = serialWaitForData(interval);
 
-    if (ctrlcflag) {
+    reg = get_regs();
+    if (ctrlcflag || find_breakpoint(reg.pc) || (reg.pc == hardbrkaddr && !hw_break_borrowed()))
       break;
+
+    if (stop_if_idle) {
+      if (reg.pc == cur_pc) {
+        if (++same_cnt == 5)
+          break;
+      }
+      else {
+        same_cnt = 0;
+        cur_pc = reg.pc;
+      }
     }
 
-    // get current register values
-    reg_data reg = get_regs();
+    if (!reported && interval < 256000)
+      interval *= 2;
+  }
+  continue_mode = false;
 
-    if (reg.pc == cur_pc || (softbrkaddr && (reg.pc >= (softbrkaddr & 0xffff) && reg.pc <= ((softbrkaddr + 3) & 0xffff)))) {
-      same_cnt++;
-      // printf("good addr=$%04X : same_cnt=%d (soft=$%04X)\n", reg.pc, same_cnt, softbrkaddr);
-      if (same_cnt == 5) {
-        if (reg.pc >= (softbrkaddr & 0xffff) && reg.pc <= ((softbrkaddr + 3) & 0xffff)) {
-          clearSoftBreak();
-          // doOneShotAssembly("cli");
-        }
-        break;
-      }
+  // a soft breakpoint leaves the CPU running, jumping to itself
+  serialWrite("t1\n");
+  serialRead(inbuf, BUFSIZE);
+  disarm_breakpoints();
+
+  return reg;
+}
+
+void do_continue(int do_soft_break)
+{
+  traceframe = 0;
+
+  // get address from parameter?
+  char *token = strtok(NULL, " ");
+
+  // if <addr> field is provided, use it
+  if (token) {
+    int addr = get_sym_value(token);
+
+    if (do_soft_break) {
+      // a temporary soft breakpoint (more reliable for now...)
+      add_breakpoint(addr, true);
     }
     else {
-      // printf("lost addr=$%04X (soft=$%04X)\n", reg.pc, softbrkaddr);
-      same_cnt = 0;
-      cur_pc = reg.pc;
+      // set a hard breakpoint
+      char str[100];
+      hardbrkaddr = addr;
+      sprintf(str, "b%04X\n", addr);
+      serialWrite(str);
+      serialRead(inbuf, BUFSIZE);
     }
   }
 
-  continue_mode = false;
+  // Run until a breakpoint gets hit, the CPU sits still, or the user
+  // presses CTRL-C (which sends a "t1" to turn trace mode back on)
+  reg_data reg = get_regs();
+  resume(&reg);
+  wait_for_break(true);
+
   if (autocls)
     cmdClearScreen();
 
-  // show the registers
-  // serialWrite("r\n");
-  // serialRead(inbuf, BUFSIZE);
-  // printf("%s", inbuf);
-
   cmdDisassemble();
 }
 
@@ -2166,6 +2570,62 @@ void cmdStep(void)
   }
 }
 
+/*
+  n, finish and until run the CPU to where they are going, rather than stepping
+  it there one instruction (and a couple of round trips) at a time, with a
+  temporary breakpoint from the table.
+*/
+
+// Runs the stopped CPU until it gets to addr with SP at or above min_sp (so
+// that a recursive call passing through addr does not count). Returns false
+// if it stopped anywhere else: a user breakpoint, or CTRL-C.
+bool run_to(int addr, int min_sp)
+{
+  while (1) {
+    reg_data reg = get_regs();
+    if (add_breakpoint(addr, true) == -1)
+      return false;
+    resume(&reg);
+    reg = wait_for_break(false);
+
+    if (ctrlcflag)
+      return false;
+    if (reg.pc != (addr & 0xffff)) {
+      printf("- Stopped at breakpoint $%04X\n", reg.pc);
+      return false;
+    }
+    if (reg.sp >= min_sp)
+      return true;
+
+    // deeper in a recursion, so this is not the return we are waiting for
+  }
+}
+
+bool is_call(int opcode)
+{
+  return (strcmp(instruction_lut[opcode], "JSR") == 0 || strcmp(instruction_lut[opcode], "BSR") == 0)
+         && opcode_mode[mode_lut[opcode]].val == 2;
+}
+
+// Finds where the current routine returns to, from the first word on the
+// stack that points at the end of a JSR/BSR. Gives -1 if there is none, and
+// in *ret_sp what SP will be after the RTS.
+int find_return_address(reg_data *reg, int *ret_sp)
+{
+  mem_data stack = get_mem(reg->sp + 1, false);
+
+  for (int k = 0; k < 15; k++) {
+    int ret = stack.b[k] + (stack.b[k + 1] << 8);
+    mem_data call = get_mem((ret - 2) & 0xffff, false);
+    if (is_call(call.b[0])) {
+      *ret_sp = reg->sp + k + 2;
+      return (ret + 1) & 0xffff;
+    }
+  }
+
+  return -1;
+}
+
 void cmdNext(void)
 {
   traceframe = 0;
@@ -2186,37 +2646,26 @@ void cmdNext(void)
     mem_data mem = get_mem(reg.pc, false);
 
     // if not, then just do a normal step
-    if (strcmp(instruction_lut[mem.b[0]], "JSR") != 0) {
+    if (!is_call(mem.b[0])) {
       step();
     }
     else {
-      // if it is JSR, then keep doing step into until it returns to the next command after the JSR
-
+      // if it is, then run until it returns to the next command after it
       type_opcode_mode mode = opcode_mode[mode_lut[mem.b[0]]];
       int last_bytecount = mode.val + 1;
-      int next_addr = reg.pc + last_bytecount;
-
-      while (reg.pc != next_addr) {
-        // just send an enter command
-        serialWrite("\n");
-        serialRead(inbuf, BUFSIZE);
-
-        reg = get_regs();
+      int next_addr = (reg.pc + last_bytecount) & 0xffff;
 
-        if (ctrlcflag)
-          break;
-      }
-
-      // show disassembly of current position
-      serialWrite("r\n");
-      serialRead(inbuf, BUFSIZE);
+      if (!run_to(next_addr, reg.sp))
+        break;
     } // end if
-  }   // end for
+
+    if (ctrlcflag)
+      break;
+  } // end for
 
   if (outputFlag) {
     if (autocls)
       cmdClearScreen();
-    // printf("%s", inbuf);
     cmdDisassemble();
   }
 }
@@ -2227,24 +2676,57 @@ void cmdFinish(void)
 
   reg_data reg = get_regs();
 
-  int cur_sp = reg.sp;
-  bool function_returning = false;
+  int ret_sp;
+  int ret_addr = find_return_address(&reg, &ret_sp);
 
-  // outputFlag = false;
-  while (!function_returning) {
-    reg = get_regs();
-    mem_data mem = get_mem(reg.pc, false);
+  if (ret_addr != -1)
+    run_to(ret_addr, ret_sp);
+  else {
+    // no idea where it returns to, so step over until it does
+    int cur_sp = reg.sp;
+    bool function_returning = false;
+
+    outputFlag = false;
+    while (!function_returning) {
+      reg = get_regs();
+      mem_data mem = get_mem(reg.pc, false);
+
+      if ((strcmp(instruction_lut[mem.b[0]], "RTS") == 0 || strcmp(instruction_lut[mem.b[0]], "RTI") == 0)
+          && reg.sp == cur_sp)
+        function_returning = true;
 
-    if ((strcmp(instruction_lut[mem.b[0]], "RTS") == 0 || strcmp(instruction_lut[mem.b[0]], "RTI") == 0) && reg.sp == cur_sp)
-      function_returning = true;
+      cmdNext();
 
+      if (ctrlcflag)
+        break;
+    }
+    outputFlag = true;
+  }
+
+  if (autocls)
     cmdClearScreen();
-    cmdNext();
+  cmdDisassemble();
+}
 
-    if (ctrlcflag)
-      break;
+void cmdUntil(void)
+{
+  traceframe = 0;
+
+  char *token = strtok(NULL, " ");
+
+  if (token == NULL) {
+    printf("- Address or :line required\n");
+    return;
   }
-  // outputFlag = true;
+
+  int addr = get_sym_value(token);
+  if (addr == -1)
+    return;
+
+  run_to(addr & 0xffff, 0);
+
+  if (autocls)
+    cmdClearScreen();
   cmdDisassemble();
 }
 
@@ -2437,6 +2919,7 @@ void cmdSetBreakpoint(void)
       return;
 
     printf("- Setting hardware breakpoint to $%04X\n", addr);
+    hardbrkaddr = addr;
 
     sprintf(str, "b%04X\n", addr);
     serialWrite(str);
@@ -2444,94 +2927,51 @@ void cmdSetBreakpoint(void)
   }
 }
 
-bool inHypervisorMode(void)
-{
-  // get current register values
-  reg_data reg = get_regs();
-
-  if (reg.maph == 0x3F00)
-    return true;
-
-  return false;
-}
-
-void clearSoftBreak(void)
-{
-  char str[100];
-
-  // stop the cpu
-  serialWrite("t1\n");
-  usleep(10000);
-  serialRead(inbuf, BUFSIZE);
-
-  bool in_hv = inHypervisorMode();
-  if (in_hv)
-    softbrkaddr |= 0xfff0000;
-
-  // inject JMP command to loop over itself
-  sprintf(str, "s%04X %02X %02X %02X\n", softbrkaddr, softbrkmem[0], softbrkmem[1], softbrkmem[2]);
-  serialWrite(str);
-  serialRead(inbuf, BUFSIZE);
-  softbrkaddr = 0;
-}
-
-void setSoftBreakpoint(int addr)
+void cmdSetSoftwareBreakpoint(void)
 {
-  char str[100];
-
-  softbrkaddr = addr;
-
-  int cpu_stopped = isCpuStopped();
+  char *token = strtok(NULL, " ");
 
-  if (!cpu_stopped) {
-    serialWrite("t1\n");
-    usleep(10000);
-    serialRead(inbuf, BUFSIZE);
+  // if no parameter, then list them
+  if (token == NULL) {
+    for (int k = 0; k < softbreak_count; k++)
+      printf("#%d: $%04X\n", k, softbreaks[k].addr);
+    if (softbreak_count == 0)
+      printf("- No software breakpoints\n");
+    return;
   }
 
-  bool in_hv = inHypervisorMode();
-  if (in_hv)
-    addr |= 0xfff0000;
-
-  // user manually enforcing a hypervisor breakpoint? (or any other >64kb for that matter)
-  if (addr > 0xffff)
-    in_hv = true;
-
-  mem_data mem = get_mem(addr, in_hv);
-  softbrkmem[0] = mem.b[0];
-  softbrkmem[1] = mem.b[1];
-  softbrkmem[2] = mem.b[2];
-
-  // inject JMP command to loop over itself
-  sprintf(str, "s%04X %02X %02X %02X\n", addr, 0x4C, addr & 0xff, (addr >> 8) & 0xff);
-  serialWrite(str);
-  serialRead(inbuf, BUFSIZE);
+  int addr = get_sym_value(token);
 
-  if (!cpu_stopped) {
-    serialWrite("t0\n");
-    usleep(100000);
-    serialRead(inbuf, BUFSIZE);
-  }
+  if (addr == -1)
+    return;
 
-  // sprintf(str, "b%04X\n", addr);
-  // serialWrite(str);
-  // serialRead(inbuf, BUFSIZE);
+  int idx = add_breakpoint(addr, false);
+  if (idx != -1)
+    printf("- Setting software breakpoint #%d to $%04X\n", idx, addr);
 }
 
-void cmdSetSoftwareBreakpoint(void)
+void cmdDeleteSoftwareBreakpoint(void)
 {
   char *token = strtok(NULL, " ");
 
-  if (token != NULL) {
-    int addr = get_sym_value(token);
-
-    if (addr == -1)
-      return;
+  if (token == NULL)
+    return;
 
-    printf("- Setting software breakpoint to $%04X\n", addr);
+  if (strcmp(token, "all") == 0) {
+    softbreak_count = 0;
+    printf("- Deleted all software breakpoints\n");
+    return;
+  }
 
-    setSoftBreakpoint(addr);
+  int idx = -1;
+  sscanf(token, "%d", &idx);
+  if (idx < 0 || idx >= softbreak_count) {
+    printf("- No software breakpoint #%s\n", token);
+    return;
   }
+
+  printf("- Deleted software breakpoint #%d ($%04X)\n", idx, softbreaks[idx].addr);
+  delete_breakpoint(idx);
 }
 
 void cmd_watch(type_watch type)
@@ -2604,6 +3044,199 @@ void cmdWatchMDump(void)
   cmd_watch(TYPE_MDUMP);
 }
 
+/*
+  Showing the watches (as autowatch does before every step) fetches the memory
+  of all of them in one batch, nearby watches sharing the same m/M commands,
+  then prints them from that snapshot. Bytes that changed since the last time
+  are shown in red. What each watch's name resolves to is kept until the
+  symbol map changes.
+*/
+
+#define WATCH_MERGE_GAP 16   // watches closer than this share a fetch
+#define WATCH_STRING_MAX 101 // (print_string() truncates after this many)
+
+typedef struct {
+  int addr;
+  int end;
+} type_mem_range;
+
+int watches_generation = -1; // symmap_generation the watches were resolved at
+
+int watch_length(type_watch_entry *watch)
+{
+  int count = 16; // default count
+
+  switch (watch->type) {
+  case TYPE_BYTE:
+    return 1;
+  case TYPE_WORD:
+    return 2;
+  case TYPE_DWORD:
+    return 4;
+  case TYPE_STRING:
+    return WATCH_STRING_MAX;
+  default:
+    if (watch->param1)
+      sscanf(watch->param1, "%X", &count);
+    // whole lines, as dump() shows
+    return (count + 15) & ~15;
+  }
+}
+
+// Works out the address and length of every watch not already known
+void resolve_watches(void)
+{
+  bool stale = watches_changed || watches_generation != symmap_generation;
+
+  for (type_watch_entry *iter = lstWatches; iter != NULL; iter = iter->next) {
+    // (a ':<line>' name depends on the current file, so is never kept)
+    if (!stale && iter->mem && iter->name[0] != ':')
+      continue;
+
+    int addr = get_sym_value(iter->name);
+    if (iter->type != TYPE_MDUMP)
+      addr = 0x7770000 | (addr & 0xffff); // in cpu context, as get_mem(addr, false) does
+    int len = watch_length(iter);
+
+    if (addr != iter->addr || len != iter->len || !iter->mem) {
+      iter->addr = addr;
+      iter->len = len;
+      free(iter->mem);
+      free(iter->prev);
+      iter->mem = calloc(len + 1, 1);
+      iter->prev = NULL;
+      iter->fetched = false;
+    }
+  }
+
+  watches_generation = symmap_generation;
+  watches_changed = false;
+}
+
+// Fetches the memory of all the watches, in one batch
+void refresh_watches(void)
+{
+  static type_mem_range *ranges = NULL;
+  static int ranges_size = 0;
+  int count = 0;
+  int reads = 0;
+
+  resolve_watches();
+
+  // their ranges, sorted and merged
+  for (type_watch_entry *iter = lstWatches; iter != NULL; iter = iter->next) {
+    if (count == ranges_size) {
+      ranges_size = ranges_size ? ranges_size * 2 : 16;
+      ranges = realloc(ranges, ranges_size * sizeof(type_mem_range));
+    }
+    int k = count++;
+    for (; k > 0 && ranges[k - 1].addr > iter->addr; k--)
+      ranges[k] = ranges[k - 1];
+    ranges[k].addr = iter->addr;
+    ranges[k].end = iter->addr + iter->len;
+  }
+
+  int merged = 0;
+  for (int k = 0; k < count; k++) {
+    if (merged && ranges[k].addr <= ranges[merged - 1].end + WATCH_MERGE_GAP) {
+      if (ranges[k].end > ranges[merged - 1].end)
+        ranges[merged - 1].end = ranges[k].end;
+    }
+    else
+      ranges[merged++] = ranges[k];
+  }
+
+  for (int k = 0; k < merged; k++)
+    for (int addr = ranges[k].addr; addr < ranges[k].end; addr += ranges[k].end - addr > 16 ? 256 : 16)
+      reads++;
+  if (reads == 0)
+    return;
+
+  char *batch = malloc(reads * 16 + 1);
+  int replies_size = reads * 16 * 64 + 1;
+  char *replies = malloc(replies_size);
+  char str[16];
+
+  batch[0] = '\0';
+  for (int k = 0; k < merged; k++)
+    for (int addr = ranges[k].addr; addr < ranges[k].end; addr += ranges[k].end - addr > 16 ? 256 : 16) {
+      sprintf(str, "%c%X\n", ranges[k].end - addr > 16 ? 'M' : 'm', addr);
+      strlcat(batch, str, reads * 16 + 1);
+    }
+  serialWriteBatch(batch, reads, replies, replies_size);
+
+  for (type_watch_entry *iter = lstWatches; iter != NULL; iter = iter->next) {
+    if (iter->fetched) {
+      if (!iter->prev)
+        iter->prev = malloc(iter->len + 1);
+      memcpy(iter->prev, iter->mem, iter->len);
+    }
+    parse_mem_lines(replies, iter->addr, iter->mem, iter->len);
+    iter->fetched = true;
+  }
+
+  free(batch);
+  free(replies);
+}
+
+bool watch_changed(type_watch_entry *watch, int offs, int len)
+{
+  return watch->prev && memcmp(watch->prev + offs, watch->mem + offs, len) != 0;
+}
+
+void print_watch_bytes(type_watch_entry *watch, int offs, int len, bool reversed)
+{
+  for (int k = 0; k < len; k++) {
+    int i = offs + (reversed ? len - 1 - k : k);
+    if (watch_changed(watch, i, 1))
+      printf(KRED "%02X" KNRM, watch->mem[i]);
+    else
+      printf("%02X", watch->mem[i]);
+  }
+}
+
+// Shows a watch from the last refresh_watches()
+void print_watch(type_watch_entry *watch)
+{
+  switch (watch->type) {
+  case TYPE_BYTE:
+  case TYPE_WORD:
+  case TYPE_DWORD:
+    printf(" %s: ", watch->name);
+    print_watch_bytes(watch, 0, watch->len, true);
+    printf("\n");
+    break;
+
+  case TYPE_STRING: {
+    int len = strnlen((char *)watch->mem, WATCH_STRING_MAX);
+    bool changed = watch_changed(watch, 0, len < WATCH_STRING_MAX ? len + 1 : len);
+    printf(" %s: %s%.*s%s%s\n", watch->name, changed ? KRED : "", len, watch->mem, len == WATCH_STRING_MAX ? "..." : "",
+        changed ? KNRM : "");
+    break;
+  }
+
+  case TYPE_DUMP:
+  case TYPE_MDUMP:
+    printf(" %s:\n", watch->name);
+    for (int offs = 0; offs < watch->len; offs += 16) {
+      printf(" :%07X ", watch->addr + offs);
+      for (int k = 0; k < 16; k++) {
+        if (k == 8) // add extra space prior to 8th byte
+          printf(" ");
+        print_watch_bytes(watch, offs + k, 1, false);
+        printf(" ");
+      }
+
+      printf(" | ");
+
+      for (int k = 0; k < 16; k++)
+        print_char(watch->mem[offs + k]);
+      printf("\n");
+    }
+    break;
+  }
+}
+
 void cmdWatches(void)
 {
   type_watch_entry *iter = lstWatches;
@@ -2611,31 +3244,13 @@ void cmdWatches(void)
 
   printf("---------------------------------------\n");
 
+  refresh_watches();
+
   while (iter != NULL) {
     cnt++;
 
     printf("#%d: %s ", cnt, type_names[iter->type]);
-
-    switch (iter->type) {
-    case TYPE_BYTE:
-      print_byte(iter->name);
-      break;
-    case TYPE_WORD:
-      print_word(iter->name);
-      break;
-    case TYPE_DWORD:
-      print_dword(iter->name);
-      break;
-    case TYPE_STRING:
-      print_string(iter->name);
-      break;
-    case TYPE_DUMP:
-      print_dump(iter);
-      break;
-    case TYPE_MDUMP:
-      print_mdump(iter);
-      break;
-    }
+    print_watch(iter);
 
     iter = iter->next;
   }
@@ -2942,34 +3557,37 @@ void cmdSave(void)
   int count;
   sscanf(strCount, "%X", &count);
 
-  int cnt = 0;
   FILE *fsave = fopen(strBinFile, "wb");
-  while (cnt < count) {
-    // get memory at current pc
-    mem_data *multimem = get_mem28array(addr + cnt);
-
-    for (int line = 0; line < 16; line++) {
-      mem_data *mem = &multimem[line];
-
-      for (int k = 0; k < 16; k++) {
-        fputc(mem->b[k], fsave);
-
-        cnt++;
+  if (!fsave) {
+    printf("Error opening the file '%s'!\n", strBinFile);
+    return;
+  }
 
-        if (cnt >= count)
-          break;
-      }
+  unsigned char *buffer = (unsigned char *)malloc(count);
+  if (!buffer) {
+    fclose(fsave);
+    return;
+  }
 
-      printf("0x%X bytes saved...\r", cnt);
-      if (cnt >= count)
-        break;
-    }
+  int cnt = 0;
+  while (cnt < count && !ctrlcflag) {
+    int size = count - cnt;
+    if (size > MEM_BURST_READS * 256)
+      size = MEM_BURST_READS * 256;
 
-    if (ctrlcflag)
+    if (!get_mem_block(addr + cnt, buffer + cnt, size)) {
+      printf("\nError reading memory at $%07X, no reply from the monitor!\n", addr + cnt);
       break;
+    }
+    cnt += size;
+    show_progress("saved", cnt, count);
   }
 
-  printf("\n0x%X bytes saved to \"%s\"\n", cnt, strBinFile);
+  if (fwrite(buffer, 1, cnt, fsave) != (size_t)cnt)
+    printf("\nError writing the file '%s'!\n", strBinFile);
+  else
+    printf("\n0x%X bytes saved to \"%s\"\n", cnt, strBinFile);
+  free(buffer);
   fclose(fsave);
 }
 
@@ -3000,15 +3618,19 @@ void cmdLoad(void)
       fread(buffer, fsize, 1, fload);
 
       int i = 0;
-      while (i < fsize) {
+      while (i < fsize && !ctrlcflag) {
         int outSize = fsize - i;
-        if (outSize > 16) {
-          outSize = 16;
-        }
+        if (outSize > MEM_UPLOAD_SIZE)
+          outSize = MEM_UPLOAD_SIZE;
 
-        put_mem28array(addr + i, (unsigned char *)(buffer + i), outSize);
+        if (!put_mem_block(addr + i, (unsigned char *)(buffer + i), outSize)) {
+          printf("\nError writing memory at $%07X, no reply from the monitor!\n", addr + i);
+          break;
+        }
         i += outSize;
+        show_progress("loaded", i, fsize);
       }
+      printf("\n0x%X bytes loaded from \"%s\"\n", i, strBinFile);
 
       free(buffer);
     }
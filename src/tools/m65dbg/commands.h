@@ -21,6 +21,7 @@ void cmdStep(void);
 void cmdHardNext(void);
 void cmdNext(void);
 void cmdFinish(void);
+void cmdUntil(void);
 void cmdPrintByte(void);
 void cmdPrintWord(void);
 void cmdPrintDWord(void);
@@ -29,6 +30,7 @@ void cmdClearScreen(void);
 void cmdAutoClearScreen(void);
 void cmdSetBreakpoint(void);
 void cmdSetSoftwareBreakpoint(void);
+void cmdDeleteSoftwareBreakpoint(void);
 void cmdWatchByte(void);
 void cmdWatchByte(void);
 void cmdWatchWord(void);
@@ -110,6 +112,11 @@ typedef struct we {
   type_watch type;
   char *name;
   char *param1;
+  int addr;            // what name resolved to (in cpu context, unless an mdump)
+  int len;             // bytes shown
+  unsigned char *mem;  // as of the last refresh
+  unsigned char *prev; // as of the refresh before that (to show what changed)
+  bool fetched;
   struct we *next;
 } type_watch_entry;
 
@@ -1,5 +1,8 @@
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
 #include "m65common.h"
 #include "serial.h"
 
@@ -45,7 +48,7 @@ bool serialRead(char *buf, int bufsize)
     start += bytes_read;
     rest_size -= bytes_read;
 
-    found_dot = ((uint8_t *)buf - start > 2) && start[-2] == '\n' && start[-1] == '.';
+    found_dot = (start - (uint8_t *)buf >= 2) && start[-2] == '\n' && start[-1] == '.';
     if (found_dot) {
       break;
     }
@@ -84,6 +87,98 @@ bool serialRead(char *buf, int bufsize)
   return false;
 }
 
+bool serialWriteBatch(char *commands, int count, char *buf, int bufsize)
+{
+  unsigned char tmp[1024];
+  int prompts = 0;
+  int got = 0;
+  unsigned char last = 0;
+  int timeout_us = TIMEOUT_START_US;
+
+  serialFlush();
+  slow_write(fd, commands, strlen(commands));
+
+  // Xemu needs an extra delay.
+  if (xemu_flag)
+    usleep(10000);
+
+  // one dot prompt per command
+  while (prompts < count) {
+    int bytes_read = serialport_read(fd, tmp, sizeof(tmp));
+    if (bytes_read < 1) {
+      if (timeout_us > TIMEOUT_MAX_US)
+        break;
+      usleep(timeout_us);
+      timeout_us *= 2;
+      continue;
+    }
+    timeout_us = TIMEOUT_START_US;
+
+    for (int k = 0; k < bytes_read; k++) {
+      if (last == '\n' && tmp[k] == '.')
+        prompts++;
+      last = tmp[k];
+    }
+
+    if (buf) {
+      int n = bytes_read < bufsize - 1 - got ? bytes_read : bufsize - 1 - got;
+      memcpy(buf + got, tmp, n);
+      got += n;
+    }
+  }
+
+  if (buf)
+    buf[got] = '\0';
+
+  return prompts == count;
+}
+
+bool serialUpload(int addr, unsigned char *data, int size)
+{
+  char cmd[64];
+  unsigned char tmp[256];
+  unsigned char last = 0;
+
+  serialFlush();
+  sprintf(cmd, "l%x %x\r", addr, (addr + size) & 0xffff);
+  slow_write(fd, cmd, strlen(cmd));
+  if (xemu_flag)
+    usleep(50000);
+
+  while (size > 0) {
+    int w = serialport_write(fd, data, size);
+    if (w > 0) {
+      data += w;
+      size -= w;
+    }
+    else
+      usleep(1000);
+  }
+
+  // the prompt comes once the last byte is in, which can be a while
+  // after the write returns
+  while (serialWaitForData(500000)) {
+    int bytes_read = serialport_read(fd, tmp, sizeof(tmp));
+    for (int k = 0; k < bytes_read; k++) {
+      if (last == '\n' && tmp[k] == '.')
+        return true;
+      last = tmp[k];
+    }
+  }
+
+  return false;
+}
+
+bool serialWaitForData(int timeout_us)
+{
+  fd_set fds;
+  struct timeval tv = { timeout_us / 1000000, timeout_us % 1000000 };
+
+  FD_ZERO(&fds);
+  FD_SET(fd, &fds);
+  return select(fd + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
 void serialBaud(bool fastmode)
 {
   set_serial_speed(fd, fastmode ? 4000000 : 2000000);
@@ -33,6 +33,40 @@ void serialWrite(char *string);
  */
 bool serialRead(char *buf, int bufsize);
 
+/**
+ * @brief Writes several commands in one burst, then reads past all their
+ * prompts.
+ *
+ * @param commands the commands, each ending in a newline
+ * @param count how many commands there are
+ * @param buf where to put everything the monitor sent back, echoes and
+ * prompts included (or NULL)
+ * @param bufsize size of buf
+ * @return true if a prompt came back for every command
+ */
+bool serialWriteBatch(char *commands, int count, char *buf, int bufsize);
+
+/**
+ * @brief Writes a block of memory with one monitor 'l' command.
+ *
+ * The block must not cross a 64KB boundary.
+ *
+ * @param addr 28-bit address to write to
+ * @param data the bytes
+ * @param size how many bytes
+ * @return true if the monitor prompted again afterwards
+ */
+bool serialUpload(int addr, unsigned char *data, int size);
+
+/**
+ * @brief Waits for something to arrive unprompted, such as the register
+ * display the monitor gives when a breakpoint is hit.
+ *
+ * @param timeout_us how long to wait, in microseconds
+ * @return true if there is something to read
+ */
+bool serialWaitForData(int timeout_us);
+
 /**
  * @brief Sets the transmission rate.
  *
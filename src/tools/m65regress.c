@@ -0,0 +1,924 @@
+/*
+  Regression test runner for MEGA65 unit test programmes.
+
+  Runs the tests of src/tests/regression-tests.lst like regression-test.sh
+  does, but natively and on several MEGA65s at once: each device gets a worker
+  process that opens its serial monitor once and keeps it, resetting the
+  machine between tests rather than starting a new m65 for each one. The
+  tests are handed out one at a time to whichever device is free and can run
+  them (going by the PLATFORM column of the list), so that the devices stay
+  busy until the list is done.
+
+  Each test's results are written in the same log format as m65 -u --utlog
+  (one file per test), and all of them together as JUnit XML, followed by a
+  summary of the time each test and each device took.
+
+  The devices must already run the bitstream to be tested (see m65 --bit);
+  -b only checks that they do.
+
+  src/tests/m65regress_test.sh runs it against several copies of
+  src/tests/unittest_monitor_standin.py.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+
+#include <m65common.h>
+#include <logging.h>
+#include <unittest.h>
+
+#define MAX_DEVICES 16
+#define MAX_TESTS 256
+#define DEFAULT_TIMEOUT 60
+
+// the outcome of a test programme
+enum { TEST_PENDING, TEST_RUNNING, TEST_PASSED, TEST_FAILED, TEST_ERROR, TEST_SKIPPED };
+const char *test_status_names[] = { "pending", "running", "passed", "FAILED", "ERROR", "skipped" };
+
+typedef struct {
+  char name[256];
+  int timeout;
+  char platforms[256];
+  int runnable_on; // how many of the devices can run it
+
+  int status;
+  int device;
+  unsigned int failcount;
+  int passes, skips;
+  double setup_ms; // reset and load
+  double run_ms;   // from RUN to the last result
+  char message[UT_MSG_LEN + 64];
+} test_entry;
+
+typedef struct {
+  char port[256];
+  char platform[64];
+  char bitstream[64];
+  char model_name[64];
+  pid_t pid;
+  int to_worker, from_worker;
+  int alive;
+  int busy; // the test it runs, or -1
+  int tests_run;
+  double busy_ms;
+} device;
+
+// sent by a worker once it has the monitor, then for every test
+enum { MSG_HELLO, MSG_RESULT };
+typedef struct {
+  int type;
+  int ok;
+  char platform[64];
+  char bitstream[64];
+  char model_name[64];
+} hello_msg;
+
+typedef struct {
+  int type;
+  int test;
+  int status;
+  unsigned int failcount;
+  int passes, skips;
+  double setup_ms, run_ms;
+  char message[UT_MSG_LEN + 64];
+} result_msg;
+
+test_entry tests[MAX_TESTS];
+int test_count = 0;
+device devices[MAX_DEVICES];
+int device_count = 0;
+
+char *list_file = "regression-tests.lst";
+char *test_dir = NULL;
+char *log_dir = "regression-logs";
+char *junit_file = NULL;
+char *bitstream = NULL;
+int default_timeout = DEFAULT_TIMEOUT;
+int reset_wait_ms = 2000;
+int log_level = LOG_NOTE;
+
+double now_ms(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+void usage(void)
+{
+  fprintf(stderr, "MEGA65 regression test runner\n\n");
+  fprintf(stderr, "Usage: m65regress [-h] [-0 <log level>] -l <device>[,<platform>] [-l ...] [-s <serial speed>]\n"
+                  "                  [-L <test list>] [-d <test dir>] [-o <log dir>] [-j <junit file>]\n"
+                  "                  [-b <bitstream>] [-T <default timeout>] [-R <reset wait>]\n");
+  fprintf(stderr, "  -h - display this help.\n");
+  fprintf(stderr, "  -0 - set log level (0 = quiet ... 5 = everything).\n");
+  fprintf(stderr, "  -l - serial port of a MEGA65 to run tests on, as for m65 -l (up to %d of them). Its platform,\n"
+                  "       as in the test list, is worked out from its hardware model unless given.\n",
+      MAX_DEVICES);
+  fprintf(stderr, "  -s - serial port speed (default 2000000).\n");
+  fprintf(stderr, "  -L - the list of tests (default regression-tests.lst).\n");
+  fprintf(stderr, "  -d - the directory the test programmes are in (default that of the list).\n");
+  fprintf(stderr, "  -o - directory for the test logs (default regression-logs). The workers log there as well.\n");
+  fprintf(stderr, "  -j - JUnit XML results file (default junit.xml in the log directory).\n");
+  fprintf(stderr, "  -b - check that the devices run this bitstream (by the date and hash in its name).\n");
+  fprintf(stderr, "  -T - timeout in seconds for tests whose list entry gives none (default %d).\n", DEFAULT_TIMEOUT);
+  fprintf(stderr, "  -R - milliseconds to give a MEGA65 to come back up after it is reset (default 2000).\n");
+  fprintf(stderr, "\n");
+  exit(-3);
+}
+
+/*
+  Test list
+*/
+
+// TESTNAME TIMEOUT PLATFORM, as regression-test.sh reads it
+int read_test_list(char *name)
+{
+  char line[1024];
+
+  FILE *f = fopen(name, "r");
+  if (!f) {
+    log_crit("could not open test list '%s': %s", name, strerror(errno));
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), f)) {
+    char test[256], timeout[64], platforms[256];
+    int n = sscanf(line, "%255s %63s %255s", test, timeout, platforms);
+    if (n < 1 || test[0] == '#')
+      continue;
+    if (test_count == MAX_TESTS) {
+      log_error("more than %d tests in '%s', ignoring the rest", MAX_TESTS, name);
+      break;
+    }
+    test_entry *t = &tests[test_count++];
+    memset(t, 0, sizeof(*t));
+    strcpy(t->name, test);
+    t->timeout = default_timeout;
+    if (n >= 2 && strspn(timeout, "0123456789") == strlen(timeout))
+      t->timeout = atoi(timeout);
+    strcpy(t->platforms, n >= 3 ? platforms : "all");
+    t->device = -1;
+  }
+  fclose(f);
+
+  log_info("%d tests in '%s'", test_count, name);
+  return 0;
+}
+
+int platform_matches(test_entry *t, const char *platform)
+{
+  char list[256], *p;
+
+  strcpy(list, t->platforms);
+  for (p = strtok(list, ","); p; p = strtok(NULL, ","))
+    if (!strcmp(p, "all") || !strcasecmp(p, platform))
+      return 1;
+  return 0;
+}
+
+// the platform names used in bitstream names, and so in the test list
+const char *model_platform(unsigned char model)
+{
+  switch (model) {
+  case 1:
+    return "mega65r1";
+  case 2:
+    return "mega65r2";
+  case 3:
+    return "mega65r3";
+  case 33:
+    return "megaphoner1";
+  case 64:
+    return "nexys4";
+  case 65:
+    return "nexys4ddr";
+  case 66:
+    return "nexys4ddr-widget";
+  case 253:
+    return "wukong";
+  default:
+    return "unknown";
+  }
+}
+
+/*
+  Worker: runs the tests it is given on one device
+*/
+
+typedef struct {
+  FILE *log;
+  result_msg *result;
+} worker_test;
+
+void worker_event(ut_parser *p, unsigned short issue, unsigned char sub, unsigned char state, const char *msg)
+{
+  worker_test *wt = (worker_test *)p->ctx;
+  char line[255];
+
+  ut_format_line(line, sizeof(line), issue, sub, state, msg);
+  log_info("%s", line);
+  if (wt->log) {
+    fprintf(wt->log, "%s\n", line);
+    fflush(wt->log);
+  }
+
+  switch (state) {
+  case UT_PASS:
+    wt->result->passes++;
+    break;
+  case UT_SKIP:
+    wt->result->skips++;
+    break;
+  case UT_FAIL:
+  case UT_ERROR:
+    // the first one is what the JUnit failure says
+    if (!wt->result->message[0])
+      snprintf(wt->result->message, sizeof(wt->result->message), "%s in Issue#%04d, Test #%03d%s%s",
+          state == UT_FAIL ? "failure" : "error", issue, sub, msg ? " - " : "", msg ? msg : "");
+    break;
+  }
+}
+
+// reset, load into C64 mode and RUN, as m65 --c64mode --run would
+int worker_start_test(test_entry *t, const char *path)
+{
+  unsigned char buf[65536];
+  int retVal = 0;
+
+  do {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+      log_error("could not open '%s': %s", path, strerror(errno));
+      retVal = -1;
+      break;
+    }
+    int len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    if (len < 3) {
+      log_error("'%s' is not a programme", path);
+      retVal = -1;
+      break;
+    }
+
+    log_note("resetting MEGA65");
+    start_cpu();
+    slow_write(fd, "\r!\r", 3);
+    monitor_sync();
+    do_usleep(reset_wait_ms * 1000);
+
+    detect_mode();
+    if (!saw_c64_mode) {
+      if (switch_to_c64mode()) {
+        log_error("could not switch to C64 mode");
+        retVal = -1;
+        break;
+      }
+      // the systems needs a bit to switch over
+      do_usleep(200000);
+    }
+
+    // (C64 BASIC programmes all start at $0801)
+    int load_addr = 0x0801;
+    log_note("loading '%s'", path);
+    real_stop_cpu();
+    push_ram(load_addr, len - 2, buf + 2);
+    unsigned char end_addr[2] = { (load_addr + len - 2) & 0xff, (load_addr + len - 2) >> 8 };
+    push_ram(0x2d, 2, end_addr);
+    start_cpu();
+    monitor_sync();
+
+    stuff_keybuffer("RUN:\r");
+  } while (0);
+
+  return retVal;
+}
+
+void worker_run_test(int index, result_msg *result)
+{
+  test_entry *t = &tests[index];
+  char path[1024], log_name[1024], base[256];
+  unsigned char inbuf[8192];
+  worker_test wt = { NULL, result };
+  ut_parser parser;
+
+  memset(result, 0, sizeof(*result));
+  result->type = MSG_RESULT;
+  result->test = index;
+
+  snprintf(path, sizeof(path), "%s/%s", test_dir, t->name);
+  snprintf(base, sizeof(base), "%s", t->name);
+  char *dot = strrchr(base, '.');
+  if (dot && !strcasecmp(dot, ".prg"))
+    *dot = 0;
+  snprintf(log_name, sizeof(log_name), "%s/%s.log", log_dir, base);
+
+  wt.log = fopen(log_name, "w");
+  if (!wt.log)
+    log_warn("could not create '%s': %s", log_name, strerror(errno));
+
+  double start = now_ms();
+  if (worker_start_test(t, path)) {
+    result->status = TEST_ERROR;
+    snprintf(result->message, sizeof(result->message), "could not load and run '%.180s'", path);
+    if (wt.log)
+      fclose(wt.log);
+    return;
+  }
+  double running = now_ms();
+  result->setup_ms = running - start;
+
+  if (wt.log)
+    ut_log_header(wt.log, t->name, system_bitstream_version, system_hardware_model, system_hardware_model_name,
+        system_rom_version);
+
+  ut_init(&parser, worker_event, &wt);
+  time_t last_token = time(NULL);
+  int done = 0;
+  while (!done && time(NULL) - last_token < t->timeout) {
+    if (!wait_for_serial(WAIT_READ, 1, 0))
+      continue;
+    int b = serialport_read(fd, inbuf, sizeof(inbuf));
+    if (b <= 0)
+      continue;
+    int feed = ut_feed(&parser, inbuf, b);
+    // the timeout runs from the last token, as with m65 -u
+    if (feed & UT_FEED_ACTIVE)
+      last_token = time(NULL);
+    done = feed & UT_FEED_DONE;
+  }
+  result->run_ms = now_ms() - running;
+  result->failcount = parser.failcount;
+
+  if (!done) {
+    result->status = TEST_ERROR;
+    snprintf(result->message, sizeof(result->message), "timeout, no result for %d seconds", t->timeout);
+  }
+  else if (parser.failcount)
+    result->status = TEST_FAILED;
+  else
+    result->status = TEST_PASSED;
+
+  if (wt.log) {
+    ut_log_footer(wt.log, parser.failcount, !done);
+    fclose(wt.log);
+  }
+}
+
+void worker(int index, int from_parent, int to_parent)
+{
+  device *d = &devices[index];
+  char log_name[1024];
+  hello_msg hello;
+
+  snprintf(log_name, sizeof(log_name), "%s/device%d.log", log_dir, index);
+  FILE *log = fopen(log_name, "w");
+  if (log) {
+    setvbuf(log, NULL, _IOLBF, 0);
+    log_setup(log, log_level < LOG_INFO ? LOG_INFO : log_level);
+    // (some of m65common's messages are printed)
+    fflush(stdout);
+    dup2(fileno(log), 1);
+  }
+  log_note("worker for %s", d->port);
+
+  memset(&hello, 0, sizeof(hello));
+  hello.type = MSG_HELLO;
+  if (!open_the_serial_port(d->port)) {
+    rxbuff_detect();
+    monitor_sync();
+    if (get_system_bitstream_version())
+      log_warn("could not read the bitstream version");
+    get_system_rom_version();
+    snprintf(hello.platform, sizeof(hello.platform), "%s",
+        d->platform[0] ? d->platform : model_platform(system_hardware_model));
+    snprintf(hello.bitstream, sizeof(hello.bitstream), "%s", system_bitstream_version);
+    snprintf(hello.model_name, sizeof(hello.model_name), "%s", system_hardware_model_name);
+    hello.ok = 1;
+    log_note("%s (%s, platform %s), bitstream %s, ROM %s", d->port, hello.model_name, hello.platform, hello.bitstream,
+        system_rom_version);
+  }
+  if (write(to_parent, &hello, sizeof(hello)) != sizeof(hello) || !hello.ok)
+    exit(1);
+
+  int test;
+  while (read(from_parent, &test, sizeof(test)) == sizeof(test) && test >= 0) {
+    result_msg result;
+    log_note("running %s", tests[test].name);
+    worker_run_test(test, &result);
+    log_note("%s %s after %.0fms", tests[test].name, test_status_names[result.status], result.setup_ms + result.run_ms);
+    if (write(to_parent, &result, sizeof(result)) != sizeof(result))
+      exit(1);
+  }
+
+  close_communication_port();
+  exit(0);
+}
+
+/*
+  Scheduler
+*/
+
+int start_worker(int index)
+{
+  device *d = &devices[index];
+  int down[2], up[2];
+
+  if (pipe(down) || pipe(up)) {
+    log_crit("could not create pipes: %s", strerror(errno));
+    return -1;
+  }
+  fflush(NULL);
+  d->pid = fork();
+  if (d->pid < 0) {
+    log_crit("could not start a worker: %s", strerror(errno));
+    return -1;
+  }
+  if (!d->pid) {
+    close(down[1]);
+    close(up[0]);
+    for (int i = 0; i < index; i++) {
+      close(devices[i].to_worker);
+      close(devices[i].from_worker);
+    }
+    worker(index, down[0], up[1]);
+  }
+  close(down[0]);
+  close(up[1]);
+  d->to_worker = down[1];
+  d->from_worker = up[0];
+  d->busy = -1;
+  return 0;
+}
+
+// a whole message, or 0 if the worker went away
+int read_msg(int fd, void *msg, int size)
+{
+  int got = 0;
+
+  while (got < size) {
+    int r = read(fd, (char *)msg + got, size - got);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return 0;
+    got += r;
+  }
+  return 1;
+}
+
+void device_lost(device *d)
+{
+  if (d->busy >= 0) {
+    test_entry *t = &tests[d->busy];
+    t->status = TEST_ERROR;
+    snprintf(t->message, sizeof(t->message), "lost the device while running the test");
+    d->busy = -1;
+  }
+  d->alive = 0;
+  close(d->to_worker);
+  close(d->from_worker);
+  log_error("lost %s", d->port);
+}
+
+/*
+  Gives d the next test it can run, returns 0 if there is none. The tests
+  that the fewest devices can run go first, so that a device that can run
+  more than the others does not use up its time on what they could have
+  done instead.
+*/
+int dispatch(int index)
+{
+  device *d = &devices[index];
+  int next = -1;
+
+  for (int i = 0; i < test_count; i++) {
+    test_entry *t = &tests[i];
+    if (t->status != TEST_PENDING || !platform_matches(t, d->platform))
+      continue;
+    if (next < 0 || t->runnable_on < tests[next].runnable_on)
+      next = i;
+  }
+  if (next < 0)
+    return 0;
+
+  test_entry *t = &tests[next];
+  t->status = TEST_RUNNING;
+  t->device = index;
+  d->busy = next;
+  log_note("%-24s -> %s", t->name, d->port);
+  if (write(d->to_worker, &next, sizeof(next)) != sizeof(next))
+    device_lost(d);
+  return 1;
+}
+
+// the date and hash of a bitstream version (branch,date,hash) must be in the bitstream's name
+int bitstream_matches(const char *version)
+{
+  char copy[64], *date, *hash;
+
+  snprintf(copy, sizeof(copy), "%s", version);
+  date = strchr(copy, ',');
+  if (!date)
+    return 0;
+  date++;
+  hash = strchr(date, ',');
+  if (!hash)
+    return 0;
+  *hash++ = 0;
+  return strstr(bitstream, date) && strstr(bitstream, hash);
+}
+
+int run_tests(void)
+{
+  int alive = 0;
+
+  for (int i = 0; i < device_count; i++)
+    if (start_worker(i))
+      return -1;
+
+  for (int i = 0; i < device_count; i++) {
+    device *d = &devices[i];
+    hello_msg hello;
+    if (!read_msg(d->from_worker, &hello, sizeof(hello)) || !hello.ok) {
+      log_error("could not talk to the MEGA65 at %s (see %s/device%d.log)", d->port, log_dir, i);
+      close(d->to_worker);
+      close(d->from_worker);
+      continue;
+    }
+    strcpy(d->platform, hello.platform);
+    strcpy(d->bitstream, hello.bitstream);
+    strcpy(d->model_name, hello.model_name);
+    if (bitstream && !bitstream_matches(d->bitstream)) {
+      log_error("%s runs bitstream %s, not %s", d->port, d->bitstream, bitstream);
+      close(d->to_worker);
+      close(d->from_worker);
+      continue;
+    }
+    log_note("%s: %s, platform %s, bitstream %s", d->port, d->model_name, d->platform, d->bitstream);
+    d->alive = 1;
+    alive++;
+  }
+  if (!alive) {
+    log_crit("no MEGA65 to run the tests on");
+    return -1;
+  }
+
+  // what none of them can run is skipped
+  for (int i = 0; i < test_count; i++) {
+    test_entry *t = &tests[i];
+    for (int j = 0; j < device_count; j++)
+      if (devices[j].alive && platform_matches(t, devices[j].platform))
+        t->runnable_on++;
+    if (!t->runnable_on) {
+      t->status = TEST_SKIPPED;
+      strcpy(t->message, "no device for platform ");
+      strncat(t->message, t->platforms, sizeof(t->message) - strlen(t->message) - 1);
+      log_note("skipping %s (%s)", t->name, t->message);
+    }
+  }
+
+  for (int i = 0; i < device_count; i++)
+    if (devices[i].alive)
+      dispatch(i);
+
+  while (1) {
+    fd_set readable;
+    int max_fd = -1;
+
+    FD_ZERO(&readable);
+    for (int i = 0; i < device_count; i++)
+      if (devices[i].alive && devices[i].busy >= 0) {
+        FD_SET(devices[i].from_worker, &readable);
+        if (devices[i].from_worker > max_fd)
+          max_fd = devices[i].from_worker;
+      }
+    if (max_fd < 0)
+      break;
+
+    if (select(max_fd + 1, &readable, NULL, NULL, NULL) < 0) {
+      if (errno == EINTR)
+        continue;
+      log_crit("select failed: %s", strerror(errno));
+      return -1;
+    }
+
+    for (int i = 0; i < device_count; i++) {
+      device *d = &devices[i];
+      if (!d->alive || d->busy < 0 || !FD_ISSET(d->from_worker, &readable))
+        continue;
+
+      result_msg result;
+      if (!read_msg(d->from_worker, &result, sizeof(result)) || result.test != d->busy) {
+        device_lost(d);
+        continue;
+      }
+      test_entry *t = &tests[result.test];
+      t->status = result.status;
+      t->failcount = result.failcount;
+      t->passes = result.passes;
+      t->skips = result.skips;
+      t->setup_ms = result.setup_ms;
+      t->run_ms = result.run_ms;
+      strcpy(t->message, result.message);
+      d->tests_run++;
+      d->busy_ms += t->setup_ms + t->run_ms;
+      d->busy = -1;
+      log_note("%-24s %-7s %7.1fs on %s", t->name, test_status_names[t->status], (t->setup_ms + t->run_ms) / 1000,
+          d->port);
+
+      dispatch(i);
+    }
+  }
+
+  // the devices that were lost leave their tests pending
+  for (int i = 0; i < test_count; i++)
+    if (tests[i].status == TEST_PENDING) {
+      tests[i].status = TEST_ERROR;
+      snprintf(tests[i].message, sizeof(tests[i].message), "no device left to run it on");
+    }
+
+  for (int i = 0; i < device_count; i++) {
+    device *d = &devices[i];
+    if (d->alive) {
+      int quit = -1;
+      write(d->to_worker, &quit, sizeof(quit));
+      close(d->to_worker);
+      close(d->from_worker);
+    }
+    if (d->pid > 0)
+      waitpid(d->pid, NULL, 0);
+  }
+  return 0;
+}
+
+/*
+  Results
+*/
+
+void xml_escaped(FILE *f, const char *s)
+{
+  for (; *s; s++) {
+    switch (*s) {
+    case '<':
+      fputs("&lt;", f);
+      break;
+    case '>':
+      fputs("&gt;", f);
+      break;
+    case '&':
+      fputs("&amp;", f);
+      break;
+    case '"':
+      fputs("&quot;", f);
+      break;
+    default:
+      // (control characters are not allowed in XML 1.0)
+      if ((unsigned char)*s >= ' ' || *s == '\n' || *s == '\t')
+        fputc(*s, f);
+    }
+  }
+}
+
+int write_junit(const char *name, double elapsed_ms)
+{
+  int failures = 0, errors = 0, skipped = 0;
+  char stamp[32];
+  time_t now = time(NULL);
+
+  FILE *f = fopen(name, "w");
+  if (!f) {
+    log_error("could not create '%s': %s", name, strerror(errno));
+    return -1;
+  }
+
+  for (int i = 0; i < test_count; i++) {
+    failures += tests[i].status == TEST_FAILED;
+    errors += tests[i].status == TEST_ERROR;
+    skipped += tests[i].status == TEST_SKIPPED;
+  }
+  strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", gmtime(&now));
+
+  fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+  fprintf(f, "<testsuites tests=\"%d\" failures=\"%d\" errors=\"%d\" skipped=\"%d\" time=\"%.3f\">\n", test_count, failures,
+      errors, skipped, elapsed_ms / 1000);
+  fprintf(f, "  <testsuite name=\"");
+  xml_escaped(f, list_file);
+  fprintf(f, "\" tests=\"%d\" failures=\"%d\" errors=\"%d\" skipped=\"%d\" time=\"%.3f\" timestamp=\"%s\">\n", test_count,
+      failures, errors, skipped, elapsed_ms / 1000, stamp);
+
+  fprintf(f, "    <properties>\n");
+  if (bitstream) {
+    fprintf(f, "      <property name=\"bitstream\" value=\"");
+    xml_escaped(f, bitstream);
+    fprintf(f, "\"/>\n");
+  }
+  for (int i = 0; i < device_count; i++) {
+    fprintf(f, "      <property name=\"device%d\" value=\"", i);
+    xml_escaped(f, devices[i].port);
+    fprintf(f, " ");
+    xml_escaped(f, devices[i].platform);
+    fprintf(f, " ");
+    xml_escaped(f, devices[i].bitstream);
+    fprintf(f, "\"/>\n");
+  }
+  fprintf(f, "    </properties>\n");
+
+  for (int i = 0; i < test_count; i++) {
+    test_entry *t = &tests[i];
+    device *d = t->device >= 0 ? &devices[t->device] : NULL;
+
+    fprintf(f, "    <testcase name=\"");
+    xml_escaped(f, t->name);
+    fprintf(f, "\" classname=\"regression.");
+    xml_escaped(f, d ? d->platform : "none");
+    fprintf(f, "\" time=\"%.3f\">\n", (t->setup_ms + t->run_ms) / 1000);
+
+    switch (t->status) {
+    case TEST_FAILED:
+      fprintf(f, "      <failure type=\"fail\" message=\"%d failures: ", t->failcount);
+      xml_escaped(f, t->message);
+      fprintf(f, "\"/>\n");
+      break;
+    case TEST_ERROR:
+      fprintf(f, "      <error type=\"%s\" message=\"", strncmp(t->message, "timeout", 7) ? "error" : "timeout");
+      xml_escaped(f, t->message);
+      fprintf(f, "\"/>\n");
+      break;
+    case TEST_SKIPPED:
+      fprintf(f, "      <skipped message=\"");
+      xml_escaped(f, t->message);
+      fprintf(f, "\"/>\n");
+      break;
+    }
+
+    if (d) {
+      char log_name[1024], base[256], line[1024];
+      snprintf(base, sizeof(base), "%s", t->name);
+      char *dot = strrchr(base, '.');
+      if (dot && !strcasecmp(dot, ".prg"))
+        *dot = 0;
+      snprintf(log_name, sizeof(log_name), "%s/%s.log", log_dir, base);
+      FILE *log = fopen(log_name, "r");
+      fprintf(f, "      <system-out>device ");
+      xml_escaped(f, d->port);
+      fprintf(f, ", %.3fs reset and load, %.3fs run\n", t->setup_ms / 1000, t->run_ms / 1000);
+      while (log && fgets(line, sizeof(line), log))
+        xml_escaped(f, line);
+      fprintf(f, "</system-out>\n");
+      if (log)
+        fclose(log);
+    }
+    fprintf(f, "    </testcase>\n");
+  }
+
+  fprintf(f, "  </testsuite>\n</testsuites>\n");
+  fclose(f);
+  return 0;
+}
+
+int print_summary(double elapsed_ms)
+{
+  int bad = 0, counts[TEST_SKIPPED + 1] = { 0 };
+  double total_ms = 0;
+
+  printf("\n%-24s %-7s %-20s %9s %9s %9s\n", "test", "result", "device", "setup", "run", "total");
+  for (int i = 0; i < test_count; i++) {
+    test_entry *t = &tests[i];
+    counts[t->status]++;
+    total_ms += t->setup_ms + t->run_ms;
+    if (t->status == TEST_FAILED || t->status == TEST_ERROR)
+      bad++;
+    printf("%-24s %-7s %-20s %8.1fs %8.1fs %8.1fs", t->name, test_status_names[t->status],
+        t->device >= 0 ? devices[t->device].port : "-", t->setup_ms / 1000, t->run_ms / 1000,
+        (t->setup_ms + t->run_ms) / 1000);
+    if (t->message[0])
+      printf("  %s", t->message);
+    printf("\n");
+  }
+
+  printf("\n%-24s %-16s %6s %9s %6s\n", "device", "platform", "tests", "busy", "used");
+  for (int i = 0; i < device_count; i++) {
+    device *d = &devices[i];
+    printf("%-24s %-16s %6d %8.1fs %5.0f%%\n", d->port, d->platform[0] ? d->platform : "-", d->tests_run, d->busy_ms / 1000,
+        elapsed_ms > 0 ? d->busy_ms * 100 / elapsed_ms : 0);
+  }
+
+  printf("\n%d tests: %d passed, %d failed, %d errors, %d skipped\n", test_count, counts[TEST_PASSED], counts[TEST_FAILED],
+      counts[TEST_ERROR], counts[TEST_SKIPPED]);
+  printf("%.1fs of tests in %.1fs on %d device%s\n", total_ms / 1000, elapsed_ms / 1000, device_count,
+      device_count == 1 ? "" : "s");
+  return bad;
+}
+
+int main(int argc, char **argv)
+{
+  char junit_default[1024];
+
+  log_setup(stderr, LOG_NOTE);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "0:l:s:L:d:o:j:b:T:R:h")) != -1) {
+    switch (opt) {
+    case '0':
+    {
+      int level = log_parse_level(optarg);
+      if (level == -1)
+        log_warn("failed to parse log level!");
+      else {
+        log_level = level;
+        log_setup(stderr, level);
+      }
+      break;
+    }
+    case 'l':
+    {
+      if (device_count == MAX_DEVICES)
+        usage();
+      device *d = &devices[device_count++];
+      memset(d, 0, sizeof(*d));
+      snprintf(d->port, sizeof(d->port), "%s", optarg);
+      char *comma = strchr(d->port, ',');
+      if (comma) {
+        *comma = 0;
+        snprintf(d->platform, sizeof(d->platform), "%s", comma + 1);
+      }
+      break;
+    }
+    case 's':
+      serial_speed = atoi(optarg);
+      break;
+    case 'L':
+      list_file = optarg;
+      break;
+    case 'd':
+      test_dir = optarg;
+      break;
+    case 'o':
+      log_dir = optarg;
+      break;
+    case 'j':
+      junit_file = optarg;
+      break;
+    case 'b':
+      bitstream = optarg;
+      break;
+    case 'T':
+      default_timeout = atoi(optarg);
+      break;
+    case 'R':
+      reset_wait_ms = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (!device_count || optind != argc)
+    usage();
+
+  if (!test_dir) {
+    test_dir = strdup(list_file);
+    char *slash = strrchr(test_dir, '/');
+    if (slash)
+      *slash = 0;
+    else
+      strcpy(test_dir, ".");
+  }
+  if (!junit_file) {
+    snprintf(junit_default, sizeof(junit_default), "%s/junit.xml", log_dir);
+    junit_file = junit_default;
+  }
+
+  if (read_test_list(list_file))
+    exit(-1);
+  mkdir(log_dir, 0755);
+  struct stat st;
+  if (stat(log_dir, &st) || !S_ISDIR(st.st_mode)) {
+    log_crit("could not create log directory '%s'", log_dir);
+    exit(-1);
+  }
+  // a worker that went away shows up as a failed read, not a signal
+  signal(SIGPIPE, SIG_IGN);
+
+  double start = now_ms();
+  if (run_tests())
+    exit(-1);
+  double elapsed = now_ms() - start;
+
+  write_junit(junit_file, elapsed);
+  int bad = print_summary(elapsed);
+  printf("JUnit results in %s\n", junit_file);
+
+  exit(bad > 125 ? 125 : bad);
+}
@@ -48,6 +48,7 @@
 #include "etherload/ethlet_all_done_basic2_map.h"
 #include "filehost.h"
 #include "diskman.h"
+#include "file_pipeline.h"
 #include "dirtymock.h"
 #include "logging.h"
 
@@ -179,11 +180,15 @@ unsigned int calc_first_cluster_of_file(void);
 unsigned int calc_size_of_file(void);
 BOOL is_d81_file(char *filename);
 void wrap_upload(char *fname);
+void make_d81_upload(char *d81name, char *pattern, int interleave);
+int sync_tree(char *local_root, char *remote_path, BOOL dry_run);
 char *get_file_extension(char *filename);
 int extend_dir_cluster_chain(void);
 BOOL find_contiguous_free_direntries(int direntries_needed);
 int normalise_long_name(char *long_name, char *short_name, char *dir_name);
 void write_file_size_into_direntry(unsigned int size);
+void write_modified_time_into_direntry(void);
+void assemble_time_into_raw_at_offset(unsigned char *buffer, int offs, struct tm *tm);
 void write_cluster_number_into_direntry(int a_cluster);
 int calculate_needed_direntries_for_vfat(char *filename);
 unsigned char lfn_checksum(const unsigned char *pFCBName);
@@ -204,6 +209,9 @@ static uint16_t eth_packet_len[1024];
 int eth_num_packets = 0;
 uint32_t eth_batch_start_sector = 0;
 uint8_t eth_batch_size = 0;
+// flash/memory read job in flight: byte range that lands at queue_read_data[queue_read_len]
+uint32_t eth_read_start_address = 0;
+uint32_t eth_read_len = 0;
 
 // Helper routine for faster sector writing
 extern unsigned int helperroutine_len;
@@ -515,6 +523,7 @@ int execute_command(char *cmd)
     return -1;
   }
   int slot = 0;
+  int interleave = 1;
   char src[1024];
   char dst[1024];
   if ((!strcmp(cmd, "exit")) || (!strcmp(cmd, "quit"))) {
@@ -546,9 +555,21 @@ int execute_command(char *cmd)
   else if (parse_command(cmd, "put %s %s", src, dst) == 2) {
     upload_file(src, dst);
   }
+  else if (parse_command(cmd, "sync -n %s %s", src, dst) == 2) {
+    sync_tree(src, dst, TRUE);
+  }
+  else if (parse_command(cmd, "sync %s %s", src, dst) == 2) {
+    sync_tree(src, dst, FALSE);
+  }
   else if (parse_command(cmd, "dput %s", src) == 1) {
     wrap_upload(src);
   }
+  else if (parse_command(cmd, "dmake %s %s %d", dst, src, &interleave) == 3) {
+    make_d81_upload(dst, src, interleave);
+  }
+  else if (parse_command(cmd, "dmake %s %s", dst, src) == 2) {
+    make_d81_upload(dst, src, 1);
+  }
   else if (parse_command(cmd, "del %s", src) == 1) {
     delete_file_or_dir(src);
   }
@@ -667,6 +688,10 @@ int execute_command(char *cmd)
     printf("put <file> [destination name] - upload file to SD card, and optionally rename it destination file.\n");
     printf("get <file> [destination name] - download file from SD card, and optionally rename it destination file.\n");
     printf("dput <file> - upload .prg file wrapped into a .d81 file\n");
+    printf("sync [-n] <localdir> <remotedir> - upload new and changed files of a local directory tree "
+           "(-n: only show what would be transferred).\n");
+    printf("dmake <d81file> <wildcardpattern> [interleave] - build a .d81 file from all matching local .prg/.seq files "
+           "and upload it.\n");
     printf("del <file> - delete a file from SD card.\n");
     printf("mkdir <dirname> - create a directory on the SD card.\n");
     printf("cd <dirname> - change directory on the SD card. (aka. 'chdir')\n");
@@ -1333,16 +1358,45 @@ void ethernet_process_result(uint8_t *rx_payload, int rx_len)
     sector_number = p[3] + (p[4] << 8) + (p[5] << 16) + (p[6] << 24);
     log_debug("Received sector %d, batch start sector %d", sector_number, eth_batch_start_sector);
     uint32_t index = sector_number - eth_batch_start_sector;
+    if (index >= eth_batch_size) {
+      // late duplicate of a sector from an earlier batch (retransmission)
+      log_debug("Ignoring sector %d outside of current batch", sector_number);
+      break;
+    }
     bcopy(&rx_payload[13], &queue_read_data[queue_read_len + index * 512], 512);
     break;
   }
 
+  case 0x0f: // flash read
+  {
+    memory_addr = p[3] + (p[4] << 8) + (p[5] << 16) + (p[6] << 24);
+    log_debug("Received flash sector at $%x, job start $%x", memory_addr, eth_read_start_address);
+    uint32_t offset = memory_addr - eth_read_start_address;
+    if (offset % 512 || offset >= eth_read_len) {
+      log_debug("Ignoring flash sector at $%x outside of current job", memory_addr);
+      break;
+    }
+    bcopy(&rx_payload[13], &queue_read_data[queue_read_len + offset], 512);
+    break;
+  }
+
   case 0x11: // memory read
-    memory_read_buffer_len = p[1] + 1;
+  {
+    int count = p[1] + 1;
+    if (rx_len < 12 + count) {
+      log_debug("Ignoring truncated memory block");
+      break;
+    }
+    memory_read_buffer_len = count;
     memory_addr = p[2] + (p[3] << 8) + (p[4] << 16) + (p[5] << 24);
-    log_debug("Received memory block at $%x (%d bytes)", memory_addr, memory_read_buffer_len);
-    bcopy(&rx_payload[12], memory_read_buffer, memory_read_buffer_len);
+    log_debug("Received memory block at $%x (%d bytes)", memory_addr, count);
+    bcopy(&rx_payload[12], memory_read_buffer, count);
+    // peek() reads outside of a job, where eth_read_len is 0
+    uint32_t offset = memory_addr - eth_read_start_address;
+    if (offset < eth_read_len && offset + count <= eth_read_len)
+      bcopy(&rx_payload[12], &queue_read_data[queue_read_len + offset], count);
     break;
+  }
 
   case 0x12: // mount file
     mount_file_response = p[1];
@@ -1424,6 +1478,15 @@ int ethernet_match_payloads(uint8_t *rx_payload, int rx_len, uint8_t *tx_payload
         (tx_payload[4] + (tx_payload[5] << 8)));
     ethernet_process_result(rx_payload, rx_len);
     break;
+  case 0x0f: // read flash cmd
+    // ry_payload[9] is 4 bytes of flash address
+    if (rx_len != 512 + 13 || memcmp(&rx_payload[9], &tx_payload[9], 4) != 0) {
+      return 0;
+    }
+    log_debug("Received packet (read_flash ack) #%d matches expected packet #%d", (rx_payload[4] + (rx_payload[5] << 8)),
+        (tx_payload[4] + (tx_payload[5] << 8)));
+    ethernet_process_result(rx_payload, rx_len);
+    break;
   case 0x11: // read memory cmd
     // ry_payload[7] is number of bytes
     // ry_payload[8] is 4 bytes of address
@@ -1586,6 +1649,104 @@ void process_ethernet_read_sectors_job(uint8_t *job)
   ethl_send_packet_unscheduled(payload, sizeof(payload));
 }
 
+// Sets up the byte range a flash/memory read job fills in queue_read_data
+static void begin_ethernet_read_job(uint32_t start_address, uint32_t len)
+{
+  if (queue_read_len + len > sizeof(queue_read_data)) {
+    log_error("Read job of %d bytes exceeds the read buffer", len);
+    exit(-1);
+  }
+  eth_read_start_address = start_address;
+  eth_read_len = len;
+}
+
+// Waits for the last response of a flash/memory read job and appends its data to the read buffer
+static void end_ethernet_read_job(void)
+{
+  if (wait_all_acks(ETHERNET_TIMEOUT)) {
+    log_error("Timeout waiting for ethernet read job acks");
+    exit(-1);
+  }
+  queue_read_len += eth_read_len;
+  eth_read_len = 0;
+}
+
+void process_ethernet_read_flash_job(uint8_t *job)
+{
+  uint16_t sector_count = job[1] + (job[2] << 8);
+  uint32_t flash_address = job[3] + (job[4] << 8) + (job[5] << 16) + (job[6] << 24);
+  uint8_t payload[13];
+  uint8_t payload_unrolled[13];
+  int i;
+
+  begin_ethernet_read_job(flash_address, sector_count * 512);
+
+  memcpy(payload, ethernet_request_string, 4); // 'mreq' magic string
+  payload[6] = 0x0f;
+  payload[8] = 0;
+  memcpy(payload_unrolled, payload, sizeof(payload));
+  payload_unrolled[7] = 0;
+
+  // Like process_ethernet_read_sectors_job(), but requests are limited to the window size, so
+  // that a slow model isn't asked to stream more sectors than it can have in flight.
+  while (sector_count) {
+    int batch = sector_count < ethernet_window_size ? sector_count : ethernet_window_size;
+    wait_ack_slots_available(batch, ETHERNET_TIMEOUT);
+    uint16_t seq_num = ethl_get_current_seq_num();
+    for (i = 0; i < batch; ++i) {
+      uint32_t address = flash_address + i * 512;
+      payload_unrolled[9] = address >> 0;
+      payload_unrolled[10] = address >> 8;
+      payload_unrolled[11] = address >> 16;
+      payload_unrolled[12] = address >> 24;
+      ethl_schedule_ack(payload_unrolled, sizeof(payload_unrolled), ETHERNET_TIMEOUT);
+    }
+
+    payload[7] = batch - 1;
+    payload[9] = flash_address >> 0;
+    payload[10] = flash_address >> 8;
+    payload[11] = flash_address >> 16;
+    payload[12] = flash_address >> 24;
+    ethernet_embed_packet_seq(payload, sizeof(payload), seq_num);
+    ethl_send_packet_unscheduled(payload, sizeof(payload));
+
+    flash_address += batch * 512;
+    sector_count -= batch;
+  }
+
+  end_ethernet_read_job();
+}
+
+void process_ethernet_read_mem_job(uint8_t *job)
+{
+  uint32_t address = job[1] + (job[2] << 8) + (job[3] << 16) + (job[4] << 24);
+  uint32_t len = job[5] + (job[6] << 8) + (job[7] << 16) + (job[8] << 24);
+  uint8_t payload[12];
+
+  begin_ethernet_read_job(address, len);
+
+  memcpy(payload, ethernet_request_string, 4); // 'mreq' magic string
+  payload[6] = 0x11;
+
+  // One request per 256 byte block, each answered by a single packet
+  while (len) {
+    int count = len < 256 ? len : 256;
+    payload[7] = count - 1;
+    payload[8] = address >> 0;
+    payload[9] = address >> 8;
+    payload[10] = address >> 16;
+    payload[11] = address >> 24;
+    if (ethl_send_packet(payload, sizeof(payload), ETHERNET_TIMEOUT)) {
+      log_error("Timeout waiting for a free slot for read memory request");
+      exit(-1);
+    }
+    address += count;
+    len -= count;
+  }
+
+  end_ethernet_read_job();
+}
+
 int process_ethernet_mount_file_job(uint8_t *job)
 {
   wait_all_acks(ETHERNET_TIMEOUT);
@@ -1674,15 +1835,15 @@ void process_jobs_ethernet(void)
       break;
 
     case 0x0f: // read flash
+      ethl_set_queue_length(ethernet_window_size);
+      process_ethernet_read_flash_job(ptr);
       ptr += 7;
-      log_debug("read flash job not implemented for ethernet");
-      exit(-1);
       break;
-    
+
     case 0x11: // read mem
+      ethl_set_queue_length(ethernet_window_size);
+      process_ethernet_read_mem_job(ptr);
       ptr += 9;
-      log_debug("read mem job not implemented for ethernet");
-      exit(-1);
       break;
 
     case 0x12: // mount file
@@ -1699,7 +1860,11 @@ void process_jobs_ethernet(void)
     }
   }
 
-  wait_all_acks(ETHERNET_TIMEOUT);
+  if (wait_all_acks(ETHERNET_TIMEOUT)) {
+    // don't carry on with sectors that never arrived
+    log_error("Timeout waiting for ethernet job acks");
+    exit(-1);
+  }
 }
 
 void queue_execute(void)
@@ -1773,6 +1938,15 @@ int execute_write_queue(void)
   return retVal;
 }
 
+// Returns 1 if any sector in the write queue lies in the given range
+int write_queue_overlaps(uint32_t sector_number, uint16_t sector_count)
+{
+  for (int i = 0; i < write_sector_count; i++)
+    if (write_sector_numbers[i] - sector_number < sector_count)
+      return 1;
+  return 0;
+}
+
 void queue_write_sector(uint32_t sector_number, uint8_t *buffer)
 {
   // Merge writes to same sector
@@ -1920,6 +2094,9 @@ int DIRTYMOCK(read_sector)(const unsigned int sector_number, unsigned char *buff
     //    for (int n=0;n<batch_read_size;n++)
     //      queue_read_sector(sector_number+n,0x40000+(n<<9));
     //    queue_read_mem(0x40000,512*batch_read_size);
+    // The read-ahead goes into the cache, so it must not see sectors from before queued writes to them
+    if (write_queue_overlaps(sector_number, batch_read_size))
+      execute_write_queue();
     queue_read_sectors(sector_number, batch_read_size);
     queue_execute();
 
@@ -3395,6 +3572,17 @@ void list_all_roms(void)
   llist_free(lst_dirents);
 }
 
+// set while uploading a freshly built d81 image, so that sectors it doesn't use are skipped
+unsigned char *upload_sector_map = NULL;
+
+int upload_d81_image(char *name, char *dest_name)
+{
+  upload_sector_map = d81_used_sectors();
+  int retVal = upload_file(name, dest_name);
+  upload_sector_map = NULL;
+  return retVal;
+}
+
 void wrap_upload(char *fname)
 {
   char *d81name;
@@ -3403,34 +3591,81 @@ void wrap_upload(char *fname)
   strcpy(fname, d81name);
 
   if (fname) {
-    upload_file(fname, fname);
+    upload_d81_image(fname, fname);
   }
   else {
     printf("ERROR: Unable to download file from filehost!\n");
   }
 }
 
+int compare_strings(const void *a, const void *b)
+{
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+void make_d81_upload(char *d81name, char *pattern, int interleave)
+{
+  DIR *d;
+  struct dirent *dir;
+  char **files = NULL;
+  int file_count = 0;
+
+  d = opendir(".");
+  if (!d) {
+    printf("ERROR: Cannot read local directory\n");
+    return;
+  }
+  while ((dir = readdir(d)) != NULL) {
+    struct stat file_stats;
+    if (!is_match(dir->d_name, pattern, 1) || stat(dir->d_name, &file_stats) || S_ISDIR(file_stats.st_mode))
+      continue;
+    if (endswith(dir->d_name, ".d81") || endswith(dir->d_name, ".D81"))
+      continue;
+    files = realloc(files, sizeof(char *) * (file_count + 1));
+    files[file_count++] = strdup(dir->d_name);
+  }
+  closedir(d);
+
+  if (!file_count) {
+    printf("ERROR: No local files match '%s'\n", pattern);
+    return;
+  }
+
+  // keep the directory order of the image stable
+  qsort(files, file_count, sizeof(char *), compare_strings);
+
+  if (!create_d81_for_files(d81name, files, file_count, interleave))
+    upload_d81_image(d81name, d81name);
+
+  for (int i = 0; i < file_count; i++)
+    free(files[i]);
+  free(files);
+}
+
 void perform_filehost_get(int num, char *destname)
 {
   char *fname = download_file_from_filehost(num);
+  if (!fname) {
+    printf("ERROR: Unable to download file from filehost!\n");
+    return;
+  }
 
+  BOOL wrapped = FALSE;
   if (endswith(fname, ".prg") || endswith(fname, ".PRG")) {
     char *d81name = create_d81_for_prg(fname);
     strcpy(fname, d81name);
+    wrapped = TRUE;
   }
 
   if (destname != NULL && strcmp(destname, "-") == 0)
     return;
 
-  if (fname) {
-    if (destname)
-      upload_file(fname, destname);
-    else
-      upload_file(fname, fname);
-  }
-  else {
-    printf("ERROR: Unable to download file from filehost!\n");
-  }
+  if (wrapped)
+    upload_d81_image(fname, destname ? destname : fname);
+  else if (destname)
+    upload_file(fname, destname);
+  else
+    upload_file(fname, fname);
 }
 
 // borrowed from mega65-core's "megaflash.c"
@@ -3682,6 +3917,8 @@ void perform_filehost_flash(int fhnum, int slotnum)
 
   // grab the file from the filehost
   char *fname = download_file_from_filehost(fhnum);
+  if (!fname)
+    return;
 
   flash_core_to_slot(fname, slotnum);
 }
@@ -4300,6 +4537,13 @@ void write_file_size_into_direntry(unsigned int size)
   dir_sector_buffer[dir_sector_offset + 0x1F] = (size >> 24) & 0xff;
 }
 
+void write_modified_time_into_direntry(void)
+{
+  time_t t = time(0);
+  struct tm *tm = localtime(&t);
+  assemble_time_into_raw_at_offset(&dir_sector_buffer[dir_sector_offset], 0x16, tm);
+}
+
 BOOL create_direntry_with_attrib(char *dest_name, int attrib)
 {
   char short_name[8 + 3 + 1];
@@ -4331,6 +4575,20 @@ BOOL create_direntry_with_attrib(char *dest_name, int attrib)
   return TRUE;
 }
 
+// set by sync, so that directory and FAT sector writes of many small files get merged
+BOOL defer_write_queue = FALSE;
+
+// progress line for uploads/downloads, at most every 100ms
+void show_transfer_progress(char *what, long long bytes, unsigned long long *last_status_output)
+{
+  unsigned long long now = gettime_ms();
+  if (now - *last_status_output > 100) {
+    printf("\r%s %lld bytes.", what, bytes);
+    fflush(stdout);
+    *last_status_output = now;
+  }
+}
+
 int upload_single_file(char *name, char *dest_name)
 {
   struct m65dirent de;
@@ -4425,11 +4683,16 @@ int upload_single_file(char *name, char *dest_name)
     int sector_in_cluster = 0;
     int file_cluster = first_cluster_of_file;
     unsigned long long last_status_output = 0;
+    int skipped_sectors = 0;
+    unsigned char *sector_map = (upload_sector_map && st.st_size == D81_SIZE) ? upload_sector_map : NULL;
     unsigned int sector_number;
     FILE *f = fopen(name, "rb");
+    file_pipeline *fp = NULL;
 
-    if (!f) {
+    if (!f || !(fp = pipeline_open_read(f))) {
       printf("ERROR: Could not open file '%s' for reading.\n", name);
+      if (f)
+        fclose(f);
       retVal = -1;
       break;
     }
@@ -4466,20 +4729,20 @@ int upload_single_file(char *name, char *dest_name)
       // Write sector
       unsigned char buffer[512];
       bzero(buffer, 512);
-      int bytes = fread(buffer, 1, 512, f);
+      int bytes = pipeline_read(fp, buffer, 512);
       sector_number = partition_start + first_cluster_sector + (sectors_per_cluster * (file_cluster - first_cluster))
                     + sector_in_cluster;
       if (0)
         printf("T+%lld : Read %d bytes from file, writing to sector $%x (%d) for cluster %d\n", gettime_us() - start_usec,
             bytes, sector_number, sector_number, file_cluster);
-      unsigned long long now = gettime_ms();
-      if (now - last_status_output > 100) {
-        printf("\rUploaded %lld bytes.", (long long)st.st_size - remaining_length);
-        fflush(stdout);
-        last_status_output = now;
-      }
+      if (!sector_in_cluster)
+        show_transfer_progress("Uploaded", st.st_size - remaining_length, &last_status_output);
 
-      if (write_sector(sector_number, buffer)) {
+      if (sector_map && !sector_map[(st.st_size - remaining_length) / 512]) {
+        // nothing in this sector of the image, no need to send it
+        skipped_sectors++;
+      }
+      else if (write_sector(sector_number, buffer)) {
         printf("ERROR: Failed to write to sector %d\n", sector_number);
         retVal = -1;
         break;
@@ -4490,12 +4753,19 @@ int upload_single_file(char *name, char *dest_name)
       remaining_length -= 512;
     }
 
+    long long link_idle_ms = pipeline_link_idle_us(fp) / 1000;
+    long long io_idle_ms = pipeline_io_idle_us(fp) / 1000;
+    if (pipeline_close(fp)) {
+      printf("ERROR: Failed to read from file '%s'\n", name);
+      retVal = -1;
+    }
     fclose(f);
 
     // XXX check for orphan clusters at the end, and if present, free them.
 
-    // Write file size into directory entry
+    // Write file size and modification time into directory entry
     write_file_size_into_direntry((unsigned int)st.st_size);
+    write_modified_time_into_direntry();
 
     if (write_sector(partition_start + dir_sector, dir_sector_buffer)) {
       printf("ERROR: Failed to write updated directory sector after updating file length.\n");
@@ -4503,13 +4773,18 @@ int upload_single_file(char *name, char *dest_name)
       break;
     }
 
-    // Flush any pending sector writes out
-    execute_write_queue();
+    // Flush any pending sector writes out (sync batches them up over many files)
+    if (!defer_write_queue)
+      execute_write_queue();
 
     if (time(0) == upload_start)
       upload_start = time(0) - 1;
     printf("\rUploaded %lld bytes in %lld seconds (%.1fKB/sec)\n", (long long)st.st_size, (long long)time(0) - upload_start,
         st.st_size * 1.0 / 1024 / (time(0) - upload_start));
+    if (skipped_sectors)
+      printf("Skipped %d unused sectors of the disk image.\n", skipped_sectors);
+    log_info("local file reads kept the link idle for %lldms, file reader waited %lldms for the link", link_idle_ms,
+        io_idle_ms);
   } while (0);
 
   return retVal;
@@ -4545,6 +4820,250 @@ int upload_file(char *name, char *dest_name)
   return 0;
 }
 
+/*
+ * sync: upload a local directory tree to the SD card, sending only files that are new or
+ * have changed since they were last uploaded.
+ */
+
+// nominal transfer rates for the dry-run estimate (KB/sec)
+#define SYNC_SERIAL_RATE 100
+#define SYNC_ETHERNET_RATE 1000
+
+typedef struct {
+  char path[1024]; // relative to the sync root
+  long size;
+  time_t mtime;
+  long first_cluster;
+  BOOL is_dir;
+} sync_entry;
+
+typedef struct {
+  int new_files;
+  int changed_files;
+  int unchanged_files;
+  int new_dirs;
+  int failed;
+  long long bytes;
+} sync_stats;
+
+sync_entry *sync_index = NULL;
+int sync_index_count = 0;
+int sync_index_size = 0;
+
+void sync_join_path(char *dest, int len, char *base, char *name)
+{
+  if (!name[0])
+    snprintf(dest, len, "%s", base);
+  else if (!base[0])
+    snprintf(dest, len, "%s", name);
+  else if (base[strlen(base) - 1] == '/')
+    snprintf(dest, len, "%s%s", base, name);
+  else
+    snprintf(dest, len, "%s/%s", base, name);
+}
+
+time_t direntry_modified_time(unsigned char *raw)
+{
+  struct tm tm;
+  memset(&tm, 0, sizeof(struct tm));
+  tm.tm_sec = (raw[0x16] & 0x1f) << 1;
+  tm.tm_min = ((raw[0x16] >> 5) & 0x07) | ((raw[0x17] & 0x7) << 3);
+  tm.tm_hour = raw[0x17] >> 3;
+  tm.tm_mday = raw[0x18] & 0x1f;
+  tm.tm_mon = (((raw[0x18] >> 5) & 0x7) | ((raw[0x19] & 0x1) << 3)) - 1;
+  tm.tm_year = (raw[0x19] >> 1) + 80;
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+int compare_sync_entries(const void *a, const void *b)
+{
+  return strcasecmp(((sync_entry *)a)->path, ((sync_entry *)b)->path);
+}
+
+sync_entry *find_sync_entry(char *path)
+{
+  sync_entry key;
+  snprintf(key.path, sizeof(key.path), "%s", path);
+  return bsearch(&key, sync_index, sync_index_count, sizeof(sync_entry), compare_sync_entries);
+}
+
+// Reads the remote tree below remote_path into sync_index, one directory listing at a time
+int index_remote_tree(char *remote_path, char *rel_path)
+{
+  llist *lst_dirents = llist_new();
+  int retVal = 0;
+
+  do {
+    if (!read_direntries(lst_dirents, remote_path)) {
+      retVal = -1;
+      break;
+    }
+
+    for (llist *cur = lst_dirents; cur != NULL && cur->item != NULL; cur = cur->next) {
+      struct m65dirent *itm = (struct m65dirent *)cur->item;
+      char *name = itm->d_longname[0] ? itm->d_longname : itm->d_name;
+      if (!strcmp(name, ".") || !strcmp(name, "..") || (itm->d_attr & 0x08))
+        continue;
+
+      if (sync_index_count == sync_index_size) {
+        sync_index_size = sync_index_size ? sync_index_size * 2 : 256;
+        sync_index = realloc(sync_index, sizeof(sync_entry) * sync_index_size);
+      }
+      sync_entry *e = &sync_index[sync_index_count++];
+      sync_join_path(e->path, sizeof(e->path), rel_path, name);
+      e->size = itm->d_filelen;
+      e->mtime = direntry_modified_time(itm->de_raw);
+      e->first_cluster = itm->d_ino;
+      e->is_dir = (itm->d_attr & 0x10) ? TRUE : FALSE;
+
+      if (e->is_dir) {
+        char sub_remote[1024], sub_rel[1024];
+        sync_join_path(sub_remote, sizeof(sub_remote), remote_path, name);
+        snprintf(sub_rel, sizeof(sub_rel), "%s", e->path);
+        if (index_remote_tree(sub_remote, sub_rel)) {
+          retVal = -1;
+          break;
+        }
+      }
+    }
+  } while (0);
+
+  llist_free(lst_dirents);
+  return retVal;
+}
+
+void sync_local_tree(char *local_path, char *rel_path, char *remote_root, BOOL dry_run, sync_stats *stats)
+{
+  DIR *d = opendir(local_path);
+  struct dirent *dir;
+
+  if (!d) {
+    printf("ERROR: Cannot read local directory '%s'\n", local_path);
+    stats->failed++;
+    return;
+  }
+
+  while ((dir = readdir(d)) != NULL) {
+    char local_name[1024], rel_name[1024], remote_dir[1024];
+    struct stat st;
+
+    if (!strcmp(dir->d_name, ".") || !strcmp(dir->d_name, ".."))
+      continue;
+    sync_join_path(local_name, sizeof(local_name), local_path, dir->d_name);
+    sync_join_path(rel_name, sizeof(rel_name), rel_path, dir->d_name);
+    sync_join_path(remote_dir, sizeof(remote_dir), remote_root, rel_path);
+    if (stat(local_name, &st))
+      continue;
+
+    sync_entry *e = find_sync_entry(rel_name);
+
+    if (S_ISDIR(st.st_mode)) {
+      if (!e || !e->is_dir) {
+        stats->new_dirs++;
+        printf("%s%s/\n", dry_run ? "would create " : "creating ", rel_name);
+        if (!dry_run) {
+          change_dir(remote_dir);
+          if (create_dir(dir->d_name)) {
+            stats->failed++;
+            continue;
+          }
+        }
+      }
+      sync_local_tree(local_name, rel_name, remote_root, dry_run, stats);
+      continue;
+    }
+
+    // FAT timestamps have 2 second resolution
+    if (e && !e->is_dir && e->size == st.st_size && st.st_mtime <= e->mtime + 2) {
+      stats->unchanged_files++;
+      continue;
+    }
+    if (e)
+      stats->changed_files++;
+    else
+      stats->new_files++;
+    stats->bytes += st.st_size;
+    printf("%s%s (%lld bytes)\n", dry_run ? "would upload " : "uploading ", rel_name, (long long)st.st_size);
+
+    if (!dry_run) {
+      change_dir(remote_dir);
+      if (upload_single_file(local_name, dir->d_name))
+        stats->failed++;
+    }
+  }
+  closedir(d);
+}
+
+int sync_tree(char *local_root, char *remote_path, BOOL dry_run)
+{
+  char remote_root[1024];
+  char saved_dir[1024];
+  sync_stats stats;
+  struct stat st;
+  int retVal = 0;
+
+  if (stat(local_root, &st) || !S_ISDIR(st.st_mode)) {
+    printf("ERROR: '%s' is not a local directory\n", local_root);
+    return -1;
+  }
+
+  if (remote_path[0] == '/')
+    snprintf(remote_root, sizeof(remote_root), "%s", remote_path);
+  else
+    sync_join_path(remote_root, sizeof(remote_root), current_dir, remote_path);
+
+  if (!file_system_found)
+    open_file_system();
+  if (!file_system_found) {
+    fprintf(stderr, "ERROR: Could not open file system.\n");
+    return -1;
+  }
+  if (fat_opendir(remote_root, FALSE)) {
+    printf("ERROR: Remote directory '%s' does not exist (mkdir it first)\n", remote_root);
+    return -1;
+  }
+
+  memset(&stats, 0, sizeof(stats));
+  snprintf(saved_dir, sizeof(saved_dir), "%s", current_dir);
+  long long start = gettime_ms();
+
+  do {
+    sync_index_count = 0;
+    if (index_remote_tree(remote_root, "")) {
+      printf("ERROR: Failed to read remote directory tree '%s'\n", remote_root);
+      retVal = -1;
+      break;
+    }
+    qsort(sync_index, sync_index_count, sizeof(sync_entry), compare_sync_entries);
+    log_info("indexed %d remote entries below %s in %lldms", sync_index_count, remote_root, gettime_ms() - start);
+
+    defer_write_queue = !dry_run;
+    sync_local_tree(local_root, "", remote_root, dry_run, &stats);
+    defer_write_queue = FALSE;
+    execute_write_queue();
+  } while (0);
+
+  change_dir(saved_dir);
+
+  if (!retVal) {
+    printf("%d new, %d changed, %d unchanged files, %d new directories, %lld bytes %s\n", stats.new_files,
+        stats.changed_files, stats.unchanged_files, stats.new_dirs, stats.bytes, dry_run ? "to transfer" : "transferred");
+    if (dry_run) {
+      int rate = ethernet_mode ? SYNC_ETHERNET_RATE : SYNC_SERIAL_RATE;
+      printf("Estimated transfer time: %.1f seconds (at a nominal %dKB/sec)\n", stats.bytes / 1024.0 / rate, rate);
+    }
+    else
+      printf("Sync took %.1f seconds\n", (gettime_ms() - start) / 1000.0);
+    if (stats.failed) {
+      printf("ERROR: %d items failed to sync\n", stats.failed);
+      retVal = -1;
+    }
+  }
+
+  return retVal;
+}
+
 void assemble_time_into_raw_at_offset(unsigned char *buffer, int offs, struct tm *tm)
 {
   buffer[0x00 + offs] = (tm->tm_sec >> 1) & 0x1F; // 2 second resolution
@@ -5395,11 +5914,14 @@ int download_single_file(char *dest_name, char *local_name, int showClusters)
     unsigned long long last_status_output = 0;
     unsigned int sector_number;
     FILE *f = NULL;
+    file_pipeline *fp = NULL;
 
     if (!showClusters) {
       f = fopen(local_name, "wb");
-      if (!f) {
+      if (!f || !(fp = pipeline_open_write(f))) {
         printf("ERROR: Could not open file '%s' for writing.\n", local_name);
+        if (f)
+          fclose(f);
         retVal = -1;
         break;
       }
@@ -5415,8 +5937,10 @@ int download_single_file(char *dest_name, char *local_name, int showClusters)
         int next_cluster = chained_cluster(file_cluster);
         if (next_cluster == 0 || next_cluster >= FAT32_MIN_END_OF_CLUSTER_MARKER) {
           printf("\n?  PREMATURE END OF FILE ERROR\n");
-          if (f)
+          if (f) {
+            pipeline_close(fp);
             fclose(f);
+          }
           retVal = -1;
           break;
         }
@@ -5441,26 +5965,25 @@ int download_single_file(char *dest_name, char *local_name, int showClusters)
         if (read_sector(sector_number, download_buffer, CACHE_YES, 128)) {
           printf("ERROR: Failed to read to sector %d\n", sector_number);
           retVal = -1;
-          if (f)
-            fclose(f);
+          pipeline_close(fp);
+          fclose(f);
           break;
         }
 
-        if (remaining_bytes >= 512)
-          fwrite(download_buffer, 512, 1, f);
-        else
-          fwrite(download_buffer, remaining_bytes, 1, f);
+        if (pipeline_write(fp, download_buffer, remaining_bytes >= 512 ? 512 : remaining_bytes) < 0) {
+          printf("ERROR: Failed to write to file '%s'\n", local_name);
+          retVal = -1;
+          pipeline_close(fp);
+          fclose(f);
+          break;
+        }
       }
 
       if (0)
         printf("T+%lld : Read %d bytes from file, writing to sector $%x (%d) for cluster %d\n", gettime_us() - start_usec,
             (int)de.d_filelen, sector_number, sector_number, file_cluster);
-      unsigned long long now = gettime_ms();
-      if (!showClusters && !quietFlag && (now - last_status_output > 100)) {
-        printf("\rDownloaded %lld bytes.", (long long)de.d_filelen - remaining_bytes);
-        last_status_output = now;
-        fflush(stdout);
-      }
+      if (!showClusters && !quietFlag && !sector_in_cluster)
+        show_transfer_progress("Downloaded", de.d_filelen - remaining_bytes, &last_status_output);
 
       //      printf("T+%lld : after write.\n",gettime_us()-start_usec);
 
@@ -5470,11 +5993,22 @@ int download_single_file(char *dest_name, char *local_name, int showClusters)
         remaining_bytes = 0;
     }
 
+    if (retVal)
+      break;
+
     if (showClusters) {
       printf("LastCluster=%d\n", file_cluster);
     }
-    if (f)
+    long long link_idle_ms = 0, io_idle_ms = 0;
+    if (f) {
+      link_idle_ms = pipeline_link_idle_us(fp) / 1000;
+      io_idle_ms = pipeline_io_idle_us(fp) / 1000;
+      if (pipeline_close(fp)) {
+        printf("ERROR: Failed to write to file '%s'\n", local_name);
+        retVal = -1;
+      }
       fclose(f);
+    }
 
     int next_cluster = chained_cluster(file_cluster);
     if (!quietFlag)
@@ -5490,6 +6024,8 @@ int download_single_file(char *dest_name, char *local_name, int showClusters)
     if (!showClusters && !quietFlag) {
       printf("\rDownloaded %lld bytes in %lld seconds (%.1fKB/sec)\n", (long long)de.d_filelen,
           (long long)time(0) - upload_start, de.d_filelen * 1.0 / 1024 / (time(0) - upload_start));
+      log_info("local file writes kept the link idle for %lldms, file writer waited %lldms for the link", link_idle_ms,
+          io_idle_ms);
     }
     else {
       if (!quietFlag)
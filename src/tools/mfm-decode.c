@@ -1,18 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 int show_gaps = 0;
 int show_bits = 0;
 int show_quantised_gaps = 0;
 int show_post_correction = 0;
 
+int write_gap_csv = 0;
+int write_binary = 0;
+int benchmark = 0;
+int thread_count = 1;
+
 // MEGA65 floppies contain a track info block that is always written at DD data rate.
 // When the TIB is read, the FDC switches to the indicated rate and encoding
-float rate = 81 + 1; // DD 720KB
-// float rate=40+1; // HD 1.44MB
-
-int rll_encoding = 0;
+#define DEFAULT_RATE (81 + 1) // DD 720KB
+// #define DEFAULT_RATE (40 + 1) // HD 1.44MB
 
 float quantise_gap_mfm(float gap)
 {
@@ -58,14 +65,6 @@ float quantise_gap_rll27(float gap)
   return gap;
 }
 
-float quantise_gap(float gap)
-{
-  if (rll_encoding)
-    return quantise_gap_rll27(gap);
-  else
-    return quantise_gap_mfm(gap);
-}
-
 int q_gap(float gap)
 {
   //  printf("qgap=%f\n",gap);
@@ -74,36 +73,66 @@ int q_gap(float gap)
   return b;
 }
 
-int last_pulse = 0;
-float last_gap = 0;
-int last_bit = 0;
-unsigned char byte = 0;
-int bits = 0;
-int byte_count = 0;
-int bytes_emitted = 0;
-int sync_count = 0;
-int field_ofs = 0;
-unsigned char data_field[1024];
-
-#define MAX_GAPS 65536 * 4
-float corrected_deltas[MAX_GAPS];
-float uncorrected_deltas[MAX_GAPS];
-int cdelta_count = 0;
-int ucdelta_count = 0;
-int start_data = 0;
-
-#define MAX_SIGNALS 64
-#define MAX_SAMPLES 65536 * 4
-float traces[MAX_SIGNALS][MAX_SAMPLES];
-int sample_counts[MAX_SIGNALS] = { 0 };
-float max_time = 0;
+/*
+  Gaps are quantised through a table indexed by the raw capture value, rebuilt whenever the
+  divisor or encoding changes, so the float thresholds above are only evaluated once per entry.
+  Gap codes are in half bit cells for MFM (2, 3, 4 for 1.0, 1.5, 2.0) and the number of zero
+  bits before the pulse for RLL2,7 (2-7).
+*/
+#define MAX_RAW_GAP 1024
+
+/*
+  Compact binary output (-b), written to <capture>.dec: a "MFD1" magic, followed by records
+  of a type byte and a 16-bit little-endian payload length, then the payload:
+    'G' quantised gap codes, one byte each
+    'T' track info block: track, divisor, encoding, CRC ok
+    'H' sector header: track, side, sector, size, CRC ok
+    'D' sector data: CRC ok, then the 512 data bytes
+*/
+#define GAP_RECORD_MAX 4096
+
+struct decoder {
+  FILE *out; // text output
+  FILE *raw; // rawgaps.csv, if requested
+  FILE *bin; // binary sector/gap output, if requested
+
+  float rate;    // data rate, as set by the file name or the track info block
+  float divisor; // rate at the start of the capture, which the raw gaps are scaled by
+  int rll_encoding;
+
+  unsigned char gap_code[MAX_RAW_GAP];
+  int short_gap; // raw gaps shorter than this are accumulated with the next one
+  int partial_gap;
+
+  unsigned int recent_gaps; // last four gaps in half bit cells, most recent in the low byte
+  int last_gap;             // code of the previous gap, 0 before the first
+  int last_bit;
+  unsigned int byte;
+  int bits;
+  int byte_count;
+  int bytes_emitted;
+  int sync_count;
+  int found_sync3;
+  int reset_delta;
+  int field_ofs;
+  unsigned char data_field[1024];
+
+  // RLL2,7 bit shift register, oldest bit highest
+  unsigned int rll_bits;
+  int rll_bit_count;
+  int skip_bits;
+
+  unsigned char gap_record[GAP_RECORD_MAX];
+  int gap_record_len;
+
+  long samples;
+};
 
 // CRC16 algorithm from:
 // https://github.com/psbhlw/floppy-disk-ripper/blob/master/fdrc/mfm.cpp
 // GPL3+, Copyright (C) 2014, psb^hlw, ts-labs.
 // crc16 table
 unsigned short crc_ccitt[256];
-unsigned short crc = 0;
 
 // crc16 init table
 void crc16_init()
@@ -123,52 +152,106 @@ unsigned short crc16(unsigned short crc, unsigned short b)
   return crc;
 }
 
-void describe_data(void)
+void build_gap_tables(struct decoder *d)
+{
+  for (int raw = 0; raw < MAX_RAW_GAP; raw++) {
+    float gap = raw / d->divisor;
+    if (d->rll_encoding)
+      d->gap_code[raw] = quantise_gap_rll27(gap);
+    else
+      d->gap_code[raw] = quantise_gap_mfm(gap) * 2;
+  }
+  for (d->short_gap = 0; d->short_gap < MAX_RAW_GAP; d->short_gap++)
+    if (d->short_gap / d->divisor >= 0.7)
+      break;
+}
+
+float gap_value(struct decoder *d, int code)
+{
+  return d->rll_encoding ? code : code / 2.0;
+}
+
+void write_record(struct decoder *d, unsigned char type, unsigned char *data, int len)
+{
+  unsigned char hdr[3] = { type, len & 0xff, len >> 8 };
+  fwrite(hdr, 3, 1, d->bin);
+  fwrite(data, len, 1, d->bin);
+}
+
+void flush_gap_record(struct decoder *d)
+{
+  if (d->bin && d->gap_record_len)
+    write_record(d, 'G', d->gap_record, d->gap_record_len);
+  d->gap_record_len = 0;
+}
+
+void write_field_record(struct decoder *d, unsigned char type, unsigned char *data, int len, int crc_ok)
+{
+  unsigned char rec[1 + 512];
+
+  if (!d->bin)
+    return;
+  flush_gap_record(d);
+  if (type == 'D') {
+    rec[0] = crc_ok;
+    memcpy(&rec[1], data, len);
+  }
+  else {
+    memcpy(rec, data, len);
+    rec[len] = crc_ok;
+  }
+  write_record(d, type, rec, len + 1);
+}
+
+void describe_data(struct decoder *d)
 {
-  unsigned short crc_calc;
+  unsigned char *data_field = d->data_field;
+  FILE *out = d->out;
+  unsigned short crc, crc_calc = 0;
   switch (data_field[0]) {
   case 0x65:
-    if (field_ofs > 6) {
+    if (d->field_ofs > 6) {
       // MEGA65 Track Information Block
-      fprintf(stdout, "\nTRACK INFO BLOCK: Track=%d, Divisor=%d (%.2fMHz), Encoding=$%02x\n", data_field[1], data_field[2],
+      fprintf(out, "\nTRACK INFO BLOCK: Track=%d, Divisor=%d (%.2fMHz), Encoding=$%02x\n", data_field[1], data_field[2],
           40.5 / data_field[2], data_field[3]);
       if ((data_field[3] & 0x0f) == 0x01) {
         // RLL
-        rate = data_field[2];
-        rll_encoding = 1;
+        d->rate = data_field[2];
+        d->rll_encoding = 1;
       }
       else {
         // MFM
-        rate = data_field[2];
-        rll_encoding = 0;
+        d->rate = data_field[2];
+        d->rll_encoding = 0;
       }
-      start_data = ucdelta_count;
+      build_gap_tables(d);
 
-      unsigned short crc = 0xffff;
-      printf("CRC Calc over:");
+      crc = 0xffff;
+      fprintf(out, "CRC Calc over:");
       for (int i = 0; i < 3; i++) {
         crc = crc16(crc, 0xa1);
-        printf(" ;$%02x", 0xa1);
+        fprintf(out, " ;$%02x", 0xa1);
       }
       for (int i = 0; i < 7; i++) {
         if (i == 5)
           crc_calc = crc;
         crc = crc16(crc, data_field[i]);
-        printf(" `$%02x", data_field[i]);
+        fprintf(out, " `$%02x", data_field[i]);
       }
-      printf("\n");
+      fprintf(out, "\n");
       if (crc)
-        printf("CRC FAIL! Saw $%02x%02x, Calculated $%04x\n", data_field[5], data_field[6], crc_calc);
+        fprintf(out, "CRC FAIL! Saw $%02x%02x, Calculated $%04x\n", data_field[5], data_field[6], crc_calc);
       else
-        printf("CRC ok\n");
+        fprintf(out, "CRC ok\n");
+      write_field_record(d, 'T', &data_field[1], 3, !crc);
     }
     break;
   case 0xfe:
     // Sector header
-    fprintf(stdout, "\nSECTOR HEADER: Track=%d, Side=%d, Sector=%d, Size=%d (%d bytes) ", data_field[1], data_field[2],
+    fprintf(out, "\nSECTOR HEADER: Track=%d, Side=%d, Sector=%d, Size=%d (%d bytes) ", data_field[1], data_field[2],
         data_field[3], data_field[4], 128 << (data_field[4]));
 
-    unsigned short crc = 0xffff;
+    crc = 0xffff;
     for (int i = 0; i < 3; i++)
       crc = crc16(crc, 0xa1);
     for (int i = 0; i < 7; i++) {
@@ -177,20 +260,21 @@ void describe_data(void)
       crc = crc16(crc, data_field[i]);
     }
     if (crc)
-      printf("CRC FAIL! Saw $%02x%02x, Calculated $%04x\n", data_field[5], data_field[6], crc_calc);
+      fprintf(out, "CRC FAIL! Saw $%02x%02x, Calculated $%04x\n", data_field[5], data_field[6], crc_calc);
     else
-      printf("CRC ok\n");
+      fprintf(out, "CRC ok\n");
+    write_field_record(d, 'H', &data_field[1], 4, !crc);
     break;
   case 0xfb:
     // Sector data
     crc = 0xffff;
-    printf("\nSECTOR DATA:\n");
+    fprintf(out, "\nSECTOR DATA:\n");
     for (int i = 0; i < 512; i += 16) {
-      printf("  %04x :", i);
+      fprintf(out, "  %04x :", i);
       for (int j = 0; j < 16; j++) {
-        printf(" %02x", data_field[1 + i + j]);
+        fprintf(out, " %02x", data_field[1 + i + j]);
       }
-      printf("    ");
+      fprintf(out, "    ");
       for (int j = 0; j < 16; j++) {
         unsigned char c = data_field[1 + i + j];
         // De-PETSCII the data
@@ -199,23 +283,23 @@ void describe_data(void)
         if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
           c ^= 0x20;
         if (c >= ' ' && c < 0x7f)
-          printf("%c", c);
+          fprintf(out, "%c", c);
         else
-          printf(".");
+          fprintf(out, ".");
       }
-      printf("\n");
+      fprintf(out, "\n");
     }
     for (int i = 0; i < 3; i++)
       crc = crc16(crc, 0xa1);
-    unsigned short crc_calc;
     for (int i = 0; i < 1 + 512 + 2; i++) {
       if (i == 1 + 512)
         crc_calc = crc;
       crc = crc16(crc, data_field[i]);
     }
+    write_field_record(d, 'D', &data_field[1], 512, !crc);
     if (crc) {
       unsigned int fdc_crc = (data_field[1 + 512] << 8) + data_field[1 + 513];
-      printf("CRC FAIL!  (included field = $%04x, calculated as $%04x)\n", fdc_crc, crc_calc);
+      fprintf(out, "CRC FAIL!  (included field = $%04x, calculated as $%04x)\n", fdc_crc, crc_calc);
       for (int s = 0; s < 4; s++) {
         crc = 0xffff;
         for (int i = 0; i < s; i++)
@@ -225,111 +309,89 @@ void describe_data(void)
             crc_calc = crc;
           crc = crc16(crc, data_field[i]);
           if (crc == fdc_crc)
-            printf("CRC matched at i=%d, with %d sync marks\n", i, s);
+            fprintf(out, "CRC matched at i=%d, with %d sync marks\n", i, s);
         }
       }
     }
     else
-      printf("CRC ok\n");
+      fprintf(out, "CRC ok\n");
     // Clear sector between operations
     bzero(data_field, 512);
     break;
   case 0xff:
-    printf("\nFound Amiga sector (type = $%02X)\n",data_field[0]);
-    unsigned int odd_bits = (data_field[0]<<8) + data_field[1];
-    unsigned int even_bits = (data_field[2]<<8) + data_field[3];
-    unsigned int out = 0;
-    printf("  First bytes = $%02X $%02X $%02X $%02x\n",
-	   data_field[0],data_field[1],data_field[2],data_field[3]);
-    for(int bit=0;bit<16;bit++) {
-      int e = (even_bits>>bit)&1;
-      int o = (even_bits>>bit)&1;
-      out |= ((o<<1)+e)<<(bit<<1);
-    }
-    printf("  Header first bytes = $%08X\n",out);
-    field_ofs = 0;
+    fprintf(out, "\nFound Amiga sector (type = $%02X)\n", data_field[0]);
+    unsigned int even_bits = (data_field[2] << 8) + data_field[3];
+    unsigned int word = 0;
+    fprintf(out, "  First bytes = $%02X $%02X $%02X $%02x\n", data_field[0], data_field[1], data_field[2], data_field[3]);
+    for (int bit = 0; bit < 16; bit++) {
+      int e = (even_bits >> bit) & 1;
+      int o = (even_bits >> bit) & 1;
+      word |= ((o << 1) + e) << (bit << 1);
+    }
+    fprintf(out, "  Header first bytes = $%08X\n", word);
+    d->field_ofs = 0;
     break;
   default:
-    fprintf(stdout, "WARNING: Unknown data field type $%02x\n", data_field[0]);
+    fprintf(out, "WARNING: Unknown data field type $%02x\n", data_field[0]);
     break;
   }
 }
 
-void emit_bit(int b)
+void emit_byte(struct decoder *d, unsigned char byte)
 {
-  if (show_bits)
-    printf("  bit %d\n", b);
-  last_bit = b;
-  byte = (byte << 1) | b;
-  bits++;
-  if (bits == 8) {
-    if (byte_count < 16)
-      byte_count++;
-    else {
-      printf("\n");
-      byte_count = 0;
-    }
-    if (sync_count == 3) {
-      printf("Data field type $%02x\n", byte);
-      sync_count = 0;
-      field_ofs = 1;
-      data_field[0] = byte;
-    }
-    else {
-      printf(" :$%02x", byte);
-      if (field_ofs < 1024)
-        data_field[field_ofs++] = byte;
-      else printf("!");
-      if (data_field[0] == 0x65 && field_ofs == 7)
-        describe_data();
-    }
-    bytes_emitted++;
-    byte = 0;
-    bits = 0;
+  if (d->byte_count < 16)
+    d->byte_count++;
+  else {
+    fprintf(d->out, "\n");
+    d->byte_count = 0;
   }
+  if (d->sync_count == 3) {
+    fprintf(d->out, "Data field type $%02x\n", byte);
+    d->sync_count = 0;
+    d->field_ofs = 1;
+    d->data_field[0] = byte;
+  }
+  else {
+    fprintf(d->out, " :$%02x", byte);
+    if (d->field_ofs < 1024)
+      d->data_field[d->field_ofs++] = byte;
+    else
+      fprintf(d->out, "!");
+    if (d->data_field[0] == 0x65 && d->field_ofs == 7)
+      describe_data(d);
+  }
+  d->bytes_emitted++;
 }
 
-int skip_bits = 0;
-char buffered_bits[16];
-int buffered_bit_count = 0;
-
-void buffer_bit(int bit)
+// Shifts the lowest count bits of value (at most 4) into the byte being assembled, oldest first
+void emit_bits(struct decoder *d, unsigned int value, int count)
 {
-  if (0)
-    fprintf(stdout, "buffered bits before stuffing next: %d:  %s\n", buffered_bit_count, buffered_bits);
-
-  buffered_bits[buffered_bit_count] = 0;
-  if (skip_bits) {
-    skip_bits--;
-    return;
-  }
-  if (buffered_bit_count < 16) {
-    buffered_bits[buffered_bit_count++] = bit;
-    buffered_bits[buffered_bit_count] = 0;
+  if (show_bits)
+    for (int i = count - 1; i >= 0; i--)
+      fprintf(d->out, "  bit %d\n", (value >> i) & 1);
+  d->last_bit = value & 1;
+  d->byte = (d->byte << count) | value;
+  d->bits += count;
+  if (d->bits >= 8) {
+    d->bits -= 8;
+    emit_byte(d, d->byte >> d->bits);
+    d->byte &= (1 << d->bits) - 1;
   }
 }
 
-// $4E = ...000100 00001000 0100
-//                6        4    5
-
-// $FE = 1000 1000 1000 0100
-//
-
-// 0001000100001001
-
-//    010  10 0010
+/*
+  MFM: bits produced by a gap of 1.0, 1.5 or 2.0 bit cells, as { bits, count }, depending on
+  whether the previous bit was a 0 or a 1, or this is the first gap.
+*/
+static const unsigned char mfm_bits[3][3][2] = {
+  { { 0x0, 1 }, { 0x1, 1 }, { 0x1, 2 } }, // after a 0
+  { { 0x1, 1 }, { 0x0, 2 }, { 0x1, 2 } }, // after a 1
+  { { 0x3, 2 }, { 0x1, 2 }, { 0x5, 3 } }, // first gap
+};
 
-void bit_buffer_shuffle(int n)
-{
-  for (int i = 0; i < (buffered_bit_count - n); i++)
-    buffered_bits[i] = buffered_bits[i + n];
-  buffered_bit_count -= n;
-  buffered_bits[buffered_bit_count] = 0;
-}
+/*
+  RLL2,7 code words
 
-void rll27_decode_gap(float gap)
-{
-  /*
     Input    Encoded
 
     11       1000
@@ -339,193 +401,121 @@ void rll27_decode_gap(float gap)
     011      001000
     0011     00001000
     0010     00100100
-  */
-
-  for (int i = 0; i < gap; i++)
-    buffer_bit('0');
-  buffer_bit('1');
-
-  buffered_bits[buffered_bit_count] = 0;
-  //  printf("buffered bits: [%s]\n",buffered_bits);
-
-  if (buffered_bit_count >= 8) {
-    if (!strncmp("00001000", buffered_bits, 8)) {
-      emit_bit(0);
-      emit_bit(0);
-      emit_bit(1);
-      emit_bit(1);
-      bit_buffer_shuffle(8);
-    }
-    else if (!strncmp("00100100", buffered_bits, 8)) {
-      emit_bit(0);
-      emit_bit(0);
-      emit_bit(1);
-      emit_bit(0);
-      bit_buffer_shuffle(8);
-    }
-  }
-  if (buffered_bit_count >= 6) {
-    if (!strncmp("100100", buffered_bits, 6)) {
-      emit_bit(0);
-      emit_bit(0);
-      emit_bit(0);
-      bit_buffer_shuffle(6);
-    }
-    else if (!strncmp("000100", buffered_bits, 6)) {
-      emit_bit(0);
-      emit_bit(1);
-      emit_bit(0);
-      bit_buffer_shuffle(6);
-    }
-    else if (!strncmp("001000", buffered_bits, 6)) {
-      emit_bit(0);
-      emit_bit(1);
-      emit_bit(1);
-      bit_buffer_shuffle(6);
-    }
-  }
-  if (buffered_bit_count >= 4) {
-    if (!strncmp("1000", buffered_bits, 4)) {
-      emit_bit(1);
-      emit_bit(1);
-      bit_buffer_shuffle(4);
-    }
-    else if (!strncmp("0100", buffered_bits, 4)) {
-      emit_bit(1);
-      emit_bit(0);
-      bit_buffer_shuffle(4);
-    }
+
+  rll27_table[length][code word] holds the input bits of a code word in the low nibble and their
+  count in the high nibble, or 0 if the encoded bits are not a code word of that length.
+*/
+static const char *rll27_codes[][2] = { { "11", "1000" }, { "10", "0100" }, { "000", "100100" }, { "010", "000100" },
+  { "011", "001000" }, { "0011", "00001000" }, { "0010", "00100100" } };
+unsigned char rll27_table[9][256];
+
+void rll27_init(void)
+{
+  for (int i = 0; i < sizeof(rll27_codes) / sizeof(rll27_codes[0]); i++) {
+    int input = strtol(rll27_codes[i][0], NULL, 2);
+    int encoded = strtol(rll27_codes[i][1], NULL, 2);
+    rll27_table[strlen(rll27_codes[i][1])][encoded] = input | (strlen(rll27_codes[i][0]) << 4);
   }
 }
 
-float recent_gaps[4];
-float sync_gaps_mfm[4] = { 2.0, 1.5, 2.0, 1.5 };
-float sync_gaps_rll27[2] = { 7.0, 2.0 };
+// Decodes a code word of the given length from the front of the shift register, if there is one
+void rll27_match(struct decoder *d, int len)
+{
+  if (d->rll_bit_count < len)
+    return;
+  unsigned char m = rll27_table[len][(d->rll_bits >> (d->rll_bit_count - len)) & ((1 << len) - 1)];
+  if (!m)
+    return;
+  emit_bits(d, m & 0x0f, m >> 4);
+  d->rll_bit_count -= len;
+  d->rll_bits &= (1 << d->rll_bit_count) - 1;
+}
 
-int reset_delta = 0;
-int found_sync3 = 0;
+void rll27_decode_gap(struct decoder *d, int gap)
+{
+  // The gap adds gap zero bits and a one, after dropping any bits still to be skipped
+  // after a sync mark. The register holds at most 16 bits.
+  int count = gap + 1;
+  int skip = d->skip_bits < count ? d->skip_bits : count;
+  d->skip_bits -= skip;
+  count -= skip;
+  int room = 16 - d->rll_bit_count;
+  int added = count < room ? count : room;
+  d->rll_bits = (d->rll_bits << added) | (added && added == count);
+  d->rll_bit_count += added;
+
+  rll27_match(d, 8);
+  rll27_match(d, 6);
+  rll27_match(d, 4);
+}
 
-float previous_partial_gap = 0;
+#define SYNC_GAPS_MFM 0x04030403 // 2.0, 1.5, 2.0, 1.5 bit cells
+#define SYNC_GAPS_RLL27 0x0e04   // 7, 2
 
-float mfm_decode(float gap)
+// Decodes one raw gap, returning its code, or 0 if it was accumulated into the next gap
+int mfm_decode(struct decoder *d, int gap)
 {
-  float gap_in = gap + previous_partial_gap;
+  int gap_in = gap + d->partial_gap;
 
-  if (gap_in < 0.7) {
-    previous_partial_gap = gap;
-    printf("Accumulating short gap %.2f\n", gap);
+  if (gap_in < d->short_gap) {
+    d->partial_gap = gap;
+    fprintf(d->out, "Accumulating short gap %.2f\n", gap / d->divisor);
     return 0;
   }
 
-  if (previous_partial_gap) {
-    printf("Accumulated gap = %.2f + %.2f = %.2f\n", gap, previous_partial_gap, gap_in);
+  if (d->partial_gap) {
+    fprintf(d->out, "Accumulated gap = %.2f + %.2f = %.2f\n", gap / d->divisor, d->partial_gap / d->divisor,
+        gap_in / d->divisor);
   }
-  gap = quantise_gap(gap_in);
-  previous_partial_gap = 0;
+  int code = d->gap_code[gap_in < MAX_RAW_GAP ? gap_in : MAX_RAW_GAP - 1];
+  d->partial_gap = 0;
 
   if (show_quantised_gaps)
-    printf("%.2f (%.2f)\n", gap, gap_in);
-
-  // Look at recent gaps to see if it is a sync mark
-  for (int i = 0; i < 3; i++)
-    recent_gaps[i] = recent_gaps[i + 1];
-  recent_gaps[3] = gap;
+    fprintf(d->out, "%.2f (%.2f)\n", gap_value(d, code), gap_in / d->divisor);
 
-  int i;
-  if (!rll_encoding) {
-    for (i = 0; i < 4; i++)
-      if (recent_gaps[i] != sync_gaps_mfm[i])
-        break;
+  if (d->bin) {
+    d->gap_record[d->gap_record_len++] = code;
+    if (d->gap_record_len == GAP_RECORD_MAX)
+      flush_gap_record(d);
   }
-  else {
-    for (i = 2; i < 4; i++)
-      if (recent_gaps[i] != sync_gaps_rll27[i - 2])
-        break;
-  }
-  if (i == 4) {
-    //    if (byte_count)
-    //      printf("\n");
-    if (bytes_emitted) {
-      describe_data();
-      printf("(%d bytes since last sync)\n", bytes_emitted);
-      sync_count = 0;
-    }
-    sync_count++;
-    if (sync_count == 3) {
-      printf("SYNC MARK (3x $A1)\n");
-      found_sync3++;
-    }
-    printf("Sync $A1 x #%d\n", sync_count);
-    bits = 0;
-    byte = 0;
-    byte_count = 0;
-    bytes_emitted = 0;
-    buffered_bits[0] = '1';
-    buffered_bits[1] = 0;
-    buffered_bit_count = 1;
-    reset_delta = 1;
-    if (rll_encoding)
-      skip_bits = 3;
-    return gap;
-  }
-
-  if (rll_encoding) {
-    rll27_decode_gap(gap);
+
+  // Look at recent gaps to see if it is a sync mark
+  d->recent_gaps = (d->recent_gaps << 8) | (d->rll_encoding ? code * 2 : code);
+  if (d->rll_encoding ? (d->recent_gaps & 0xffff) == SYNC_GAPS_RLL27 : d->recent_gaps == SYNC_GAPS_MFM) {
+    if (d->bytes_emitted) {
+      describe_data(d);
+      fprintf(d->out, "(%d bytes since last sync)\n", d->bytes_emitted);
+      d->sync_count = 0;
+    }
+    d->sync_count++;
+    if (d->sync_count == 3) {
+      fprintf(d->out, "SYNC MARK (3x $A1)\n");
+      d->found_sync3++;
+    }
+    fprintf(d->out, "Sync $A1 x #%d\n", d->sync_count);
+    d->bits = 0;
+    d->byte = 0;
+    d->byte_count = 0;
+    d->bytes_emitted = 0;
+    d->rll_bits = 1;
+    d->rll_bit_count = 1;
+    d->reset_delta = 1;
+    if (d->rll_encoding)
+      d->skip_bits = 3;
+    return code;
   }
+
+  if (d->rll_encoding)
+    rll27_decode_gap(d, code);
   else {
-    // MFM
-    if (!last_gap) {
-      if (gap == 1.0) {
-        emit_bit(1);
-        emit_bit(1);
-      }
-      else if (gap == 1.5) {
-        emit_bit(0);
-        emit_bit(1);
-      }
-      else if (gap >= 2.0) {
-        emit_bit(1);
-        emit_bit(0);
-        emit_bit(1);
-      }
-    }
-    else {
-      if (last_bit == 1) {
-        if (gap == 1.0)
-          emit_bit(1);
-        else if (gap == 1.5) {
-          emit_bit(0);
-          emit_bit(0);
-        }
-        else if (gap >= 2.0) {
-          emit_bit(0);
-          emit_bit(1);
-        }
-      }
-      else {
-        // last bit was a 0
-        if (gap == 1.0)
-          emit_bit(0);
-        else if (gap == 1.5) {
-          emit_bit(1);
-        }
-        else if (gap == 2.0) {
-          emit_bit(0);
-          emit_bit(1);
-        }
-      }
-    }
+    const unsigned char *b = mfm_bits[d->last_gap ? d->last_bit : 2][code - 2];
+    emit_bits(d, b[0], b[1]);
   }
 
-  last_gap = gap;
-  return gap;
+  d->last_gap = code;
+  return code;
 }
 
-struct precomp_rule {
-  float before, me, after;
-  float shift;
-};
-
 float absf(float f)
 {
   if (f < 0)
@@ -533,450 +523,446 @@ float absf(float f)
   return f;
 }
 
-#define RULE_COUNT 13
-// clang-format off
-struct precomp_rule rules[RULE_COUNT]
-={
-  { 1.0,1.0,1.5,+0.10 }, //
-  { 1.0,1.0,2.0,+0.15 }, //
-
-  { 1.0,1.5,1.0,-0.20 }, //
-  { 1.0,1.5,1.5,-0.15 },
-  { 1.0,1.5,2.0,-0.05 },
-
-  { 1.0,2.0,1.0,-0.25 }, //
-  { 1.0,2.0,1.5,-0.20 }, 
-  
-  { 1.5,1.0,1.0,+0.10 },
-  { 1.5,1.0,2.0,+0.20 }, //
-
-  { 1.5,1.5,1.0,-0.05 }, //
-  { 1.5,2.0,1.0,-0.15 }, //
-  
-  { 2.0,1.0,1.00,+0.15},
-  { 2.0,1.0,1.50,+0.20}  //
+/*
+  Pulse registration analysis behind rawgaps.csv (-c). This compares each pulse against the
+  previous eight, which is far more work than the decoding itself, so it only runs on request.
+*/
+struct gap_analysis {
+  int current_pulse;
+  int last_pulse;
+  int last_pulse_uncorrected;
+  int early, late, n;
+  float recent[8];
+  int recent_q[8];
+  float esum;
 };
-// clang-format on
 
-// Frequency of a gap following the two previously indicate gap values
-unsigned int gap_freqs[256][256][256];
-
-int main(int argc, char **argv)
+void analyse_gap(struct decoder *d, struct gap_analysis *a, int raw)
 {
-  if (argc < 2) {
-    fprintf(stderr, "usage: mfm-decode <MEGA65 FDC read capture ...>\n");
-    exit(-1);
+  float divisor = d->divisor;
+  float gap = raw / divisor;
+  float (*quantise_gap)(float) = d->rll_encoding ? quantise_gap_rll27 : quantise_gap_mfm;
+  float *recent = a->recent;
+  int *recent_q = a->recent_q;
+  int current_pulse = a->current_pulse;
+
+  a->n++;
+
+  float v[8] = { current_pulse / divisor - recent[0] - recent_q[1] - recent_q[2] - recent_q[3] - recent_q[4] - recent_q[5]
+                     - recent_q[6] - recent_q[7],
+    current_pulse / divisor - recent[1] - recent_q[2] - recent_q[3] - recent_q[4] - recent_q[5] - recent_q[6] - recent_q[7],
+    current_pulse / divisor - recent[2] - recent_q[3] - recent_q[4] - recent_q[5] - recent_q[6] - recent_q[7],
+
+    current_pulse / divisor - recent[3] - recent_q[4] - recent_q[5] - recent_q[6] - recent_q[7],
+    current_pulse / divisor - recent[4] - recent_q[5] - recent_q[6] - recent_q[7],
+    current_pulse / divisor - recent[5] - recent_q[6] - recent_q[7], current_pulse / divisor - recent[6] - recent_q[7],
+    current_pulse / divisor - recent[7] };
+
+  // Rule 1: Fall-back is to average the registration against the past five pulses
+  float avg = 0;
+  for (int i = 0; i < 8; i++)
+    avg += v[i];
+  avg /= 8;
+  float e1, e2;
+  e1 = gap - quantise_gap(gap) - 1;
+
+  // Rule 2: If the gap is an integer number of gaps vs any of the past five pulses,
+  // then use the one that had the most hits
+  int best_count = 0;
+  int best_int = 0;
+  int counts[9] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+  for (int i = 0; i < 8; i++) {
+    if (absf(v[i]) - ((int)absf(v[i])) < 0.02) {
+      int bin = (int)absf(v[i]);
+      if (bin >= 0 && bin < 10)
+        counts[bin]++;
+    }
   }
-
-  for (int i = 0; i < MAX_SIGNALS; i++) {
-    sample_counts[i] = 0;
+  for (int i = 3; i <= 8; i++) {
+    if (counts[i] > best_count) {
+      best_count = counts[i];
+      best_int = i;
+    }
   }
+  if (best_count > 0)
+    avg = best_int;
+
+  e2 = avg - quantise_gap(gap) - 1;
+  if (a->n >= 186)
+    a->esum += absf(e2 * 100) * absf(e2 * 100);
+
+  fprintf(d->raw,
+      "%-4d,% -9.2f"
+      ",% -5.2f"
+      ",% -5.2f"
+      ",%5d"
+      ",% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f"
+      ",% -7.2f,% -7.2f,% -7.2f"
+      "\n",
+      a->n, current_pulse / divisor, (current_pulse - a->last_pulse) / divisor, avg, current_pulse - a->last_pulse, v[0],
+      v[1], v[2], v[3], v[4], v[5], v[6], v[7], e1, e2, a->esum);
+  for (int r = 0; r < (8 - 1); r++)
+    recent[r] = recent[r + 1];
+  for (int r = 0; r < (8 - 1); r++)
+    recent_q[r] = recent_q[r + 1];
+  recent[7] = current_pulse / divisor;
+  recent_q[7] = quantise_gap(gap) + 1;
+}
 
-  for (int arg = 1; arg < argc; arg++) {
-    FILE *f = fopen(argv[arg], "r");
-    unsigned char buffer[MAX_SAMPLES];
-    int count = fread(buffer, 1, MAX_SAMPLES, f);
-    printf("Read %d bytes\n", count);
-
-    crc16_init();
-
-    int i;
-
-    fprintf(stderr, "NOTE: Assuming DMA floppy gap capture.\n");
-    fprintf(stderr, "      %d samples.\n", count);
+// Tracks early/late pulses against the decoded gap, for the pulse positions in rawgaps.csv
+void correct_pulse(struct decoder *d, struct gap_analysis *a, int raw, int code)
+{
+  float divisor = d->divisor;
+  float gap = raw / divisor;
+  int pulse_adjust = 0;
+
+  if (show_quantised_gaps) {
+    float uncorrected_gap = a->current_pulse - a->last_pulse_uncorrected;
+    uncorrected_gap /= divisor;
+    float uc_delta = (d->rll_encoding ? quantise_gap_rll27 : quantise_gap_mfm)(uncorrected_gap) - uncorrected_gap + 1;
+    fprintf(d->out, "     uncorrected gap=%.2f, delta=%.2f\n", uncorrected_gap, uc_delta);
+  }
+  if (d->rll_encoding) {
+    float delta = (gap - 1) - (code ? gap_value(d, code) : 0);
+    if (d->reset_delta) {
+      delta = 0;
+      d->reset_delta = 0;
+    }
+    if (delta > 0 && delta <= 0.5) {
+      // Pulse is a bit late, so adjust last_pulse backwards a bit
+      pulse_adjust = (int)(delta * divisor);
+    }
+    if (delta < 0 && delta >= -0.5) {
+      // Pulse is a bit late, so adjust last_pulse backwards a bit
+      pulse_adjust = (int)(delta * divisor);
+    }
+    if (delta < 0)
+      a->early++;
+    if (delta > 0)
+      a->late++;
+    if (a->late > 5) {
+      if (show_post_correction)
+        fprintf(d->out, "     LATE\n");
+      a->late = 0;
+      pulse_adjust--;
+    }
+    if (a->early > 5) {
+      if (show_post_correction)
+        fprintf(d->out, "     EARLY\n");
+      a->early = 0;
+      pulse_adjust++;
+    }
+
+    if (show_post_correction)
+      fprintf(d->out, "     post-correction delta=%.2f\n", delta);
+  }
+  a->last_pulse = a->current_pulse - pulse_adjust;
+  a->last_pulse_uncorrected = a->current_pulse;
+}
 
-    // Obtain data rate from filename if present
-    sscanf(argv[arg], "rate%f", &rate);
-    fprintf(stderr, "Rate = %f\n", rate);
+// Frequency of each gap value, and of the quantised values of the two gaps before it,
+// to help tune our write pre-comp logic
+void show_gap_statistics(struct decoder *d, unsigned char *buffer, int count)
+{
+  FILE *out = d->out;
+  unsigned int(*tally)[10][10] = calloc(256, sizeof(*tally));
+  unsigned int cs[256];
+  unsigned int bc[10];
+  int q[256];
+
+  // quantise as RLL2,7, at half the rate because values are shifted right one
+  float rate = d->rate / 2;
+  for (int v = 0; v < 256; v++)
+    q[v] = q_gap(quantise_gap_rll27(v / rate));
+
+  if (!tally) {
+    fprintf(stderr, "ERROR: Could not allocate memory\n");
+    exit(-1);
+  }
+  bzero(cs, sizeof(cs));
+  bzero(bc, sizeof(bc));
+  for (int i = 2; i < count; i++) {
+    tally[buffer[i]][q[buffer[i - 2]]][q[buffer[i - 1]]]++;
+    cs[buffer[i]]++;
+  }
+  for (int c = 0; c < 256; c++) {
+    if (cs[c])
+      fprintf(out, "%3d : %d\n", c, cs[c]);
+    bc[q[c]] += cs[c];
+  }
 
-    last_pulse = 0;
-    found_sync3 = 0;
+  for (int c = 0; c < 10; c++) {
+    if (bc[c]) {
+      fprintf(out, "%d (%6d) : ", c, bc[c]);
+      for (int c0 = 0; c0 < 256; c0++) {
+        if (q[c0] != c)
+          continue;
+        fprintf(out, "\n      c0=%d : ", c0);
+        for (int a = 0; a < 10; a++)
+          for (int b = 0; b < 10; b++)
+            if (tally[c0][a][b])
+              fprintf(out, " %d@%d,%d", tally[c0][a][b], a, b);
+      }
+      fprintf(out, "\n");
+    }
+  }
+  free(tally);
+}
 
-    float divisor = rate;
-    int pulse_adjust = 0;
-    int last_pulse_uncorrected = 9;
-    int early = 0;
-    int late = 0;
-    int n = 0;
+/*
+  Decodes one capture, writing the text report to out. Returns 0 on success.
+*/
+int decode_capture(char *filename, FILE *out, long *samples)
+{
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not open '%s'\n", filename);
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  unsigned char *buffer = malloc(size ? size : 1);
+  struct decoder *d = calloc(1, sizeof(struct decoder));
+  if (!buffer || !d) {
+    fprintf(stderr, "ERROR: Could not allocate memory for '%s'\n", filename);
+    exit(-1);
+  }
+  int count = fread(buffer, 1, size, f);
+  fclose(f);
 
-    FILE *raw = fopen("rawgaps.csv", "w");
-    float recent[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-    int recent_q[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-    float esum = 0;
+  d->out = out;
+  fprintf(out, "Read %d bytes\n", count);
 
-    int current_pulse = 0;
+  if (!benchmark) {
+    fprintf(stderr, "NOTE: Assuming DMA floppy gap capture.\n"
+                    "      %d samples.\n",
+        count);
+  }
 
-    for (i = 1; i < count; i++) {
-      pulse_adjust = 0;
-      float gap = buffer[i];
+  // Obtain data rate from filename if present
+  d->rate = DEFAULT_RATE;
+  sscanf(filename, "rate%f", &d->rate);
+  if (!benchmark)
+    fprintf(stderr, "Rate = %f\n", d->rate);
+  d->divisor = d->rate;
+  build_gap_tables(d);
+
+  char name[8192];
+  if (write_gap_csv) {
+    // a single capture keeps the traditional name
+    if (write_gap_csv > 1)
+      snprintf(name, sizeof(name), "%s.rawgaps.csv", filename);
+    else
+      snprintf(name, sizeof(name), "rawgaps.csv");
+    d->raw = fopen(name, "w");
+    if (!d->raw)
+      fprintf(stderr, "ERROR: Could not create '%s'\n", name);
+  }
+  if (write_binary) {
+    snprintf(name, sizeof(name), "%s.dec", filename);
+    d->bin = fopen(name, "wb");
+    if (!d->bin)
+      fprintf(stderr, "ERROR: Could not create '%s'\n", name);
+    else
+      fwrite("MFD1", 4, 1, d->bin);
+  }
 
-      current_pulse += buffer[i];
+  struct gap_analysis a = { .last_pulse_uncorrected = 9 };
+  int analyse = d->raw || show_gaps || show_quantised_gaps || show_post_correction;
 
-      if (show_gaps)
-        printf(" $%03x(%3d) ", (int)(gap * 3.0 / 2), (int)(gap * 3.0 / 2));
-      gap /= divisor;
+  for (int i = 1; i < count; i++) {
+    int gap = buffer[i];
 
-      n++;
+    a.current_pulse += gap;
 
-      float v[8] = { current_pulse / divisor - recent[0] - recent_q[1] - recent_q[2] - recent_q[3] - recent_q[4]
-                         - recent_q[5] - recent_q[6] - recent_q[7],
-        current_pulse / divisor - recent[1] - recent_q[2] - recent_q[3] - recent_q[4] - recent_q[5] - recent_q[6]
-            - recent_q[7],
-        current_pulse / divisor - recent[2] - recent_q[3] - recent_q[4] - recent_q[5] - recent_q[6] - recent_q[7],
+    if (show_gaps)
+      fprintf(out, " $%03x(%3d) ", (int)(gap * 3.0 / 2), (int)(gap * 3.0 / 2));
 
-        current_pulse / divisor - recent[3] - recent_q[4] - recent_q[5] - recent_q[6] - recent_q[7],
-        current_pulse / divisor - recent[4] - recent_q[5] - recent_q[6] - recent_q[7],
-        current_pulse / divisor - recent[5] - recent_q[6] - recent_q[7], current_pulse / divisor - recent[6] - recent_q[7],
-        current_pulse / divisor - recent[7] };
+    if (d->raw)
+      analyse_gap(d, &a, gap);
 
-      // Rule 1: Fall-back is to average the registration against the past five pulses
-      float avg = 0;
-      for (int i = 0; i < 8; i++)
-        avg += v[i];
-      avg /= 8;
-      float e1, e2;
-      e1 = gap - quantise_gap(gap) - 1;
+    if (show_gaps)
+      fprintf(out, "%.2f (%d-%d=%d)\n", gap / d->divisor, a.current_pulse, a.last_pulse, a.current_pulse - a.last_pulse);
 
-      // Rule 2: If the gap is an integer number of gaps vs any of the past five pulses,
-      // then use the one that had the most hits
-      int best_count = 0;
-      int best_int = 0;
-      int counts[9] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-      for (int i = 0; i < 8; i++) {
-        if (absf(v[i]) - ((int)absf(v[i])) < 0.02) {
-          int bin = (int)absf(v[i]);
-          if (bin >= 0 && bin < 10)
-            counts[bin]++;
-        }
-      }
-      for (int i = 3; i <= 8; i++) {
-        if (counts[i] > best_count) {
-          best_count = counts[i];
-          best_int = i;
-        }
-      }
-      if (best_count > 0)
-        avg = best_int;
-
-      e2 = avg - quantise_gap(gap) - 1;
-      if (n >= 186)
-        esum += absf(e2 * 100) * absf(e2 * 100);
-
-      fprintf(raw,
-          "%-4d,% -9.2f"
-          ",% -5.2f"
-          ",% -5.2f"
-          ",%5d"
-          ",% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f"
-          ",% -7.2f,% -7.2f,% -7.2f"
-          "\n",
-          n, current_pulse / divisor, (current_pulse - last_pulse) / divisor, avg, current_pulse - last_pulse, v[0], v[1],
-          v[2], v[3], v[4], v[5], v[6], v[7], e1, e2, esum);
-      for (int r = 0; r < (8 - 1); r++)
-        recent[r] = recent[r + 1];
-      for (int r = 0; r < (8 - 1); r++)
-        recent_q[r] = recent_q[r + 1];
-      recent[7] = current_pulse / divisor;
-      recent_q[7] = quantise_gap(gap) + 1;
-
-      if (show_gaps)
-        printf("%.2f (%d-%d=%d)\n", gap, current_pulse, last_pulse, current_pulse - last_pulse);
-
-      if (found_sync3 == 1) {
-        printf("Harmonising at Sync3 after %d samples\n", sample_counts[arg]);
-        sample_counts[arg] = 0;
-        found_sync3++;
-      }
+    if (d->found_sync3 == 1) {
+      fprintf(out, "Harmonising at Sync3 after %ld samples\n", d->samples);
+      d->samples = 0;
+      d->found_sync3++;
+    }
+    d->samples++;
 
-      // Log the trace
-      if (sample_counts[arg]) {
-        // Calculate cumulative time
-        traces[arg][sample_counts[arg]] = gap + traces[arg][sample_counts[arg] - 1];
-      }
-      else {
-        traces[arg][sample_counts[arg]] = gap;
-      }
-      sample_counts[arg]++;
-      if (traces[arg][sample_counts[arg] - 1] > max_time)
-        max_time = traces[arg][sample_counts[arg] - 1];
-
-      float quantised = mfm_decode(gap);
-      {
-        float uncorrected_gap = current_pulse - last_pulse_uncorrected;
-        uncorrected_gap /= divisor;
-        float uc_delta = quantise_gap(uncorrected_gap) - uncorrected_gap + 1;
-        if (show_quantised_gaps)
-          printf("     uncorrected gap=%.2f, delta=%.2f\n", uncorrected_gap, uc_delta);
-        uncorrected_deltas[ucdelta_count++] = uc_delta;
-      }
-      if (rll_encoding) {
-        float delta = (gap - 1) - quantised;
-        if (reset_delta) {
-          delta = 0;
-          reset_delta = 0;
-        }
-        if (delta > 0 && delta <= 0.5) {
-          // Pulse is a bit late, so adjust last_pulse backwards a bit
-          pulse_adjust = (int)(delta * divisor);
-          //		printf("rewind last_pulse by %d\n",pulse_adjust);
-        }
-        if (delta < 0 && delta >= -0.5) {
-          // Pulse is a bit late, so adjust last_pulse backwards a bit
-          pulse_adjust = (int)(delta * divisor);
-          //		printf("advance last_pulse by %d\n",-pulse_adjust);
-        }
-        if (delta < 0)
-          early++;
-        if (delta > 0)
-          late++;
-        if (late > 5) {
-          if (show_post_correction)
-            printf("     LATE\n");
-          late = 0;
-          pulse_adjust--;
-        }
-        if (early > 5) {
-          if (show_post_correction)
-            printf("     EARLY\n");
-          early = 0;
-          pulse_adjust++;
-        }
+    int code = mfm_decode(d, gap);
+    if (analyse)
+      correct_pulse(d, &a, gap, code);
+  }
 
-        if (show_post_correction)
-          printf("     post-correction delta=%.2f\n", delta);
-        corrected_deltas[ucdelta_count] = delta;
-      }
-      last_pulse = current_pulse - pulse_adjust;
-      last_pulse_uncorrected = current_pulse;
-    }
+  if (d->raw)
+    fclose(d->raw);
+  if (d->bin) {
+    flush_gap_record(d);
+    fclose(d->bin);
+  }
 
-    fclose(raw);
+  fprintf(out, "\n");
 
-    printf("\n");
+  show_gap_statistics(d, buffer, count);
 
-    // Record the gap lengths based on the previous two gaps
-    // to help tune our write pre-comp logic
-    bzero(gap_freqs, sizeof(unsigned int) * 256 * 256 * 256);
-    unsigned int cs[256];
-    bzero(cs, sizeof(unsigned int) * 256);
-    for (i = 2; i < count; i++) {
-      gap_freqs[buffer[i - 2]][buffer[i - 1]][buffer[i]]++;
-      cs[buffer[i]]++;
-    }
-    for (int c = 0; c < 256; c++) {
-      if (cs[c])
-        printf("%3d : %d\n", c, cs[c]);
-    }
+  *samples = count;
+  free(buffer);
+  free(d);
+  return 0;
+}
 
-    unsigned int buckets[10][10][10];
-    bzero(buckets, sizeof(unsigned int) * 10 * 10 * 10);
-    unsigned int bc[10];
-    bzero(bc, sizeof(bc));
-
-    rll_encoding = 1;
-    rate = rate / 2; // because values are shifted right one
-
-    for (int c = 0; c < 256; c++) {
-      //	if (!cs[c]) { skip=1; continue; }
-      for (int a = 0; a < 256; a++) {
-        for (int b = 0; b < 256; b++) {
-          if (gap_freqs[a][b][c]) {
-            //	      printf("%d,%d,%d\n",
-            //		     q_gap(quantise_gap(a/rate)),q_gap(quantise_gap(b/rate)),q_gap(quantise_gap(c/rate)));
-            buckets[q_gap(quantise_gap(a / rate))][q_gap(quantise_gap(b / rate))][q_gap(quantise_gap(c / rate))]
-                += gap_freqs[a][b][c];
-            bc[q_gap(quantise_gap(c / rate))] += gap_freqs[a][b][c];
-          }
-        }
-      }
-      //	printf("\n");
-    }
+/*
+  Batch mode: worker threads take the next capture in turn, each writing its report to a
+  temporary file, which is then copied to stdout in command line order.
+*/
+struct capture_job {
+  char *filename;
+  FILE *out;
+  int result;
+  long samples;
+};
 
-    // int skip = 0;
-    for (int c = 0; c < 10; c++) {
-      if (bc[c]) {
-        printf("%d (%6d) : ", c, bc[c]);
-
-        int tally[10][10];
-
-        for (int c0 = 0; c0 < 256; c0++) {
-          int cc = q_gap(quantise_gap(c0 / rate));
-          bzero(tally, sizeof(tally));
-          for (int a = 0; a < 256; a++) {
-            for (int b = 0; b < 256; b++) {
-              int aa = q_gap(quantise_gap(a / rate));
-              int bb = q_gap(quantise_gap(b / rate));
-              if (cc == c) {
-                if (gap_freqs[a][b][c0]) {
-                  tally[aa][bb] += gap_freqs[a][b][c0];
-                }
-              }
-            }
-          }
-
-          if (cc == c) {
-            printf("\n      c0=%d : ", c0);
-            for (int a = 0; a < 10; a++) {
-              for (int b = 0; b < 10; b++) {
-                if (tally[a][b])
-                  printf(" %d@%d,%d", tally[a][b], a, b);
-              }
-            }
-          }
-        }
+struct capture_job *jobs;
+int job_count;
+int next_job = 0;
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
 
-        printf("\n");
-      }
-    }
+void *decode_worker(void *arg)
+{
+  while (1) {
+    pthread_mutex_lock(&job_lock);
+    int j = next_job++;
+    pthread_mutex_unlock(&job_lock);
+    if (j >= job_count)
+      break;
+    jobs[j].result = decode_capture(jobs[j].filename, jobs[j].out, &jobs[j].samples);
   }
-  return 0;
-
-  FILE *f = fopen("gaps.vcd", "w");
-  if (!f)
-    return -1;
+  return NULL;
+}
 
-  fprintf(f, "$date\n"
-             "   Mon Feb 17 15:29:53 2020\n"
-             "\n"
-             "$end\n"
-             "$version\n"
-             "   MEGA65 Floppy Decode Trace Tool.\n"
-             "$end\n"
-             "$comment\n"
-             "   No comment.\n"
-             "$end\n"
-             "$timescale 1us $end\n"
-             "$scope module logic $end\n");
-
-  for (int arg = 1; arg < argc + 2; arg++) {
-    if (arg < argc)
-      fprintf(f, "$var wire 1 %c %s $end\n", '@' + arg, argv[arg]);
-    else if (arg == argc)
-      fprintf(f, "$var wire 1 %c model $end\n", '@' + arg);
+int decode_all(void)
+{
+  int retVal = 0;
+  pthread_t threads[thread_count];
+
+  for (int j = 0; j < job_count; j++) {
+    if (benchmark)
+      jobs[j].out = fopen("/dev/null", "w");
+    else if (thread_count > 1)
+      jobs[j].out = tmpfile();
     else
-      fprintf(f, "$var wire 1 %c modelerr $end\n", '@' + arg);
-  }
-
-  fprintf(f, "$upscope $end\n"
-             "$enddefinitions $end\n"
-             "$dumpvars\n");
-  for (int arg = 1; arg < argc + 2; arg++)
-    fprintf(f, "0%c\n", '@' + arg);
-  fprintf(f, "$end\n"
-             "\n");
-
-  printf("Determining average time base for fastest rate...\n");
-  float sum = 0;
-  int count = 0;
-  for (int i = 1; i < sample_counts[1]; i++) {
-    float diff = traces[1][i] - traces[1][i - 1];
-    if (diff >= 0.91 && diff <= 1.09) {
-      sum += diff;
-      count++;
+      jobs[j].out = stdout;
+    if (!jobs[j].out) {
+      fprintf(stderr, "ERROR: Could not create output file for '%s'\n", jobs[j].filename);
+      exit(-1);
     }
   }
-  printf("%d samples for slowest rate.\n", sample_counts[argc - 1]);
-  if (count)
-    printf("Renormalising %d samples : 1.0 step on average = %.2f to 1.0\n", sample_counts[1], sum / count);
-  // Renormalise trace 1 to be exactly 1.0 per MFM bit
-  for (int i = 1; i < sample_counts[1]; i++)
-    traces[1][i] /= sum / count;
-
-  // Generate modeled distorted high-data-rate signal
-  // Rule #1: short then long makes the short late, and the long early (draws them together)
-  // Rule #2: long then short makes the long early and short late (pushes them apart)
-  // Rule #3: Double early and double late make no difference
-  // Rule #4: Presumably early + late = ontime ("The Deutsche Bahn Rule")
-  printf("Surrounding gaps:\n");
-  for (int i = 0; i < sample_counts[argc - 1]; i++) {
-    float gap_before = 1.0;
-    float gap_me = 1.0;
-    float gap_after = 1.0;
-    if (i > 1) {
-      gap_before = traces[argc - 1][i - 1] - traces[argc - 1][i - 2];
-    }
-    if (i) {
-      gap_me = traces[argc - 1][i] - traces[argc - 1][i - 1];
-    }
-    if (i < (sample_counts[argc - 1] - 1)) {
-      gap_after = traces[argc - 1][i + 1] - traces[argc - 1][i];
-    }
-    gap_before = quantise_gap(gap_before);
-    gap_me = quantise_gap(gap_me);
-    gap_after = quantise_gap(gap_after);
 
-    float gap_munged = gap_me;
+  next_job = 0;
+  if (thread_count > 1) {
+    for (int t = 0; t < thread_count; t++)
+      pthread_create(&threads[t], NULL, decode_worker, NULL);
+    for (int t = 0; t < thread_count; t++)
+      pthread_join(threads[t], NULL);
+  }
+  else
+    decode_worker(NULL);
+
+  for (int j = 0; j < job_count; j++) {
+    if (jobs[j].result)
+      retVal = -1;
+    if (jobs[j].out == stdout)
+      continue;
+    if (!benchmark) {
+      char buf[65536];
+      int n;
+      rewind(jobs[j].out);
+      while ((n = fread(buf, 1, sizeof(buf), jobs[j].out)) > 0)
+        fwrite(buf, 1, n, stdout);
+    }
+    fclose(jobs[j].out);
+  }
+  return retVal;
+}
 
-    for (int j = 0; j < RULE_COUNT; j++) {
-      if (gap_before == rules[j].before && gap_me == rules[j].me && gap_after == rules[j].after)
-        gap_munged += rules[j].shift;
-    }
+long long gettime_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
 
-    traces[argc][i] = gap_munged;
-    float ref_gap = 1.0;
-    if (i) {
-      ref_gap = traces[1][i] - traces[1][i - 1];
-      //	traces[argc+1][i]=quantise_gap(ref_gap)-gap_munged;
-      traces[argc + 1][i] = ref_gap - gap_munged;
-      traces[argc][i] += traces[argc][i - 1];
-    }
-    printf("#%-5d : %.2f : %.2f : %.2f : %.2f : M=%.2f vs R=%.2f (%.2f)", i, traces[argc - 1][i], gap_before, gap_me,
-        gap_after, gap_munged, ref_gap, traces[argc - 1][i]);
-    if (absf(traces[argc + 1][i]) >= 0.06)
-      printf("  E=%.2f", traces[argc + 1][i]);
-    printf("\n");
-  }
-
-  float time = 0;
-  int ofs[MAX_SIGNALS] = { 0 };
-  int asserted[MAX_SIGNALS] = { 0 };
-  for (int arg = 1; arg < argc + 2; arg++) {
-    for (int i = 0; i < sample_counts[arg]; i++)
-      printf("#%d : %.2f : %.2f\n", arg, traces[arg][i], i ? traces[arg][i] - traces[arg][i - 1] : traces[arg][i]);
-  }
-
-  for (time = 0; time < (max_time + 0.01); time += 0.01) {
-    for (int arg = 1; arg < argc + 2; arg++) {
-      if (ofs[arg] < sample_counts[arg]) {
-        if (asserted[arg]) {
-          fprintf(f, "#%d\n0%c\n", (int)(time * 100), '@' + arg);
-          asserted[arg] = 0;
-          ofs[arg]++;
-        }
-        else if (traces[arg][ofs[arg]] <= time) {
-          fprintf(f, "#%d\n1%c\n", (int)(time * 100), '@' + arg);
-          asserted[arg] = 1;
-        }
-      }
-    }
-  }
-  fclose(f);
+void usage(void)
+{
+  fprintf(stderr, "usage: mfm-decode [-c] [-b] [-j <threads>] [-t] <MEGA65 FDC read capture ...>\n"
+                  "  -c - write the pulse registration analysis to rawgaps.csv\n"
+                  "       (<capture>.rawgaps.csv when decoding more than one capture).\n"
+                  "  -b - write decoded sectors and quantised gaps to <capture>.dec in compact binary form.\n"
+                  "  -j - decode this many captures in parallel.\n"
+                  "  -t - benchmark: decode the captures repeatedly, discarding the output, and report throughput.\n");
+  exit(-1);
+}
 
-  f = fopen("gaps.csv", "w");
-  if (!f)
-    return -1;
-  for (int i = 0; i < sample_counts[1]; i++) {
-    fprintf(f, "%5d, ", i);
-    for (int arg = 1; arg < argc + 2; arg++) {
-      fprintf(f, "%.2f, ", traces[arg][i] - (i ? traces[arg][i - 1] : 0));
+int main(int argc, char **argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "bcj:t")) != -1) {
+    switch (opt) {
+    case 'b':
+      write_binary = 1;
+      break;
+    case 'c':
+      write_gap_csv = 1;
+      break;
+    case 'j':
+      thread_count = atoi(optarg);
+      if (thread_count < 1)
+        usage();
+      break;
+    case 't':
+      benchmark = 1;
+      break;
+    default:
+      usage();
     }
-    fprintf(f, "\n");
   }
-  fclose(f);
-
-  f = fopen("deltacompare.csv", "w");
-  float ucsum = 0, csum = 0, ucmax = 0, cmax = 0;
-  for (int i = start_data; i < ucdelta_count; i++) {
-    if (absf(uncorrected_deltas[i]) > ucmax)
-      ucmax = uncorrected_deltas[i];
-    if (absf(corrected_deltas[i]) > cmax)
-      cmax = corrected_deltas[i];
-    ucsum += absf(uncorrected_deltas[i]);
-    csum += absf(corrected_deltas[i]);
-    fprintf(f, "%-4d,% -5.2f,% -5.2f,% -5.2f,% -6.2f,% -5.2f,% -6.2f\n", i, uncorrected_deltas[i], corrected_deltas[i], cmax,
-        ucmax, csum, ucsum);
+  if (optind >= argc)
+    usage();
+
+  job_count = argc - optind;
+  if (write_gap_csv && job_count > 1)
+    write_gap_csv = 2;
+  jobs = calloc(job_count, sizeof(struct capture_job));
+  if (!jobs) {
+    fprintf(stderr, "ERROR: Could not allocate memory\n");
+    exit(-1);
   }
-  fclose(f);
-
+  for (int j = 0; j < job_count; j++)
+    jobs[j].filename = argv[optind + j];
+
+  crc16_init();
+  rll27_init();
+
+  if (!benchmark)
+    return decode_all() ? 1 : 0;
+
+  // Repeat the whole batch for at least a second, so small captures still give stable numbers
+  long long start = gettime_us(), elapsed;
+  long long samples = 0;
+  int rounds = 0;
+  do {
+    if (decode_all())
+      return 1;
+    for (int j = 0; j < job_count; j++)
+      samples += jobs[j].samples;
+    rounds++;
+    elapsed = gettime_us() - start;
+  } while (elapsed < 1000000);
+
+  fprintf(stderr, "Decoded %d capture(s) %d times using %d thread(s): %lld samples in %.2f seconds, %.2f Msamples/sec\n",
+      job_count, rounds, thread_count, samples, elapsed / 1000000.0, samples / (double)elapsed);
   return 0;
 }
@@ -151,6 +151,9 @@ int fd = -1;
 #define READ_SECTOR_BUFFER_ADDRESS 0xFFD6e00
 #define WRITE_SECTOR_BUFFER_ADDRESS 0xFFD6e00
 
+// where the sector being dumped lives: the SD sector buffer, or a read-ahead slot
+unsigned int sd_read_base = READ_SECTOR_BUFFER_ADDRESS;
+
 unsigned long long gettime_ms()
 {
   struct timeval nowtv;
@@ -238,9 +241,9 @@ int process_line(char *line, int live)
         // dump_bytes(0,"SDcard status",sd_status,16);
         sd_status_fresh = 1;
       }
-      else if (addr >= READ_SECTOR_BUFFER_ADDRESS && (addr <= (READ_SECTOR_BUFFER_ADDRESS + 0x200))) {
+      else if (addr >= sd_read_base && (addr <= (sd_read_base + 0x200))) {
         // Reading sector card buffer
-        int sector_offset = addr - READ_SECTOR_BUFFER_ADDRESS;
+        int sector_offset = addr - sd_read_base;
         // printf("Read sector buffer 0x%03x - 0x%03x\n",sector_offset,sector_offset+15);
         if (sector_offset < 512) {
           if (sd_read_buffer) {
@@ -348,9 +351,34 @@ int queue_command(char *c)
   return 0;
 }
 
+int fat_opendir(char *path);
+int fat_readdir(struct dirent *d);
+int open_file_system(void);
+extern int file_system_found;
+
 int execute_command(char *cmd)
 {
+  char src[1024], dst[1024];
+  struct dirent de;
+
   printf("'%s'\n", cmd);
+  if (!strcmp(cmd, "dir")) {
+    if (!file_system_found)
+      open_file_system();
+    if (!file_system_found || fat_opendir("/")) {
+      fprintf(stderr, "ERROR: Could not open file system.\n");
+      return -1;
+    }
+    while (!fat_readdir(&de))
+      if (de.d_name[0])
+        printf("%13s   %d\n", de.d_name, (int)de.d_off);
+  }
+  else if (sscanf(cmd, "put %1023s %1023s", src, dst) == 2)
+    return upload_file(src, dst);
+  else if (sscanf(cmd, "put %1023s", src) == 1)
+    return upload_file(src, basename(src));
+  else
+    fprintf(stderr, "ERROR: Unknown command '%s' (try dir, put <file> [name])\n", cmd);
   return 0;
 }
 
@@ -363,7 +391,7 @@ int main(int argc, char **argv)
   while ((opt = getopt(argc, argv, "b:s:l:c:")) != -1) {
     switch (opt) {
     case 'l':
-      strcpy(serial_port, optarg);
+      serial_port = strdup(optarg);
       break;
     case 's':
       serial_speed = atoi(optarg);
@@ -517,15 +545,22 @@ int onceOnly = 1;
 
 int sdhc_check(void)
 {
-  unsigned char buffer[512];
+  static unsigned char buffer[512];
 
-  sdhc = 0;
+  // Use sector addressing while probing: a byte-addressed card fails the read of sector 1
+  sdhc = -1;
 
   // Force early detection of old vs new uart monitor
   if (onceOnly)
     slow_write(fd, "r\r", 2, 2500);
   onceOnly = 0;
 
+  // Map the SD card sector buffer at $FFD6E00 instead of the floppy one
+  char cmd[64];
+  wait_for_sdready();
+  snprintf(cmd, 64, "sffd3689 %02x\r", sd_status[9] | 0x80);
+  slow_write(fd, cmd, strlen(cmd), 0);
+
   int r0 = read_sector(0, buffer, 1);
   int r1 = read_sector(1, buffer, 1);
   int r200 = read_sector(0x200, buffer, 1);
@@ -534,54 +569,201 @@ int sdhc_check(void)
     fprintf(stderr, "Could not detect SD/SDHC card\n");
     exit(-3);
   }
-  sdhc = r1;
+  sdhc = r1 ? 0 : 1;
   return sdhc;
 }
 
 #define SECTOR_CACHE_SIZE 4096
+#define SECTOR_CACHE_HASH_BITS 12
 int sector_cache_count = 0;
 unsigned char sector_cache[SECTOR_CACHE_SIZE][512];
 unsigned int sector_cache_sectors[SECTOR_CACHE_SIZE];
-
-// XXX - DO NOT USE A BUFFER THAT IS ON THE STACK OR BAD BAD THINGS WILL HAPPEN
-int read_sector(const unsigned int sector_number, unsigned char *buffer, int noCacheP)
+// Hash chains through the cache slots. These hold slot number + 1, so that 0 ends a chain
+unsigned short sector_cache_buckets[1 << SECTOR_CACHE_HASH_BITS];
+unsigned short sector_cache_chain[SECTOR_CACHE_SIZE];
+// Once the cache is full, slots are recycled second-chance (clock) style
+unsigned char sector_cache_referenced[SECTOR_CACHE_SIZE];
+int sector_cache_hand = 0;
+
+unsigned int sector_cache_hash(unsigned int sector_number)
 {
-  int retVal = 0;
-  do {
+  return (sector_number * 2654435761U) >> (32 - SECTOR_CACHE_HASH_BITS);
+}
 
-    int cachedRead = 0;
+int sector_cache_lookup(unsigned int sector_number)
+{
+  for (int s = sector_cache_buckets[sector_cache_hash(sector_number)]; s; s = sector_cache_chain[s - 1]) {
+    if (sector_cache_sectors[s - 1] == sector_number) {
+      sector_cache_referenced[s - 1] = 1;
+      return s - 1;
+    }
+  }
+  return -1;
+}
 
-    if (!noCacheP) {
-      for (int i = 0; i < sector_cache_count; i++) {
-        if (sector_cache_sectors[i] == sector_number) {
-          bcopy(sector_cache[i], buffer, 512);
-          retVal = 0;
-          cachedRead = 1;
-          break;
-        }
+void sector_cache_store(unsigned int sector_number, unsigned char *buffer)
+{
+  int i = sector_cache_lookup(sector_number);
+  if (i < 0) {
+    if (sector_cache_count < SECTOR_CACHE_SIZE)
+      i = sector_cache_count++;
+    else {
+      // Evict the first slot that has not been used since the hand last went past it
+      while (sector_cache_referenced[sector_cache_hand]) {
+        sector_cache_referenced[sector_cache_hand] = 0;
+        sector_cache_hand = (sector_cache_hand + 1) % SECTOR_CACHE_SIZE;
       }
+      i = sector_cache_hand;
+      sector_cache_hand = (sector_cache_hand + 1) % SECTOR_CACHE_SIZE;
+      unsigned short *link = &sector_cache_buckets[sector_cache_hash(sector_cache_sectors[i])];
+      while (*link != i + 1)
+        link = &sector_cache_chain[*link - 1];
+      *link = sector_cache_chain[i];
     }
+    unsigned int h = sector_cache_hash(sector_number);
+    sector_cache_sectors[i] = sector_number;
+    sector_cache_chain[i] = sector_cache_buckets[h];
+    sector_cache_buckets[h] = i + 1;
+    sector_cache_referenced[i] = 1;
+  }
+  bcopy(buffer, sector_cache[i], 512);
+}
 
-    if (cachedRead)
-      break;
+/*
+  Read-ahead: a run of consecutive sectors is read with one monitor command per
+  sector after the first. Each of those triggers a chain of DMA jobs that parks
+  the previous sector from the SD sector buffer in its own slot, snapshots the
+  SD status registers next to it, and then writes the address of the next
+  sector and the read command into the SD controller. The parked slot is dumped
+  while the SD card is busy with that read, so only the last sector of a run
+  needs the status to be polled. The others are checked against their snapshot
+  afterwards. A sector that was not complete when parked is read again on its
+  own, and so is the one after it, because the SD controller ignores a read
+  command while it is busy, leaving the previous sector in the buffer.
+
+  The slots, snapshots, sector address table and the DMA lists themselves live
+  in the top of colour RAM, out of the way of the screen and of the programme in
+  chip RAM. Every job of a chain starts with its own option list, naming the
+  $FFxxxxx megabyte for both source and destination.
+*/
+#define READ_AHEAD_SECTORS 16
+#define READ_AHEAD_LIST_SIZE 0x50
+#define READ_AHEAD_DMA_LIST_ADDRESS 0xFF85800
+#define READ_AHEAD_TABLE_ADDRESS 0xFF85e00
+#define READ_AHEAD_STATUS_ADDRESS 0xFF85f00
+#define READ_AHEAD_ADDRESS 0xFF86000
+
+int read_ahead_lists_written = 0;
+unsigned char read_ahead_buffer[READ_AHEAD_SECTORS][512];
+unsigned char read_ahead_status[512];
+
+int write_read_ahead_lists(void)
+{
+  static unsigned char lists[READ_AHEAD_SECTORS * READ_AHEAD_LIST_SIZE];
+  char cmd[1024];
+
+  bzero(lists, sizeof(lists));
+  for (int i = 0; i < READ_AHEAD_SECTORS; i++) {
+    unsigned int slot = READ_AHEAD_ADDRESS + i * 0x200;
+    unsigned int status = READ_AHEAD_STATUS_ADDRESS + i * 0x10;
+    unsigned int next = READ_AHEAD_TABLE_ADDRESS + (i + 1) * 4;
+    unsigned char list[69] = {
+      // F018B, everything in the $FFxxxxx megabyte
+      0x0b, 0x80, 0xff, 0x81, 0xff, 0x00,
+      // copy $200 bytes of SD sector buffer to the slot, chained
+      0x04, 0x00, 0x02, 0x00, 0x6e, 0x0d, slot & 0xff, (slot >> 8) & 0xff, (slot >> 16) & 0x0f, 0x00, 0x00, 0x00,
+      // copy $10 bytes of SD status to the snapshot, chained
+      0x80, 0xff, 0x81, 0xff, 0x00,
+      0x04, 0x10, 0x00, 0x80, 0x36, 0x0d, status & 0xff, (status >> 8) & 0xff, (status >> 16) & 0x0f, 0x00, 0x00, 0x00,
+      // copy the next sector address to $D681-$D684, chained
+      0x80, 0xff, 0x81, 0xff, 0x00,
+      0x04, 0x04, 0x00, next & 0xff, (next >> 8) & 0xff, (next >> 16) & 0x0f, 0x81, 0x36, 0x0d, 0x00, 0x00, 0x00,
+      // fill $D680 with 2 to start reading it
+      0x80, 0xff, 0x81, 0xff, 0x00,
+      0x03, 0x01, 0x00, 0x02, 0x00, 0x00, 0x80, 0x36, 0x0d, 0x00, 0x00, 0x00 };
+    bcopy(list, &lists[i * READ_AHEAD_LIST_SIZE], sizeof(list));
+  }
+
+  snprintf(cmd, 1024, "l%x %x\r", READ_AHEAD_DMA_LIST_ADDRESS, (READ_AHEAD_DMA_LIST_ADDRESS + (int)sizeof(lists)) & 0xffff);
+  slow_write(fd, cmd, strlen(cmd), 500);
+  usleep(10000); // give uart monitor time to get ready for the data
+  process_waiting(fd);
+  if (write(fd, lists, sizeof(lists)) != sizeof(lists)) {
+    printf("ERROR: Failed to write read-ahead DMA lists to serial port\n");
+    return -1;
+  }
+  process_waiting(fd);
+  read_ahead_lists_written = 1;
+  return 0;
+}
+
+// Fetch 256 or 512 bytes of memory with M commands
+int dump_memory(unsigned int address, unsigned char *buffer, int length)
+{
+  char cmd[1024];
+
+  sd_read_base = address;
+  sd_read_buffer = buffer;
+  sd_read_offset = 0;
+  for (int offset = 0; offset < length; offset += 0x100) {
+    snprintf(cmd, 1024, "M%x\r", address + offset);
+    slow_write(fd, cmd, strlen(cmd), 0);
+    while (sd_read_offset != offset + 0x100)
+      process_waiting(fd);
+  }
+  sd_read_buffer = NULL;
+  sd_read_base = READ_SECTOR_BUFFER_ADDRESS;
+  return 0;
+}
+
+int read_sector_run(const unsigned int first_sector, int count)
+{
+  int retVal = 0;
+  do {
+    char cmd[1024];
+
+    if (count > READ_AHEAD_SECTORS)
+      count = READ_AHEAD_SECTORS;
+    if (count > 1 && !read_ahead_lists_written && write_read_ahead_lists())
+      count = 1;
 
     // Clear backlog
-    // printf("Clearing serial backlog in preparation for reading sector 0x%x\n",sector_number);
     process_waiting(fd);
 
-    // printf("Getting SD card ready\n");
     wait_for_sdready();
 
-    // printf("Commanding SD read\n");
-    char cmd[1024];
-    unsigned int sector_address;
-    if (!sdhc)
-      sector_address = sector_number * 0x0200;
-    else
-      sector_address = sector_number;
-    snprintf(cmd, 1024, "sffd3681 %02x %02x %02x %02x\rsffd3680 2\r", (sector_address >> 0) & 0xff,
-        (sector_address >> 8) & 0xff, (sector_address >> 16) & 0xff, (sector_address >> 24) & 0xff);
+    unsigned int sector_address[READ_AHEAD_SECTORS];
+    for (int i = 0; i < count; i++) {
+      if (!sdhc)
+        sector_address[i] = (first_sector + i) * 0x0200;
+      else
+        sector_address[i] = first_sector + i;
+    }
+
+    // Sector addresses for the DMA chains, four sectors per command
+    for (int i = 1; i < count; i += 4) {
+      int len = snprintf(cmd, 1024, "s%x", READ_AHEAD_TABLE_ADDRESS + i * 4);
+      for (int j = i; j < count && j < i + 4; j++)
+        len += snprintf(&cmd[len], 1024 - len, " %02x %02x %02x %02x", (sector_address[j] >> 0) & 0xff,
+            (sector_address[j] >> 8) & 0xff, (sector_address[j] >> 16) & 0xff, (sector_address[j] >> 24) & 0xff);
+      snprintf(&cmd[len], 1024 - len, "\r");
+      slow_write(fd, cmd, strlen(cmd), 0);
+    }
+
+    snprintf(cmd, 1024, "sffd3681 %02x %02x %02x %02x\rsffd3680 2\r", (sector_address[0] >> 0) & 0xff,
+        (sector_address[0] >> 8) & 0xff, (sector_address[0] >> 16) & 0xff, (sector_address[0] >> 24) & 0xff);
     slow_write(fd, cmd, strlen(cmd), 0);
+
+    for (int i = 1; i < count; i++) {
+      // Park sector i-1 and start reading sector i
+      unsigned int list = READ_AHEAD_DMA_LIST_ADDRESS + (i - 1) * READ_AHEAD_LIST_SIZE;
+      snprintf(cmd, 1024, "sffd3701 %02x %02x 00 %02x %02x\r", (list >> 8) & 0xff, (list >> 16) & 0x0f, (list >> 20) & 0xff,
+          list & 0xff);
+      slow_write(fd, cmd, strlen(cmd), 0);
+
+      dump_memory(READ_AHEAD_ADDRESS + (i - 1) * 0x200, read_ahead_buffer[i - 1], 512);
+    }
+
     if (wait_for_sdready_passive()) {
       printf("wait_for_sdready_passive() failed\n");
       retVal = -1;
@@ -589,32 +771,65 @@ int read_sector(const unsigned int sector_number, unsigned char *buffer, int noC
     }
 
     // Read succeeded, so fetch sector contents
-    // printf("Reading back sector contents\n");
-    sd_read_buffer = buffer;
-    sd_read_offset = 0;
-    snprintf(cmd, 1024, "M%x\r", READ_SECTOR_BUFFER_ADDRESS);
-    slow_write(fd, cmd, strlen(cmd), 0);
-    while (sd_read_offset != 256)
-      process_waiting(fd);
-
-    snprintf(cmd, 1024, "M%x\r", READ_SECTOR_BUFFER_ADDRESS + 0x100);
-    slow_write(fd, cmd, strlen(cmd), 0);
-    while (sd_read_offset != 512)
-      process_waiting(fd);
-    sd_read_buffer = NULL;
-    // printf("Read sector %d (0x%x)\n",sector_number,sector_number);
+    dump_memory(READ_SECTOR_BUFFER_ADDRESS, read_ahead_buffer[count - 1], 512);
+    if (count > 1)
+      dump_memory(READ_AHEAD_STATUS_ADDRESS, read_ahead_status, 0x100);
 
     // Store in cache / update cache
-    int i;
-    for (i = 0; i < sector_cache_count; i++)
-      if (sector_cache_sectors[i] == sector_number)
+    for (int i = 0; i < count; i++) {
+      // Still busy (or failed) when it was parked, or its read command came while the previous sector was
+      if ((i < count - 1 && (read_ahead_status[i * 0x10] & 0x03))
+          || (i > 0 && (read_ahead_status[(i - 1) * 0x10] & 0x03))) {
+        if (read_sector_run(first_sector + i, 1)) {
+          retVal = -1;
+          break;
+        }
+      }
+      else
+        sector_cache_store(first_sector + i, read_ahead_buffer[i]);
+    }
+
+  } while (0);
+  return retVal;
+}
+
+// Bring sectors into the cache ahead of use, in as few runs as the cache misses allow
+int prefetch_sectors(const unsigned int first_sector, int count)
+{
+  int retVal = 0;
+  int i = 0;
+  while (i < count && !retVal) {
+    if (sector_cache_lookup(first_sector + i) >= 0) {
+      i++;
+      continue;
+    }
+    int run = 1;
+    while (i + run < count && run < READ_AHEAD_SECTORS && sector_cache_lookup(first_sector + i + run) < 0)
+      run++;
+    retVal = read_sector_run(first_sector + i, run);
+    i += run;
+  }
+  return retVal;
+}
+
+// XXX - DO NOT USE A BUFFER THAT IS ON THE STACK OR BAD BAD THINGS WILL HAPPEN
+int read_sector(const unsigned int sector_number, unsigned char *buffer, int noCacheP)
+{
+  int retVal = 0;
+  do {
+
+    if (!noCacheP) {
+      int i = sector_cache_lookup(sector_number);
+      if (i >= 0) {
+        bcopy(sector_cache[i], buffer, 512);
         break;
-    if (i < SECTOR_CACHE_SIZE) {
-      bcopy(buffer, sector_cache[i], 512);
-      sector_cache_sectors[i] = sector_number;
+      }
     }
-    if (sector_cache_count < (i + 1))
-      sector_cache_count = i + 1;
+
+    retVal = read_sector_run(sector_number, 1);
+    if (!retVal)
+      bcopy(read_ahead_buffer[0], buffer, 512);
+    // printf("Read sector %d (0x%x)\n",sector_number,sector_number);
 
   } while (0);
   if (retVal)
@@ -632,14 +847,10 @@ int write_sector(const unsigned int sector_number, unsigned char *buffer)
     // Force sector into read buffer
     read_sector(sector_number, verify, 0);
     // See if it matches what we are writing, if so, don't write it!
-    for (int i = 0; i < sector_cache_count; i++) {
-      if (sector_number == sector_cache_sectors[i]) {
-        if (!bcmp(sector_cache[i], buffer, 512)) {
-          //	  printf("Writing unchanged sector -- skipping physical write\n");
-          sectorUnchanged = 1;
-          break;
-        }
-      }
+    int cached = sector_cache_lookup(sector_number);
+    if (cached >= 0 && !bcmp(sector_cache[cached], buffer, 512)) {
+      //	  printf("Writing unchanged sector -- skipping physical write\n");
+      sectorUnchanged = 1;
     }
     if (sectorUnchanged) {
       //      printf("Skipping physical write\n");
@@ -696,16 +907,7 @@ int write_sector(const unsigned int sector_number, unsigned char *buffer)
     }
 
     // Store in cache / update cache
-    int i;
-    for (i = 0; i < sector_cache_count; i++)
-      if (sector_cache_sectors[i] == sector_number)
-        break;
-    if (i < SECTOR_CACHE_SIZE) {
-      bcopy(buffer, sector_cache[i], 512);
-      sector_cache_sectors[i] = sector_number;
-    }
-    if (sector_cache_count < (i + 1))
-      sector_cache_count = i + 1;
+    sector_cache_store(sector_number, buffer);
 
   } while (0);
   if (retVal)
@@ -846,6 +1048,8 @@ int fat_opendir(char *path)
     dir_sector = first_cluster_sector;
     dir_sector_offset = -32;
     dir_sector_in_cluster = 0;
+    // The whole first cluster of the directory will be walked
+    prefetch_sectors(partition_start + dir_sector, sectors_per_cluster);
     retVal = read_sector(partition_start + dir_sector, dir_sector_buffer, 0);
     if (retVal)
       dir_sector = -1;
@@ -872,6 +1076,7 @@ int fat_readdir(struct dirent *d)
           dir_cluster = next_cluster;
           dir_sector_in_cluster = 0;
           dir_sector = first_cluster_sector + (next_cluster - first_cluster) * sectors_per_cluster;
+          prefetch_sectors(partition_start + dir_sector, sectors_per_cluster);
         }
         else {
           // End of directory reached
@@ -1101,6 +1306,10 @@ unsigned int find_free_cluster(unsigned int first_cluster)
     o = (first_cluster % (512 / 4)) * 4;
 
     for (; i < sectors_per_fat; i++) {
+      // Once the scan goes past its first FAT sector, pull the rest in a run at a time
+      if (i > first_cluster / (512 / 4) && (!(i % READ_AHEAD_SECTORS) || i == first_cluster / (512 / 4) + 1))
+        prefetch_sectors(partition_start + fat1_sector + i, READ_AHEAD_SECTORS - (i % READ_AHEAD_SECTORS));
+
       // Read FAT sector
       printf("Checking FAT sector $%x for free clusters.\n", i);
       if (read_sector(partition_start + fat1_sector + i, fat_sector, 0)) {
@@ -1329,6 +1538,12 @@ int upload_file(char *name, char *dest_name)
       int bytes = fread(buffer, 1, 512, f);
       sector_number = partition_start + first_cluster_sector + (sectors_per_cluster * (file_cluster - first_cluster))
                     + sector_in_cluster;
+
+      // write_sector() compares with what is there already, so fetch the rest of the cluster in one go
+      if (!sector_in_cluster) {
+        int sectors_left = (remaining_length + 511) / 512;
+        prefetch_sectors(sector_number, sectors_left < sectors_per_cluster ? sectors_left : sectors_per_cluster);
+      }
       printf("T+%lld : Read %d bytes from file, writing to sector $%x (%d) for cluster %d\n", gettime_us() - start_usec,
           bytes, sector_number, sector_number, file_cluster);
 
@@ -15,6 +15,8 @@
 #include <string.h>
 #include <strings.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #define PNG_DEBUG 3
 #include <png.h>
@@ -75,17 +77,19 @@ char *vhdl_suffix = ");\n"
 
 /* ============================================================= */
 
-int x, y;
+// screen RAM has 13 bits of tile number, the top bits flip the tile
+#define MAX_TILES 8192
+#define TILE_FLIP_X 0x4000
+#define TILE_FLIP_Y 0x8000
 
-int width, height;
-png_byte color_type;
-png_byte bit_depth;
+#define PALETTE_HASH_SIZE 1024
 
-png_structp png_ptr;
-png_infop info_ptr;
-int number_of_passes;
-png_bytep *row_pointers;
-int multiplier;
+// for the benchmark's generated images
+#define BENCH_WIDTH 320
+#define BENCH_HEIGHT 200
+#define BENCH_POOL_TILES 64
+
+int worker_count = 0;
 
 /* ============================================================= */
 
@@ -111,41 +115,71 @@ struct rgb {
   int b;
 };
 
+struct palette {
+  struct rgb colours[256];
+  int colour_count;
+  // colour index + 1 by hash of the colour, 0 for a free slot
+  short index[PALETTE_HASH_SIZE];
+};
+
 struct tile_set {
   struct tile *tiles;
   int tile_count;
   int max_tiles;
 
-  // Palette
-  struct rgb colours[256];
-  int colour_count;
+  // tile number + 1 by hash of the tile, 0 for a free slot
+  int *index;
+  int index_size;
+
+  struct palette palette;
 
   struct tile_set *next;
 };
 
-int palette_lookup(struct tile_set *ts, int r, int g, int b)
+/*
+  An input image, as a worker thread leaves it for merging into the tile set:
+  its tiles in reading order, with colours from the image's own palette.
+*/
+struct image {
+  char *file_name;
+  int width, height;
+
+  struct palette palette;
+  // per tile, each pixel's index into palette + 1, or 0 if transparent
+  unsigned short (*tiles)[8][8];
+  unsigned char *transparent;
+
+  int done;
+};
+
+/* ============================================================= */
+
+int palette_lookup(struct palette *p, int r, int g, int b)
 {
-  int i;
+  unsigned int h = ((r * 31 + g) * 31 + b) & (PALETTE_HASH_SIZE - 1);
 
   // Do we know this colour already?
-  for (i = 0; i < ts->colour_count; i++) {
-    if (r == ts->colours[i].r && g == ts->colours[i].g && b == ts->colours[i].b) {
+  while (p->index[h]) {
+    struct rgb *c = &p->colours[p->index[h] - 1];
+    if (r == c->r && g == c->g && b == c->b) {
       // It's a colour we have seen before, so return the index
-      return i;
+      return p->index[h] - 1;
     }
+    h = (h + 1) & (PALETTE_HASH_SIZE - 1);
   }
 
   // new colour, check if palette has space
-  if (ts->colour_count > 255) {
+  if (p->colour_count > 255) {
     fprintf(stderr, "Too many colours in image: Must be <= %d\n", 256);
     exit(-1);
   }
 
   // allocate the new colour
-  ts->colours[ts->colour_count].r = r;
-  ts->colours[ts->colour_count].g = g;
-  ts->colours[ts->colour_count].b = b;
-  return ts->colour_count++;
+  p->colours[p->colour_count].r = r;
+  p->colours[p->colour_count].g = g;
+  p->colours[p->colour_count].b = b;
+  p->index[h] = p->colour_count + 1;
+  return p->colour_count++;
 }
 
 unsigned char nyblswap(unsigned char in)
@@ -161,7 +195,9 @@ struct tile_set *new_tileset(int max_tiles)
     exit(-3);
   }
   ts->tiles = calloc(sizeof(struct tile), max_tiles);
-  if (!ts->tiles) {
+  ts->index_size = max_tiles * 2;
+  ts->index = calloc(sizeof(int), ts->index_size);
+  if (!ts->tiles || !ts->index) {
     perror("calloc() failed");
     exit(-3);
   }
@@ -216,141 +252,110 @@ struct screen *new_screen(int id, struct tile_set *tiles, int width, int height)
   return s;
 }
 
-int tile_lookup(struct tile_set *ts, struct tile *t)
+unsigned int tile_hash(struct tile *t)
 {
-  // See if tile matches any that we have already stored.
-  // (Also check if it matches flipped in either or both X,Y
-  // axes.
-  for (int i = 0; i < ts->tile_count; i++) {
-    int matches = 1;
-    // Compare unflipped
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[x][y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i;
-    // Compare with flipped X
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[7 - x][y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i | 0x4000;
-    // Compare with flipped Y
+  // FNV-1a
+  unsigned int h = 2166136261u;
+  for (int x = 0; x < 8; x++)
     for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[x][7 - y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i | 0x8000;
-    // Compare with flipped X and Y
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[7 - x][7 - y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i | 0xC000;
+      h = (h ^ t->bytes[x][y]) * 16777619u;
+  return h;
+}
+
+// Returns the number of the stored tile identical to t, or -1
+int tile_find(struct tile_set *ts, struct tile *t)
+{
+  unsigned int h = tile_hash(t) & (ts->index_size - 1);
+  while (ts->index[h]) {
+    if (!memcmp(&ts->tiles[ts->index[h] - 1], t, sizeof(struct tile)))
+      return ts->index[h] - 1;
+    h = (h + 1) & (ts->index_size - 1);
   }
+  return -1;
+}
 
-  // The tile is new.
-  if (ts->tile_count >= ts->max_tiles) {
+void tile_index_add(struct tile_set *ts, int n)
+{
+  unsigned int h = tile_hash(&ts->tiles[n]) & (ts->index_size - 1);
+  while (ts->index[h])
+    h = (h + 1) & (ts->index_size - 1);
+  ts->index[h] = n + 1;
+}
+
+void tileset_grow(struct tile_set *ts)
+{
+  if (ts->max_tiles >= MAX_TILES) {
     fprintf(stderr, "ERROR: Used up all %d tiles.\n", ts->max_tiles);
     exit(-3);
   }
-
-  // Allocate new tile and return
-  for (int y = 0; y < 8; y++)
-    for (int x = 0; x < 8; x++)
-      ts->tiles[ts->tile_count].bytes[x][y] = t->bytes[x][y];
-  return ts->tile_count++;
+  ts->max_tiles *= 2;
+  if (ts->max_tiles > MAX_TILES)
+    ts->max_tiles = MAX_TILES;
+  ts->tiles = realloc(ts->tiles, sizeof(struct tile) * ts->max_tiles);
+  free(ts->index);
+  ts->index_size = ts->max_tiles * 2;
+  ts->index = calloc(sizeof(int), ts->index_size);
+  if (!ts->tiles || !ts->index) {
+    perror("realloc() failed");
+    exit(-3);
+  }
+  for (int i = 0; i < ts->tile_count; i++)
+    tile_index_add(ts, i);
 }
 
-struct screen *png_to_screen(int id, struct tile_set *ts)
+int tile_lookup(struct tile_set *ts, struct tile *t)
 {
-  int x, y;
-
-  if (height % 8 || width % 8) {
-    fprintf(stderr, "ERROR: PNG image dimensions must be a multiple of 8.\n");
-    exit(-3);
+  // See if tile matches any that we have already stored.
+  // (Also check if it matches flipped in either or both X,Y
+  // axes.) No two stored tiles are flips of one another, so
+  // at most one stored tile can match.
+  static const int flips[4] = { 0, TILE_FLIP_X, TILE_FLIP_Y, TILE_FLIP_X | TILE_FLIP_Y };
+  for (int f = 0; f < 4; f++) {
+    struct tile flipped;
+    for (int y = 0; y < 8; y++)
+      for (int x = 0; x < 8; x++)
+        flipped.bytes[x][y] = t->bytes[(flips[f] & TILE_FLIP_X) ? 7 - x : x][(flips[f] & TILE_FLIP_Y) ? 7 - y : y];
+    int i = tile_find(ts, &flipped);
+    if (i != -1)
+      return i | flips[f];
   }
 
-  struct screen *s = new_screen(id, ts, width / 8, height / 8);
+  // The tile is new.
+  if (ts->tile_count >= ts->max_tiles)
+    tileset_grow(ts);
 
-  for (y = 0; y < height; y += 8)
-    for (x = 0; x < width; x += 8) {
-      int transparent_tile = 1;
-      struct tile t;
-      for (int yy = 0; yy < 8; yy++) {
-        png_byte *row = row_pointers[yy + y];
-        for (int xx = 0; xx < 8; xx++) {
-          png_byte *ptr = &(row[(xx + x) * multiplier]);
-          int r, g, b, a, c;
-          r = ptr[0];
-          g = ptr[1];
-          b = ptr[2];
-          if (multiplier == 4)
-            a = ptr[3];
-          else
-            a = 0xff;
-          if (a) {
-            transparent_tile = 0;
-            c = palette_lookup(ts, r, g, b);
-          }
-          else
-            c = 0;
-          t.bytes[xx][yy] = c;
-        }
-      }
-      if (transparent_tile) {
-        // Set screen and colour bytes to all $00 to indicate
-        // non-set block.
-        s->screen_rows[y / 8][x * 2 + 0] = 0x00;
-        s->screen_rows[y / 8][x * 2 + 1] = 0x00;
-        s->colourram_rows[y / 8][x * 2 + 0] = 0x00;
-        s->colourram_rows[y / 8][x * 2 + 1] = 0x00;
-      }
-      else {
-        // Block has non-transparent pixels, so add to tileset,
-        // or lookup to see if it is already there.
-        int tile_number = tile_lookup(ts, &t);
-        s->screen_rows[y / 8][x / 8 * 2 + 0] = tile_number & 0xff;
-        s->screen_rows[y / 8][x / 8 * 2 + 1] = (tile_number >> 8) & 0xff;
-        s->colourram_rows[y / 8][x / 8 * 2 + 0] = 0x00;
-        s->colourram_rows[y / 8][x / 8 * 2 + 1] = 0xff; // FG colour
-      }
-    }
-  return s;
+  // Allocate new tile and return
+  ts->tiles[ts->tile_count] = *t;
+  tile_index_add(ts, ts->tile_count);
+  return ts->tile_count++;
 }
 
-void read_png_file(char *file_name)
+/*
+  Reads the PNG file, and cuts it into tiles coloured from the image's own
+  palette. Touches nothing but img, so that images can be read in parallel.
+*/
+void read_png_file(struct image *img)
 {
   unsigned char header[8]; // 8 is the maximum size that can be checked
+  char *file_name = img->file_name;
+  png_bytep *row_pointers;
+  int multiplier;
 
   /* open file and test for it being a png */
   FILE *infile = fopen(file_name, "rb");
   if (infile == NULL)
     abort_("[read_png_file] File %s could not be opened for reading", file_name);
 
-  fread(header, 1, 8, infile);
-  if (png_sig_cmp(header, 0, 8))
+  if (fread(header, 1, 8, infile) != 8 || png_sig_cmp(header, 0, 8))
     abort_("[read_png_file] File %s is not recognized as a PNG file", file_name);
 
   /* initialize stuff */
-  png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 
   if (!png_ptr)
     abort_("[read_png_file] png_create_read_struct failed");
 
-  info_ptr = png_create_info_struct(png_ptr);
+  png_infop info_ptr = png_create_info_struct(png_ptr);
   if (!info_ptr)
     abort_("[read_png_file] png_create_info_struct failed");
 
@@ -365,30 +370,23 @@ void read_png_file(char *file_name)
 
   png_read_info(png_ptr, info_ptr);
 
-  width = png_get_image_width(png_ptr, info_ptr);
-  height = png_get_image_height(png_ptr, info_ptr);
-  color_type = png_get_color_type(png_ptr, info_ptr);
-  bit_depth = png_get_bit_depth(png_ptr, info_ptr);
-
-  printf("Input-file is: width=%d, height=%d.\n", width, height);
+  img->width = png_get_image_width(png_ptr, info_ptr);
+  img->height = png_get_image_height(png_ptr, info_ptr);
 
-  number_of_passes = png_set_interlace_handling(png_ptr);
+  png_set_interlace_handling(png_ptr);
   png_read_update_info(png_ptr, info_ptr);
 
   /* read file */
   if (setjmp(png_jmpbuf(png_ptr)))
     abort_("[read_png_file] Error during read_image");
 
-  row_pointers = (png_bytep *)malloc(sizeof(png_bytep) * height);
-  for (y = 0; y < height; y++)
+  row_pointers = (png_bytep *)malloc(sizeof(png_bytep) * img->height);
+  for (int y = 0; y < img->height; y++)
     row_pointers[y] = (png_byte *)malloc(png_get_rowbytes(png_ptr, info_ptr));
 
   png_read_image(png_ptr, row_pointers);
 
-  if (infile != NULL) {
-    fclose(infile);
-    infile = NULL;
-  }
+  fclose(infile);
 
   if (png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_RGB)
     multiplier = 3;
@@ -398,59 +396,333 @@ void read_png_file(char *file_name)
     fprintf(stderr, "Could not convert file to RGB or RGBA\n");
     exit(-3);
   }
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+
+  if (img->height % 8 || img->width % 8) {
+    fprintf(stderr, "ERROR: PNG image '%s' dimensions must be a multiple of 8.\n", file_name);
+    exit(-3);
+  }
+
+  int tile_count = (img->width / 8) * (img->height / 8);
+  img->tiles = malloc(sizeof(*img->tiles) * tile_count);
+  img->transparent = malloc(tile_count);
+  if (!img->tiles || !img->transparent) {
+    perror("malloc() failed");
+    exit(-3);
+  }
 
-  return;
+  // Colours are numbered in the order they are first seen, as in the final palette
+  int n = 0;
+  for (int y = 0; y < img->height; y += 8)
+    for (int x = 0; x < img->width; x += 8, n++) {
+      int transparent_tile = 1;
+      for (int yy = 0; yy < 8; yy++) {
+        png_byte *row = row_pointers[yy + y];
+        for (int xx = 0; xx < 8; xx++) {
+          png_byte *ptr = &(row[(xx + x) * multiplier]);
+          int a = multiplier == 4 ? ptr[3] : 0xff;
+          if (a) {
+            transparent_tile = 0;
+            img->tiles[n][xx][yy] = palette_lookup(&img->palette, ptr[0], ptr[1], ptr[2]) + 1;
+          }
+          else
+            img->tiles[n][xx][yy] = 0;
+        }
+      }
+      img->transparent[n] = transparent_tile;
+    }
+
+  for (int y = 0; y < img->height; y++)
+    free(row_pointers[y]);
+  free(row_pointers);
+}
+
+/*
+  Merges an image that read_png_file() has prepared into the tile set.
+  Images must be merged in order, so that tile and colour numbers come out
+  the same however many threads read them.
+*/
+struct screen *png_to_screen(int id, struct tile_set *ts, struct image *img)
+{
+  unsigned char colour_map[256];
+
+  for (int i = 0; i < img->palette.colour_count; i++)
+    colour_map[i]
+        = palette_lookup(&ts->palette, img->palette.colours[i].r, img->palette.colours[i].g, img->palette.colours[i].b);
+
+  struct screen *s = new_screen(id, ts, img->width / 8, img->height / 8);
+
+  int n = 0;
+  for (int y = 0; y < img->height / 8; y++)
+    for (int x = 0; x < img->width / 8; x++, n++) {
+      if (img->transparent[n]) {
+        // Set screen and colour bytes to all $00 to indicate
+        // non-set block.
+        s->screen_rows[y][x * 2 + 0] = 0x00;
+        s->screen_rows[y][x * 2 + 1] = 0x00;
+        s->colourram_rows[y][x * 2 + 0] = 0x00;
+        s->colourram_rows[y][x * 2 + 1] = 0x00;
+      }
+      else {
+        // Block has non-transparent pixels, so add to tileset,
+        // or lookup to see if it is already there.
+        struct tile t;
+        for (int yy = 0; yy < 8; yy++)
+          for (int xx = 0; xx < 8; xx++)
+            t.bytes[xx][yy] = img->tiles[n][xx][yy] ? colour_map[img->tiles[n][xx][yy] - 1] : 0;
+        int tile_number = tile_lookup(ts, &t);
+        s->screen_rows[y][x * 2 + 0] = tile_number & 0xff;
+        s->screen_rows[y][x * 2 + 1] = (tile_number >> 8) & 0xff;
+        s->colourram_rows[y][x * 2 + 0] = 0x00;
+        s->colourram_rows[y][x * 2 + 1] = 0xff; // FG colour
+      }
+    }
+
+  free(img->tiles);
+  free(img->transparent);
+  img->tiles = NULL;
+  img->transparent = NULL;
+  return s;
 }
 
 /* ============================================================= */
 
+/*
+  Worker threads take the next unread image, and signal when it is ready, so
+  that the main thread can merge images in order while later ones are still
+  being read.
+*/
+pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t image_ready = PTHREAD_COND_INITIALIZER;
+struct image *images = NULL;
+int image_count = 0;
+int next_image = 0;
+
+void *image_worker(void *arg)
+{
+  while (1) {
+    pthread_mutex_lock(&image_lock);
+    int i = next_image < image_count ? next_image++ : -1;
+    pthread_mutex_unlock(&image_lock);
+    if (i == -1)
+      return NULL;
+
+    read_png_file(&images[i]);
+
+    pthread_mutex_lock(&image_lock);
+    images[i].done = 1;
+    pthread_cond_broadcast(&image_ready);
+    pthread_mutex_unlock(&image_lock);
+  }
+}
+
+void wait_for_image(int i)
+{
+  pthread_mutex_lock(&image_lock);
+  while (!images[i].done)
+    pthread_cond_wait(&image_ready, &image_lock);
+  pthread_mutex_unlock(&image_lock);
+}
+
+double time_now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* ============================================================= */
+
+/*
+  Benchmark input: frames built from a small pool of tiles, placed flipped at
+  random, with some transparent and some one-off tiles mixed in, like the
+  frames of an animation.
+*/
+void write_bench_png(char *file_name, unsigned int seed, struct tile *pool, struct rgb *colours)
+{
+  png_byte *rows[BENCH_HEIGHT];
+  png_byte image[BENCH_HEIGHT][BENCH_WIDTH * 4];
+
+  for (int y = 0; y < BENCH_HEIGHT; y += 8)
+    for (int x = 0; x < BENCH_WIDTH; x += 8) {
+      int kind = rand_r(&seed) % 100;
+      struct tile one_off, *t = &pool[rand_r(&seed) % BENCH_POOL_TILES];
+      int flip = rand_r(&seed) & 3;
+      if (kind < 2) {
+        for (int xx = 0; xx < 8; xx++)
+          for (int yy = 0; yy < 8; yy++)
+            one_off.bytes[xx][yy] = rand_r(&seed) % 16;
+        t = &one_off;
+      }
+      for (int yy = 0; yy < 8; yy++)
+        for (int xx = 0; xx < 8; xx++) {
+          png_byte *p = &image[y + yy][(x + xx) * 4];
+          struct rgb *c = &colours[t->bytes[(flip & 1) ? 7 - xx : xx][(flip & 2) ? 7 - yy : yy]];
+          p[0] = c->r;
+          p[1] = c->g;
+          p[2] = c->b;
+          p[3] = kind >= 90 ? 0x00 : 0xff;
+        }
+    }
+
+  FILE *f = fopen(file_name, "wb");
+  if (!f) {
+    perror("Could not create benchmark image");
+    exit(-3);
+  }
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (!png_ptr || !info_ptr || setjmp(png_jmpbuf(png_ptr)))
+    abort_("[write_bench_png] Could not write %s", file_name);
+  png_init_io(png_ptr, f);
+  png_set_IHDR(png_ptr, info_ptr, BENCH_WIDTH, BENCH_HEIGHT, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+      PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+  for (int y = 0; y < BENCH_HEIGHT; y++)
+    rows[y] = image[y];
+  png_write_image(png_ptr, rows);
+  png_write_end(png_ptr, NULL);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  fclose(f);
+}
+
+// Generates count images in a new temporary directory, returning their names
+char **make_bench_images(int count, char *dir)
+{
+  struct tile pool[BENCH_POOL_TILES];
+  struct rgb colours[16];
+  unsigned int seed = 1;
+
+  if (!mkdtemp(dir)) {
+    perror("Could not create directory for benchmark images");
+    exit(-3);
+  }
+  printf("Generating %d benchmark images in %s\n", count, dir);
+  for (int i = 0; i < 16; i++) {
+    colours[i].r = rand_r(&seed) & 0xff;
+    colours[i].g = rand_r(&seed) & 0xff;
+    colours[i].b = rand_r(&seed) & 0xff;
+  }
+  for (int i = 0; i < BENCH_POOL_TILES; i++)
+    for (int x = 0; x < 8; x++)
+      for (int y = 0; y < 8; y++)
+        pool[i].bytes[x][y] = rand_r(&seed) % 16;
+
+  char **names = calloc(sizeof(char *), count);
+  for (int i = 0; i < count; i++) {
+    names[i] = malloc(strlen(dir) + 32);
+    sprintf(names[i], "%s/frame%04d.png", dir, i);
+    write_bench_png(names[i], i + 1, pool, colours);
+  }
+  return names;
+}
+
+/* ============================================================= */
+
+void usage(void)
+{
+  fprintf(stderr, "Usage: pngtoscreens [-j <threads>] <output file> <png file ...>\n"
+                  "       pngtoscreens [-j <threads>] -b <images> <output file>\n"
+                  "  -j - number of threads reading PNG files (default: one per CPU).\n"
+                  "  -b - benchmark: generate this many images to convert, and report the conversion rate.\n");
+  exit(-1);
+}
+
 int main(int argc, char **argv)
 {
   int i, x, y;
-
-  if (argc < 3) {
-    fprintf(stderr, "Usage: pngtoscreens <output file> <png file ...>\n");
-    exit(-1);
+  int bench_images = 0;
+  char bench_dir[] = "/tmp/pngtoscreensXXXXXX";
+  char **file_names;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:j:")) != -1) {
+    switch (opt) {
+    case 'b':
+      bench_images = atoi(optarg);
+      break;
+    case 'j':
+      worker_count = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (argc - optind < (bench_images ? 1 : 2))
+    usage();
+  if (worker_count < 1)
+    worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+  if (worker_count < 1)
+    worker_count = 1;
+
+  image_count = bench_images ? bench_images : argc - optind - 1;
+  // Screen 0 is reserved for the current display (it gets constructed
+  // by MEGABASIC on initialisation).
+  if (image_count > 254) {
+    fprintf(stderr, "ERROR: Too many input files. Maximum of 254 PNG files.\n");
+    exit(-3);
   }
 
-  FILE *outfile = fopen(argv[1], "w");
+  FILE *outfile = fopen(argv[optind], "w");
   if (!outfile) {
     perror("Could not open output file");
     exit(-3);
   }
 
-  // Allow upto 128KB of tiles (we will complain later when
-  // saving out, if the whole thing is too big).
+  if (bench_images)
+    file_names = make_bench_images(bench_images, bench_dir);
+  else
+    file_names = &argv[optind + 1];
+
+  // Start with room for 128KB of tiles, growing up to what
+  // screen RAM can address.
   struct tile_set *ts = new_tileset(2048);
 
   struct screen *screen_list[256];
-  // Screen 0 is reserved for the current display (it gets constructed
-  // by MEGABASIC on initialisation).
   int screen_count = 1;
 
-  if (argc > 255) {
-    fprintf(stderr, "ERROR: Too many input files. Maximum of 250 PNG files.\n");
+  images = calloc(sizeof(struct image), image_count);
+  if (!images) {
+    perror("calloc() failed");
     exit(-3);
   }
+  for (i = 0; i < image_count; i++)
+    images[i].file_name = file_names[i];
 
-  int image_tiles = 0;
+  double start = time_now();
+  if (worker_count > image_count)
+    worker_count = image_count;
+  pthread_t workers[worker_count];
+  for (i = 0; i < worker_count; i++)
+    pthread_create(&workers[i], NULL, image_worker, NULL);
 
-  for (int i = 2; i < argc; i++) {
-    printf("Reading %s\n", argv[i]);
-    read_png_file(argv[i]);
-    image_tiles += width * height / 64;
-    struct screen *s = png_to_screen(i - 1, ts);
-    if (!s) {
-      fprintf(stderr, "ERROR: Could not produce screen from PNG '%s'\n", argv[i]);
-    }
-    else {
-      screen_list[screen_count++] = s;
-      printf("screen_list[%d]=%p\n", screen_count - 1, s);
-    }
+  int image_tiles = 0;
+  for (i = 0; i < image_count; i++) {
+    wait_for_image(i);
+    int tiles_before = ts->tile_count;
+    image_tiles += images[i].width * images[i].height / 64;
+    screen_list[screen_count++] = png_to_screen(i + 1, ts, &images[i]);
+    printf("\rRead %d/%d images, %d tiles (%d unique)", i + 1, image_count, image_tiles, ts->tile_count);
+    if (!isatty(fileno(stdout)) || i == image_count - 1)
+      printf(": %s (%dx%d, %d new tiles)\n", images[i].file_name, images[i].width, images[i].height,
+          ts->tile_count - tiles_before);
+    fflush(stdout);
   }
+  for (i = 0; i < worker_count; i++)
+    pthread_join(workers[i], NULL);
+  double elapsed = time_now() - start;
 
   printf("Images consists of %d tiles (%d unique) and %d unique colours found.\n", image_tiles, ts->tile_count,
-      ts->colour_count);
+      ts->palette.colour_count);
+  printf("Read %d images in %.3f seconds using %d threads (%.1f images/sec), tile dedup ratio %.2f:1\n", image_count,
+      elapsed, worker_count, image_count / (elapsed > 0 ? elapsed : 1e-6),
+      ts->tile_count ? (double)image_tiles / ts->tile_count : 0.0);
+
+  if (bench_images) {
+    for (i = 0; i < bench_images; i++)
+      unlink(file_names[i]);
+    rmdir(bench_dir);
+  }
 
   // Write out tile set structure
   /*
@@ -471,7 +743,7 @@ int main(int argc, char **argv)
   snprintf((char *)header, 64, "MEGA65 TILESET00");
   header[16] = ts->tile_count & 0xff;
   header[17] = (ts->tile_count >> 8) & 0xff;
-  header[18] = ts->colour_count;
+  header[18] = ts->palette.colour_count;
   unsigned size = 64 + 256 + 256 + 256 + (ts->tile_count * 64);
   header[61] = (size >> 00) & 0xff;
   header[62] = (size >> 8) & 0xff;
@@ -479,27 +751,23 @@ int main(int argc, char **argv)
   fwrite(header, 64, 1, outfile);
   unsigned char paletteblock[256];
   for (i = 0; i < 256; i++)
-    paletteblock[i] = nyblswap(ts->colours[i].r);
+    paletteblock[i] = nyblswap(ts->palette.colours[i].r);
   fwrite(paletteblock, 256, 1, outfile);
   for (i = 0; i < 256; i++)
-    paletteblock[i] = nyblswap(ts->colours[i].g);
+    paletteblock[i] = nyblswap(ts->palette.colours[i].g);
   fwrite(paletteblock, 256, 1, outfile);
   for (i = 0; i < 256; i++)
-    paletteblock[i] = nyblswap(ts->colours[i].b);
+    paletteblock[i] = nyblswap(ts->palette.colours[i].b);
   fwrite(paletteblock, 256, 1, outfile);
 
-  printf("Writing tiles");
-  fflush(stdout);
+  printf("Writing %d tiles\n", ts->tile_count);
   for (i = 0; i < ts->tile_count; i++) {
     unsigned char tile[64];
     for (y = 0; y < 8; y++)
       for (x = 0; x < 8; x++)
         tile[y * 8 + x] = ts->tiles[i].bytes[x][y];
     fwrite(tile, 64, 1, outfile);
-    printf(".");
-    fflush(stdout);
   }
-  printf("\n");
 
   // Write out screen structures
   /*
@@ -518,8 +786,7 @@ int main(int argc, char **argv)
     screenram bytes (2 bytes x width) x height [get resolved to absolute tile numbers after loading]
     colourram bytes (2 bytes x width) x height
   */
-  printf("Writing %d screens", screen_count - 1);
-  fflush(stdout);
+  printf("Writing %d screens\n", screen_count - 1);
   for (i = 1; i < screen_count; i++) {
     unsigned char header[64];
     bzero(header, sizeof(header));
@@ -538,10 +805,7 @@ int main(int argc, char **argv)
       fwrite(screen_list[i]->screen_rows[y], 2 * screen_list[i]->width, 1, outfile);
     for (y = 0; y < screen_list[i]->height; y++)
       fwrite(screen_list[i]->colourram_rows[y], 2 * screen_list[i]->width, 1, outfile);
-    printf(".");
-    fflush(stdout);
   }
-  printf("\n");
 
   /* Finish off with a null header */
   printf("Adding end of file marker.\n");
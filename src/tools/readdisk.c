@@ -41,11 +41,13 @@
 #include <logging.h>
 #include <fpgajtag.h>
 
+#include "diskman.h"
+
 #define UT_TIMEOUT 10
 
 #define UT_RES_TIMEOUT 127
 
-#define TOOLNAME "MEGA65 ReadDisk Test"
+#define TOOLNAME "MEGA65 ReadDisk"
 
 extern int pending_vf011_read;
 extern int pending_vf011_write;
@@ -82,10 +84,11 @@ void get_video_state(void);
 void usage(void)
 {
   fprintf(stderr, "MEGA65 remote disk reading tool.\n");
-  fprintf(stderr, "usage: m65 [-l <serial port>] [-s <230400|2000000|4000000>] [-f] out.d81\n");
+  fprintf(stderr, "usage: readdisk [-l <serial port>] [-s <230400|2000000|4000000>] [-r <retries>] [-f] out.d81\n");
 
-  fprintf(stderr, "  -f - Do full copy (instead of only copying sectors likely to contain data.\n"
+  fprintf(stderr, "  -f - Do full copy (instead of only copying tracks the BAM marks as used).\n"
                   "  -l - Name of serial port to use, e.g., /dev/ttyUSB1\n"
+                  "  -r - Number of times to retry sectors that fail to read (default 3).\n"
                   "  -s - Speed of serial port in bits per second. This must match what your bitstream uses.\n"
                   "       (Typically 2000000 or 4000000).\n"
                   "\n");
@@ -1012,64 +1015,181 @@ unsigned char checkUSBPermissions()
   return 1;
 }
 
-unsigned char read_a_sector(unsigned char track_number, unsigned char side, unsigned char sector)
+// Sectors are read one after another into the single FDC sector buffer, so after each read an
+// enhanced DMA job copies the buffer into a staging area in chip RAM. A whole track (both sides)
+// is then pulled back with one fetch_ram() instead of one round trip per sector.
+#define FDC_BUFFER_ADDRESS 0xffd6e00
+#define STAGING_ADDRESS 0x40000
+#define DMALIST_ADDRESS 0x45000
+#define DMALIST_SIZE 18
+#define SECTORS_PER_SIDE 10
+#define SECTORS_PER_TRACK (2 * SECTORS_PER_SIDE)
+#define TRACKS 80
+
+int read_retries = 3;
+
+// fetch_ram() asks for 256 bytes per monitor command
+unsigned long fetch_round_trips = 0;
+
+// FDC status of the last attempt at each sector, 0 once it has been read successfully
+unsigned char sector_errors[TRACKS][SECTORS_PER_TRACK];
+
+int fdc_setup(void)
 {
-  // Disable auto-seek, or we can't force seeking to track 0
-  mega65_poke(0xffD3696, 0x00);
+  unsigned char sector_buffer_select;
 
-  // Floppy motor on, and select side
-  mega65_poke(0xffD3080, 0x68);
-  if (side)
-    mega65_poke(0xffD3080, 0x60);
+  regop_peek(0xffD3689, &sector_buffer_select);
+  if (regop_execute())
+    return -1;
+
+  // Disable auto-seek, or we can't force seeking to track 0
+  regop_poke(0xffD3696, 0x00);
 
   // Map FDC sector buffer, not SD sector buffer
-  mega65_poke(0xffD3689, mega65_peek(0xffD3689) & 0x7f);
+  regop_poke(0xffD3689, sector_buffer_select & 0x7f);
 
   // Disable matching on any sector, use real drive
-  mega65_poke(0xffd36A1, 0x01);
+  regop_poke(0xffd36A1, 0x01);
 
   // Wait until busy flag clears
-  while (mega65_peek(0xffD3082) & 0x80) {
-    continue;
+  regop_wait(0xffD3082, 0x80, 0x00, NULL);
+  return regop_execute();
+}
+
+// Writes one DMA list per staging slot, each copying the FDC buffer into its slot
+int setup_staging_dmalists(void)
+{
+  unsigned char lists[SECTORS_PER_TRACK * DMALIST_SIZE];
+
+  for (int slot = 0; slot < SECTORS_PER_TRACK; slot++) {
+    unsigned char *l = &lists[slot * DMALIST_SIZE];
+    unsigned int dest = STAGING_ADDRESS + slot * 512;
+    l[0] = 0x0b; // F018B list format
+    l[1] = 0x80; // source MB
+    l[2] = FDC_BUFFER_ADDRESS >> 20;
+    l[3] = 0x81; // destination MB
+    l[4] = dest >> 20;
+    l[5] = 0x00; // end of options
+    l[6] = 0x00; // copy
+    l[7] = 0x00; // 512 bytes
+    l[8] = 0x02;
+    l[9] = FDC_BUFFER_ADDRESS & 0xff;
+    l[10] = (FDC_BUFFER_ADDRESS >> 8) & 0xff;
+    l[11] = (FDC_BUFFER_ADDRESS >> 16) & 0x0f;
+    l[12] = dest & 0xff;
+    l[13] = (dest >> 8) & 0xff;
+    l[14] = (dest >> 16) & 0x0f;
+    l[15] = 0x00; // sub command
+    l[16] = 0x00; // modulo
+    l[17] = 0x00;
   }
+  push_ram(DMALIST_ADDRESS, sizeof(lists), lists);
 
-#if 0
-  // Seek to track 0
-  goto_track0();
-  
-  // Seek to the requested track
-  while(PEEK(0xD082)&0x80) continue;
-  for(i=0;i<track_number;i++) {
-    while(PEEK(0xD082)&0x80) continue;
-    POKE(0xD081,0x18);
-    while(PEEK(0xD082)&0x80) continue;
-    }
-#endif
+  // All lists share one bank, so only $D701/$D705 change per job
+  regop_poke(0xffd3702, (DMALIST_ADDRESS >> 16) & 0x7f);
+  regop_poke(0xffd3704, DMALIST_ADDRESS >> 20);
+  return regop_execute();
+}
+
+void queue_sector_read(unsigned char track_number, int slot, unsigned char *status)
+{
+  int side = slot / SECTORS_PER_SIDE;
+  unsigned int list = DMALIST_ADDRESS + slot * DMALIST_SIZE;
 
-  // Now select the side, and try to read the sector
-  mega65_poke(0xffD3084, track_number);
-  mega65_poke(0xffD3085, sector);
-  mega65_poke(0xffD3086, side ? 1 : 0);
+  // Floppy motor on, and select side
+  regop_poke(0xffD3080, side ? 0x60 : 0x68);
+
+  regop_poke(0xffD3084, track_number);
+  regop_poke(0xffD3085, slot % SECTORS_PER_SIDE + 1);
+  regop_poke(0xffD3086, side);
 
   // Issue read command
-  mega65_poke(0xffD3081, 0x01); // but first reset buffers
-  mega65_poke(0xffD3081, 0x40);
+  regop_poke(0xffD3081, 0x01); // but first reset buffers
+  regop_poke(0xffD3081, 0x40);
 
-  // Wait for busy flag to clear
-  while (mega65_peek(0xffD3082) & 0x80) { }
+  // Wait for busy flag to clear, the last status read has the result
+  regop_wait(0xffD3082, 0x80, 0x00, status);
 
-  if (mega65_peek(0xffD3082) & 0x18) {
-    // Read failed
-    log_error("failed to read T:%02x, S:%02x, H:%02x", track_number, sector, side);
-    return 1;
-  }
-  else {
-    // Read succeeded
-    return 0;
+  // Copy the sector to its staging slot. This goes out with the next sector's read command, and
+  // copies garbage if the read failed, which is fine as the slot is read again.
+  regop_poke(0xffd3701, (list >> 8) & 0xff);
+  regop_poke(0xffd3705, list & 0xff);
+}
+
+/*
+  Reads the sectors of one track that are still marked bad in the error map into track_buf,
+  making up to read_retries further passes over the sectors that fail.
+  Returns the number of sectors that could not be read, or -1 if the monitor stopped answering.
+*/
+int read_track(unsigned char track_number, unsigned char *track_buf)
+{
+  unsigned char *errors = sector_errors[track_number];
+  unsigned char status[SECTORS_PER_TRACK];
+  int bad = 0;
+
+  for (int pass = 0; pass <= read_retries; pass++) {
+    int queued = 0;
+    for (int slot = 0; slot < SECTORS_PER_TRACK; slot++)
+      if (errors[slot]) {
+        queue_sector_read(track_number, slot, &status[slot]);
+        queued++;
+      }
+    if (!queued)
+      break;
+    if (regop_execute())
+      return -1;
+
+    if (queued == SECTORS_PER_TRACK) {
+      fetch_ram(STAGING_ADDRESS, SECTORS_PER_TRACK * 512, track_buf);
+      fetch_round_trips += SECTORS_PER_TRACK * 2;
+    }
+
+    bad = 0;
+    for (int slot = 0; slot < SECTORS_PER_TRACK; slot++) {
+      if (!errors[slot])
+        continue;
+      if (status[slot] & 0x18) {
+        log_debug("failed to read T:%02x, S:%02x, H:%02x (status $%02x)", track_number,
+            slot % SECTORS_PER_SIDE + 1, slot / SECTORS_PER_SIDE, status[slot]);
+        errors[slot] = status[slot];
+        bad++;
+        continue;
+      }
+      if (queued != SECTORS_PER_TRACK) {
+        fetch_ram(STAGING_ADDRESS + slot * 512, 512, &track_buf[slot * 512]);
+        fetch_round_trips += 2;
+      }
+      errors[slot] = 0;
+    }
+    if (bad && pass < read_retries)
+      log_info("retrying %d sector(s) of T:%02x", bad, track_number);
   }
+
+  // track_buf still holds the previous track, or whatever the failed reads copied in
+  for (int slot = 0; slot < SECTORS_PER_TRACK; slot++)
+    if (errors[slot])
+      memset(&track_buf[slot * 512], 0, 512);
+
+  return bad;
 }
 
-void goto_track0(void)
+// Returns 1 if the BAM in the D81 track 40 image marks any block on D81 track t (1-80) as used
+int bam_track_used(unsigned char *dir_track, int t)
+{
+  // BAM sectors are logical sectors 1 and 2, i.e., the second half of physical sector 1 and
+  // the first half of physical sector 2
+  unsigned char *bam = &dir_track[t <= 40 ? 0x100 : 0x200];
+  return bam[0x10 + ((t - 1) % 40) * 6] < 40;
+}
+
+// Returns 1 if track 40 looks like it holds a valid D81 header and BAM
+int bam_valid(unsigned char *dir_track)
+{
+  return dir_track[0x002] == 0x44 && dir_track[0x100] == 0x28 && dir_track[0x102] == 0x44 && dir_track[0x200] == 0x00
+      && dir_track[0x202] == 0x44;
+}
+
+int goto_track0(void)
 {
   // Do some slow seeks first, in case head is stuck at end of disk
   mega65_poke(0xffd3081, 0x10);
@@ -1105,15 +1225,35 @@ void goto_track0(void)
   mega65_poke(0xffd3081, 0x10);
   usleep(40000);
 
-  while (!(mega65_peek(0xffd3082) & 0x01)) {
-    while (mega65_peek(0xffd3082) & 0x80)
-      continue;
-    //    mega65_poke(0xffd3020,1);
-    mega65_poke(0xffd3081, 0x10);
-    while (mega65_peek(0xffd3082) & 0x80)
-      continue;
-    mega65_poke(0xffd3020, mega65_peek(0xffd3020) + 1);
+  unsigned char status;
+  unsigned char border;
+  regop_peek(0xffd3020, &border);
+  regop_wait(0xffd3082, 0x80, 0x00, &status);
+  if (regop_execute())
+    return -1;
+
+  // Step out until the TK0 bit shows, flashing the border once per step
+  while (!(status & 0x01)) {
+    regop_poke(0xffd3020, ++border);
+    regop_poke(0xffd3081, 0x10);
+    regop_wait(0xffd3082, 0x80, 0x00, &status);
+    if (regop_execute())
+      return -1;
   }
+  return 0;
+}
+
+int head_track = 0;
+
+// Steps the head to the given track, one step at a time, waiting for the FDC after each
+int seek_track(int track)
+{
+  while (head_track != track) {
+    regop_poke(0xffD3081, head_track < track ? 0x18 : 0x10);
+    regop_wait(0xffd3082, 0x80, 0x00, NULL);
+    head_track += head_track < track ? 1 : -1;
+  }
+  return regop_execute();
 }
 
 int main(int argc, char **argv)
@@ -1128,7 +1268,7 @@ int main(int argc, char **argv)
     usage();
 
   int opt;
-  while ((opt = getopt(argc, argv, "fhl:s:?")) != -1) {
+  while ((opt = getopt(argc, argv, "fhl:r:s:?")) != -1) {
     switch (opt) {
     case 'h':
     case '?':
@@ -1136,6 +1276,8 @@ int main(int argc, char **argv)
     case 'f':
       full_read = 1;
       break;
+    case 'r':
+      read_retries = atoi(optarg);
       break;
     case 'l':
       serial_port = strdup(optarg);
@@ -1157,11 +1299,12 @@ int main(int argc, char **argv)
       usage();
     }
   }
+  if (optind != argc - 1)
+    usage();
+  char *out_file = argv[optind];
 
-  // Automatically find the serial port
-  unsigned int fpga_id = get_bitstream_fpgaid(bitstream);
-
-  char *res = init_fpgajtag(fpga_serial, serial_port, fpga_id);
+  // Automatically find the serial port, unless one was given
+  char *res = serial_port ? strdup(serial_port) : init_fpgajtag(fpga_serial, NULL, get_bitstream_fpgaid(bitstream));
 
 #ifndef WINDOWS
   // this is set by fpgajtag/util.c:fpgausb_init which is called by fpgajtag/fpgajtag.c:init_fpgajtag
@@ -1201,39 +1344,102 @@ int main(int argc, char **argv)
 
   real_stop_cpu();
 
-  // Seek to track 0, then to track 37
-  goto_track0();
-  for (int i = 0; i < 35; i++) {
-    mega65_poke(0xffD3081, 0x18);
-    while (mega65_peek(0xffd3082) & 0x80)
-      continue;
+  FILE *out = fopen(out_file, "wb");
+  if (!out) {
+    log_crit("could not create D81 file '%s'", out_file);
+    exit(-1);
   }
+  // Unread and unreadable sectors stay zero
+  if (ftruncate(fileno(out), D81_SIZE)) {
+    log_crit("could not size D81 file '%s'", out_file);
+    exit(-1);
+  }
+
+  if (fdc_setup() || setup_staging_dmalists() || goto_track0()) {
+    log_crit("could not set up the floppy controller");
+    exit(-1);
+  }
+  head_track = 0;
+
+  memset(sector_errors, 0xff, sizeof(sector_errors));
 
-  for (int track = 38; track < 41; track++) {
+  // The directory track is read first, as its BAM tells which other tracks hold data
+  int order[TRACKS];
+  order[0] = 39;
+  for (int i = 0, track = 0; track < TRACKS; track++)
+    if (track != 39)
+      order[++i] = track;
 
-    // Step one track
-    mega65_poke(0xffD3081, 0x18);
-    while (mega65_peek(0xffd3082) & 0x80)
+  unsigned char track_buf[SECTORS_PER_TRACK * 512];
+  unsigned char dir_track[SECTORS_PER_TRACK * 512];
+  int tracks_read = 0, sectors_read = 0, bad_sectors = 0;
+  unsigned long read_round_trips = 0, seek_round_trips = 0;
+  long long start = gettime_ms();
+
+  for (int i = 0; i < TRACKS; i++) {
+    int track = order[i];
+
+    if (i && !full_read && !bam_track_used(dir_track, track + 1)) {
+      log_info("skipping unused track %d", track + 1);
       continue;
+    }
 
-    usleep(50000);
-    log_note("current track is T:%02x, H:%02x", mega65_peek(0xffd36a3), mega65_peek(0xffd36a5));
+    unsigned long round_trips = regop_round_trips;
+    if (seek_track(track)) {
+      log_crit("could not seek to track %d", track);
+      exit(-1);
+    }
+    seek_round_trips += regop_round_trips - round_trips;
 
-    for (int side = 0; side < 2; side++) {
-      // Allow a little bit of time for a sector to pass under the head,
-      // so that we can check the track and head, and step if we need
+    round_trips = regop_round_trips + fetch_round_trips;
+    int bad = read_track(track, track_buf);
+    if (bad < 0) {
+      log_crit("could not read track %d", track);
+      exit(-1);
+    }
+    round_trips = regop_round_trips + fetch_round_trips - round_trips;
+    read_round_trips += round_trips;
+    log_note("read T:%02x, %d bad sector(s), %lu monitor round trips", track, bad, round_trips);
 
-      for (int sector = 1; sector <= 10; sector++) {
-        log_note("reading T:%02x, S:%02x, H:%02x", track, sector, side);
-        read_a_sector(track, side, sector);
+    if (fseek(out, track * SECTORS_PER_TRACK * 512, SEEK_SET)
+        || fwrite(track_buf, 1, sizeof(track_buf), out) != sizeof(track_buf)) {
+      log_crit("could not write to D81 file '%s'", out_file);
+      exit(-1);
+    }
+    tracks_read++;
+    sectors_read += SECTORS_PER_TRACK - bad;
+    bad_sectors += bad;
+
+    if (!i) {
+      memcpy(dir_track, track_buf, sizeof(dir_track));
+      if (!full_read && (bad || !bam_valid(dir_track))) {
+        log_warn("no valid BAM on directory track, reading all tracks");
+        full_read = 1;
       }
     }
   }
+  fclose(out);
+
   // Floppy motor off
   mega65_poke(0xffD3080, 0x00);
 
+  double secs = (gettime_ms() - start) / 1000.0;
+  log_note("read %d tracks, %d sectors in %.1f seconds (%.1f sectors/sec)", tracks_read, sectors_read, secs,
+      sectors_read / secs);
+  log_note("%.1f monitor round trips per track, plus %lu for seeking", (double)read_round_trips / tracks_read,
+      seek_round_trips);
+
+  if (bad_sectors) {
+    log_error("%d sector(s) could not be read:", bad_sectors);
+    for (int track = 0; track < TRACKS; track++)
+      for (int slot = 0; slot < SECTORS_PER_TRACK; slot++)
+        if (sector_errors[track][slot] && sector_errors[track][slot] != 0xff)
+          log_error("  T:%02x, S:%02x, H:%02x: %s", track, slot % SECTORS_PER_SIDE + 1, slot / SECTORS_PER_SIDE,
+              sector_errors[track][slot] & 0x10 ? "record not found" : "CRC error");
+  }
+
   start_cpu();
-  do_exit(0);
+  do_exit(bad_sectors ? 1 : 0);
 }
 
 void do_exit(int retval)
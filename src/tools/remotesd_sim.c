@@ -0,0 +1,1383 @@
+/*
+  Host-side stand-in for a MEGA65 running the remotesd helper.
+
+  Lets mega65_ftp (and anything else speaking the same protocols) be
+  exercised and timed without real hardware. The SD card is backed by
+  an image file, and two transports are offered:
+
+  - a pseudo terminal that behaves like the serial monitor with the
+    remotesd helper already running: m/M/s/l monitor commands, job
+    lists pushed to $C001 and started by writing the job count to
+    $C000, replies as FTJOBDATA (RLE) / FTJOBDATR (raw) / FTJOBDONE /
+    FTBATCHDONE, exactly as src/utilities/remotesd.c sends them.
+    The F011 floppy controller registers are modelled as well, backed
+    by a D81 image, for tools like readdisk that drive the FDC directly
+    through the monitor, along with enhanced DMA jobs (copy and fill)
+    triggered by writing $D705. The SD controller registers at $D680
+    can be driven directly too, as monitor_upload does. Optionally, a
+    C64 KERNAL screen editor can be modelled reading the keyboard
+    buffer at $0277/$C6, so that typing with m65 -t can be timed.
+
+  - a UDP socket speaking the 'mreq'/'mrsp' protocol of
+    src/utilities/remotesd_eth.c, plus echoing of the etherload
+    single-command and dmaload packets so that the helper upload and
+    ping at start-up succeed.
+
+  Per-sector latency, link bandwidth and packet loss can be dialled in
+  so that throughput changes in the host tools can be measured in a
+  repeatable way (see src/tests/ftp_benchmark.sh).
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <logging.h>
+
+#include "etherload/ethlet_dma_load_map.h"
+
+#define SECTOR_SIZE 512
+
+// Chip RAM visible to the jobs, and the $FFD3xxx IO page
+#define SIM_RAM_SIZE (384 * 1024)
+#define SIM_IO_BASE 0xffd3000
+#define SIM_IO_SIZE 0x1000
+// the FDC sector buffer shows at $FFD6E00 while $D689 bit 7 is clear, the SD one while it is set
+#define SIM_SECTORBUF_BASE 0xffd6e00
+#define SIM_COLOURRAM_BASE 0xff80000
+#define SIM_COLOURRAM_SIZE 0x8000
+
+// time the FDC stays busy for a head step
+#define FDC_STEP_US 3000
+
+#define ETH_PORT 4510
+
+unsigned char sim_ram[SIM_RAM_SIZE];
+unsigned char sim_io[SIM_IO_SIZE];
+unsigned char sim_colour_ram[SIM_COLOURRAM_SIZE];
+unsigned char fdc_buffer[SECTOR_SIZE];
+unsigned char sd_buffer[SECTOR_SIZE];
+
+int sdcard_fd = -1;
+int flash_fd = -1;
+int floppy_fd = -1;
+unsigned int sdcard_sectors = 0;
+
+int pty_master = -1;
+int pty_slave = -1;
+int udp_fd = -1;
+
+// link simulation parameters
+long sector_latency_us = 0;
+long serial_bandwidth = 0;   // bytes/sec, 0 = unlimited
+long ethernet_bandwidth = 0; // bytes/sec, 0 = unlimited
+double packet_loss = 0;      // probability 0.0 .. 1.0
+long fdc_latency_us = 0;     // time a sector read keeps the FDC busy
+double fdc_error_rate = 0;   // probability of a CRC error per floppy sector read
+long serial_turnaround_us = 0;
+long kernal_key_us = 1000; // time the screen editor takes per character
+
+// typed text seen by the modelled KERNAL, NULL if not modelled
+FILE *keyboard_file = NULL;
+long long kernal_busy_until_us = 0;
+
+// floppy drive state
+int fdc_head_track = 40;
+long long fdc_busy_until_us = 0;
+unsigned char fdc_error = 0;
+
+// SD controller state, for hosts that drive $D680 directly
+long long sd_busy_until_us = 0;
+unsigned char sd_error = 0;
+int sd_read_pending = 0;
+unsigned int sd_pending_sector = 0;
+
+long long serial_link_free_us = 0;
+long long ethernet_link_free_us = 0;
+
+// statistics, printed on exit
+unsigned long stat_sectors_read = 0;
+unsigned long stat_sectors_written = 0;
+unsigned long stat_batches = 0;
+unsigned long stat_packets_in = 0;
+unsigned long stat_packets_out = 0;
+unsigned long stat_packets_dropped = 0;
+unsigned long stat_monitor_commands = 0;
+unsigned long stat_serial_turnarounds = 0;
+unsigned long stat_fdc_reads = 0;
+unsigned long stat_keys_buffered = 0;
+unsigned long stat_keys_matrix = 0;
+unsigned long stat_dmaload_packets = 0;
+unsigned long stat_dmaload_bytes = 0;
+
+volatile int quit_flag = 0;
+
+long long gettime_us(void)
+{
+  struct timeval nowtv;
+  gettimeofday(&nowtv, NULL);
+  return nowtv.tv_sec * 1000000LL + nowtv.tv_usec;
+}
+
+void usage(void)
+{
+  fprintf(stderr, "MEGA65 remotesd helper simulator (serial monitor pty + ethernet)\n\n");
+  fprintf(stderr, "Usage: remotesd_sim [-h] [-0 <log level>] -i <sdcard image> [-C <MB>] [-f <flash image>]\n"
+                  "                    [-l <pty link>] [-e] [-a <ipv6 address>] [-u <udp port>] [-m <model id>]\n"
+                  "                    [-L <usec per sector>] [-b <serial bytes/sec>] [-B <ethernet bytes/sec>]\n"
+                  "                    [-p <packet loss %%>] [-d <d81 image>] [-D <usec per FDC read>]\n"
+                  "                    [-E <floppy error %%>] [-T <usec serial turnaround>] [-o <ram dump>]\n");
+  fprintf(stderr, "  -h - display this help.\n");
+  fprintf(stderr, "  -0 - set log level (0 = quiet ... 5 = everything).\n");
+  fprintf(stderr, "  -i - SD card image file to serve.\n");
+  fprintf(stderr, "  -C - create a blank image of the given size in MB first (FAT32 + MEGA65 system partition).\n");
+  fprintf(stderr, "  -f - QSPI flash image to serve for flash read jobs (reads as $FF otherwise).\n");
+  fprintf(stderr, "  -l - create a symlink to the serial pty with this name (use it with mega65_ftp -l).\n");
+  fprintf(stderr, "  -e - also answer the ethernet protocol (use mega65_ftp -i ::1%%lo).\n");
+  fprintf(stderr, "  -a - IPv6 address to listen on for ethernet requests (default ::1).\n");
+  fprintf(stderr, "  -u - UDP port to listen on for ethernet requests (default %d).\n", ETH_PORT);
+  fprintf(stderr, "  -m - hardware model id reported in $D629 (default $03, MEGA65 R3).\n");
+  fprintf(stderr, "  -L - simulated SD card latency per sector access in microseconds.\n");
+  fprintf(stderr, "  -b - simulated serial link bandwidth towards the host in bytes/sec (e.g. 200000 for 2Mbit).\n");
+  fprintf(stderr, "  -B - simulated ethernet bandwidth towards the host in bytes/sec.\n");
+  fprintf(stderr, "  -p - percentage of UDP packets to drop (in either direction).\n");
+  fprintf(stderr, "  -d - D81 image in the floppy drive, read through the F011 registers.\n");
+  fprintf(stderr, "  -D - time in microseconds a floppy sector read keeps the FDC busy.\n");
+  fprintf(stderr, "  -E - percentage of floppy sector reads that fail with a CRC error.\n");
+  fprintf(stderr, "  -T - serial turnaround latency in microseconds, paid once per burst of host input\n"
+                  "       (e.g. 1000 for the latency timer of a USB UART).\n");
+  fprintf(stderr, "  -k - model the KERNAL reading the keyboard buffer, writing what gets typed to this file\n"
+                  "       (keys pressed on the virtual keyboard show as {xx}, the matrix position).\n");
+  fprintf(stderr, "  -K - time in microseconds the KERNAL takes to handle each character (default 1000).\n");
+  fprintf(stderr, "  -o - write the chip RAM to this file on exit (e.g. to check what etherload put there).\n");
+  fprintf(stderr, "\n");
+  exit(-3);
+}
+
+/*
+  Memory model
+*/
+
+unsigned char fdc_status(void);
+void fdc_command(unsigned char cmd);
+unsigned char sd_status(void);
+void sd_settle(void);
+void sd_command(unsigned char cmd);
+uint32_t get_le32(unsigned char *p);
+void dma_execute(unsigned long list_addr);
+
+unsigned char mem_read(unsigned long addr)
+{
+  addr &= 0xfffffff;
+  if (addr == 0xffd3082)
+    return fdc_status();
+  if (addr == 0xffd3680)
+    return sd_status();
+  if (addr >= SIM_SECTORBUF_BASE && addr < SIM_SECTORBUF_BASE + SECTOR_SIZE) {
+    if (!(sim_io[0x689] & 0x80))
+      return fdc_buffer[addr - SIM_SECTORBUF_BASE];
+    sd_settle();
+    return sd_buffer[addr - SIM_SECTORBUF_BASE];
+  }
+  if (addr >= SIM_IO_BASE && addr < SIM_IO_BASE + SIM_IO_SIZE)
+    return sim_io[addr - SIM_IO_BASE];
+  if (addr >= SIM_COLOURRAM_BASE && addr < SIM_COLOURRAM_BASE + SIM_COLOURRAM_SIZE)
+    return sim_colour_ram[addr - SIM_COLOURRAM_BASE];
+  if (addr < SIM_RAM_SIZE)
+    return sim_ram[addr];
+  return 0x00;
+}
+
+void mem_write(unsigned long addr, unsigned char value)
+{
+  addr &= 0xfffffff;
+  if (addr >= SIM_SECTORBUF_BASE && addr < SIM_SECTORBUF_BASE + SECTOR_SIZE) {
+    if (sim_io[0x689] & 0x80) {
+      sd_settle();
+      sd_buffer[addr - SIM_SECTORBUF_BASE] = value;
+    }
+    else
+      fdc_buffer[addr - SIM_SECTORBUF_BASE] = value;
+  }
+  else if (addr >= SIM_IO_BASE && addr < SIM_IO_BASE + SIM_IO_SIZE) {
+    if (addr == 0xffd3680) {
+      sd_command(value);
+      return;
+    }
+    sim_io[addr - SIM_IO_BASE] = value;
+    if (addr == 0xffd3081)
+      fdc_command(value);
+    if (addr == 0xffd3705)
+      dma_execute(
+          ((unsigned long)sim_io[0x704] << 20) | ((sim_io[0x702] & 0x7f) << 16) | (sim_io[0x701] << 8) | value);
+    if (addr == 0xffd3616 && keyboard_file && value != 0x7f) {
+      // second virtual key: the first one is only a modifier when this is set
+      fprintf(keyboard_file, "{%02x}", value);
+      stat_keys_matrix++;
+    }
+    else if (addr == 0xffd3615 && keyboard_file && value != 0x7f && value != 0x0f) {
+      fprintf(keyboard_file, "{%02x}", value);
+      stat_keys_matrix++;
+    }
+  }
+  else if (addr >= SIM_COLOURRAM_BASE && addr < SIM_COLOURRAM_BASE + SIM_COLOURRAM_SIZE)
+    sim_colour_ram[addr - SIM_COLOURRAM_BASE] = value;
+  else if (addr < SIM_RAM_SIZE)
+    sim_ram[addr] = value;
+}
+
+void mem_read_block(unsigned long addr, unsigned char *buffer, int count)
+{
+  for (int i = 0; i < count; i++)
+    buffer[i] = mem_read(addr + i);
+}
+
+void mem_write_block(unsigned long addr, unsigned char *buffer, int count)
+{
+  for (int i = 0; i < count; i++)
+    mem_write(addr + i, buffer[i]);
+}
+
+/*
+  SD card and flash backing store
+*/
+
+void sector_delay(void)
+{
+  if (sector_latency_us)
+    usleep(sector_latency_us);
+}
+
+int sd_read_sector(unsigned int sector_number, unsigned char *buffer)
+{
+  sector_delay();
+  stat_sectors_read++;
+  memset(buffer, 0, SECTOR_SIZE);
+  if (sector_number >= sdcard_sectors) {
+    log_warn("read of sector $%08x beyond end of image", sector_number);
+    return -1;
+  }
+  if (pread(sdcard_fd, buffer, SECTOR_SIZE, (off_t)sector_number * SECTOR_SIZE) != SECTOR_SIZE) {
+    log_error("could not read sector $%08x from image: %s", sector_number, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int sd_write_sector(unsigned int sector_number, unsigned char *buffer)
+{
+  sector_delay();
+  stat_sectors_written++;
+  if (sector_number >= sdcard_sectors) {
+    log_warn("write of sector $%08x beyond end of image", sector_number);
+    return -1;
+  }
+  if (pwrite(sdcard_fd, buffer, SECTOR_SIZE, (off_t)sector_number * SECTOR_SIZE) != SECTOR_SIZE) {
+    log_error("could not write sector $%08x to image: %s", sector_number, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+void flash_read(unsigned int addr, unsigned char *buffer)
+{
+  memset(buffer, 0xff, SECTOR_SIZE);
+  if (flash_fd >= 0)
+    pread(flash_fd, buffer, SECTOR_SIZE, addr);
+}
+
+/*
+  SD controller: reset, and single sector reads and writes between the card and
+  the SD sector buffer, addressed by the (SDHC) sector number in $D681-$D684.
+  The busy bit stays set for the simulated sector latency instead of stalling
+  the simulator, so that a host can overlap other monitor traffic with it. As on
+  the real controller, a read only reaches the sector buffer once it is no longer
+  busy, and reads and writes asked for while it is busy are ignored.
+*/
+
+unsigned char sd_status(void)
+{
+  if (gettime_us() < sd_busy_until_us)
+    return 0x02;
+  sd_settle();
+  return sd_error;
+}
+
+// Completes a read whose latency has run out
+void sd_settle(void)
+{
+  if (!sd_read_pending || gettime_us() < sd_busy_until_us)
+    return;
+  sd_read_pending = 0;
+  if (sd_pending_sector >= sdcard_sectors
+      || pread(sdcard_fd, sd_buffer, SECTOR_SIZE, (off_t)sd_pending_sector * SECTOR_SIZE) != SECTOR_SIZE) {
+    log_debug("SD: read of sector $%08x failed", sd_pending_sector);
+    sd_error = 0x43;
+  }
+  else
+    sd_error = 0;
+}
+
+void sd_command(unsigned char cmd)
+{
+  unsigned int sector_number = get_le32(&sim_io[0x681]);
+
+  sd_settle();
+  if ((cmd == 0x02 || cmd == 0x03) && gettime_us() < sd_busy_until_us) {
+    log_debug("SD: command $%02x ignored while busy", cmd);
+    return;
+  }
+
+  switch (cmd) {
+  case 0x00: // assert and release reset
+  case 0x01:
+    sd_error = 0;
+    sd_read_pending = 0;
+    sd_busy_until_us = 0;
+    break;
+  case 0x02: // read sector
+    stat_sectors_read++;
+    sd_read_pending = 1;
+    sd_pending_sector = sector_number;
+    sd_busy_until_us = gettime_us() + sector_latency_us;
+    break;
+  case 0x03: // write sector
+    stat_sectors_written++;
+    if (sector_number >= sdcard_sectors
+        || pwrite(sdcard_fd, sd_buffer, SECTOR_SIZE, (off_t)sector_number * SECTOR_SIZE) != SECTOR_SIZE) {
+      log_debug("SD: write of sector $%08x failed", sector_number);
+      sd_error = 0x43;
+    }
+    else
+      sd_error = 0;
+    sd_busy_until_us = gettime_us() + sector_latency_us;
+    break;
+  default:
+    log_debug("SD: command $%02x is not simulated", cmd);
+    break;
+  }
+}
+
+/*
+  F011 floppy controller: just enough of $D080-$D086 for stepping the head and
+  reading sectors, with the busy flag in $D082 held for the simulated duration.
+*/
+
+unsigned char fdc_status(void)
+{
+  unsigned char status = fdc_error;
+  if (gettime_us() < fdc_busy_until_us)
+    status |= 0x80;
+  if (!fdc_head_track)
+    status |= 0x01; // TK0
+  return status;
+}
+
+void fdc_command(unsigned char cmd)
+{
+  long long now = gettime_us();
+
+  switch (cmd) {
+  case 0x10: // step out
+    if (fdc_head_track > 0)
+      fdc_head_track--;
+    fdc_busy_until_us = now + FDC_STEP_US;
+    break;
+  case 0x18: // step in
+    if (fdc_head_track < 84)
+      fdc_head_track++;
+    fdc_busy_until_us = now + FDC_STEP_US;
+    break;
+  case 0x40: // read sector
+  {
+    int track = sim_io[0x084];
+    int sector = sim_io[0x085];
+    int side = sim_io[0x086] & 1;
+    stat_fdc_reads++;
+    fdc_error = 0;
+    memset(fdc_buffer, 0, SECTOR_SIZE);
+    // the sector header has to be found under the head, as with auto-seek disabled
+    if (floppy_fd < 0 || track != fdc_head_track || sector < 1 || sector > 10
+        || pread(floppy_fd, fdc_buffer, SECTOR_SIZE, ((off_t)track * 20 + side * 10 + sector - 1) * SECTOR_SIZE)
+               != SECTOR_SIZE) {
+      log_debug("FDC: record not found T:%d S:%d H:%d (head on track %d)", track, sector, side, fdc_head_track);
+      fdc_error = 0x10; // RNF
+    }
+    else if (fdc_error_rate > 0 && drand48() < fdc_error_rate) {
+      log_debug("FDC: simulated CRC error T:%d S:%d H:%d", track, sector, side);
+      fdc_error = 0x08; // CRC
+    }
+    sim_io[0x6a3] = fdc_head_track;
+    sim_io[0x6a5] = side;
+    fdc_busy_until_us = now + fdc_latency_us;
+    break;
+  }
+  default: // buffer resets etc. complete at once
+    break;
+  }
+}
+
+/*
+  Enhanced DMA: each job, chained ones included, is an option list followed by
+  an F018A/F018B job, copy and fill only. (The megabyte options stay set for the
+  jobs after the one that gave them.)
+*/
+
+void dma_execute(unsigned long list_addr)
+{
+  int f018b = 0;
+  unsigned long src_mb = 0, dst_mb = 0;
+  unsigned char opt;
+  unsigned char job[12];
+
+  do {
+    while ((opt = mem_read(list_addr++))) {
+      if (opt == 0x0a)
+        f018b = 0;
+      else if (opt == 0x0b)
+        f018b = 1;
+      else if (opt == 0x80)
+        src_mb = mem_read(list_addr++);
+      else if (opt == 0x81)
+        dst_mb = mem_read(list_addr++);
+      else if (opt & 0x80)
+        list_addr++; // unmodelled option with an argument
+    }
+
+    mem_read_block(list_addr, job, f018b ? 12 : 11);
+    list_addr += f018b ? 12 : 11;
+    int count = job[1] + (job[2] << 8);
+    if (!count)
+      count = 0x10000;
+    unsigned long src = (src_mb << 20) | ((job[5] & 0x0f) << 16) | job[3] | (job[4] << 8);
+    unsigned long dst = (dst_mb << 20) | ((job[8] & 0x0f) << 16) | job[6] | (job[7] << 8);
+
+    switch (job[0] & 0x03) {
+    case 0x00: // copy
+      log_debug("DMA: copy $%x bytes $%07lx -> $%07lx", count, src, dst);
+      for (int i = 0; i < count; i++)
+        mem_write(dst + i, mem_read(src + i));
+      break;
+    case 0x03: // fill, with the fill byte in the low byte of the source address
+      log_debug("DMA: fill $%x bytes at $%07lx with $%02x", count, dst, job[3]);
+      for (int i = 0; i < count; i++)
+        mem_write(dst + i, job[3]);
+      break;
+    default:
+      log_warn("DMA: job command $%02x is not simulated", job[0]);
+      break;
+    }
+  } while (job[0] & 0x04);
+}
+
+void put_le32(unsigned char *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+uint32_t get_le32(unsigned char *p)
+{
+  return p[0] + (p[1] << 8) + (p[2] << 16) + ((uint32_t)p[3] << 24);
+}
+
+/*
+  Create a blank SD card image, laid out the way the MEGA65 formats cards:
+  a FAT32 data partition followed by the MEGA65 system partition with a
+  few freeze slots, so that dir, put, get and getslot all have something
+  to work with.
+*/
+int create_sdcard_image(char *filename, int size_mb)
+{
+  int retVal = 0;
+  do {
+    if (size_mb < 16) {
+      log_error("image size must be at least 16MB");
+      retVal = -1;
+      break;
+    }
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      log_error("could not create image '%s': %s", filename, strerror(errno));
+      retVal = -1;
+      break;
+    }
+
+    uint32_t total_sectors = size_mb * 2048;
+    if (ftruncate(fd, (off_t)total_sectors * SECTOR_SIZE)) {
+      log_error("could not size image '%s': %s", filename, strerror(errno));
+      close(fd);
+      retVal = -1;
+      break;
+    }
+
+    const int slot_count = 8;
+    const int slot_size = 0x300;
+    const int slotdir_sectors = 1;
+    uint32_t sys_sectors = 1 + slotdir_sectors + slot_count * slot_size;
+    uint32_t sys_start = total_sectors - sys_sectors;
+    uint32_t fat_start = 2048;
+    uint32_t fat_size = sys_start - fat_start;
+
+    const int reserved_sectors = 32;
+    const int sectors_per_cluster = 8;
+    uint32_t clusters = (fat_size - reserved_sectors) / sectors_per_cluster;
+    uint32_t sectors_per_fat = ((clusters + 2) * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    clusters = (fat_size - reserved_sectors - 2 * sectors_per_fat) / sectors_per_cluster;
+
+    unsigned char sector[SECTOR_SIZE];
+
+    // MBR with the FAT32 and the system partition
+    memset(sector, 0, SECTOR_SIZE);
+    sector[0x1be + 4] = 0x0c;
+    put_le32(&sector[0x1be + 8], fat_start);
+    put_le32(&sector[0x1be + 12], fat_size);
+    sector[0x1ce + 4] = 0x41;
+    put_le32(&sector[0x1ce + 8], sys_start);
+    put_le32(&sector[0x1ce + 12], sys_sectors);
+    sector[0x1fe] = 0x55;
+    sector[0x1ff] = 0xaa;
+    pwrite(fd, sector, SECTOR_SIZE, 0);
+
+    // FAT32 boot sector
+    memset(sector, 0, SECTOR_SIZE);
+    sector[0] = 0xeb;
+    sector[1] = 0x58;
+    sector[2] = 0x90;
+    memcpy(&sector[3], "MEGA65  ", 8);
+    sector[0x0b] = SECTOR_SIZE & 0xff;
+    sector[0x0c] = SECTOR_SIZE >> 8;
+    sector[0x0d] = sectors_per_cluster;
+    sector[0x0e] = reserved_sectors;
+    sector[0x10] = 2;
+    sector[0x15] = 0xf8;
+    put_le32(&sector[0x1c], fat_start);
+    put_le32(&sector[0x20], fat_size);
+    put_le32(&sector[0x24], sectors_per_fat);
+    put_le32(&sector[0x2c], 2);
+    sector[0x30] = 1;
+    sector[0x32] = 6;
+    sector[0x40] = 0x80;
+    sector[0x42] = 0x29;
+    put_le32(&sector[0x43], 0x6565ec0d);
+    memcpy(&sector[0x47], "MEGA65     ", 11);
+    memcpy(&sector[0x52], "FAT32   ", 8);
+    sector[0x1fe] = 0x55;
+    sector[0x1ff] = 0xaa;
+    pwrite(fd, sector, SECTOR_SIZE, (off_t)fat_start * SECTOR_SIZE);
+    pwrite(fd, sector, SECTOR_SIZE, (off_t)(fat_start + 6) * SECTOR_SIZE);
+
+    // FS information sector
+    memset(sector, 0, SECTOR_SIZE);
+    memcpy(&sector[0], "RRaA", 4);
+    memcpy(&sector[0x1e4], "rrAa", 4);
+    put_le32(&sector[0x1e8], clusters - 1);
+    put_le32(&sector[0x1ec], 3);
+    sector[0x1fe] = 0x55;
+    sector[0x1ff] = 0xaa;
+    pwrite(fd, sector, SECTOR_SIZE, (off_t)(fat_start + 1) * SECTOR_SIZE);
+
+    // Both FATs: media descriptor, reserved entry and the root directory cluster
+    memset(sector, 0, SECTOR_SIZE);
+    put_le32(&sector[0], 0x0ffffff8);
+    put_le32(&sector[4], 0x0fffffff);
+    put_le32(&sector[8], 0x0fffffff);
+    for (int i = 0; i < 2; i++)
+      pwrite(fd, sector, SECTOR_SIZE, (off_t)(fat_start + reserved_sectors + i * sectors_per_fat) * SECTOR_SIZE);
+
+    // Root directory with volume label
+    memset(sector, 0, SECTOR_SIZE);
+    memcpy(&sector[0], "MEGA65     ", 11);
+    sector[0x0b] = 0x08;
+    pwrite(fd, sector, SECTOR_SIZE, (off_t)(fat_start + reserved_sectors + 2 * sectors_per_fat) * SECTOR_SIZE);
+
+    // MEGA65 system partition header
+    memset(sector, 0, SECTOR_SIZE);
+    memcpy(&sector[0], "MEGA65SYS00", 11);
+    put_le32(&sector[0x10], 1);
+    put_le32(&sector[0x14], 0);
+    put_le32(&sector[0x18], slot_size);
+    sector[0x1c] = slot_count;
+    sector[0x1e] = slotdir_sectors;
+    pwrite(fd, sector, SECTOR_SIZE, (off_t)sys_start * SECTOR_SIZE);
+
+    close(fd);
+    log_note("created %dMB image '%s' (FAT32 at $%x, %d clusters; system partition at $%x)", size_mb, filename, fat_start,
+        clusters, sys_start);
+  } while (0);
+  return retVal;
+}
+
+/*
+  Serial side
+*/
+
+// Pace output so that it leaves no faster than the simulated link allows
+void link_throttle(long long *link_free_us, long bandwidth, int bytes)
+{
+  if (!bandwidth)
+    return;
+  long long now = gettime_us();
+  if (*link_free_us < now)
+    *link_free_us = now;
+  *link_free_us += (long long)bytes * 1000000LL / bandwidth;
+  if (*link_free_us > now + 1000)
+    usleep(*link_free_us - now);
+}
+
+void serial_write(const void *data, int len)
+{
+  const unsigned char *p = data;
+
+  link_throttle(&serial_link_free_us, serial_bandwidth, len);
+
+  while (len > 0) {
+    int w = write(pty_master, p, len);
+    if (w > 0) {
+      p += w;
+      len -= w;
+      continue;
+    }
+    if (w < 0 && errno != EAGAIN) {
+      log_error("write to pty failed: %s", strerror(errno));
+      return;
+    }
+    struct pollfd pfd = { pty_master, POLLOUT, 0 };
+    if (poll(&pfd, 1, 1000) == 0) {
+      // Nobody is reading the other end, so throw the stale data away rather than
+      // blocking all other traffic
+      log_warn("host is not reading serial output, discarding %d bytes", len);
+      tcflush(pty_slave, TCIFLUSH);
+      return;
+    }
+  }
+}
+
+void serial_printf(const char *fmt, ...)
+{
+  char msg[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  serial_write(msg, len);
+}
+
+/*
+  RLE encoding as understood by queue_data_decode() in mega65_ftp:
+  $00-$7F = that many literal bytes follow, $80|n = next byte repeated n times.
+*/
+unsigned char rle_out[2 * 65536];
+unsigned char rle_stream[65536];
+
+int rle_encode(unsigned char *in, int len, unsigned char *out)
+{
+  int olen = 0;
+  int raw_start = 0, raw_len = 0;
+
+  for (int i = 0; i < len;) {
+    int run = 1;
+    while (i + run < len && run < 127 && in[i + run] == in[i])
+      run++;
+    if (run >= 3 || raw_len == 127) {
+      if (raw_len) {
+        out[olen++] = raw_len;
+        memcpy(&out[olen], &in[raw_start], raw_len);
+        olen += raw_len;
+        raw_len = 0;
+      }
+    }
+    if (run >= 3) {
+      out[olen++] = 0x80 | run;
+      out[olen++] = in[i];
+      i += run;
+    }
+    else {
+      if (!raw_len)
+        raw_start = i;
+      raw_len++;
+      i++;
+    }
+  }
+  if (raw_len) {
+    out[olen++] = raw_len;
+    memcpy(&out[olen], &in[raw_start], raw_len);
+    olen += raw_len;
+  }
+  return olen;
+}
+
+void job_done(uint16_t job_addr)
+{
+  serial_printf("FTJOBDONE:%04X:\n\r", job_addr);
+}
+
+void run_jobs(void)
+{
+  unsigned char buffer[SECTOR_SIZE];
+  int job_count = mem_read(0xc000);
+  uint16_t addr = 0xc001;
+  long long start = gettime_us();
+
+  log_debug("received list of %d jobs", job_count);
+  stat_batches++;
+
+  for (int jid = 0; jid < job_count && addr <= 0xcfff; jid++) {
+    uint16_t job_addr = addr;
+    unsigned char job_type = mem_read(addr);
+    unsigned char job[9];
+    mem_read_block(addr, job, 9);
+
+    switch (job_type) {
+    case 0x00:
+      addr++;
+      break;
+
+    case 0xff:
+      // The real helper drops back to BASIC here. We stay resident, so that the next
+      // session finds the helper still running.
+      log_note("quit requested");
+      addr++;
+      break;
+
+    case 0x02: // write sector
+    case 0x05: // multi write first
+    case 0x06: // multi write middle
+    case 0x07: // multi write end
+    {
+      uint32_t buffer_address = get_le32(&job[1]);
+      uint32_t sector_number = get_le32(&job[5]);
+      addr += 9;
+      log_debug("write sector $%08x from mem $%07x", sector_number, buffer_address);
+      mem_read_block(buffer_address, buffer, SECTOR_SIZE);
+      sd_write_sector(sector_number, buffer);
+      break;
+    }
+
+    case 0x01: // read sector into memory
+    {
+      uint32_t buffer_address = get_le32(&job[1]);
+      uint32_t sector_number = get_le32(&job[5]);
+      addr += 9;
+      log_debug("read sector $%08x into mem $%07x", sector_number, buffer_address);
+      sd_read_sector(sector_number, buffer);
+      mem_write_block(buffer_address, buffer, SECTOR_SIZE);
+      job_done(job_addr);
+      break;
+    }
+
+    case 0x03: // read sectors and stream with RLE
+    case 0x04: // read sectors and stream raw
+    case 0x0f: // read slab of QSPI flash, raw
+    {
+      uint16_t sector_count = job[1] + (job[2] << 8);
+      uint32_t sector_number = get_le32(&job[3]);
+      addr += 7;
+      log_debug("read %d sectors from $%08x (job $%02x)", sector_count, sector_number, job_type);
+      serial_printf("%s:%04X:%08X:", job_type == 0x03 ? "FTJOBDATA" : "FTJOBDATR", job_addr, sector_count * SECTOR_SIZE);
+
+      // Like the helper, RLE runs continue across sector boundaries
+      int stream_len = 0;
+      for (int i = 0; i < sector_count; i++) {
+        if (job_type == 0x0f) {
+          flash_read(sector_number, buffer);
+          sector_number += SECTOR_SIZE;
+        }
+        else
+          sd_read_sector(sector_number++, buffer);
+        if (job_type == 0x03) {
+          if (stream_len + SECTOR_SIZE > (int)sizeof(rle_stream)) {
+            serial_write(rle_out, rle_encode(rle_stream, stream_len, rle_out));
+            stream_len = 0;
+          }
+          memcpy(&rle_stream[stream_len], buffer, SECTOR_SIZE);
+          stream_len += SECTOR_SIZE;
+        }
+        else
+          serial_write(buffer, SECTOR_SIZE);
+      }
+      if (stream_len)
+        serial_write(rle_out, rle_encode(rle_stream, stream_len, rle_out));
+      job_done(job_addr);
+      break;
+    }
+
+    case 0x11: // send block of memory, RLE
+    {
+      uint32_t buffer_address = get_le32(&job[1]);
+      uint32_t transfer_size = get_le32(&job[5]);
+      addr += 9;
+      log_debug("send mem $%07x - $%07x", buffer_address, buffer_address + transfer_size - 1);
+      serial_printf("FTJOBDATA:%04X:%08X:", job_addr, transfer_size);
+      while (transfer_size) {
+        unsigned char block[4096];
+        int n = transfer_size > sizeof(block) ? sizeof(block) : transfer_size;
+        mem_read_block(buffer_address, block, n);
+        serial_write(rle_out, rle_encode(block, n, rle_out));
+        buffer_address += n;
+        transfer_size -= n;
+      }
+      job_done(job_addr);
+      break;
+    }
+
+    case 0x12: // mount a disk image
+    {
+      char filename[65];
+      int i;
+      for (i = 0; i < 64 && mem_read(addr + 1 + i); i++)
+        filename[i] = mem_read(addr + 1 + i);
+      filename[i] = 0;
+      addr += 2 + i;
+      log_note("mount of '%s' requested", filename);
+      break;
+    }
+
+    case 0x13: // remotesd version
+      addr++;
+      serial_printf("\nMEGA65FT1.0\n\r");
+      break;
+
+    default:
+      log_warn("unknown job type $%02x at $%04x", job_type, job_addr);
+      addr = 0xd000;
+      break;
+    }
+  }
+
+  mem_write(0xc000, 0);
+  serial_printf("FTBATCHDONE\n");
+  log_debug("batch of %d jobs took %lld usec", job_count, gettime_us() - start);
+}
+
+/*
+  C64 KERNAL screen editor, as far as the keyboard buffer goes: while the
+  count at $C6 is non-zero, it takes the first character from $0277,
+  shuffles the rest down, and spends kernal_key_us handling it.
+*/
+void kernal_keyboard(void)
+{
+  long long now = gettime_us();
+  while (sim_ram[0xc6] && now >= kernal_busy_until_us) {
+    int count = sim_ram[0xc6] > 10 ? 10 : sim_ram[0xc6];
+    fputc(sim_ram[0x277], keyboard_file);
+    memmove(&sim_ram[0x277], &sim_ram[0x278], count - 1);
+    sim_ram[0xc6] = count - 1;
+    stat_keys_buffered++;
+    kernal_busy_until_us = (kernal_busy_until_us > now - kernal_key_us ? kernal_busy_until_us : now) + kernal_key_us;
+  }
+}
+
+/*
+  Serial monitor command interpreter. Only what the host tools rely on is
+  modelled: echo of the command line, m/M memory dumps, s/l memory writes
+  and the '.' prompt. Anything else is just acknowledged with a prompt.
+*/
+
+char mon_line[1024];
+int mon_line_len = 0;
+unsigned long load_addr = 0;
+int load_remaining = 0;
+int jobs_pending = 0;
+int prompt_sent = 0;
+
+void monitor_dump_line(unsigned long addr)
+{
+  char msg[64];
+  int len = snprintf(msg, sizeof(msg), "\n:%08lX:", addr);
+  for (int i = 0; i < 16; i++)
+    len += snprintf(&msg[len], sizeof(msg) - len, "%02X", mem_read(addr + i));
+  msg[len++] = '\r';
+  serial_write(msg, len);
+}
+
+void monitor_prompt(void)
+{
+  serial_write("\r\n.", 3);
+  prompt_sent = 1;
+  if (jobs_pending) {
+    jobs_pending = 0;
+    run_jobs();
+  }
+}
+
+void monitor_command(char *cmd)
+{
+  char *p = cmd + 1;
+  unsigned long addr = strtoul(p, &p, 16);
+
+  switch (cmd[0]) {
+  case 'm':
+    monitor_dump_line(addr);
+    break;
+  case 'M':
+    for (int i = 0; i < 16; i++)
+      monitor_dump_line(addr + i * 16);
+    break;
+  case 's':
+  case 'S':
+    while (*p) {
+      char *next;
+      unsigned long value = strtoul(p, &next, 16);
+      if (next == p)
+        break;
+      mem_write(addr, value);
+      if ((addr & 0xfffffff) == 0xc000 && value)
+        jobs_pending = 1;
+      addr++;
+      p = next;
+    }
+    break;
+  case 'l':
+  case 'L':
+  {
+    unsigned long end_addr = strtoul(p, &p, 16);
+    load_addr = addr;
+    load_remaining = (end_addr - addr) & 0xffff;
+    if (!load_remaining)
+      load_remaining = 0x10000;
+    log_debug("loading $%x bytes to $%07lx", load_remaining, load_addr);
+    // prompt follows once all the data has arrived
+    return;
+  }
+  default:
+    break;
+  }
+  monitor_prompt();
+}
+
+void serial_input(unsigned char *buff, int len)
+{
+  for (int i = 0; i < len; i++) {
+    unsigned char c = buff[i];
+
+    if (load_remaining) {
+      int n = len - i;
+      if (n > load_remaining)
+        n = load_remaining;
+      mem_write_block(load_addr, &buff[i], n);
+      load_addr += n;
+      load_remaining -= n;
+      i += n - 1;
+      if (!load_remaining)
+        monitor_prompt();
+      continue;
+    }
+
+    if (c == 0x15) {
+      // ^U clears the line
+      mon_line_len = 0;
+      continue;
+    }
+    if (c == '\r' || c == '\n') {
+      serial_write(&c, 1);
+      mon_line[mon_line_len] = 0;
+      stat_monitor_commands++;
+      if (mon_line_len)
+        monitor_command(mon_line);
+      else
+        monitor_prompt();
+      mon_line_len = 0;
+      continue;
+    }
+    if (!c)
+      continue;
+    serial_write(&c, 1);
+    if (mon_line_len < (int)sizeof(mon_line) - 1)
+      mon_line[mon_line_len++] = c;
+  }
+}
+
+int open_pty(char *link_name)
+{
+  pty_master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (pty_master < 0 || grantpt(pty_master) || unlockpt(pty_master)) {
+    log_crit("could not allocate pty: %s", strerror(errno));
+    return -1;
+  }
+  char *slave_name = ptsname(pty_master);
+
+  // Keep a handle on the slave side, so the master survives clients coming and going
+  pty_slave = open(slave_name, O_RDWR | O_NOCTTY);
+  if (pty_slave < 0) {
+    log_crit("could not open pty slave '%s': %s", slave_name, strerror(errno));
+    return -1;
+  }
+  struct termios t;
+  tcgetattr(pty_slave, &t);
+  cfmakeraw(&t);
+  tcsetattr(pty_slave, TCSANOW, &t);
+  fcntl(pty_master, F_SETFL, fcntl(pty_master, F_GETFL, NULL) | O_NONBLOCK);
+
+  if (link_name) {
+    unlink(link_name);
+    if (symlink(slave_name, link_name)) {
+      log_crit("could not create symlink '%s': %s", link_name, strerror(errno));
+      return -1;
+    }
+  }
+  log_note("serial monitor on %s%s%s", slave_name, link_name ? " -> " : "", link_name ? link_name : "");
+  return 0;
+}
+
+/*
+  Ethernet side
+*/
+
+int packet_lost(void)
+{
+  if (packet_loss > 0 && drand48() < packet_loss) {
+    stat_packets_dropped++;
+    return 1;
+  }
+  return 0;
+}
+
+void udp_reply(unsigned char *payload, int len, struct sockaddr_in6 *dest)
+{
+  if (packet_lost())
+    return;
+  link_throttle(&ethernet_link_free_us, ethernet_bandwidth, len);
+  stat_packets_out++;
+  sendto(udp_fd, payload, len, 0, (struct sockaddr *)dest, sizeof(*dest));
+}
+
+void ethernet_request(unsigned char *rx, int len, struct sockaddr_in6 *src)
+{
+  unsigned char tx[1500];
+
+  if (len == 1024) {
+    // etherload single command (ping, all done). Echo it as the ethlet would.
+    udp_reply(rx, len, src);
+    return;
+  }
+  if (len == 1280) {
+    // dmaload packet: store the data and echo it as acknowledgement
+    unsigned long addr = (rx[ethlet_dma_load_offset_dest_mb] << 20) + ((rx[ethlet_dma_load_offset_dest_bank] & 0xf) << 16)
+                       + (rx[ethlet_dma_load_offset_dest_address + 1] << 8) + rx[ethlet_dma_load_offset_dest_address];
+    int count = rx[ethlet_dma_load_offset_byte_count] + (rx[ethlet_dma_load_offset_byte_count + 1] << 8);
+    if (ethlet_dma_load_offset_data + count <= len)
+      mem_write_block(addr, &rx[ethlet_dma_load_offset_data], count);
+    stat_dmaload_packets++;
+    stat_dmaload_bytes += count;
+    udp_reply(rx, len, src);
+    return;
+  }
+  if (len < 7 || memcmp(rx, "mreq", 4))
+    return;
+
+  memcpy(tx, "mrsp", 4);
+  tx[4] = rx[4];
+  tx[5] = rx[5];
+  tx[6] = rx[6];
+
+  switch (rx[6]) {
+  case 0x02: // write sector(s), one packet per sector
+    if (len != 14 + SECTOR_SIZE)
+      return;
+    sd_write_sector(get_le32(&rx[10]) + rx[9], &rx[14]);
+    memcpy(&tx[7], &rx[7], 7);
+    udp_reply(tx, 14, src);
+    break;
+
+  case 0x04: // read sectors, one response per sector
+  {
+    if (len != 13)
+      return;
+    int count = rx[7] + 1;
+    uint32_t sector_number = get_le32(&rx[9]);
+    tx[7] = 0;
+    tx[8] = 0;
+    for (int i = 0; i < count; i++) {
+      put_le32(&tx[9], sector_number + i);
+      sd_read_sector(sector_number + i, &tx[13]);
+      udp_reply(tx, 13 + SECTOR_SIZE, src);
+    }
+    break;
+  }
+
+  case 0x0f: // read flash, one response per 512 byte flash sector
+  {
+    if (len != 13)
+      return;
+    int count = rx[7] + 1;
+    uint32_t flash_address = get_le32(&rx[9]);
+    tx[7] = 0;
+    tx[8] = 0;
+    for (int i = 0; i < count; i++) {
+      put_le32(&tx[9], flash_address + i * SECTOR_SIZE);
+      flash_read(flash_address + i * SECTOR_SIZE, &tx[13]);
+      udp_reply(tx, 13 + SECTOR_SIZE, src);
+    }
+    break;
+  }
+
+  case 0x11: // read memory
+  {
+    if (len != 12)
+      return;
+    int count = rx[7] + 1;
+    memcpy(&tx[7], &rx[7], 5);
+    mem_read_block(get_le32(&rx[8]), &tx[12], count);
+    udp_reply(tx, 12 + count, src);
+    break;
+  }
+
+  case 0x12: // mount
+    log_note("mount of '%.64s' requested", &rx[7]);
+    tx[7] = 0;
+    udp_reply(tx, 8, src);
+    break;
+
+  case 0xfd: // hello
+  case 0xff: // quit
+    udp_reply(tx, 7, src);
+    break;
+
+  default:
+    log_debug("ignoring unknown ethernet request $%02x", rx[6]);
+    break;
+  }
+}
+
+int open_udp(char *address, int port)
+{
+  struct sockaddr_in6 addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_port = htons(port);
+  if (inet_pton(AF_INET6, address, &addr.sin6_addr) != 1) {
+    log_crit("invalid IPv6 address '%s'", address);
+    return -1;
+  }
+  udp_fd = socket(AF_INET6, SOCK_DGRAM, 0);
+  if (udp_fd < 0 || bind(udp_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    log_crit("could not listen on [%s]:%d: %s", address, port, strerror(errno));
+    return -1;
+  }
+  fcntl(udp_fd, F_SETFL, fcntl(udp_fd, F_GETFL, NULL) | O_NONBLOCK);
+  log_note("ethernet remote on [%s]:%d", address, port);
+  return 0;
+}
+
+void handle_signal(int sig)
+{
+  quit_flag = 1;
+}
+
+int main(int argc, char **argv)
+{
+  char *image_name = NULL;
+  char *flash_name = NULL;
+  char *floppy_name = NULL;
+  char *link_name = NULL;
+  char *ram_dump_name = NULL;
+  char *listen_address = "::1";
+  int udp_port = ETH_PORT;
+  int create_mb = 0;
+  int ethernet = 0;
+  int model_id = 0x03;
+
+  log_setup(stderr, LOG_NOTE);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "0:i:C:f:l:ea:u:m:L:b:B:p:d:D:E:T:k:K:o:h")) != -1) {
+    switch (opt) {
+    case '0':
+    {
+      int level = log_parse_level(optarg);
+      if (level == -1)
+        log_warn("failed to parse log level!");
+      else
+        log_setup(stderr, level);
+      break;
+    }
+    case 'i':
+      image_name = optarg;
+      break;
+    case 'C':
+      create_mb = atoi(optarg);
+      break;
+    case 'f':
+      flash_name = optarg;
+      break;
+    case 'l':
+      link_name = optarg;
+      break;
+    case 'e':
+      ethernet = 1;
+      break;
+    case 'a':
+      listen_address = optarg;
+      ethernet = 1;
+      break;
+    case 'u':
+      udp_port = atoi(optarg);
+      ethernet = 1;
+      break;
+    case 'm':
+      model_id = strtol(optarg, NULL, 0);
+      break;
+    case 'L':
+      sector_latency_us = atol(optarg);
+      break;
+    case 'b':
+      serial_bandwidth = atol(optarg);
+      break;
+    case 'B':
+      ethernet_bandwidth = atol(optarg);
+      break;
+    case 'p':
+      packet_loss = atof(optarg) / 100.0;
+      break;
+    case 'd':
+      floppy_name = optarg;
+      break;
+    case 'D':
+      fdc_latency_us = atol(optarg);
+      break;
+    case 'E':
+      fdc_error_rate = atof(optarg) / 100.0;
+      break;
+    case 'T':
+      serial_turnaround_us = atol(optarg);
+      break;
+    case 'k':
+      keyboard_file = fopen(optarg, "w");
+      if (!keyboard_file) {
+        log_crit("could not create '%s': %s", optarg, strerror(errno));
+        exit(-1);
+      }
+      setvbuf(keyboard_file, NULL, _IONBF, 0);
+      break;
+    case 'K':
+      kernal_key_us = atol(optarg);
+      break;
+    case 'o':
+      ram_dump_name = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if (!image_name)
+    usage();
+
+  if (create_mb && create_sdcard_image(image_name, create_mb))
+    exit(-1);
+
+  sdcard_fd = open(image_name, O_RDWR);
+  if (sdcard_fd < 0) {
+    log_crit("could not open image '%s': %s", image_name, strerror(errno));
+    exit(-1);
+  }
+  sdcard_sectors = lseek(sdcard_fd, 0, SEEK_END) / SECTOR_SIZE;
+
+  if (flash_name) {
+    flash_fd = open(flash_name, O_RDONLY);
+    if (flash_fd < 0) {
+      log_crit("could not open flash image '%s': %s", flash_name, strerror(errno));
+      exit(-1);
+    }
+  }
+
+  if (floppy_name) {
+    floppy_fd = open(floppy_name, O_RDONLY);
+    if (floppy_fd < 0) {
+      log_crit("could not open floppy image '%s': %s", floppy_name, strerror(errno));
+      exit(-1);
+    }
+  }
+
+  // Power-on state of the bits of IO the host tools look at
+  sim_io[0x60f] = 0x20; // real hardware, not xemu
+  sim_io[0x629] = model_id;
+
+  if (open_pty(link_name))
+    exit(-1);
+  if (ethernet && open_udp(listen_address, udp_port))
+    exit(-1);
+
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+
+  while (!quit_flag) {
+    struct pollfd pfd[2] = { { pty_master, POLLIN, 0 }, { udp_fd, POLLIN, 0 } };
+    int keys_waiting = keyboard_file && sim_ram[0xc6];
+    int ready = poll(pfd, udp_fd >= 0 ? 2 : 1, keys_waiting ? 1 : 100);
+    if (keyboard_file)
+      kernal_keyboard();
+    if (ready <= 0)
+      continue;
+
+    if (pfd[0].revents & POLLIN) {
+      unsigned char buff[8192];
+      int b = read(pty_master, buff, sizeof(buff));
+      if (b > 0) {
+        // input following a prompt means the host waited for it: one turnaround
+        if (prompt_sent) {
+          prompt_sent = 0;
+          stat_serial_turnarounds++;
+          if (serial_turnaround_us)
+            usleep(serial_turnaround_us);
+        }
+        serial_input(buff, b);
+      }
+    }
+    if (udp_fd >= 0 && (pfd[1].revents & POLLIN)) {
+      unsigned char rx[2048];
+      struct sockaddr_in6 src;
+      socklen_t src_len = sizeof(src);
+      int r;
+      while ((r = recvfrom(udp_fd, rx, sizeof(rx), 0, (struct sockaddr *)&src, &src_len)) > 0) {
+        stat_packets_in++;
+        if (!packet_lost())
+          ethernet_request(rx, r, &src);
+        src_len = sizeof(src);
+      }
+    }
+  }
+
+  if (link_name)
+    unlink(link_name);
+  log_note("%lu sectors read, %lu written, %lu serial batches, %lu/%lu packets in/out, %lu dropped", stat_sectors_read,
+      stat_sectors_written, stat_batches, stat_packets_in, stat_packets_out, stat_packets_dropped);
+  log_note("%lu monitor commands in %lu serial turnarounds, %lu floppy sector reads", stat_monitor_commands,
+      stat_serial_turnarounds, stat_fdc_reads);
+  if (stat_dmaload_packets)
+    log_note("%lu bytes in %lu dmaload packets", stat_dmaload_bytes, stat_dmaload_packets);
+  if (ram_dump_name) {
+    FILE *f = fopen(ram_dump_name, "wb");
+    if (!f || fwrite(sim_ram, 1, SIM_RAM_SIZE, f) != SIM_RAM_SIZE)
+      log_error("could not write '%s': %s", ram_dump_name, strerror(errno));
+    if (f)
+      fclose(f);
+  }
+  if (keyboard_file) {
+    log_note("%lu keys typed through the keyboard buffer, %lu on the virtual keyboard", stat_keys_buffered,
+        stat_keys_matrix);
+    fclose(keyboard_file);
+  }
+  return 0;
+}
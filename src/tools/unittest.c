@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <unittest.h>
+
+static const char *ut_states[16] = { "START", " SKIP", " PASS", " FAIL", "ERROR", "C#$05", "C#$06", "C#$07", "C#$08", "C#$09",
+  "C#$0A", "C#$0B", "C#$0C", "  LOG", " NAME", " DONE" };
+
+void ut_init(ut_parser *p, void (*event)(ut_parser *, unsigned short, unsigned char, unsigned char, const char *), void *ctx)
+{
+  memset(p, 0, sizeof(*p));
+  p->event = event;
+  p->ctx = ctx;
+}
+
+static void ut_token(ut_parser *p)
+{
+  unsigned short issue = p->recent[0] + (p->recent[1] << 8);
+  unsigned char sub = p->recent[2];
+  unsigned char token = p->recent[3];
+
+  // a log message that no PASS/FAIL follows gets a line of its own
+  if (p->log[0] && token != 0xf2 && token != 0xf3) {
+    p->event(p, p->last_issue, p->last_sub, UT_LOG, p->log);
+    p->log[0] = 0;
+  }
+
+  p->event(p, issue, sub, token - 0xf0, p->log[0] ? p->log : (p->name[0] ? p->name : NULL));
+  p->log[0] = 0;
+  p->last_issue = issue;
+  p->last_sub = sub;
+
+  switch (token) {
+  case 0xf3: // Test failure (ie test ran, but detected failure of test condition)
+  case 0xf4: // Error trying to run test
+    p->failcount++;
+    break;
+  case 0xff: // Last test complete
+    p->done = 1;
+    break;
+  }
+}
+
+int ut_feed(ut_parser *p, const unsigned char *buf, int len)
+{
+  int result = 0;
+
+  for (int i = 0; i < len && !p->done; i++) {
+    // message receive mode: fill message buffer until end of string is reached
+    if (p->in_string) {
+      // (ugly workaround: use pound sign as string end marker, because zeroes
+      // sometimes get corrupted when using the serial line...)
+      if (buf[i] == 92) {
+        p->msg[p->msg_pos] = 0;
+        p->in_string = 0;
+        if (p->recent[3] == 0xfd)
+          strcpy(p->log, p->msg);
+        else
+          strcpy(p->name, p->msg);
+        memset(p->recent, 0, 4);
+        p->fill = 0;
+      }
+      else if (p->msg_pos < UT_MSG_LEN - 1)
+        p->msg[p->msg_pos++] = buf[i];
+      continue;
+    }
+
+    p->recent[0] = p->recent[1];
+    p->recent[1] = p->recent[2];
+    p->recent[2] = p->recent[3];
+    p->recent[3] = buf[i];
+    if (p->fill < 4)
+      p->fill++;
+    if (p->fill > 3 && p->filter && p->filter(p, p->recent))
+      p->fill = 0;
+    if (p->fill < 4)
+      continue;
+
+    if (p->recent[3] == 0xfe || p->recent[3] == 0xfd) {
+      // a new log message: report the one before, if nothing did
+      if (p->recent[3] == 0xfd && p->log[0]) {
+        p->event(p, p->last_issue, p->last_sub, UT_LOG, p->log);
+        p->log[0] = 0;
+        result |= UT_FEED_ACTIVE;
+      }
+      p->in_string = 1;
+      p->msg_pos = 0;
+    }
+    else if (p->recent[3] >= 0xf0) {
+      ut_token(p);
+      p->fill = 0;
+      result |= UT_FEED_ACTIVE;
+    }
+  }
+
+  if (p->done)
+    result |= UT_FEED_DONE;
+  return result;
+}
+
+void ut_format_line(char *out, int size, unsigned short issue, unsigned char sub, unsigned char state, const char *msg)
+{
+  struct timeval now;
+  char stamp[32];
+
+  gettimeofday(&now, NULL);
+  time_t secs = now.tv_sec;
+  strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", gmtime(&secs));
+
+  if (msg)
+    snprintf(out, size, "%s.%03dZ %s (Issue#%04d, Test #%03d - %s)", stamp, (int)now.tv_usec / 1000, ut_states[state & 0xf],
+        issue, sub, msg);
+  else
+    snprintf(out, size, "%s.%03dZ %s (Issue#%04d, Test #%03d)", stamp, (int)now.tv_usec / 1000, ut_states[state & 0xf], issue,
+        sub);
+}
+
+void ut_log_header(FILE *f, const char *test, const char *bitstream, unsigned char model, const char *model_name,
+    const char *rom)
+{
+  fprintf(f, ">>>>> TEST: %s\n===== BITSTREAM: %s\n===== MODELCODE: %02X\n===== MODEL: %s\n===== ROM: %s\n", test, bitstream,
+      model, model_name, rom);
+}
+
+void ut_log_footer(FILE *f, unsigned int failcount, int timed_out)
+{
+  if (timed_out) {
+    fprintf(f, "!!!!! TIMEOUT\n");
+    failcount++;
+  }
+  if (failcount > 0)
+    fprintf(f, "!!!!! FAILCOUNT: %d\n", failcount);
+  else
+    fprintf(f, "===== FAILCOUNT: 0\n");
+  fprintf(f, "<<<<< TEST COMPLETED\n");
+}
@@ -4,168 +4,935 @@
   Written with the assistance of ChatGPT 4.
   It might have saved some time overall, but it required a _lot_ of guidance to
   track down and fix the major flaws in its generated code.
+
+  The lexer is a hand-written state machine over the mmapped source: tokens are
+  slices of the file (nothing is copied or allocated per token), and keywords
+  are found with a perfect hash of the identifier.
+
+  usage: vhdl_tokenise <file.vhd>
+           lists the tokens of a file
+         vhdl_tokenise -i <index file> [-q <name>] <file or directory>...
+           brings the index of entity, port, signal and process definitions up
+           to date with the VHDL files (only those changed since it was last
+           written are read again), and looks up a name in it
+         vhdl_tokenise -b [-r <repeats>] <file or directory>...
+           tokens/sec benchmark
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-#include <regex.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 typedef enum {
-    TOKEN_KEYWORD,
-    TOKEN_IDENTIFIER,
-    TOKEN_LITERAL,
-    TOKEN_OPERATOR,
-    TOKEN_COMMENT,
-    TOKEN_BRACKET,
-    TOKEN_END
+  TOKEN_KEYWORD,
+  TOKEN_IDENTIFIER,
+  TOKEN_LITERAL,
+  TOKEN_OPERATOR,
+  TOKEN_COMMENT,
+  TOKEN_BRACKET,
+  TOKEN_END
 } token_type_t;
 
-typedef struct token {
-    token_type_t type;
-    char *value;
-    struct token *next;
+static const char *token_type_names[] = { "keyword", "identifier", "literal", "operator", "comment", "bracket", "end" };
+
+typedef struct {
+  token_type_t type;
+  const char *start;
+  int len;
+  int line;
+  int keyword; // KW_* for a TOKEN_KEYWORD
 } token_t;
 
-const char *identifier_pattern = "\\b[a-zA-Z]([a-zA-Z0-9_])*\\b";
-const char *literal_pattern = "\"[^\"\\n]*\"|'[^']'|[0-9]+|\\b[0-9]*'?[0-9]+(\\.[0-9]+)?(E[+-]?[0-9]+)?\\b";
-// const char *operator_pattern = "\\+|-|\\\\*|/|=|<|>|&|\\\\||:|;|,|\\\\(|\\\\)|\\\\[|\\\\]|\\\\{|\\\\}|\\\\.|'|\\\\\"|\\\\?|@|\\\\^";
-const char *operator_pattern = "\\+|-|\\\\*|/|=|<|>|&|\\\\||:|;|,|\\\\.|'|\\\\\"|\\\\?|@|\\\\^";
-// const char *operator_pattern = "\\+|-|\\\\*|/|=|<|>|&|\\\\||:|;|,|\\\\(|\\\\)|\\\\[|\\\\]|\\\\{|\\\\}|\\\\.|'|\\\\\"|\\\\?|@|\\\\^";
-const char *keyword_pattern = "\\b(begin|end|architecture|entity|is|process|if|then|else|elsif|case|when|loop|while|for|to|downto|and|or|not|xor|nand|nor|xnor|signal|variable|constant|component|in|out|inout|buffer|linkage|type|range|array|of|subtype|function|procedure|package|return|generic|map|port)\\b";
-const char *comment_pattern = "--[^\\n]*";
-
-regex_t keyword_regex;
-regex_t identifier_regex;
-regex_t numeric_literal_regex;
-regex_t string_literal_regex;
-regex_t operator_regex;
-
-char *next_token(char **input_ptr, const char *delimiters) {
-    // Skip delimiters
-    *input_ptr += strspn(*input_ptr, delimiters);
-
-    // Check for end of input
-    if (**input_ptr == '\0') {
-        return NULL;
-    }
-
-    // Check for brackets and return them as separate tokens
-    if (**input_ptr == '(' || **input_ptr == ')') {
-        char *bracket_token = (char *)malloc(2 * sizeof(char));
-        bracket_token[0] = **input_ptr;
-        bracket_token[1] = '\0';
-        (*input_ptr)++;
-        return bracket_token;
-    }
-
-    // Calculate token length
-    size_t token_length = strcspn(*input_ptr, delimiters);
-
-    // Check for brackets within the token and adjust the token length
-    int inside_string = 0;
-    for (size_t i = 0; i < token_length; ++i) {
-        if ((*input_ptr)[i] == '\"') {
-            inside_string = !inside_string;
-        }
+typedef struct {
+  const char *p;
+  const char *end;
+  int line;
+  // what came before, for telling a character literal from an attribute tick
+  token_type_t last_type;
+  char last_char;
+} lexer_t;
+
+/*
+  VHDL-2008 reserved words (including the PSL ones), lower case.
+*/
+static const char *keywords[] = { "abs", "access", "after", "alias", "all", "and", "architecture", "array", "assert", "assume",
+  "assume_guarantee", "attribute", "begin", "block", "body", "buffer", "bus", "case", "component", "configuration", "constant",
+  "context", "cover", "default", "disconnect", "downto", "else", "elsif", "end", "entity", "exit", "fairness", "file", "for",
+  "force", "function", "generate", "generic", "group", "guarded", "if", "impure", "in", "inertial", "inout", "is", "label",
+  "library", "linkage", "literal", "loop", "map", "mod", "nand", "new", "next", "nor", "not", "null", "of", "on", "open", "or",
+  "others", "out", "package", "parameter", "port", "postponed", "procedure", "process", "property", "protected", "pure",
+  "range", "record", "register", "reject", "release", "rem", "report", "restrict", "restrict_guarantee", "return", "rol",
+  "ror", "select", "sequence", "severity", "shared", "signal", "sla", "sll", "sra", "srl", "strong", "subtype", "then", "to",
+  "transport", "type", "unaffected", "units", "until", "use", "variable", "vmode", "vprop", "vseq", "vunit", "wait", "when",
+  "while", "with", "xnor", "xor", NULL };
+
+// the ones the index looks for (their positions in keywords[])
+enum {
+  KW_ARCHITECTURE = 6,
+  KW_BODY = 14,
+  KW_COMPONENT = 18,
+  KW_END = 28,
+  KW_ENTITY = 29,
+  KW_IS = 45,
+  KW_OF = 59,
+  KW_PACKAGE = 65,
+  KW_PORT = 67,
+  KW_POSTPONED = 68,
+  KW_PROCESS = 70,
+  KW_SIGNAL = 90
+};
+
+#define KW_MIN_LEN 2
+#define KW_MAX_LEN 18
+#define KW_HASH_SIZE 1024
+
+// (multipliers found by search to give every keyword a slot of its own)
+#define KW_HASH(s, len)                                                                                                     \
+  (((len)*241 + lower[(unsigned char)(s)[0]] * 135 + lower[(unsigned char)(s)[1]] * 217                                    \
+       + lower[(unsigned char)(s)[(len)-1]] * 50 + lower[(unsigned char)(s)[(len)-2]])                                     \
+      & (KW_HASH_SIZE - 1))
+
+static unsigned char kw_slots[KW_HASH_SIZE]; // keyword number + 1, or 0
+static unsigned char lower[256];
+
+enum { C_OTHER, C_SPACE, C_NEWLINE, C_ALPHA, C_DIGIT, C_BRACKET, C_OPERATOR };
+static unsigned char char_class[256];
+
+void lexer_init(void)
+{
+  for (int c = 0; c < 256; c++) {
+    lower[c] = tolower(c);
+    if (isalpha(c))
+      char_class[c] = C_ALPHA;
+    else if (isdigit(c))
+      char_class[c] = C_DIGIT;
+    else if (c == '\n')
+      char_class[c] = C_NEWLINE;
+    else if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v')
+      char_class[c] = C_SPACE;
+    else if (c && strchr("()[]", c))
+      char_class[c] = C_BRACKET;
+    else if (c && strchr("+-*/=<>&|:;,.'\"?@^#!\\`", c))
+      char_class[c] = C_OPERATOR;
+    else
+      char_class[c] = C_OTHER;
+  }
+
+  for (int i = 0; keywords[i]; i++) {
+    int len = strlen(keywords[i]);
+    int h = KW_HASH(keywords[i], len);
+    if (kw_slots[h]) {
+      fprintf(stderr, "ERROR: keywords '%s' and '%s' share a hash slot\n", keywords[kw_slots[h] - 1], keywords[i]);
+      exit(-1);
+    }
+    kw_slots[h] = i + 1;
+  }
+}
 
-        if (!inside_string && ((*input_ptr)[i] == '(' || (*input_ptr)[i] == ')')) {
-            token_length = i;
+// keyword number, or -1
+static int keyword_lookup(const char *s, int len)
+{
+  if (len < KW_MIN_LEN || len > KW_MAX_LEN)
+    return -1;
+  int k = kw_slots[KW_HASH(s, len)];
+  if (!k)
+    return -1;
+  const char *kw = keywords[k - 1];
+  for (int i = 0; i < len; i++)
+    if (lower[(unsigned char)s[i]] != (unsigned char)kw[i])
+      return -1;
+  return kw[len] ? -1 : k - 1;
+}
+
+void lexer_start(lexer_t *lx, const char *text, size_t len)
+{
+  lx->p = text;
+  lx->end = text + len;
+  lx->line = 1;
+  lx->last_type = TOKEN_END;
+  lx->last_char = 0;
+}
+
+static int is_word_char(char c)
+{
+  unsigned char cc = char_class[(unsigned char)c];
+  return cc == C_ALPHA || cc == C_DIGIT || c == '_';
+}
+
+// a string, with "" standing for a quote; p is at the opening quote
+static const char *skip_string(const char *p, const char *end)
+{
+  for (p++; p < end; p++) {
+    if (*p == '"') {
+      if (p + 1 < end && p[1] == '"')
+        p++;
+      else
+        return p + 1;
+    }
+    else if (*p == '\n')
+      break; // (unterminated: stop at the end of the line)
+  }
+  return p;
+}
+
+// digits and underscores
+static const char *skip_digits(const char *p, const char *end)
+{
+  while (p < end && (char_class[(unsigned char)*p] == C_DIGIT || *p == '_'))
+    p++;
+  return p;
+}
+
+/*
+  The next token (comments included) in *t.
+  Returns 0 at the end of the text.
+*/
+int next_token(lexer_t *lx, token_t *t)
+{
+  const char *p = lx->p;
+  const char *end = lx->end;
+
+  for (;;) {
+    if (p >= end) {
+      lx->p = p;
+      t->type = TOKEN_END;
+      t->start = p;
+      t->len = 0;
+      t->line = lx->line;
+      return 0;
+    }
+    unsigned char cc = char_class[(unsigned char)*p];
+    if (cc == C_SPACE)
+      p++;
+    else if (cc == C_NEWLINE) {
+      lx->line++;
+      p++;
+    }
+    else
+      break;
+  }
+
+  const char *s = p;
+  t->start = s;
+  t->line = lx->line;
+  t->keyword = -1;
+
+  switch (char_class[(unsigned char)*p]) {
+  case C_ALPHA:
+    p++;
+    while (p < end && is_word_char(*p))
+      p++;
+    // bit string literal: x"FF", b"0101", ux"1F" and so on
+    if (p < end && *p == '"' && p - s <= 2 && strchr("bodx", lower[(unsigned char)p[-1]])
+        && (p - s == 1 || strchr("us", lower[(unsigned char)s[0]]))) {
+      p = skip_string(p, end);
+      t->type = TOKEN_LITERAL;
+      break;
+    }
+    t->keyword = keyword_lookup(s, p - s);
+    t->type = t->keyword < 0 ? TOKEN_IDENTIFIER : TOKEN_KEYWORD;
+    break;
+
+  case C_DIGIT:
+    p = skip_digits(p, end);
+    if (p < end && *p == '#') {
+      // based literal: 16#FF#, 2#1010_1010#E2
+      const char *q = p + 1;
+      while (q < end && (isxdigit((unsigned char)*q) || *q == '_' || *q == '.'))
+        q++;
+      if (q < end && *q == '#')
+        p = q + 1;
+    }
+    else {
+      if (p + 1 < end && *p == '.' && char_class[(unsigned char)p[1]] == C_DIGIT)
+        p = skip_digits(p + 1, end);
+      // sized bit string literal: 8x"FF", 12sb"..."
+      const char *q = p;
+      while (q < end && q - p < 2 && char_class[(unsigned char)*q] == C_ALPHA)
+        q++;
+      if (q > p && q < end && *q == '"') {
+        p = skip_string(q, end);
+        t->type = TOKEN_LITERAL;
+        break;
+      }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+      const char *q = p + 1;
+      if (q < end && (*q == '+' || *q == '-'))
+        q++;
+      if (q < end && char_class[(unsigned char)*q] == C_DIGIT)
+        p = skip_digits(q, end);
+    }
+    t->type = TOKEN_LITERAL;
+    break;
+
+  case C_BRACKET:
+    p++;
+    t->type = TOKEN_BRACKET;
+    break;
+
+  default:
+    t->type = TOKEN_OPERATOR;
+    switch (*p) {
+    case '-':
+      if (p + 1 < end && p[1] == '-') {
+        while (p < end && *p != '\n')
+          p++;
+        t->type = TOKEN_COMMENT;
+      }
+      else
+        p++;
+      break;
+    case '/':
+      if (p + 1 < end && p[1] == '*') {
+        // (VHDL-2008 block comment)
+        for (p += 2; p < end && !(p[0] == '*' && p + 1 < end && p[1] == '/'); p++)
+          if (*p == '\n')
+            lx->line++;
+        p = p < end ? p + 2 : end;
+        t->type = TOKEN_COMMENT;
+      }
+      else if (p + 1 < end && p[1] == '=')
+        p += 2;
+      else
+        p++;
+      break;
+    case '"':
+      p = skip_string(p, end);
+      t->type = TOKEN_LITERAL;
+      break;
+    case '\\':
+      // extended identifier
+      for (p++; p < end && *p != '\n'; p++)
+        if (*p == '\\') {
+          if (p + 1 < end && p[1] == '\\')
+            p++;
+          else {
+            p++;
             break;
+          }
         }
+      t->type = TOKEN_IDENTIFIER;
+      break;
+    case '\'':
+      // a character literal, unless it is an attribute (clk'event) or qualified expression (t'(...))
+      if (p + 2 < end && p[2] == '\'' && lx->last_type != TOKEN_IDENTIFIER
+          && !(lx->last_type == TOKEN_BRACKET && (lx->last_char == ')' || lx->last_char == ']'))) {
+        p += 3;
+        t->type = TOKEN_LITERAL;
+      }
+      else
+        p++;
+      break;
+    case '*':
+      p += (p + 1 < end && p[1] == '*') ? 2 : 1;
+      break;
+    case ':':
+    case '>':
+      p += (p + 1 < end && p[1] == '=') ? 2 : 1;
+      break;
+    case '=':
+      p += (p + 1 < end && p[1] == '>') ? 2 : 1;
+      break;
+    case '<':
+      p += (p + 1 < end && (p[1] == '=' || p[1] == '>')) ? 2 : 1;
+      break;
+    case '?':
+      // matching operators ?= ?/= ?< ?<= ?> ?>= and the condition operator ??
+      if (p + 2 < end && p[1] == '/' && p[2] == '=')
+        p += 3;
+      else if (p + 2 < end && (p[1] == '<' || p[1] == '>') && p[2] == '=')
+        p += 3;
+      else if (p + 1 < end && strchr("=<>?", p[1]))
+        p += 2;
+      else
+        p++;
+      break;
+    default:
+      p++;
     }
+  }
 
-    // Allocate memory for the token and copy the token
-    char *token = (char *)malloc((token_length + 1) * sizeof(char));
-    strncpy(token, *input_ptr, token_length);
-    token[token_length] = '\0';
-
-    // Update the input pointer
-    *input_ptr += token_length;
-
-    return token;
-}
-
-token_t *tokenize(char *input) {
-    token_t *tokens_head = NULL;
-    token_t *tokens_tail = NULL;
-
-    char *token_str;
-    char *input_ptr = input;
-    const char *delimiters = " \t\n";
-
-    while ((token_str = next_token(&input_ptr, delimiters)) && *token_str != '\0') {
-        token_t *new_token = (token_t *)malloc(sizeof(token_t));
-
-        // Identify token type and value
-        regmatch_t match;
-        if (!regexec(&keyword_regex, token_str, 1, &match, 0)) {
-            new_token->type = TOKEN_KEYWORD;
-        } else if (!regexec(&identifier_regex, token_str, 1, &match, 0)) {
-            new_token->type = TOKEN_IDENTIFIER;
-        } else if (!regexec(&numeric_literal_regex, token_str, 1, &match, 0)) {
-            new_token->type = TOKEN_LITERAL;
-        } else if (!regexec(&string_literal_regex, token_str, 1, &match, 0)) {
-            new_token->type = TOKEN_LITERAL;
-        } else if (!regexec(&operator_regex, token_str, 1, &match, 0)) {
-            new_token->type = TOKEN_OPERATOR;
-        } else if (strcmp(token_str, "(") == 0 || strcmp(token_str, ")") == 0) {
-            new_token->type = TOKEN_BRACKET;
-        } else {
-            // If the token is not recognized, free the memory and continue with the next token
-            free(new_token);
-            continue;
-        }
+  t->len = p - s;
+  lx->p = p;
+  if (t->type != TOKEN_COMMENT) {
+    lx->last_type = t->type;
+    lx->last_char = p[-1];
+  }
+  return 1;
+}
 
-        new_token->value = strdup(token_str);
-        new_token->next = NULL;
+/*
+  A VHDL file mapped into memory.
+*/
+typedef struct {
+  const char *text;
+  size_t len;
+} source_t;
 
-        // Add the new token to the tokens list
-        if (tokens_tail == NULL) {
-            tokens_head = new_token;
-            tokens_tail = new_token;
-        } else {
-            tokens_tail->next = new_token;
-            tokens_tail = new_token;
-        }
+int source_open(source_t *src, const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: Could not open '%s': %s\n", path, strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  src->len = st.st_size;
+  src->text = "";
+  if (src->len) {
+    void *m = mmap(NULL, src->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) {
+      fprintf(stderr, "ERROR: Could not map '%s': %s\n", path, strerror(errno));
+      close(fd);
+      return -1;
     }
+    src->text = m;
+  }
+  close(fd);
+  return 0;
+}
+
+void source_close(source_t *src)
+{
+  if (src->len)
+    munmap((void *)src->text, src->len);
+}
+
+/*
+  The VHDL files under a list of paths.
+*/
+typedef struct {
+  char **paths;
+  int count;
+  int size;
+} file_list_t;
+
+static int is_vhdl(const char *name)
+{
+  const char *dot = strrchr(name, '.');
+  return dot && (!strcasecmp(dot, ".vhd") || !strcasecmp(dot, ".vhdl"));
+}
 
-    return tokens_head;
+static int compare_paths(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
-void free_tokens(token_t *tokens) {
-    token_t *tmp;
-    while (tokens != NULL) {
-        tmp = tokens;
-        tokens = tokens->next;
-        free(tmp->value);
-        free(tmp);
+void find_vhdl(file_list_t *files, const char *path, int named)
+{
+  struct stat st;
+  if (stat(path, &st)) {
+    fprintf(stderr, "ERROR: Could not stat '%s': %s\n", path, strerror(errno));
+    return;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    DIR *d = opendir(path);
+    if (!d)
+      return;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+      if (de->d_name[0] == '.')
+        continue;
+      char sub[4096];
+      snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+      find_vhdl(files, sub, 0);
     }
+    closedir(d);
+    return;
+  }
+
+  // (a file named on the command line is taken whatever it is called)
+  if (!S_ISREG(st.st_mode) || (!named && !is_vhdl(path)))
+    return;
+  if (files->count == files->size) {
+    files->size = files->size ? files->size * 2 : 256;
+    files->paths = realloc(files->paths, files->size * sizeof(char *));
+  }
+  files->paths[files->count++] = strdup(path);
 }
 
-int main() {
-    regcomp(&keyword_regex, keyword_pattern, REG_EXTENDED);
-    regcomp(&identifier_regex, identifier_pattern, REG_EXTENDED);
-    regcomp(&numeric_literal_regex, literal_pattern, REG_EXTENDED);
-    regcomp(&string_literal_regex, literal_pattern, REG_EXTENDED);
-    regcomp(&operator_regex, operator_pattern, REG_EXTENDED);
+/*
+  The index of definitions.
+
+  It is kept as a text file:
+    F <mtime> <size> <path>
+  for each VHDL file, followed by a line per definition in it:
+    D <kind> <line> <name> <scope>
+  where the scope is the entity (or package) the definition belongs to, or "-".
+*/
+#define INDEX_HEADER "# vhdl_tokenise index 1"
+#define NAME_LEN 128
+
+typedef enum { DEF_ENTITY, DEF_PORT, DEF_SIGNAL, DEF_PROCESS } def_kind_t;
+static const char *def_kind_names[] = { "entity", "port", "signal", "process" };
+
+typedef struct {
+  def_kind_t kind;
+  int line;
+  char name[NAME_LEN];
+  char scope[NAME_LEN];
+} def_t;
 
+typedef struct {
+  char *path;
+  long long mtime;
+  long long size;
+  def_t *defs;
+  int def_count;
+  int def_size;
+  int seen; // still there, in this update
+} indexed_file_t;
 
-    char input[] = "entity Example is\nport(\nclk: in std_logic;\nrst: in std_logic;\ndata: in std_logic_vector(7 downto 0);\nresult: out std_logic_vector(7 downto 0));\nend entity Example;";
-    token_t *tokens = tokenize(input);
+typedef struct {
+  indexed_file_t *files;
+  int count;
+  int size;
+} vhdl_index_t;
 
-    for (token_t *t = tokens; t != NULL; t = t->next) {
-        printf("Token Type: %d, Token Value: %s\n", t->type, t->value);
+static indexed_file_t *index_add_file(vhdl_index_t *idx, const char *path)
+{
+  if (idx->count == idx->size) {
+    idx->size = idx->size ? idx->size * 2 : 256;
+    idx->files = realloc(idx->files, idx->size * sizeof(indexed_file_t));
+  }
+  indexed_file_t *f = &idx->files[idx->count++];
+  memset(f, 0, sizeof(*f));
+  f->path = strdup(path);
+  return f;
+}
+
+static void add_def(indexed_file_t *f, def_kind_t kind, int line, const char *name, int name_len, const char *scope)
+{
+  if (f->def_count == f->def_size) {
+    f->def_size = f->def_size ? f->def_size * 2 : 32;
+    f->defs = realloc(f->defs, f->def_size * sizeof(def_t));
+  }
+  def_t *d = &f->defs[f->def_count++];
+  d->kind = kind;
+  d->line = line;
+  if (name_len >= NAME_LEN)
+    name_len = NAME_LEN - 1;
+  // (an extended identifier can have spaces in it, which the index file can't)
+  for (int i = 0; i < name_len; i++)
+    d->name[i] = isspace((unsigned char)name[i]) ? '_' : lower[(unsigned char)name[i]];
+  d->name[name_len] = 0;
+  strcpy(d->scope, scope[0] ? scope : "-");
+}
+
+static void set_name(char *dst, const token_t *t)
+{
+  int len = t->len < NAME_LEN ? t->len : NAME_LEN - 1;
+  for (int i = 0; i < len; i++)
+    dst[i] = lower[(unsigned char)t->start[i]];
+  dst[len] = 0;
+}
+
+static int is_op(const token_t *t, char c)
+{
+  return t->len == 1 && t->start[0] == c;
+}
+
+/*
+  Finds the definitions in a file's tokens:
+    entity <name> is
+    port (<name>, <name> : ...; ...)       (of an entity, not a component)
+    signal <name>, <name> : ...            (not a subprogram's parameter)
+    [<label> :] [postponed] process
+  Whatever follows an architecture or package body belongs to its entity or
+  package.
+*/
+void index_scan(indexed_file_t *f, const char *text, size_t len)
+{
+  lexer_t lx;
+  token_t t, entity_name;
+  token_t prev[3]; // the last three tokens, the latest last
+  char scope[NAME_LEN] = "";
+  enum { S_NONE, S_ENTITY, S_ARCH, S_ARCH_OF, S_PACKAGE, S_PORT, S_SIGNAL } state = S_NONE;
+  int nest = 0, in_entity = 0, in_component = 0, after_colon = 0;
+
+  memset(prev, 0, sizeof(prev));
+  for (int i = 0; i < 3; i++) {
+    prev[i].type = TOKEN_END;
+    prev[i].keyword = -1;
+  }
+  entity_name = prev[0];
+
+  lexer_start(&lx, text, len);
+  while (next_token(&lx, &t)) {
+    if (t.type == TOKEN_COMMENT)
+      continue;
+    if (t.type == TOKEN_BRACKET)
+      nest += (t.start[0] == '(' || t.start[0] == '[') ? 1 : -1;
+
+    switch (state) {
+    case S_ENTITY:
+      // entity <name> is
+      if (t.type == TOKEN_IDENTIFIER && entity_name.type == TOKEN_END) {
+        entity_name = t;
+        break;
+      }
+      if (t.keyword == KW_IS && entity_name.type == TOKEN_IDENTIFIER) {
+        set_name(scope, &entity_name);
+        add_def(f, DEF_ENTITY, entity_name.line, entity_name.start, entity_name.len, "");
+        in_entity = 1;
+      }
+      state = S_NONE;
+      break;
+    case S_ARCH:
+      // architecture <name> of <entity> is
+      if (t.keyword == KW_OF)
+        state = S_ARCH_OF;
+      else if (t.type != TOKEN_IDENTIFIER)
+        state = S_NONE;
+      break;
+    case S_ARCH_OF:
+      if (t.type == TOKEN_IDENTIFIER)
+        set_name(scope, &t);
+      state = S_NONE;
+      break;
+    case S_PACKAGE:
+      // package [body] <name> is
+      if (t.type == TOKEN_IDENTIFIER)
+        set_name(scope, &t);
+      if (t.keyword != KW_BODY)
+        state = S_NONE;
+      break;
+    case S_PORT:
+      // (the closing bracket, or the "map" of a port map, ends it)
+      if (nest == 0)
+        state = S_NONE;
+      else if (nest == 1 && is_op(&t, ';'))
+        after_colon = 0;
+      else if (nest == 1 && is_op(&t, ':'))
+        after_colon = 1;
+      else if (nest == 1 && !after_colon && t.type == TOKEN_IDENTIFIER)
+        add_def(f, DEF_PORT, t.line, t.start, t.len, scope);
+      break;
+    case S_SIGNAL:
+      if (t.type == TOKEN_IDENTIFIER)
+        add_def(f, DEF_SIGNAL, t.line, t.start, t.len, scope);
+      else if (!is_op(&t, ','))
+        state = S_NONE;
+      break;
+    default:
+      break;
+    }
+
+    if (state == S_NONE && t.type == TOKEN_KEYWORD) {
+      int ended = prev[2].keyword == KW_END;
+      int instance = is_op(&prev[2], ':');
+      switch (t.keyword) {
+      case KW_ENTITY:
+        // (not u1 : entity work.thing)
+        if (!ended && !instance) {
+          state = S_ENTITY;
+          entity_name.type = TOKEN_END;
+        }
+        break;
+      case KW_ARCHITECTURE:
+      case KW_PACKAGE:
+        if (!ended) {
+          state = t.keyword == KW_ARCHITECTURE ? S_ARCH : S_PACKAGE;
+          in_entity = 0;
+        }
+        break;
+      case KW_COMPONENT:
+        // (not u1 : component thing)
+        if (!instance)
+          in_component = !ended;
+        break;
+      case KW_PORT:
+        if (in_entity && !in_component && nest == 0) {
+          state = S_PORT;
+          after_colon = 0;
+        }
+        break;
+      case KW_SIGNAL:
+        if (nest == 0)
+          state = S_SIGNAL;
+        break;
+      case KW_PROCESS:
+        if (!ended) {
+          int at = prev[2].keyword == KW_POSTPONED ? 1 : 2;
+          if (is_op(&prev[at], ':') && prev[at - 1].type == TOKEN_IDENTIFIER)
+            add_def(f, DEF_PROCESS, t.line, prev[at - 1].start, prev[at - 1].len, scope);
+          else
+            add_def(f, DEF_PROCESS, t.line, "-", 1, scope);
+        }
+        break;
+      }
     }
 
-    free_tokens(tokens);
-    regfree(&keyword_regex);
-    regfree(&identifier_regex);
-    regfree(&numeric_literal_regex);
-    regfree(&string_literal_regex);
-    regfree(&operator_regex);
+    prev[0] = prev[1];
+    prev[1] = prev[2];
+    prev[2] = t;
+  }
+}
+
+int index_load(vhdl_index_t *idx, const char *path)
+{
+  FILE *in = fopen(path, "r");
+  if (!in)
+    return errno == ENOENT ? 0 : -1;
 
+  char line[8192];
+  indexed_file_t *f = NULL;
+  if (!fgets(line, sizeof(line), in) || strncmp(line, INDEX_HEADER, strlen(INDEX_HEADER))) {
+    // (an index from some other version: start again)
+    fclose(in);
     return 0;
+  }
+  while (fgets(line, sizeof(line), in)) {
+    line[strcspn(line, "\r\n")] = 0;
+    long long mtime, size;
+    int offset, dline;
+    char kind[16], name[NAME_LEN], scope[NAME_LEN];
+    if (sscanf(line, "F %lld %lld %n", &mtime, &size, &offset) == 2) {
+      f = index_add_file(idx, line + offset);
+      f->mtime = mtime;
+      f->size = size;
+    }
+    else if (f && sscanf(line, "D %15s %d %127s %127s", kind, &dline, name, scope) == 4) {
+      for (int k = 0; k < 4; k++)
+        if (!strcmp(kind, def_kind_names[k]))
+          add_def(f, k, dline, name, strlen(name), scope);
+    }
+  }
+  fclose(in);
+  return 0;
+}
+
+int index_save(vhdl_index_t *idx, const char *path)
+{
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *out = fopen(tmp, "w");
+  if (!out) {
+    fprintf(stderr, "ERROR: Could not write '%s': %s\n", tmp, strerror(errno));
+    return -1;
+  }
+  fprintf(out, "%s\n", INDEX_HEADER);
+  for (int i = 0; i < idx->count; i++) {
+    indexed_file_t *f = &idx->files[i];
+    if (!f->seen)
+      continue;
+    fprintf(out, "F %lld %lld %s\n", f->mtime, f->size, f->path);
+    for (int j = 0; j < f->def_count; j++)
+      fprintf(out, "D %s %d %s %s\n", def_kind_names[f->defs[j].kind], f->defs[j].line, f->defs[j].name, f->defs[j].scope);
+  }
+  if (fclose(out) || rename(tmp, path)) {
+    fprintf(stderr, "ERROR: Could not write '%s': %s\n", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static long long mtime_of(const struct stat *st)
+{
+#ifdef __APPLE__
+  return st->st_mtimespec.tv_sec * 1000000000LL + st->st_mtimespec.tv_nsec;
+#else
+  return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#endif
+}
+
+static int compare_indexed(const void *a, const void *b)
+{
+  return strcmp(((const indexed_file_t *)a)->path, ((const indexed_file_t *)b)->path);
+}
+
+int index_update(const char *index_path, file_list_t *files, const char *query)
+{
+  vhdl_index_t idx = { 0 };
+  int rescanned = 0, gone = 0, defs = 0;
+
+  if (index_load(&idx, index_path)) {
+    fprintf(stderr, "ERROR: Could not read '%s': %s\n", index_path, strerror(errno));
+    return -1;
+  }
+  if (idx.count)
+    qsort(idx.files, idx.count, sizeof(indexed_file_t), compare_indexed);
+  int loaded = idx.count;
+
+  for (int i = 0; i < files->count; i++) {
+    struct stat st;
+    if (stat(files->paths[i], &st))
+      continue;
+
+    indexed_file_t key = { .path = files->paths[i] };
+    indexed_file_t *f = loaded ? bsearch(&key, idx.files, loaded, sizeof(indexed_file_t), compare_indexed) : NULL;
+    if (f && f->mtime == mtime_of(&st) && f->size == (long long)st.st_size) {
+      f->seen = 1;
+      continue;
+    }
+
+    source_t src;
+    if (source_open(&src, files->paths[i]))
+      continue;
+    if (!f)
+      f = index_add_file(&idx, files->paths[i]);
+    f->def_count = 0;
+    f->mtime = mtime_of(&st);
+    f->size = st.st_size;
+    f->seen = 1;
+    index_scan(f, src.text, src.len);
+    source_close(&src);
+    rescanned++;
+  }
+
+  for (int i = 0; i < idx.count; i++) {
+    if (idx.files[i].seen)
+      defs += idx.files[i].def_count;
+    else
+      gone++;
+  }
+  if (rescanned || gone) {
+    qsort(idx.files, idx.count, sizeof(indexed_file_t), compare_indexed);
+    if (index_save(&idx, index_path))
+      return -1;
+  }
+  fprintf(stderr, "%d files (%d read again, %d gone), %d definitions in %s\n", idx.count - gone, rescanned, gone, defs,
+      index_path);
+
+  if (query) {
+    char name[NAME_LEN];
+    snprintf(name, sizeof(name), "%s", query);
+    for (char *c = name; *c; c++)
+      *c = lower[(unsigned char)*c];
+    for (int i = 0; i < idx.count; i++)
+      for (int j = 0; idx.files[i].seen && j < idx.files[i].def_count; j++) {
+        def_t *d = &idx.files[i].defs[j];
+        if (!strcmp(d->name, name))
+          printf("%s:%d: %s %s (%s)\n", idx.files[i].path, d->line, def_kind_names[d->kind], d->name, d->scope);
+      }
+  }
+
+  for (int i = 0; i < idx.count; i++) {
+    free(idx.files[i].path);
+    free(idx.files[i].defs);
+  }
+  free(idx.files);
+  return 0;
+}
+
+/*
+  Tokenises the files (repeats times), and says how fast that went.
+*/
+int benchmark(file_list_t *files, int repeats)
+{
+  source_t *srcs = calloc(files->count, sizeof(source_t));
+  size_t bytes = 0;
+  long long tokens = 0;
+  struct timeval start, end;
+
+  for (int i = 0; i < files->count; i++) {
+    if (source_open(&srcs[i], files->paths[i]))
+      return -1;
+    bytes += srcs[i].len;
+  }
+
+  gettimeofday(&start, NULL);
+  for (int r = 0; r < repeats; r++)
+    for (int i = 0; i < files->count; i++) {
+      lexer_t lx;
+      token_t t;
+      lexer_start(&lx, srcs[i].text, srcs[i].len);
+      while (next_token(&lx, &t))
+        tokens++;
+    }
+  gettimeofday(&end, NULL);
+
+  double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+  if (secs <= 0)
+    secs = 1e-6;
+  printf("%d files, %zu bytes, %lld tokens in %.3f seconds: %.0f tokens/sec, %.1f MB/sec\n", files->count, bytes * repeats,
+      tokens, secs, tokens / secs, bytes * repeats / secs / 1e6);
+
+  for (int i = 0; i < files->count; i++)
+    source_close(&srcs[i]);
+  free(srcs);
+  return 0;
+}
+
+int list_tokens(const char *path)
+{
+  source_t src;
+  lexer_t lx;
+  token_t t;
+
+  if (source_open(&src, path))
+    return -1;
+  lexer_start(&lx, src.text, src.len);
+  while (next_token(&lx, &t))
+    printf("%d: %s: %.*s\n", t.line, token_type_names[t.type], t.len, t.start);
+  source_close(&src);
+  return 0;
+}
+
+void usage(void)
+{
+  fprintf(stderr, "usage: vhdl_tokenise <file.vhd>\n"
+                  "       vhdl_tokenise -i <index file> [-q <name>] <file or directory>...\n"
+                  "       vhdl_tokenise -b [-r <repeats>] <file or directory>...\n");
+  exit(-1);
 }
 
+int main(int argc, char **argv)
+{
+  const char *index_path = NULL, *query = NULL;
+  int bench = 0, repeats = 1, opt;
+
+  while ((opt = getopt(argc, argv, "bi:q:r:")) != -1) {
+    switch (opt) {
+    case 'b':
+      bench = 1;
+      break;
+    case 'i':
+      index_path = optarg;
+      break;
+    case 'q':
+      query = optarg;
+      break;
+    case 'r':
+      repeats = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind >= argc || repeats < 1 || (query && !index_path))
+    usage();
+
+  lexer_init();
+
+  if (!bench && !index_path) {
+    if (optind + 1 != argc)
+      usage();
+    return list_tokens(argv[optind]) ? -1 : 0;
+  }
+
+  file_list_t files = { 0 };
+  for (int i = optind; i < argc; i++)
+    find_vhdl(&files, argv[i], 1);
+  if (files.count)
+    qsort(files.paths, files.count, sizeof(char *), compare_paths);
+
+  if (index_path && index_update(index_path, &files, query))
+    return -1;
+  if (bench && benchmark(&files, repeats))
+    return -1;
+  return 0;
+}
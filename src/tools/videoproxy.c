@@ -1,9 +1,14 @@
 /*
   Use libpcap to fetch raw video packets from C65GS, and then present them
-  via a UDP socket for reading by the C65GS vncserver.  The idea is to
+  via a TCP socket for reading by the C65GS vncserver.  The idea is to
   separate the packet sniffer which needs root, from the part that listens
   to connections from the internet.
 
+  Captured frames go into a single ring, which every connected viewer reads
+  from at its own pace. A viewer that falls more than a ring's worth of
+  frames behind skips the frames it missed, rather than holding up the
+  capture, and always receives whole frames.
+
   (C) Paul Gardner-Stephen 2014, 2018.
 
   This program is free software; you can redistribute it and/or
@@ -30,8 +35,10 @@
 // #include <sys/filio.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <linux/types.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netinet/if_ether.h>
@@ -44,7 +51,33 @@
 #include <time.h>
 #include <pcap.h>
 
-int client_sock = -1;
+// C65GS compressed video frames are sent as packets of exactly this size
+#define FRAME_SIZE 2132
+
+#define RING_FRAMES 256
+#define CAPTURE_BATCH 64
+#define WRITE_BATCH 16
+#define MAX_CLIENTS 16
+
+unsigned char ring[RING_FRAMES][FRAME_SIZE];
+unsigned long long ring_head = 0; // sequence number of the next frame to be captured
+
+struct client {
+  int sock;
+  unsigned long long next_frame; // sequence number of the next frame to send
+  unsigned char partial[FRAME_SIZE];
+  int partial_len; // unsent tail of a frame a short write left behind
+  unsigned long long forwarded;
+  unsigned long long dropped;
+};
+
+struct client clients[MAX_CLIENTS];
+int client_count = 0;
+
+unsigned long long frames_captured = 0;
+unsigned long long frames_ignored = 0;
+volatile sig_atomic_t show_stats = 0;
+volatile sig_atomic_t quit = 0;
 
 int create_listen_socket(int port)
 {
@@ -92,68 +125,326 @@ int accept_incoming(int sock)
   return -1;
 }
 
+void accept_clients(int listen_sock)
+{
+  int sock;
+  while ((sock = accept_incoming(listen_sock)) != -1) {
+    if (client_count == MAX_CLIENTS) {
+      fprintf(stderr, "Too many viewers, refusing connection.\n");
+      close(sock);
+      continue;
+    }
+    int on = 1;
+    ioctl(sock, FIONBIO, (char *)&on);
+
+    // New viewers start with the next frame captured
+    struct client *c = &clients[client_count++];
+    bzero(c, sizeof(struct client));
+    c->sock = sock;
+    c->next_frame = ring_head;
+    printf("Viewer #%d connected.\n", client_count);
+    fflush(stdout);
+  }
+}
+
+void print_client_stats(int i)
+{
+  printf("  viewer #%d: %llu frames forwarded, %llu dropped\n", i + 1, clients[i].forwarded, clients[i].dropped);
+}
+
+void drop_client(int i)
+{
+  printf("Viewer #%d disconnected.\n", i + 1);
+  print_client_stats(i);
+  fflush(stdout);
+  close(clients[i].sock);
+  clients[i] = clients[--client_count];
+}
+
+void capture_frame(unsigned char *user, const struct pcap_pkthdr *hdr, const unsigned char *packet)
+{
+  if (hdr->caplen != FRAME_SIZE) {
+    frames_ignored++;
+    return;
+  }
+  // probably a C65GS compressed video frame.
+  memcpy(ring[ring_head % RING_FRAMES], packet, FRAME_SIZE);
+  ring_head++;
+  frames_captured++;
+}
+
+// Returns the number of frames the client has yet to send, after skipping any that were overwritten
+unsigned long long client_backlog(struct client *c)
+{
+  unsigned long long oldest = ring_head > RING_FRAMES ? ring_head - RING_FRAMES : 0;
+  if (c->next_frame < oldest) {
+    c->dropped += oldest - c->next_frame;
+    c->next_frame = oldest;
+  }
+  return ring_head - c->next_frame;
+}
+
+/*
+  Sends as much of the client's backlog as the socket takes without blocking, several frames per
+  writev(). Returns -1 if the client has gone away.
+*/
+int service_client(struct client *c)
+{
+  struct iovec iov[WRITE_BATCH + 1];
+
+  while (c->partial_len || client_backlog(c)) {
+    int n = 0;
+    if (c->partial_len) {
+      iov[n].iov_base = &c->partial[FRAME_SIZE - c->partial_len];
+      iov[n++].iov_len = c->partial_len;
+    }
+    unsigned long long frames = client_backlog(c);
+    for (unsigned long long f = 0; f < frames && n <= WRITE_BATCH; f++) {
+      iov[n].iov_base = ring[(c->next_frame + f) % RING_FRAMES];
+      iov[n++].iov_len = FRAME_SIZE;
+    }
+
+    int written = writev(c->sock, iov, n);
+    if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if (written <= 0)
+      return -1;
+
+    if (c->partial_len) {
+      int done = written < c->partial_len ? written : c->partial_len;
+      c->partial_len -= done;
+      written -= done;
+      if (!c->partial_len)
+        c->forwarded++;
+    }
+    while (written >= FRAME_SIZE) {
+      c->next_frame++;
+      c->forwarded++;
+      written -= FRAME_SIZE;
+    }
+    if (written) {
+      // keep the rest of a frame cut short, so the ring can overwrite it without tearing the frame
+      memcpy(c->partial, ring[c->next_frame % RING_FRAMES], FRAME_SIZE);
+      c->partial_len = FRAME_SIZE - written;
+      c->next_frame++;
+    }
+  }
+  return 0;
+}
+
+void print_stats(pcap_t *descr, int offline)
+{
+  printf("%llu frames captured, %llu other packets ignored", frames_captured, frames_ignored);
+  struct pcap_stat ps;
+  if (!offline && !pcap_stats(descr, &ps))
+    printf(", %u packets dropped by the kernel", ps.ps_drop);
+  printf(", %d viewer(s)\n", client_count);
+  for (int i = 0; i < client_count; i++)
+    print_client_stats(i);
+  fflush(stdout);
+}
+
+void handle_signal(int sig)
+{
+  if (sig == SIGUSR1)
+    show_stats = 1;
+  else
+    quit = 1;
+}
+
+void usage(void)
+{
+  fprintf(stderr, "usage: videoproxy [-p <port>] [-s <seconds>] <interface>\n"
+                  "       videoproxy [-p <port>] [-s <seconds>] [-w <viewers>] [-f] -r <file.pcap>\n"
+                  "  -p - TCP port viewers connect to (default 6565).\n"
+                  "  -s - print frame counters every this many seconds (also on SIGUSR1 and at exit).\n"
+                  "  -r - replay frames from a pcap file instead of capturing live.\n"
+                  "  -w - wait for this many viewers to connect before replaying.\n"
+                  "  -f - replay as fast as possible, dropping frames for viewers that can't keep up,\n"
+                  "       instead of pacing the replay to the slowest viewer.\n");
+  exit(-1);
+}
+
 int main(int argc, char **argv)
 {
-  char *dev;
+  char *dev = NULL;
+  char *replay_file = NULL;
   char errbuf[PCAP_ERRBUF_SIZE];
   pcap_t *descr;
-  //    struct bpf_program fp;        /* to hold compiled program */
-  bpf_u_int32 pMask; /* subnet mask */
-  bpf_u_int32 pNet;  /* ip address*/
-  pcap_if_t *alldevs;
-
-  // Prepare a list of all the devices
-  if (pcap_findalldevs(&alldevs, errbuf) == -1) {
-    fprintf(stderr, "Error in pcap_findalldevs: %s\n", errbuf);
-    exit(1);
-  }
+  struct bpf_program fp; /* to hold compiled program */
+  int port = 6565;
+  int stats_interval = 0;
+  int wait_viewers = 0;
+  int flood = 0;
 
-  if (argv[1])
-    dev = argv[1];
-  else {
+  int opt;
+  while ((opt = getopt(argc, argv, "fp:r:s:w:")) != -1) {
+    switch (opt) {
+    case 'f':
+      flood = 1;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'r':
+      replay_file = optarg;
+      break;
+    case 's':
+      stats_interval = atoi(optarg);
+      break;
+    case 'w':
+      wait_viewers = atoi(optarg);
+      if (wait_viewers > MAX_CLIENTS)
+        usage();
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind < argc)
+    dev = argv[optind];
+  if (!dev && !replay_file) {
     fprintf(stderr, "You must specify the interface to listen on.\n");
     exit(-1);
   }
 
-  // If something was not provided
-  // return error.
-  if (dev == NULL) {
-    printf("\n[%s]\n", errbuf);
-    return -1;
+  if (replay_file) {
+    descr = pcap_open_offline(replay_file, errbuf);
+    if (descr == NULL) {
+      printf("pcap_open_offline() failed due to [%s]\n", errbuf);
+      return -1;
+    }
+  }
+  else {
+    // Now, open device for sniffing with big snaplen and
+    // promiscuous mode enabled. Activating a pcap_create() handle lets libpcap
+    // use the kernel's memory mapped packet ring, where available.
+    descr = pcap_create(dev, errbuf);
+    if (descr == NULL) {
+      printf("pcap_create() failed due to [%s]\n", errbuf);
+      return -1;
+    }
+    pcap_set_snaplen(descr, 3000);
+    pcap_set_promisc(descr, 1);
+    pcap_set_timeout(descr, 10);
+    pcap_set_buffer_size(descr, 8 * 1024 * 1024);
+    int status = pcap_activate(descr);
+    if (status < 0) {
+      printf("pcap_activate() failed due to [%s]\n", pcap_statustostr(status));
+      return -1;
+    }
+    if (pcap_setnonblock(descr, 1, errbuf) == -1) {
+      printf("pcap_setnonblock() failed due to [%s]\n", errbuf);
+      return -1;
+    }
   }
 
-  // fetch the network address and network mask
-  pcap_lookupnet(dev, &pNet, &pMask, errbuf);
+  // Only let video frames through to us
+  char filter[64];
+  snprintf(filter, sizeof(filter), "len == %d", FRAME_SIZE);
+  if (pcap_compile(descr, &fp, filter, 1, PCAP_NETMASK_UNKNOWN) == -1 || pcap_setfilter(descr, &fp) == -1) {
+    printf("Could not install packet filter '%s' due to [%s]\n", filter, pcap_geterr(descr));
+    return -1;
+  }
+  pcap_freecode(&fp);
 
-  // Now, open device for sniffing with big snaplen and
-  // promiscuous mode enabled.
-  descr = pcap_open_live(dev, 3000, 1, 10, errbuf);
-  if (descr == NULL) {
-    printf("pcap_open_live() failed due to [%s]\n", errbuf);
+  int listen_sock = create_listen_socket(port);
+  if (listen_sock == -1) {
+    printf("Could not listen on port %d\n", port);
     return -1;
   }
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGUSR1, handle_signal);
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
 
   printf("Started.\n");
   fflush(stdout);
 
-  int listen_sock = create_listen_socket(6565);
+  int capture_fd = replay_file ? -1 : pcap_get_selectable_fd(descr);
+  int replay_done = 0;
+  time_t last_stats = time(0);
+  struct pollfd fds[2 + MAX_CLIENTS];
 
-  while (1) {
-    if (client_sock == -1) {
-      client_sock = accept_incoming(listen_sock);
+  while (!quit) {
+    accept_clients(listen_sock);
+
+    if (replay_file && client_count < wait_viewers && !frames_captured) {
+      // still waiting for enough viewers to start replaying
+    }
+    else if (!replay_done) {
+      int room = 1;
+      if (replay_file && !flood) {
+        // don't overwrite frames a viewer has yet to see
+        for (int i = 0; i < client_count; i++)
+          if (client_backlog(&clients[i]) + CAPTURE_BATCH > RING_FRAMES)
+            room = 0;
+      }
+      if (room) {
+        int n = pcap_dispatch(descr, CAPTURE_BATCH, capture_frame, NULL);
+        if (n == -1) {
+          printf("pcap_dispatch() failed due to [%s]\n", pcap_geterr(descr));
+          break;
+        }
+        if (replay_file && n == 0)
+          replay_done = 1;
+      }
     }
 
-    struct pcap_pkthdr hdr;
-    hdr.caplen = 0;
-    const unsigned char *packet = pcap_next(descr, &hdr);
-    if (packet) {
-      if (hdr.caplen == 2132) {
-        // probably a C65GS compressed video frame.
-        if (client_sock != -1)
-          write(client_sock, packet, 2132);
+    int busy = 0;
+    for (int i = 0; i < client_count; i++) {
+      if (service_client(&clients[i])) {
+        drop_client(i--);
+        continue;
+      }
+      if (clients[i].partial_len || client_backlog(&clients[i]))
+        busy = 1;
+    }
+
+    // a replay is over once every viewer has been sent everything
+    if (replay_done && !busy)
+      break;
+
+    if (show_stats || (stats_interval && time(0) - last_stats >= stats_interval)) {
+      print_stats(descr, replay_file != NULL);
+      show_stats = 0;
+      last_stats = time(0);
+    }
+
+    // Sleep until there is something to capture, a viewer can take more, or someone connects
+    int nfds = 0;
+    fds[nfds].fd = listen_sock;
+    fds[nfds++].events = POLLIN;
+    if (capture_fd != -1) {
+      fds[nfds].fd = capture_fd;
+      fds[nfds++].events = POLLIN;
+    }
+    for (int i = 0; i < client_count; i++) {
+      fds[nfds].fd = clients[i].sock;
+      fds[nfds++].events = POLLIN | ((clients[i].partial_len || client_backlog(&clients[i])) ? POLLOUT : 0);
+    }
+    int timeout = 100;
+    if (replay_file && !replay_done && client_count >= wait_viewers)
+      timeout = busy ? 1 : 0;
+    poll(fds, nfds, timeout);
+
+    // Viewers never send us anything, so readable means they hung up. Walk backwards, as dropping a viewer
+    // moves the last one into its slot.
+    int first_client_fd = capture_fd != -1 ? 2 : 1;
+    for (int i = client_count - 1; i >= 0; i--) {
+      if (fds[first_client_fd + i].revents & (POLLIN | POLLERR | POLLHUP)) {
+        char discard[256];
+        int r = read(clients[i].sock, discard, sizeof(discard));
+        if (r == 0 || (r == -1 && errno != EAGAIN))
+          drop_client(i);
       }
     }
   }
+
+  print_stats(descr, replay_file != NULL);
+  for (int i = 0; i < client_count; i++)
+    close(clients[i].sock);
+  pcap_close(descr);
   printf("Exiting.\n");
 
   return 0;
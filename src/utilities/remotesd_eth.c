@@ -176,6 +176,7 @@ uint16_t send_buf_size;
 uint8_t sector_reading, sector_buffered;
 uint32_t sector_number_read, sector_number_buf, sector_number_write;
 uint8_t read_batch_active = 0;
+uint8_t read_batch_flash = 0;
 uint8_t write_batch_active = 0;
 uint8_t slot_ids_received[256];
 uint8_t slots_written;
@@ -1111,8 +1112,9 @@ void get_new_job()
         return;
 
       case 0x04:
+      case 0x0f:
         /*
-         * Read sectors request
+         * Read sectors request, or read flash request (sector_number is a flash byte address then)
          */
          
         if (write_batch_active) {
@@ -1132,7 +1134,7 @@ void get_new_job()
 
         reply_template.ipv6.ip_length = HTONS(UDP_HDR_SIZE + FTP_HDR_SIZE + sizeof(READ_SECTOR_JOB) + 512);
         reply_template.ftp.udp_length = reply_template.ipv6.ip_length;
-        reply_template.ftp.opcode = 4;
+        reply_template.ftp.opcode = recv_buf.ftp.opcode;
         reply_template.read_sector.unused_1 = 0;
         reply_template.read_sector.num_sectors_minus_one = 0;
 
@@ -1143,6 +1145,7 @@ void get_new_job()
         ++batch_left;
         sector_number_read = recv_buf.read_sector.sector_number;
         seq_num = recv_buf.ftp.seq_num;
+        read_batch_flash = recv_buf.ftp.opcode == 0x0f;
         read_batch_active = 1;
         // printf("read job q:%d b:%d s:%ld\n", seq_num, batch_left, sector_number_read);
         return;
@@ -1315,6 +1318,8 @@ void get_new_job()
  */
 void process()
 {
+  uint8_t z;
+
   // send_buf_size > 0 indicates we need to send out a packet,
   if (send_buf_size > 0) {
     // Check if TX controller is busy
@@ -1375,14 +1380,24 @@ void process()
     if (batch_left == 0) {
       read_batch_active = 0;
     }
-    ++sector_number_read;
+    if (read_batch_flash) {
+      sector_number_read += 0x200;
+    }
+    else {
+      ++sector_number_read;
+    }
     sector_reading = 0;
     sector_buffered = 1;
   }
 
   if (read_batch_active) {
     *(uint32_t *)0xD681 = sector_number_read;
-    POKE(0xD680, 0x02);
+    POKE(0xD680, read_batch_flash ? 0x53 : 0x02);
+    if (read_batch_flash) {
+      // As in remotesd.c, give the fast flash transaction a moment before the busy flag is polled
+      for (z = 0; z < 180; z++)
+        continue;
+    }
     sector_reading = 1;
     return;
   }